@@ -140,6 +140,45 @@ class Matvecs(Benchmark):
         self.A * self.x
 
 
+class MatvecBlocks(Benchmark):
+    params = [
+        [2, 3, 4, 6, 8],
+        [1, 4]
+    ]
+    param_names = ['blocksize', 'n_jobs']
+
+    def setup(self, blocksize, n_jobs):
+        b = (blocksize, blocksize)
+        self.A = sparse.kron(poisson2d(300 // blocksize),
+                             ones(b)).tobsr(blocksize=b)
+        self.x = ones(self.A.shape[1], dtype=float)
+
+    def time_matvec(self, blocksize, n_jobs):
+        self.A.dot(self.x, n_jobs=n_jobs)
+
+
+class MatvecIrregular(Benchmark):
+    params = [
+        ['csr', 'sell'],
+        [1, 4]
+    ]
+    param_names = ['format', 'n_jobs']
+
+    def setup(self, format, n_jobs):
+        # rows with power-law distributed lengths
+        m = 200000
+        random.seed(0)
+        nnz_per_row = numpy.minimum(random.zipf(1.5, size=m), 1000)
+        rows = numpy.arange(m).repeat(nnz_per_row)
+        cols = random.randint(0, m, size=len(rows))
+        vals = random.random_sample(len(rows))
+        self.A = coo_matrix((vals, (rows, cols)), (m, m)).asformat(format)
+        self.x = ones(m, dtype=float)
+
+    def time_matvec(self, format, n_jobs):
+        self.A.dot(self.x, n_jobs=n_jobs)
+
+
 class Matmul(Benchmark):
     def setup(self):
         H1, W1 = 1, 100000
@@ -163,6 +202,48 @@ class Matmul(Benchmark):
             self.matrix1 * self.matrix2
 
 
+class MatmulJobs(Benchmark):
+    params = [
+        [1, 4],
+        [100000, 5000000]
+    ]
+    param_names = ['n_jobs', 'n_col']
+
+    def setup(self, n_jobs, n_col):
+        self.A = rand(200000, 200000, density=1e-5, format='csr',
+                      random_state=0)
+        self.B = rand(200000, n_col, density=10. / n_col, format='csr',
+                      random_state=1)
+
+    def time_matmul(self, n_jobs, n_col):
+        self.A.dot(self.B, n_jobs=n_jobs)
+
+
+class MatmulStrided(Benchmark):
+    params = [
+        [1, 4],
+        ['random', 'strided']
+    ]
+    param_names = ['n_jobs', 'columns']
+
+    def setup(self, n_jobs, columns):
+        # the threads use hash tables for these rows, which must not send
+        # columns with a power-of-two stride to the same slots
+        n, k, n_col = 4000, 4000, 2**22
+        nnz = 32 * k
+        random.seed(0)
+        self.A = rand(n, k, density=32. / k, format='csr', random_state=0)
+        row = random.randint(0, k, size=nnz)
+        if columns == 'random':
+            col = random.randint(0, n_col, size=nnz)
+        else:
+            col = random.randint(0, n_col // 4096, size=nnz) * 4096
+        self.B = coo_matrix((ones(nnz), (row, col)), (k, n_col)).tocsr()
+
+    def time_matmul(self, n_jobs, columns):
+        self.A.dot(self.B, n_jobs=n_jobs)
+
+
 class Construction(Benchmark):
     params = [
         ['Empty', 'Identity', 'Poisson5pt'],
@@ -4,6 +4,7 @@ import numpy as np
 
 try:
     from scipy.spatial import cKDTree, KDTree
+    from scipy.spatial.distance import cdist
 except ImportError:
     pass
 
@@ -96,6 +97,11 @@ class Radius(Benchmark):
     def time_query_ball_point(self, mnr, probe_radius, cls_name):
         self.T.query_ball_point(self.queries, probe_radius)
 
+    def time_query_ball_point_csr(self, mnr, probe_radius, cls_name):
+        if cls_name == 'KDTree':
+            raise NotImplementedError()
+        self.T.query_ball_point(self.queries, probe_radius, return_csr=True)
+
     def time_query_pairs(self, mnr, probe_radius, cls_name):
         self.T.query_pairs(probe_radius)
 
@@ -132,3 +138,206 @@ class Neighbors(Benchmark):
         dim | # points T1 | # points T2 | probe radius |  KDTree  | cKDTree
         """
         self.T1.count_neighbors(self.T2, probe_radius)
+
+
+class NodeLayout(Benchmark):
+    params = [
+        [(3,100000,10000), (8,100000,10000), (16,100000,10000)],
+        ['standard', 'reordered', 'compact'],
+    ]
+    param_names = ['(m, n, r)', 'node_layout']
+
+    def setup(self, mnr, node_layout):
+        m, n, r = mnr
+
+        np.random.seed(1234)
+        self.data = np.concatenate((np.random.randn(n//2,m),
+                                    np.random.randn(n-n//2,m)+np.ones(m)))
+
+        self.queries = np.concatenate((np.random.randn(r//2,m),
+                                       np.random.randn(r-r//2,m)+np.ones(m)))
+
+        if node_layout == 'reordered':
+            self.kwargs = dict(reorder_data=True)
+        else:
+            self.kwargs = dict(node_layout=node_layout)
+        self.T = cKDTree(self.data, **self.kwargs)
+
+    def time_build(self, mnr, node_layout):
+        cKDTree(self.data, **self.kwargs)
+
+    def time_query(self, mnr, node_layout):
+        """
+        Querying kd-tree with k=8
+        dim | # points | # queries | standard | reordered | compact
+        """
+        self.T.query(self.queries, k=8)
+
+    def time_query_ball_point(self, mnr, node_layout):
+        self.T.query_ball_point(self.queries, 0.2)
+
+
+class LeafScan(Benchmark):
+    params = [
+        [(8,20000,500), (16,20000,500), (32,20000,500)],
+        [16, 64],
+        [1, 2, np.inf],
+    ]
+    param_names = ['(m, n, r)', 'leafsize', 'p']
+
+    def setup(self, mnr, leafsize, p):
+        m, n, r = mnr
+
+        np.random.seed(1234)
+        self.data = np.random.randn(n, m)
+        self.queries = np.random.randn(r, m)
+        self.T = cKDTree(self.data, leafsize=leafsize)
+
+    def time_query(self, mnr, leafsize, p):
+        """
+        Querying kd-tree with k=8, block or point-wise leaf scans
+        dim | leafsize | p
+        """
+        self.T.query(self.queries, k=8, p=p)
+
+
+class KNNGraph(Benchmark):
+    params = [
+        [(3,100000), (8,100000)],
+        [1, 8],
+        ['query', 'query_knn_tree'],
+    ]
+    param_names = ['(m, n)', 'k', 'method']
+
+    def setup(self, mn, k, method):
+        m, n = mn
+
+        np.random.seed(1234)
+        self.data = np.concatenate((np.random.randn(n//2,m),
+                                    np.random.randn(n-n//2,m)+np.ones(m)))
+        self.T = cKDTree(self.data)
+
+    def time_knn_graph(self, mn, k, method):
+        """
+        k nearest neighbors of all points of the tree
+        dim | # points | k | query | query_knn_tree
+        """
+        if method == 'query':
+            self.T.query(self.data, k=k)
+        else:
+            self.T.query_knn_tree(self.T, k=k)
+
+
+class ApproximateQuery(Benchmark):
+    params = [
+        [(64,50000,1000)],
+        [None, 32, 128],
+        [1, 4],
+    ]
+    param_names = ['(m, n, r)', 'max_leaves', 'trees']
+
+    def setup(self, mnr, max_leaves, trees):
+        m, n, r = mnr
+
+        # points near a 16-dimensional subspace
+        np.random.seed(1234)
+        A = np.random.randn(16, m)
+        self.data = np.random.randn(n, 16).dot(A)
+        self.queries = np.random.randn(r, 16).dot(A)
+        self.trees = [cKDTree(self.data, random_splits=seed) 
+                      for seed in range(trees)]
+
+    def time_query(self, mnr, max_leaves, trees):
+        """
+        Querying randomized kd-trees with k=5 and a bounded number of leaves
+        dim | # points | # queries | max_leaves | # trees
+        """
+        self.trees[0].query(self.queries, k=5, max_leaves=max_leaves,
+                            others=self.trees[1:])
+
+
+class PeriodicBox(Benchmark):
+    params = [
+        [(3,100000,0.01), (6,20000,0.05)],
+        [1, 2, np.inf],
+    ]
+    param_names = ['(m, n, r)', 'p']
+
+    def setup(self, mnr, p):
+        m, n, r = mnr
+
+        # clustered points in a periodic unit box, as in a simulation
+        # of large scale structure
+        np.random.seed(1234)
+        centers = np.random.uniform(size=(n//100, m))
+        offsets = 0.02 * np.random.randn(n, m)
+        self.data = (centers[np.arange(n) % len(centers)] + offsets) % 1.0
+        self.T = cKDTree(self.data, boxsize=1.0)
+        self.r = r
+
+    def time_count_neighbors(self, mnr, p):
+        """
+        Count neighbors of a periodic cKDTree with itself
+        dim | # points | r | p
+        """
+        self.T.count_neighbors(self.T, self.r, p=p)
+
+    def time_query_ball_tree(self, mnr, p):
+        """
+        Query a periodic cKDTree with itself
+        dim | # points | r | p
+        """
+        self.T.query_ball_tree(self.T, self.r, p=p)
+
+
+class KernelSum(Benchmark):
+    params = [
+        [(3,100000,1000)],
+        [0.05, 0.5],
+        [0, 1e-6],
+    ]
+    param_names = ['(m, n, r)', 'bandwidth', 'atol']
+
+    def setup(self, mnr, bandwidth, atol):
+        m, n, r = mnr
+
+        np.random.seed(1234)
+        self.data = np.random.randn(n, m)
+        self.queries = np.random.randn(r, m)
+        self.T = cKDTree(self.data)
+
+    def time_kernel_sum(self, mnr, bandwidth, atol):
+        """
+        Gaussian kernel sums at query points
+        dim | # points | # queries | bandwidth | atol
+        """
+        self.T.kernel_sum(self.queries, bandwidth, atol=atol)
+
+    def time_count_ball_point(self, mnr, bandwidth, atol):
+        """
+        Counting the points within a radius of query points
+        dim | # points | # queries | radius | atol (unused)
+        """
+        self.T.count_ball_point(self.queries, 4 * bandwidth)
+
+
+class Cdist(Benchmark):
+    params = [
+        [(3,2000,2000), (64,2000,2000), (512,1000,1000)],
+        ['direct', 'gemm', 'gemm_refined'],
+    ]
+    param_names = ['(m, n1, n2)', 'method']
+
+    def setup(self, mnn, method):
+        m, n1, n2 = mnn
+
+        np.random.seed(1234)
+        self.XA = np.random.randn(n1, m)
+        self.XB = np.random.randn(n2, m)
+
+    def time_cdist_euclidean(self, mnn, method):
+        """
+        Euclidean distances between two sets of points
+        dim | # points 1 | # points 2 | method
+        """
+        cdist(self.XA, self.XB, 'euclidean', method=method)
@@ -1,5 +1,6 @@
 import numpy as np
 from ._fortran import *
+from ._compiler import *
 from scipy._lib._version import NumpyVersion
 
 # Don't use deprecated Numpy C API.  Define this to a fixed version instead of
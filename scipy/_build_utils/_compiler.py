@@ -0,0 +1,76 @@
+import os
+import shutil
+import tempfile
+from distutils.ccompiler import new_compiler
+from distutils.sysconfig import customize_compiler
+from distutils.errors import CompileError, LinkError
+
+
+__all__ = ['get_cxx11_flags']
+
+
+# Uses what the threaded C++ extensions need: std::thread, std::mutex,
+# std::exception_ptr and lambdas.
+_CXX11_TEST_SOURCE = """
+#include <exception>
+#include <mutex>
+#include <thread>
+
+int main()
+{
+    std::mutex mutex;
+    std::exception_ptr error;
+    std::thread thread([&]() {
+        std::lock_guard<std::mutex> lock(mutex);
+        error = std::exception_ptr();
+    });
+    thread.join();
+    return 0;
+}
+"""
+
+
+def _try_compile_and_link(compiler, compile_args, link_args):
+    tmpdir = tempfile.mkdtemp()
+    try:
+        src = os.path.join(tmpdir, 'cxx11_test.cpp')
+        with open(src, 'w') as f:
+            f.write(_CXX11_TEST_SOURCE)
+        objects = compiler.compile([src], output_dir=tmpdir,
+                                   extra_postargs=compile_args)
+        compiler.link_executable(objects, 'cxx11_test', output_dir=tmpdir,
+                                 extra_postargs=link_args,
+                                 target_lang='c++')
+        return True
+    except (CompileError, LinkError):
+        return False
+    finally:
+        shutil.rmtree(tmpdir)
+
+
+def get_cxx11_flags():
+    """
+    Flags to build C++ extensions that use C++11 threads.
+
+    Returns ``(extra_compile_args, extra_link_args)`` for
+    ``config.add_extension``. Compilers that default to C++98, such as gcc
+    before 6, need ``-std=c++11`` (or ``-std=c++0x`` for older versions),
+    and ``-pthread`` is added where the compiler accepts it. MSVC needs no
+    flags. If no combination of flags works, the extension is built
+    without any and the compiler reports the actual error.
+    """
+    compiler = new_compiler()
+    if compiler.compiler_type == 'msvc':
+        return [], []
+    try:
+        customize_compiler(compiler)
+    except Exception:
+        return [], []
+
+    for std_flag in ['-std=c++11', '-std=c++0x', None]:
+        std_args = [std_flag] if std_flag is not None else []
+        for thread_args in (['-pthread'], []):
+            if _try_compile_and_link(compiler, std_args + thread_args,
+                                     thread_args):
+                return std_args + thread_args, thread_args
+    return [], []
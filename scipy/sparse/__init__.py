@@ -23,6 +23,7 @@ Sparse matrix classes
    dia_matrix - Sparse matrix with DIAgonal storage
    dok_matrix - Dictionary Of Keys based sparse matrix
    lil_matrix - Row-based linked list sparse matrix
+   sell_matrix - Sliced ELLPACK sparse matrix
    spmatrix - Sparse matrix base class
 
 Functions
@@ -69,6 +70,7 @@ Identifying sparse matrices:
    isspmatrix_dok
    isspmatrix_coo
    isspmatrix_dia
+   isspmatrix_sell
 
 Submodules
 ----------
@@ -92,7 +94,7 @@ Exceptions
 Usage information
 =================
 
-There are seven available sparse matrix types:
+There are eight available sparse matrix types:
 
     1. csc_matrix: Compressed Sparse Column format
     2. csr_matrix: Compressed Sparse Row format
@@ -101,6 +103,7 @@ There are seven available sparse matrix types:
     5. dok_matrix: Dictionary of Keys format
     6. coo_matrix: COOrdinate format (aka IJV, triplet format)
     7. dia_matrix: DIAgonal format
+    8. sell_matrix: Sliced ELLPACK format
 
 To construct a matrix efficiently, use either dok_matrix or lil_matrix.
 The lil_matrix class supports basic slicing and fancy
@@ -218,6 +221,7 @@ from .dok import *
 from .coo import *
 from .dia import *
 from .bsr import *
+from .sell import *
 from .construct import *
 from .extract import *
 
@@ -9,7 +9,7 @@ import sys
 import numpy as np
 
 from scipy._lib.six import xrange
-from .sputils import isdense, isscalarlike, isintlike
+from .sputils import isdense, isscalarlike, isintlike, get_n_threads
 
 
 class SparseWarning(Warning):
@@ -44,7 +44,8 @@ _formats = {'csc':[0, "Compressed Sparse Column"],
             'jad':[16, "JAgged Diagonal"],
             'uss':[17, "Unsymmetric Sparse Skyline"],
             'vbr':[18, "Variable Block Row"],
-            'und':[19, "Undefined"]
+            'und':[19, "Undefined"],
+            'sell':[20, "Sliced ELLpack"]
             }
 
 
@@ -250,9 +251,25 @@ class spmatrix(object):
     def minimum(self, other):
         return self.tocsr().minimum(other)
 
-    def dot(self, other):
+    def dot(self, other, n_jobs=1):
         """Ordinary dot product
 
+        Parameters
+        ----------
+        other : array_like or sparse matrix
+            The vector, matrix or sparse matrix to multiply with.
+        n_jobs : int, optional
+            Maximum number of threads. It is used by the products of CSR,
+            BSR and SELL matrices with dense vectors and matrices, whose
+            rows are split over the threads in ranges holding about the
+            same number of nonzeros, and by the products of two CSR or two
+            CSC matrices, whose rows are split by the number of scalar
+            products they need. Other products ignore it, and products
+            which are too small to profit from threads are computed
+            serially. If -1 is given, all CPUs are used. Default: 1.
+
+            .. versionadded:: 0.18.0
+
         Examples
         --------
         >>> import numpy as np
@@ -263,7 +280,7 @@ class spmatrix(object):
         array([ 1, -3, -1], dtype=int64)
 
         """
-        return self * other
+        return self._mul_dispatch(other, get_n_threads(n_jobs))
 
     def power(self, n, dtype=None):            
         return self.tocsr().power(n, dtype=dtype)
@@ -303,6 +320,9 @@ class spmatrix(object):
         return self.tocsr().__rsub__(other)
 
     def __mul__(self, other):
+        return self._mul_dispatch(other)
+
+    def _mul_dispatch(self, other, n_jobs=1):
         """interpret other and call one of the following
 
         self._mul_scalar()
@@ -316,11 +336,11 @@ class spmatrix(object):
         if other.__class__ is np.ndarray:
             # Fast path for the most common case
             if other.shape == (N,):
-                return self._mul_vector(other)
+                return self._mul_vector(other, n_jobs)
             elif other.shape == (N, 1):
-                return self._mul_vector(other.ravel()).reshape(M, 1)
+                return self._mul_vector(other.ravel(), n_jobs).reshape(M, 1)
             elif other.ndim == 2 and other.shape[0] == N:
-                return self._mul_multivector(other)
+                return self._mul_multivector(other, n_jobs)
 
         if isscalarlike(other):
             # scalar value
@@ -329,7 +349,7 @@ class spmatrix(object):
         if issparse(other):
             if self.shape[1] != other.shape[0]:
                 raise ValueError('dimension mismatch')
-            return self._mul_sparse_matrix(other)
+            return self._mul_sparse_matrix(other, n_jobs)
 
         try:
             other.shape
@@ -349,7 +369,7 @@ class spmatrix(object):
             if other.shape != (N,) and other.shape != (N,1):
                 raise ValueError('dimension mismatch')
 
-            result = self._mul_vector(np.ravel(other))
+            result = self._mul_vector(np.ravel(other), n_jobs)
 
             if isinstance(other, np.matrix):
                 result = np.asmatrix(result)
@@ -367,7 +387,7 @@ class spmatrix(object):
             if other.shape[0] != self.shape[1]:
                 raise ValueError('dimension mismatch')
 
-            result = self._mul_multivector(np.asarray(other))
+            result = self._mul_multivector(np.asarray(other), n_jobs)
 
             if isinstance(other, np.matrix):
                 result = np.asmatrix(result)
@@ -380,14 +400,14 @@ class spmatrix(object):
     def _mul_scalar(self, other):
         return self.tocsr()._mul_scalar(other)
 
-    def _mul_vector(self, other):
-        return self.tocsr()._mul_vector(other)
+    def _mul_vector(self, other, n_jobs=1):
+        return self.tocsr()._mul_vector(other, n_jobs)
 
-    def _mul_multivector(self, other):
-        return self.tocsr()._mul_multivector(other)
+    def _mul_multivector(self, other, n_jobs=1):
+        return self.tocsr()._mul_multivector(other, n_jobs)
 
-    def _mul_sparse_matrix(self, other):
-        return self.tocsr()._mul_sparse_matrix(other)
+    def _mul_sparse_matrix(self, other, n_jobs=1):
+        return self.tocsr()._mul_sparse_matrix(other, n_jobs)
 
     def __rmul__(self, other):  # other * self
         if isscalarlike(other):
@@ -690,6 +710,9 @@ class spmatrix(object):
     def tobsr(self, blocksize=None):
         return self.tocsr().tobsr(blocksize=blocksize)
 
+    def tosell(self, chunk_size=None, sigma=None):
+        return self.tocsr().tosell(chunk_size=chunk_size, sigma=sigma)
+
     def copy(self):
         return self.__class__(self,copy=True)
 
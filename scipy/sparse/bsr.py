@@ -327,7 +327,7 @@ class bsr_matrix(_cs_matrix, _minmax_mixin):
     def matmat(self, other):
         return self * other
 
-    def _mul_vector(self, other):
+    def _mul_vector(self, other, n_jobs=1):
         M,N = self.shape
         R,C = self.blocksize
 
@@ -335,11 +335,11 @@ class bsr_matrix(_cs_matrix, _minmax_mixin):
 
         bsr_matvec(M//R, N//C, R, C,
             self.indptr, self.indices, self.data.ravel(),
-            other, result)
+            other, result, n_jobs)
 
         return result
 
-    def _mul_multivector(self,other):
+    def _mul_multivector(self, other, n_jobs=1):
         R,C = self.blocksize
         M,N = self.shape
         n_vecs = other.shape[1]  # number of column vectors
@@ -348,11 +348,11 @@ class bsr_matrix(_cs_matrix, _minmax_mixin):
 
         bsr_matvecs(M//R, N//C, n_vecs, R, C,
                 self.indptr, self.indices, self.data.ravel(),
-                other.ravel(), result.ravel())
+                other.ravel(), result.ravel(), n_jobs)
 
         return result
 
-    def _mul_sparse_matrix(self, other):
+    def _mul_sparse_matrix(self, other, n_jobs=1):
         M, K1 = self.shape
         K2, N = other.shape
 
@@ -381,7 +381,7 @@ class bsr_matrix(_cs_matrix, _minmax_mixin):
                          self.indices.astype(idx_dtype),
                          other.indptr.astype(idx_dtype),
                          other.indices.astype(idx_dtype),
-                         indptr)
+                         indptr, n_jobs)
 
         bnnz = indptr[-1]
 
@@ -442,7 +442,7 @@ class _cs_matrix(_data_matrix, _minmax_mixin, IndexMixin):
     # Multiplication handlers #
     ###########################
 
-    def _mul_vector(self, other):
+    def _mul_vector(self, other, n_jobs=1):
         M,N = self.shape
 
         # output array
@@ -455,7 +455,7 @@ class _cs_matrix(_data_matrix, _minmax_mixin, IndexMixin):
 
         return result
 
-    def _mul_multivector(self, other):
+    def _mul_multivector(self, other, n_jobs=1):
         M,N = self.shape
         n_vecs = other.shape[1]  # number of column vectors
 
@@ -468,16 +468,46 @@ class _cs_matrix(_data_matrix, _minmax_mixin, IndexMixin):
 
         return result
 
-    def _mul_sparse_matrix(self, other):
+    def _mul_sparse_matrix(self, other, n_jobs=1):
         M, K1 = self.shape
         K2, N = other.shape
 
         major_axis = self._swap((M,N))[0]
         other = self.__class__(other)  # convert to this format
-
-        idx_dtype = get_index_dtype((self.indptr, self.indices,
-                                     other.indptr, other.indices),
-                                    maxval=M*N)
+        index_arrays = (self.indptr, self.indices,
+                        other.indptr, other.indices)
+
+        # The number of products bounds nnz(C).  Unless a larger index
+        # type is needed for the bound than for nnz(C), compute C in a
+        # single pass into arrays of that size.  Only the filled part of
+        # the arrays takes up memory, and they are shrunk afterwards.
+        A, B = self._swap((self, other))
+        n_products = np.diff(B.indptr)[A.indices].sum(dtype=np.int64)
+        bound = min(int(n_products), M*N)
+        idx_dtype = get_index_dtype(index_arrays, maxval=bound)
+        if idx_dtype == get_index_dtype(index_arrays):
+            try:
+                indices = np.empty(bound, dtype=idx_dtype)
+                data = np.empty(bound, dtype=upcast(self.dtype, other.dtype))
+            except MemoryError:
+                pass
+            else:
+                indptr = np.empty(major_axis + 1, dtype=idx_dtype)
+                fn = getattr(_sparsetools, self.format + '_matmat')
+                fn(M, N, np.asarray(self.indptr, dtype=idx_dtype),
+                   np.asarray(self.indices, dtype=idx_dtype),
+                   self.data,
+                   np.asarray(other.indptr, dtype=idx_dtype),
+                   np.asarray(other.indices, dtype=idx_dtype),
+                   other.data,
+                   indptr, indices, data, n_jobs)
+
+                nnz = indptr[-1]
+                indices.resize(nnz, refcheck=False)
+                data.resize(nnz, refcheck=False)
+                return self.__class__((data,indices,indptr),shape=(M,N))
+
+        idx_dtype = get_index_dtype(index_arrays, maxval=M*N)
         indptr = np.empty(major_axis + 1, dtype=idx_dtype)
 
         fn = getattr(_sparsetools, self.format + '_matmat_pass1')
@@ -486,12 +516,10 @@ class _cs_matrix(_data_matrix, _minmax_mixin, IndexMixin):
            np.asarray(self.indices, dtype=idx_dtype),
            np.asarray(other.indptr, dtype=idx_dtype),
            np.asarray(other.indices, dtype=idx_dtype),
-           indptr)
+           indptr, n_jobs)
 
         nnz = indptr[-1]
-        idx_dtype = get_index_dtype((self.indptr, self.indices,
-                                     other.indptr, other.indices),
-                                    maxval=nnz)
+        idx_dtype = get_index_dtype(index_arrays, maxval=nnz)
         indptr = np.asarray(indptr, dtype=idx_dtype)
         indices = np.empty(nnz, dtype=idx_dtype)
         data = np.empty(nnz, dtype=upcast(self.dtype, other.dtype))
@@ -503,7 +531,7 @@ class _cs_matrix(_data_matrix, _minmax_mixin, IndexMixin):
            np.asarray(other.indptr, dtype=idx_dtype),
            np.asarray(other.indices, dtype=idx_dtype),
            other.data,
-           indptr, indices, data)
+           indptr, indices, data, n_jobs)
 
         return self.__class__((data,indices,indptr),shape=(M,N))
 
@@ -480,14 +480,14 @@ class coo_matrix(_data_matrix, _minmax_mixin):
     # Multiplication handlers #
     ###########################
 
-    def _mul_vector(self, other):
+    def _mul_vector(self, other, n_jobs=1):
         #output array
         result = np.zeros(self.shape[0], dtype=upcast_char(self.dtype.char,
                                                             other.dtype.char))
         coo_matvec(self.nnz, self.row, self.col, self.data, other, result)
         return result
 
-    def _mul_multivector(self, other):
+    def _mul_multivector(self, other, n_jobs=1):
         return np.hstack([self._mul_vector(col).reshape(-1,1) for col in other.T])
 
 
@@ -11,8 +11,9 @@ import numpy as np
 from scipy._lib.six import xrange
 
 from ._sparsetools import csr_tocsc, csr_tobsr, csr_count_blocks, \
-        get_csr_submatrix, csr_sample_values
-from .sputils import (upcast, isintlike, IndexMixin, issequence,
+        get_csr_submatrix, csr_sample_values, csr_matvec, csr_matvecs, \
+        csr_tosell
+from .sputils import (upcast, upcast_char, isintlike, IndexMixin, issequence,
                       get_index_dtype, ismatrix)
 
 from .compressed import _cs_matrix
@@ -207,6 +208,65 @@ class csr_matrix(_cs_matrix, IndexMixin):
 
             return bsr_matrix((data,indices,indptr), shape=self.shape)
 
+    def tosell(self, chunk_size=None, sigma=None):
+        from .sell import sell_matrix
+
+        if chunk_size is None:
+            chunk_size = 8
+        if sigma is None:
+            sigma = 256
+        if chunk_size < 1 or sigma < 1:
+            raise ValueError('chunk_size and sigma must be positive')
+
+        M,N = self.shape
+        C = int(chunk_size)
+        n_chunks = -(-M // C)
+
+        # sort the rows by decreasing length within windows of sigma rows
+        lengths = np.diff(self.indptr)
+        perm = np.lexsort((-lengths, np.arange(M) // sigma))
+
+        # each chunk is as wide as its longest row
+        padded = np.zeros(n_chunks * C, dtype=lengths.dtype)
+        padded[:M] = lengths[perm]
+        widths = padded.reshape(n_chunks, C).max(axis=1)
+        chunk_ptr = np.zeros(n_chunks + 1, dtype=np.int64)
+        np.cumsum(widths * C, out=chunk_ptr[1:])
+
+        idx_dtype = get_index_dtype((self.indptr, self.indices),
+                                    maxval=max(M, N, chunk_ptr[-1]))
+        chunk_ptr = chunk_ptr.astype(idx_dtype)
+        perm = perm.astype(idx_dtype)
+        indices = np.empty(chunk_ptr[-1], dtype=idx_dtype)
+        data = np.empty(chunk_ptr[-1], dtype=self.dtype)
+
+        csr_tosell(M, N,
+                   self.indptr.astype(idx_dtype),
+                   self.indices.astype(idx_dtype),
+                   self.data,
+                   C, perm, chunk_ptr, indices, data)
+
+        return sell_matrix((data, indices, chunk_ptr, perm),
+                           shape=self.shape, chunk_size=C)
+
+    def _mul_vector(self, other, n_jobs=1):
+        M, N = self.shape
+        result = np.zeros(M, dtype=upcast_char(self.dtype.char,
+                                               other.dtype.char))
+        # the rows are split over at most n_jobs threads
+        csr_matvec(M, N, self.indptr, self.indices, self.data, other, result,
+                   n_jobs)
+        return result
+
+    def _mul_multivector(self, other, n_jobs=1):
+        M, N = self.shape
+        n_vecs = other.shape[1]  # number of column vectors
+        result = np.zeros((M, n_vecs), dtype=upcast_char(self.dtype.char,
+                                                         other.dtype.char))
+        csr_matvecs(M, N, n_vecs, self.indptr, self.indices, self.data,
+                    other.ravel(), result.ravel(), n_jobs)
+        return result
+
     # these functions are used by the parent class (_cs_matrix)
     # to remove redudancy between csc_matrix and csr_matrix
     def _swap(self,x):
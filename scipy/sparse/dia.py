@@ -176,7 +176,7 @@ class dia_matrix(_data_matrix):
     getnnz.__doc__ = spmatrix.getnnz.__doc__
     count_nonzero.__doc__ = spmatrix.count_nonzero.__doc__
 
-    def _mul_vector(self, other):
+    def _mul_vector(self, other, n_jobs=1):
         x = other
 
         y = np.zeros(self.shape[0], dtype=upcast_char(self.dtype.char,
@@ -363,14 +363,14 @@ class dok_matrix(spmatrix, IndexMixin, dict):
             new[key] = val * other
         return new
 
-    def _mul_vector(self, other):
+    def _mul_vector(self, other, n_jobs=1):
         # matrix * vector
         result = np.zeros(self.shape[0], dtype=upcast(self.dtype,other.dtype))
         for (i,j),v in iteritems(self):
             result[i] += v * other[j]
         return result
 
-    def _mul_multivector(self, other):
+    def _mul_multivector(self, other, n_jobs=1):
         # matrix * multivector
         M,N = self.shape
         n_vecs = other.shape[1]  # number of column vectors
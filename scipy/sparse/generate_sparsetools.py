@@ -34,8 +34,8 @@ bsr_scale_columns   v iiiiII*TT
 bsr_sort_indices    v iiii*I*I*T
 bsr_transpose       v iiiiIIT*I*I*T
 bsr_matmat_pass2    v iiiiiIITIIT*I*I*T
-bsr_matvec          v iiiiIITT*T
-bsr_matvecs         v iiiiiIITT*T
+bsr_matvec          v iiiiIITT*Ti
+bsr_matvecs         v iiiiiIITT*Ti
 bsr_elmul_bsr       v iiiiIITIIT*I*I*T
 bsr_eldiv_bsr       v iiiiIITIIT*I*I*T
 bsr_plus_bsr        v iiiiIITIIT*I*I*T
@@ -53,8 +53,9 @@ bsr_ge_bsr          v iiiiIITIIT*I*I*B
 CSC_ROUTINES = """
 csc_diagonal        v iiIIT*T
 csc_tocsr           v iiIIT*I*I*T
-csc_matmat_pass1    v iiIIII*I
-csc_matmat_pass2    v iiIITIIT*I*I*T
+csc_matmat          v iiIITIIT*I*I*Ti
+csc_matmat_pass1    v iiIIII*Ii
+csc_matmat_pass2    v iiIITIIT*I*I*Ti
 csc_matvec          v iiIITT*T
 csc_matvecs         v iiiIITT*T
 csc_elmul_csc       v iiIITIIT*I*I*T
@@ -72,13 +73,14 @@ csc_ge_csc          v iiIITIIT*I*I*B
 
 # csr.h
 CSR_ROUTINES = """
-csr_matmat_pass1    v iiIIII*I
-csr_matmat_pass2    v iiIITIIT*I*I*T
+csr_matmat          v iiIITIIT*I*I*Ti
+csr_matmat_pass1    v iiIIII*Ii
+csr_matmat_pass2    v iiIITIIT*I*I*Ti
 csr_diagonal        v iiIIT*T
 csr_tocsc           v iiIIT*I*I*T
 csr_tobsr           v iiiiIIT*I*I*T
-csr_matvec          v iiIITT*T
-csr_matvecs         v iiiIITT*T
+csr_matvec          v iiIITT*Ti
+csr_matvecs         v iiiIITT*Ti
 csr_elmul_csr       v iiIITIIT*I*I*T
 csr_eldiv_csr       v iiIITIIT*I*I*T
 csr_plus_csr        v iiIITIIT*I*I*T
@@ -105,12 +107,14 @@ csr_has_sorted_indices    i iII
 csr_has_canonical_format  i iII
 """
 
-# coo.h, dia.h, csgraph.h
+# coo.h, dia.h, sell.h, csgraph.h
 OTHER_ROUTINES = """
 coo_tocsr           v iiiIIT*I*I*T
 coo_todense         v iiiIIT*Ti
 coo_matvec          v iIITT*T
 dia_matvec          v iiiiITT*T
+csr_tosell          v iiIITiII*I*T
+sell_matvec         v iiiIIITT*Ti
 cs_graph_components i iII*I
 """
 
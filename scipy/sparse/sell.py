@@ -0,0 +1,300 @@
+"""Sliced ELLPACK (SELL-C-sigma) format"""
+
+from __future__ import division, print_function, absolute_import
+
+__docformat__ = "restructuredtext en"
+
+__all__ = ['sell_matrix', 'isspmatrix_sell']
+
+import numpy as np
+
+from .base import isspmatrix, spmatrix
+from .data import _data_matrix
+from .sputils import isshape, upcast_char, getdtype, get_index_dtype
+from ._sparsetools import sell_matvec
+
+
+class sell_matrix(_data_matrix):
+    """Sparse matrix in sliced ELLPACK (SELL-C-sigma) format
+
+    This is a format for fast matrix vector products with matrices whose
+    rows have irregular lengths.
+
+    This can be instantiated in several ways:
+        sell_matrix(D, [chunk_size, sigma])
+            with a dense matrix
+
+        sell_matrix(S, [chunk_size, sigma])
+            with another sparse matrix S (equivalent to S.tosell())
+
+        sell_matrix((M, N), [chunk_size, dtype])
+            to construct an empty matrix with shape (M, N),
+            dtype is optional, defaulting to dtype='d'.
+
+        sell_matrix((data, indices, chunk_ptr, perm), [shape=(M, N), chunk_size])
+            is the standard SELL representation where the rows of chunk
+            ``k`` are rows ``perm[k*chunk_size:(k+1)*chunk_size]`` of the
+            matrix, and their entries are stored in
+            ``indices[chunk_ptr[k]:chunk_ptr[k+1]]`` and
+            ``data[chunk_ptr[k]:chunk_ptr[k+1]]``. Entry ``p`` of row ``r``
+            of the chunk is at offset ``p*chunk_size + r``.
+
+    Parameters
+    ----------
+    chunk_size : int, optional
+        Number of rows in a chunk. Default is 8.
+    sigma : int, optional
+        The rows are sorted by decreasing length within windows of `sigma`
+        rows before they are cut into chunks. Default is 256; 1 keeps the
+        order of the rows.
+
+    Attributes
+    ----------
+    dtype : dtype
+        Data type of the matrix
+    shape : 2-tuple
+        Shape of the matrix
+    ndim : int
+        Number of dimensions (this is always 2)
+    nnz
+        Number of nonzero elements
+    data
+        SELL format data array of the matrix
+    indices
+        SELL format index array of the matrix
+    chunk_ptr
+        SELL format chunk pointer array of the matrix
+    perm
+        SELL format row permutation of the matrix
+    chunk_size
+        Number of rows in a chunk
+
+    Notes
+    -----
+
+    Each chunk is stored as a dense block, as wide as its longest row and
+    in column major order, with the shorter rows padded with zeros of
+    column index -1.
+    Sorting the rows by length keeps the padding small, which is counted
+    in ``nnz`` like the stored values of a DIA matrix. Matrix vector
+    products process the rows of a chunk in lockstep, which lets the
+    compiler vectorize them. They accept the ``n_jobs`` argument of
+    ``dot``.
+
+    Other operations convert the matrix to CSR format.
+
+    .. versionadded:: 0.18.0
+
+    Examples
+    --------
+
+    >>> import numpy as np
+    >>> from scipy.sparse import sell_matrix
+    >>> A = sell_matrix(np.array([[1, 0, 2], [0, 0, 3], [4, 5, 6]]),
+    ...                 chunk_size=2)
+    >>> A.perm
+    array([2, 0, 1], dtype=int32)
+    >>> A.chunk_ptr
+    array([0, 6, 8], dtype=int32)
+    >>> A.dot(np.ones(3))
+    array([  3.,   3.,  15.])
+
+    """
+    format = 'sell'
+
+    def __init__(self, arg1, shape=None, dtype=None, copy=False,
+                 chunk_size=None, sigma=None):
+        _data_matrix.__init__(self)
+
+        if isspmatrix(arg1):
+            if isspmatrix_sell(arg1) and copy:
+                arg1 = arg1.copy()
+            A = arg1.tosell(chunk_size=chunk_size, sigma=sigma)
+            self.data = A.data
+            self.indices = A.indices
+            self.chunk_ptr = A.chunk_ptr
+            self.perm = A.perm
+            self.chunk_size = A.chunk_size
+            self.shape = A.shape
+        elif isinstance(arg1, tuple):
+            if chunk_size is None:
+                chunk_size = 8
+            if isshape(arg1):
+                # It's a tuple of matrix dimensions (M, N)
+                # create empty matrix
+                self.shape = arg1   # spmatrix checks for errors here
+                M, N = self.shape
+                idx_dtype = get_index_dtype(maxval=max(self.shape))
+                self.data = np.zeros(0, getdtype(dtype, default=float))
+                self.indices = np.zeros(0, dtype=idx_dtype)
+                self.chunk_ptr = np.zeros(-(-M // chunk_size) + 1,
+                                          dtype=idx_dtype)
+                self.perm = np.arange(M, dtype=idx_dtype)
+                self.chunk_size = int(chunk_size)
+            else:
+                try:
+                    # Try interpreting it as (data, indices, chunk_ptr, perm)
+                    data, indices, chunk_ptr, perm = arg1
+                except:
+                    raise ValueError('unrecognized form for sell_matrix '
+                                     'constructor')
+                else:
+                    if shape is None:
+                        raise ValueError('expected a shape argument')
+                    idx_dtype = get_index_dtype((indices, chunk_ptr, perm),
+                                                maxval=max(shape),
+                                                check_contents=True)
+                    self.data = np.array(data, copy=copy, dtype=dtype)
+                    self.indices = np.array(indices, copy=copy,
+                                            dtype=idx_dtype)
+                    self.chunk_ptr = np.array(chunk_ptr, copy=copy,
+                                              dtype=idx_dtype)
+                    self.perm = np.array(perm, copy=copy, dtype=idx_dtype)
+                    self.chunk_size = int(chunk_size)
+                    self.shape = shape
+        else:
+            #must be dense, convert to CSR first, then to SELL
+            try:
+                arg1 = np.asarray(arg1)
+            except:
+                raise ValueError("unrecognized form for"
+                        " %s_matrix constructor" % self.format)
+            from .csr import csr_matrix
+            A = csr_matrix(arg1, dtype=dtype).tosell(chunk_size=chunk_size,
+                                                     sigma=sigma)
+            self.data = A.data
+            self.indices = A.indices
+            self.chunk_ptr = A.chunk_ptr
+            self.perm = A.perm
+            self.chunk_size = A.chunk_size
+            self.shape = A.shape
+
+        if dtype is not None:
+            self.data = self.data.astype(dtype)
+
+        self.check_format()
+
+    def check_format(self):
+        """check whether the matrix format is valid"""
+        M, N = self.shape
+        C = self.chunk_size
+
+        if self.data.ndim != 1 or self.indices.ndim != 1 or \
+                self.chunk_ptr.ndim != 1 or self.perm.ndim != 1:
+            raise ValueError('data, indices, chunk_ptr and perm should be '
+                             '1-D')
+        if C < 1:
+            raise ValueError('chunk_size must be positive')
+        if len(self.perm) != M:
+            raise ValueError("row permutation size (%d) should be (%d)" %
+                             (len(self.perm), M))
+        n_chunks = -(-M // C)
+        if len(self.chunk_ptr) != n_chunks + 1:
+            raise ValueError("chunk pointer size (%d) should be (%d)" %
+                             (len(self.chunk_ptr), n_chunks + 1))
+        if self.chunk_ptr[0] != 0:
+            raise ValueError("chunk pointer should start with 0")
+        if len(self.indices) != len(self.data):
+            raise ValueError("indices and data should have the same size")
+        if self.chunk_ptr[-1] != len(self.indices):
+            raise ValueError("last value of chunk pointer should be the "
+                             "size of the index and data arrays")
+        widths = np.diff(self.chunk_ptr)
+        if np.any(widths < 0) or np.any(widths % C != 0):
+            raise ValueError("chunk sizes must be nonnegative multiples "
+                             "of chunk_size")
+
+    def getnnz(self, axis=None):
+        if axis is not None:
+            raise NotImplementedError("getnnz over an axis is not implemented "
+                                      "for SELL format")
+        # leave out the rows after the last row in the last chunk
+        M = self.shape[0]
+        C = self.chunk_size
+        n_chunks = len(self.chunk_ptr) - 1
+        if n_chunks == 0:
+            return 0
+        last_width = (self.chunk_ptr[-1] - self.chunk_ptr[-2]) // C
+        return int(len(self.data) - (n_chunks * C - M) * last_width)
+
+    getnnz.__doc__ = spmatrix.getnnz.__doc__
+
+    def _mul_vector(self, other, n_jobs=1):
+        M, N = self.shape
+
+        # output array
+        result = np.zeros(M, dtype=upcast_char(self.dtype.char,
+                                               other.dtype.char))
+
+        sell_matvec(M, N, self.chunk_size, self.perm, self.chunk_ptr,
+                    self.indices, self.data, other, result, n_jobs)
+
+        return result
+
+    def _mul_multivector(self, other, n_jobs=1):
+        M, N = self.shape
+        n_vecs = other.shape[1]  # number of column vectors
+
+        result = np.zeros((M, n_vecs), dtype=upcast_char(self.dtype.char,
+                                                         other.dtype.char))
+
+        for j in range(n_vecs):
+            result[:, j] = self._mul_vector(other[:, j], n_jobs)
+
+        return result
+
+    def tosell(self, chunk_size=None, sigma=None, copy=False):
+        if (chunk_size is None or chunk_size == self.chunk_size) and \
+                sigma is None:
+            if copy:
+                return self.copy()
+            else:
+                return self
+        else:
+            return self.tocsr().tosell(chunk_size=chunk_size, sigma=sigma)
+
+    def tocsr(self):
+        #this could be faster
+        return self.tocoo().tocsr()
+
+    def tocsc(self):
+        #this could be faster
+        return self.tocoo().tocsc()
+
+    def tocoo(self):
+        M, N = self.shape
+        C = self.chunk_size
+
+        # row of each stored entry within the permuted rows
+        counts = np.diff(self.chunk_ptr)
+        chunk = np.repeat(np.arange(len(counts)), counts)
+        offset = np.arange(len(self.data)) - self.chunk_ptr[chunk]
+        row = chunk * C + offset % C
+
+        mask = (row < M)
+        mask &= (self.indices >= 0)
+        mask &= (self.data != 0)
+        row = self.perm[row[mask]]
+        col = self.indices[mask]
+        data = self.data[mask]
+
+        from .coo import coo_matrix
+        return coo_matrix((data, (row, col)), shape=self.shape)
+
+    # needed by _data_matrix
+    def _with_data(self, data, copy=True):
+        """Returns a matrix with the same sparsity structure as self,
+        but with different data.  By default the structure arrays are copied.
+        """
+        if copy:
+            return sell_matrix((data, self.indices.copy(),
+                                self.chunk_ptr.copy(), self.perm.copy()),
+                               shape=self.shape, chunk_size=self.chunk_size)
+        else:
+            return sell_matrix((data, self.indices, self.chunk_ptr,
+                                self.perm),
+                               shape=self.shape, chunk_size=self.chunk_size)
+
+
+def isspmatrix_sell(x):
+    return isinstance(x, sell_matrix)
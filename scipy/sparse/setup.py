@@ -8,6 +8,7 @@ import subprocess
 
 def configuration(parent_package='',top_path=None):
     from numpy.distutils.misc_util import Configuration
+    from scipy._build_utils import get_cxx11_flags
 
     config = Configuration('sparse',parent_package,top_path)
 
@@ -41,10 +42,14 @@ def configuration(parent_package='',top_path=None):
                'csr.h',
                'dense.h',
                'dia.h',
+               'parallel.h',
                'py3k.h',
+               'sell.h',
                'sparsetools.h',
                'util.h']
     depends = [os.path.join('sparsetools', hdr) for hdr in depends],
+    # the parallel matrix products use C++11 threads
+    cxx11_compile_args, cxx11_link_args = get_cxx11_flags()
     config.add_extension('_sparsetools',
                          define_macros=[('__STDC_FORMAT_MACROS', 1)],
                          depends=depends,
@@ -54,7 +59,9 @@ def configuration(parent_package='',top_path=None):
                                   os.path.join('sparsetools', 'csc.cxx'),
                                   os.path.join('sparsetools', 'bsr.cxx'),
                                   os.path.join('sparsetools', 'other.cxx'),
-                                  get_sparsetools_sources]
+                                  get_sparsetools_sources],
+                         extra_compile_args=cxx11_compile_args,
+                         extra_link_args=cxx11_link_args
                          )
 
     return config
@@ -721,6 +721,131 @@ void bsr_minimum_bsr(const I n_row, const I n_col, const I R, const I C,
 //}
 
 
+/*
+ * Compute Y += A*X for the block rows i_start to i_end - 1 of BSR matrix A
+ * with R x C blocks.
+ *
+ * R and C are known at compile time, so the product of each block is fully
+ * unrolled and the R sums of a block row stay in registers.
+ */
+template <int R, int C, class I, class T>
+void bsr_matvec_fixed(const I i_start,
+                      const I i_end,
+                      const I Ap[],
+                      const I Aj[],
+                      const T Ax[],
+                      const T Xx[],
+                            T Yx[])
+{
+    for(I i = i_start; i < i_end; i++){
+        T * y = Yx + (npy_intp)R * i;
+        T sums[R];
+        for(int r = 0; r < R; r++){
+            sums[r] = y[r];
+        }
+        for(I jj = Ap[i]; jj < Ap[i+1]; jj++){
+            const T * A = Ax + (npy_intp)(R*C) * jj;
+            const T * x = Xx + (npy_intp)C * Aj[jj];
+            for(int r = 0; r < R; r++){
+                if( C % 2 == 0 ){
+                    // the products are added to the sum of the row one by
+                    // one; the R independent sums can be computed in
+                    // parallel, which was faster than a separate dot
+                    // product per block for 4, 6 and 8 columns
+                    for(int c = 0; c < C; c++){
+                        sums[r] += A[r*C + c] * x[c];
+                    }
+                }
+                else {
+                    // the block's dot product is formed first, so only the
+                    // last addition waits for the previous block; this was
+                    // faster for 3 columns
+                    T dot = A[r*C] * x[0];
+                    for(int c = 1; c < C; c++){
+                        dot += A[r*C + c] * x[c];
+                    }
+                    sums[r] += dot;
+                }
+            }
+        }
+        for(int r = 0; r < R; r++){
+            y[r] = sums[r];
+        }
+    }
+}
+
+
+/*
+ * Same as above, for any block size known at run time. Square blocks of
+ * 2, 3, 4, 6 and 8 rows use the kernels specialized for them.
+ */
+template <class I, class T>
+void bsr_matvec_rows(const I i_start,
+                     const I i_end,
+                     const I R,
+                     const I C,
+                     const I Ap[],
+                     const I Aj[],
+                     const T Ax[],
+                     const T Xx[],
+                           T Yx[])
+{
+    if( R == C ){
+        switch(R){
+        case 2:
+            bsr_matvec_fixed<2,2>(i_start, i_end, Ap, Aj, Ax, Xx, Yx);
+            return;
+        case 3:
+            bsr_matvec_fixed<3,3>(i_start, i_end, Ap, Aj, Ax, Xx, Yx);
+            return;
+        case 4:
+            bsr_matvec_fixed<4,4>(i_start, i_end, Ap, Aj, Ax, Xx, Yx);
+            return;
+        case 6:
+            bsr_matvec_fixed<6,6>(i_start, i_end, Ap, Aj, Ax, Xx, Yx);
+            return;
+        case 8:
+            bsr_matvec_fixed<8,8>(i_start, i_end, Ap, Aj, Ax, Xx, Yx);
+            return;
+        }
+    }
+
+    const npy_intp RC = (npy_intp)R*C;
+    for(I i = i_start; i < i_end; i++){
+        T * y = Yx + (npy_intp)R * i;
+        for(I jj = Ap[i]; jj < Ap[i+1]; jj++){
+            const I j = Aj[jj];
+            const T * A = Ax + RC * jj;
+            const T * x = Xx + (npy_intp)C * j;
+            gemv(R, C, A, x, y); // y += A*x
+        }
+    }
+}
+
+
+/*
+ * Compute Y += A*X for BSR matrix A and dense vectors X,Y
+ *
+ *
+ * Input Arguments:
+ *   I  n_brow              - number of row blocks in A
+ *   I  n_bcol              - number of column blocks in A
+ *   I  R                   - rows per block
+ *   I  C                   - columns per block
+ *   I  Ap[n_brow+1]        - row pointer
+ *   I  Aj[nblks(A)]        - column indices
+ *   T  Ax[nnz(A)]          - nonzeros
+ *   T  Xx[C*n_bcol]        - input vector
+ *   I  n_threads           - maximum number of threads
+ *
+ * Output Arguments:
+ *   T  Yx[R*n_brow]        - output vector
+ *
+ * Note:
+ *   The block rows are split over the threads in ranges holding about the
+ *   same number of blocks, see partition_rows.
+ *
+ */
 template <class I, class T>
 void bsr_matvec(const I n_brow,
 	            const I n_bcol, 
@@ -730,26 +855,25 @@ void bsr_matvec(const I n_brow,
 	            const I Aj[], 
 	            const T Ax[],
 	            const T Xx[],
-	                  T Yx[])
+	                  T Yx[],
+	            const I n_threads = 1)
 {
     assert(R > 0 && C > 0);
 
     if( R == 1 && C == 1 ){
         //use CSR for 1x1 blocksize 
-        csr_matvec(n_brow, n_bcol, Ap, Aj, Ax, Xx, Yx);
+        csr_matvec(n_brow, n_bcol, Ap, Aj, Ax, Xx, Yx, n_threads);
         return;
     }
 
-    const npy_intp RC = (npy_intp)R*C;
-    for(I i = 0; i < n_brow; i++){
-        T * y = Yx + (npy_intp)R * i;
-        for(I jj = Ap[i]; jj < Ap[i+1]; jj++){
-            const I j = Aj[jj];
-            const T * A = Ax + RC * jj;
-            const T * x = Xx + (npy_intp)C * j;
-            gemv(R, C, A, x, y); // y += A*x
-        }
-    }
+    const npy_intp work = (npy_intp)Ap[n_brow]*R*C + (npy_intp)n_brow*R;
+    const int n_parts = parallel_threads(n_threads, work);
+    std::vector<I> bounds;
+    partition_rows(n_brow, Ap, n_parts, bounds);
+
+    parallel_run(n_parts, [&](const int k) {
+        bsr_matvec_rows(bounds[k], bounds[k+1], R, C, Ap, Aj, Ax, Xx, Yx);
+    });
 }
 
 
@@ -767,10 +891,14 @@ void bsr_matvec(const I n_brow,
  *   I  Aj[nblks(A)]        - column indices
  *   T  Ax[nnz(A)]          - nonzeros
  *   T  Xx[C*n_bcol,n_vecs] - input vector
+ *   I  n_threads           - maximum number of threads
  *
  * Output Arguments:
  *   T  Yx[R*n_brow,n_vecs] - output vector
  *
+ * Note:
+ *   The block rows are split over the threads as in bsr_matvec.
+ *
  */
 template <class I, class T>
 void bsr_matvecs(const I n_brow,
@@ -782,13 +910,14 @@ void bsr_matvecs(const I n_brow,
 	             const I Aj[], 
 	             const T Ax[],
 	             const T Xx[],
-	                   T Yx[])
+	                   T Yx[],
+	             const I n_threads = 1)
 {
     assert(R > 0 && C > 0);
 
     if( R == 1 && C == 1 ){
         //use CSR for 1x1 blocksize 
-        csr_matvecs(n_brow, n_bcol, n_vecs, Ap, Aj, Ax, Xx, Yx);
+        csr_matvecs(n_brow, n_bcol, n_vecs, Ap, Aj, Ax, Xx, Yx, n_threads);
         return;
     }
 
@@ -796,15 +925,22 @@ void bsr_matvecs(const I n_brow,
     const npy_intp Y_bs = (npy_intp)n_vecs*R; //Yx blocksize
     const npy_intp X_bs = (npy_intp)C*n_vecs; //Xx blocksize
 
-    for(I i = 0; i < n_brow; i++){
-        T * y = Yx + Y_bs * i;
-        for(I jj = Ap[i]; jj < Ap[i+1]; jj++){
-            const I j = Aj[jj];
-            const T * A = Ax + A_bs * jj;
-            const T * x = Xx + X_bs * j;
-            gemm(R, n_vecs, C, A, x, y); // y += A*x
+    const npy_intp work = ((npy_intp)Ap[n_brow]*A_bs + (npy_intp)n_brow*R) * n_vecs;
+    const int n_parts = parallel_threads(n_threads, work);
+    std::vector<I> bounds;
+    partition_rows(n_brow, Ap, n_parts, bounds);
+
+    parallel_run(n_parts, [&](const int k) {
+        for(I i = bounds[k]; i < bounds[k+1]; i++){
+            T * y = Yx + Y_bs * i;
+            for(I jj = Ap[i]; jj < Ap[i+1]; jj++){
+                const I j = Aj[jj];
+                const T * A = Ax + A_bs * jj;
+                const T * x = Xx + X_bs * j;
+                gemm(R, n_vecs, C, A, x, y); // y += A*x
+            }
         }
-    }
+    });
 }
 
 
@@ -118,8 +118,9 @@ void csc_matmat_pass1(const I n_row,
                       const I Ai[], 
                       const I Bp[],
                       const I Bi[],
-                            I Cp[])
-{ csr_matmat_pass1(n_col, n_row, Bp, Bi, Ap, Ai, Cp); }
+                            I Cp[],
+                      const I n_threads = 1)
+{ csr_matmat_pass1(n_col, n_row, Bp, Bi, Ap, Ai, Cp, n_threads); }
     
 template <class I, class T>
 void csc_matmat_pass2(const I n_row,
@@ -132,8 +133,24 @@ void csc_matmat_pass2(const I n_row,
       	              const T Bx[],
       	                    I Cp[],
       	                    I Ci[],
-      	                    T Cx[])
-{ csr_matmat_pass2(n_col, n_row, Bp, Bi, Bx, Ap, Ai, Ax, Cp, Ci, Cx); }
+      	                    T Cx[],
+      	              const I n_threads = 1)
+{ csr_matmat_pass2(n_col, n_row, Bp, Bi, Bx, Ap, Ai, Ax, Cp, Ci, Cx, n_threads); }
+
+template <class I, class T>
+void csc_matmat(const I n_row,
+                const I n_col, 
+                const I Ap[], 
+                const I Ai[], 
+                const T Ax[],
+                const I Bp[],
+                const I Bi[],
+                const T Bx[],
+                      I Cp[],
+                      I Ci[],
+                      T Cx[],
+                const I n_threads = 1)
+{ csr_matmat(n_col, n_row, Bp, Bi, Bx, Ap, Ai, Ax, Cp, Ci, Cx, n_threads); }
 
 template <class I, class T, class T2>
 void csc_ne_csc(const I n_row, const I n_col, 
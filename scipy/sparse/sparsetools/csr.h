@@ -8,6 +8,7 @@
 
 #include "util.h"
 #include "dense.h"
+#include "parallel.h"
 
 /*
  * Extract main diagonal of CSR matrix A
@@ -517,77 +518,316 @@ void csr_toell(const I n_row,
 
 
 /*
- * Pass 1 computes CSR row pointer for the matrix product C = A * B
+ * Hash table accumulating a row of the product C = A * B
  *
+ * Used in place of the O(n_col) workspaces of csr_matmat_pass1 and
+ * csr_matmat_pass2 by threads whose rows are short compared to n_col.
+ * The table is sized for the longest row, and flush() returns the columns
+ * in the same order as the workspaces, that is in reverse order of first
+ * appearance.
+ */
+template <class I, class T>
+class csr_hash_accumulator
+{
+public:
+    // max_row is the largest number of products in a row
+    explicit csr_hash_accumulator(const npy_intp max_row)
+    {
+        npy_intp size = 2;
+        shift = 63;
+        while (size < 2 * max_row) {
+            size <<= 1;
+            shift--;
+        }
+        keys.assign(size, -1);
+        sums.assign(size, 0);
+        slots.reserve(max_row);
+        mask = size - 1;
+    }
+
+    // add v to column k of the row
+    void add(const I k, const T v)
+    {
+        // Fibonacci hashing: the slot is taken from the high bits of the
+        // product, which depend on all the bits of k. The low bits would
+        // only permute k modulo the table size, and send columns with a
+        // power-of-two stride to the same probe chain.
+        npy_uintp h = (npy_uintp)(((npy_uint64)k * 0x9E3779B97F4A7C15ull)
+                                  >> shift);
+        while (keys[h] != k) {
+            if (keys[h] == -1) {
+                keys[h] = k;
+                slots.push_back(h);
+                break;
+            }
+            h = (h + 1) & mask;
+        }
+        sums[h] += v;
+    }
+
+    // number of columns in the row
+    I size() const { return (I)slots.size(); }
+
+    // clear the table for the next row
+    void clear()
+    {
+        for(size_t n = 0; n < slots.size(); n++){
+            keys[slots[n]] = -1;
+            sums[slots[n]] = 0;
+        }
+        slots.clear();
+    }
+
+    // store the nonzeros of the row from Cj[nnz], Cx[nnz] on, clear the
+    // table, and return the new nnz
+    I flush(I Cj[], T Cx[], I nnz)
+    {
+        for(npy_intp n = (npy_intp)slots.size() - 1; n >= 0; n--){
+            const npy_uintp h = slots[n];
+            if(sums[h] != 0){
+                Cj[nnz] = keys[h];
+                Cx[nnz] = sums[h];
+                nnz++;
+            }
+            keys[h] = -1;
+            sums[h] = 0;
+        }
+        slots.clear();
+        return nnz;
+    }
+
+private:
+    std::vector<I> keys;
+    std::vector<T> sums;
+    std::vector<npy_uintp> slots;
+    npy_uintp mask;
+    int shift;      // 64 - log2(table size)
+};
+
+
+/*
+ * Split the rows of A for computing C = A * B in at most n_threads threads
+ *
+ * The work of a row is the number of products A[i,j]*B[j,k], and the rows
+ * are split as in partition_rows. max_row[k] is set to the largest work of
+ * a row in part k, or to -1 if a single thread is used.
+ *
+ * Returns the number of parts.
  */
 template <class I>
-void csr_matmat_pass1(const I n_row,
-                      const I n_col, 
-                      const I Ap[], 
-                      const I Aj[], 
-                      const I Bp[],
-                      const I Bj[],
-                            I Cp[])
+int csr_matmat_partition(const I n_row,
+                         const I Ap[],
+                         const I Aj[],
+                         const I Bp[],
+                         const I n_threads,
+                         std::vector<I> &bounds,
+                         std::vector<npy_intp> &max_row)
 {
+    if (n_threads <= 1) {
+        bounds.assign(2, 0);
+        bounds[1] = n_row;
+        max_row.assign(1, -1);
+        return 1;
+    }
+
+    std::vector<npy_intp> work(n_row + 1);
+    work[0] = 0;
+    for(I i = 0; i < n_row; i++){
+        npy_intp row_work = 0;
+        for(I jj = Ap[i]; jj < Ap[i+1]; jj++){
+            const I j = Aj[jj];
+            row_work += Bp[j+1] - Bp[j];
+        }
+        work[i+1] = work[i] + row_work;
+    }
+
+    const int n_parts = parallel_threads(n_threads, work[n_row] + n_row);
+    partition_rows(n_row, &work[0], n_parts, bounds);
+
+    max_row.assign(n_parts, -1);
+    if (n_parts > 1) {
+        for(int k = 0; k < n_parts; k++){
+            for(I i = bounds[k]; i < bounds[k+1]; i++){
+                max_row[k] = std::max(max_row[k], work[i+1] - work[i]);
+            }
+        }
+    }
+    return n_parts;
+}
+
+
+/*
+ * Whether a thread should use csr_hash_accumulator, given the longest
+ * row of its part (see csr_matmat_partition)
+ *
+ * The hash table pays off once the O(n_col) workspaces no longer fit in
+ * the caches, and the rows are much shorter than n_col.
+ */
+template <class I>
+bool csr_matmat_use_hash(const I n_col, const npy_intp max_row)
+{
+    return max_row >= 0 && n_col >= (1 << 18) && 16 * max_row <= n_col;
+}
+
+
+/*
+ * Count the nonzeros of the rows row_start to row_end - 1 of C = A * B,
+ * storing the count of row i in Cp[i+1]
+ *
+ * Returns the total count.
+ */
+template <class I>
+npy_intp csr_matmat_count_rows(const I row_start,
+                               const I row_end,
+                               const I n_col,
+                               const I Ap[],
+                               const I Aj[],
+                               const I Bp[],
+                               const I Bj[],
+                                     I Cp[],
+                               const npy_intp max_row)
+{
+    npy_intp nnz = 0;
+
+    if (csr_matmat_use_hash(n_col, max_row)) {
+        csr_hash_accumulator<I,npy_bool> acc(max_row);
+
+        for(I i = row_start; i < row_end; i++){
+            for(I jj = Ap[i]; jj < Ap[i+1]; jj++){
+                I j = Aj[jj];
+                for(I kk = Bp[j]; kk < Bp[j+1]; kk++){
+                    acc.add(Bj[kk], 0);
+                }
+            }
+            Cp[i+1] = acc.size();
+            nnz += acc.size();
+            acc.clear();
+        }
+        return nnz;
+    }
+
     // method that uses O(n) temp storage
     std::vector<I> mask(n_col, -1);
-    Cp[0] = 0;
 
-    I nnz = 0;
-    for(I i = 0; i < n_row; i++){
-        npy_intp row_nnz = 0;
+    for(I i = row_start; i < row_end; i++){
+        I row_nnz = 0;
 
         for(I jj = Ap[i]; jj < Ap[i+1]; jj++){
             I j = Aj[jj];
             for(I kk = Bp[j]; kk < Bp[j+1]; kk++){
                 I k = Bj[kk];
                 if(mask[k] != i){
-                    mask[k] = i;                        
+                    mask[k] = i;
                     row_nnz++;
                 }
             }
         }
 
-        npy_intp next_nnz = nnz + row_nnz;
+        Cp[i+1] = row_nnz;
+        nnz += row_nnz;
+    }
+    return nnz;
+}
+
 
-        if (row_nnz > NPY_MAX_INTP - nnz || next_nnz != (I)next_nnz) {
-            /*
-             * Index overflowed. Note that row_nnz <= n_col and cannot overflow
-             */
+/*
+ * Pass 1 computes CSR row pointer for the matrix product C = A * B
+ *
+ * The rows are split over at most n_threads threads by the number of
+ * products, see csr_matmat_partition. Each thread counts the nonzeros of
+ * its rows with its own accumulator, and the counts are summed into Cp
+ * with a parallel prefix sum.
+ *
+ */
+template <class I>
+void csr_matmat_pass1(const I n_row,
+                      const I n_col, 
+                      const I Ap[], 
+                      const I Aj[], 
+                      const I Bp[],
+                      const I Bj[],
+                            I Cp[],
+                      const I n_threads = 1)
+{
+    std::vector<I> bounds;
+    std::vector<npy_intp> max_row;
+    const int n_parts = csr_matmat_partition(n_row, Ap, Aj, Bp, n_threads,
+                                             bounds, max_row);
+    std::vector<npy_intp> part_nnz(n_parts + 1, 0);
+
+    // count the nonzeros of each row
+    parallel_run(n_parts, [&](const int k) {
+        part_nnz[k+1] = csr_matmat_count_rows(bounds[k], bounds[k+1], n_col,
+                                              Ap, Aj, Bp, Bj, Cp, max_row[k]);
+    });
+
+    // offsets of the parts
+    for(int k = 0; k < n_parts; k++){
+        const npy_intp nnz = part_nnz[k];
+        const npy_intp next_nnz = nnz + part_nnz[k+1];
+
+        if (part_nnz[k+1] > NPY_MAX_INTP - nnz || next_nnz != (I)next_nnz) {
+            // Index overflowed
             throw std::overflow_error("nnz of the result is too large");
         }
-
-        nnz = next_nnz;
-        Cp[i+1] = nnz;
+        part_nnz[k+1] = next_nnz;
     }
+
+    // prefix sum of the counts within each part
+    Cp[0] = 0;
+    parallel_run(n_parts, [&](const int k) {
+        I nnz = (I)part_nnz[k];
+        for(I i = bounds[k]; i < bounds[k+1]; i++){
+            nnz += Cp[i+1];
+            Cp[i+1] = nnz;
+        }
+    });
 }
 
+
 /*
- * Pass 2 computes CSR entries for matrix C = A*B using the 
- * row pointer Cp[] computed in Pass 1.
+ * Compute the rows row_start to row_end - 1 of C = A * B, storing them
+ * from Cj[nnz], Cx[nnz] on and the end of row i in Cp[i+1]
  *
+ * Returns the end of the last row.
  */
 template <class I, class T>
-void csr_matmat_pass2(const I n_row,
-      	              const I n_col, 
-      	              const I Ap[], 
-      	              const I Aj[], 
-      	              const T Ax[],
-      	              const I Bp[],
-      	              const I Bj[],
-      	              const T Bx[],
-      	                    I Cp[],
-      	                    I Cj[],
-      	                    T Cx[])
+I csr_matmat_rows(const I row_start,
+                  const I row_end,
+                  const I n_col,
+                  const I Ap[],
+                  const I Aj[],
+                  const T Ax[],
+                  const I Bp[],
+                  const I Bj[],
+                  const T Bx[],
+                        I Cp[],
+                        I Cj[],
+                        T Cx[],
+                        I nnz,
+                  const npy_intp max_row)
 {
-    std::vector<I> next(n_col,-1);
-    std::vector<T> sums(n_col, 0);
+    if (csr_matmat_use_hash(n_col, max_row)) {
+        csr_hash_accumulator<I,T> acc(max_row);
 
-    I nnz = 0;
+        for(I i = row_start; i < row_end; i++){
+            for(I jj = Ap[i]; jj < Ap[i+1]; jj++){
+                I j = Aj[jj];
+                T v = Ax[jj];
+                for(I kk = Bp[j]; kk < Bp[j+1]; kk++){
+                    acc.add(Bj[kk], v*Bx[kk]);
+                }
+            }
+            nnz = acc.flush(Cj, Cx, nnz);
+            Cp[i+1] = nnz;
+        }
+        return nnz;
+    }
 
-    Cp[0] = 0;
+    std::vector<I> next(n_col,-1);
+    std::vector<T> sums(n_col, 0);
 
-    for(I i = 0; i < n_row; i++){
+    for(I i = row_start; i < row_end; i++){
         I head   = -2;
         I length =  0;
 
@@ -605,12 +845,12 @@ void csr_matmat_pass2(const I n_row,
                 sums[k] += v*Bx[kk];
 
                 if(next[k] == -1){
-                    next[k] = head;                        
+                    next[k] = head;
                     head  = k;
                     length++;
                 }
             }
-        }         
+        }
 
         for(I jj = 0; jj < length; jj++){
 
@@ -620,15 +860,162 @@ void csr_matmat_pass2(const I n_row,
                 nnz++;
             }
 
-            I temp = head;                
+            I temp = head;
             head = next[head];
 
             next[temp] = -1; //clear arrays
-            sums[temp] =  0;                              
+            sums[temp] =  0;
         }
 
         Cp[i+1] = nnz;
     }
+    return nnz;
+}
+
+
+/*
+ * Move the parts of C = A * B computed by csr_matmat_rows together
+ *
+ * Part k holds the rows bounds[k] to bounds[k+1] - 1, stored from
+ * part_start[k] to part_end[k] - 1 in Cj and Cx.
+ */
+template <class I, class T>
+void csr_matmat_join(const int n_parts,
+                     const std::vector<I> &bounds,
+                     const std::vector<I> &part_start,
+                     const std::vector<I> &part_end,
+                           I Cp[],
+                           I Cj[],
+                           T Cx[])
+{
+    I nnz = part_end[0];
+    for(int k = 1; k < n_parts; k++){
+        const I shift = part_start[k] - nnz;
+        if (shift != 0) {
+            std::copy(Cj + part_start[k], Cj + part_end[k], Cj + nnz);
+            std::copy(Cx + part_start[k], Cx + part_end[k], Cx + nnz);
+            for(I i = bounds[k]; i < bounds[k+1]; i++){
+                Cp[i+1] -= shift;
+            }
+        }
+        nnz += part_end[k] - part_start[k];
+    }
+    Cp[0] = 0;
+}
+
+
+/*
+ * Pass 2 computes CSR entries for matrix C = A*B using the 
+ * row pointer Cp[] computed in Pass 1.
+ *
+ * The rows are split over the threads as in Pass 1. Each thread writes
+ * its rows from the position given by Cp, and the parts are moved
+ * together at the end if explicit zeros were dropped.
+ *
+ */
+template <class I, class T>
+void csr_matmat_pass2(const I n_row,
+      	              const I n_col, 
+      	              const I Ap[], 
+      	              const I Aj[], 
+      	              const T Ax[],
+      	              const I Bp[],
+      	              const I Bj[],
+      	              const T Bx[],
+      	                    I Cp[],
+      	                    I Cj[],
+      	                    T Cx[],
+      	              const I n_threads = 1)
+{
+    std::vector<I> bounds;
+    std::vector<npy_intp> max_row;
+    const int n_parts = csr_matmat_partition(n_row, Ap, Aj, Bp, n_threads,
+                                             bounds, max_row);
+    std::vector<I> part_start(n_parts), part_end(n_parts);
+
+    for(int k = 0; k < n_parts; k++){
+        part_start[k] = (k == 0) ? 0 : Cp[bounds[k]];
+    }
+
+    parallel_run(n_parts, [&](const int k) {
+        part_end[k] = csr_matmat_rows(bounds[k], bounds[k+1], n_col,
+                                      Ap, Aj, Ax, Bp, Bj, Bx, Cp, Cj, Cx,
+                                      part_start[k], max_row[k]);
+    });
+
+    // close the gaps left by dropped zeros
+    csr_matmat_join(n_parts, bounds, part_start, part_end, Cp, Cj, Cx);
+}
+
+
+/*
+ * Compute C = A*B in a single pass, without the row pointer of Pass 1
+ *
+ * Input Arguments:
+ *   as in csr_matmat_pass2
+ *
+ * Output Arguments:
+ *   I  Cp[n_row+1]       - row pointer
+ *   I  Cj[bound]         - column indices
+ *   T  Cx[bound]         - nonzeros
+ *
+ * Note:
+ *   Output arrays Cp, Cj, and Cx must be preallocated, Cj and Cx with
+ *   an upper bound of nnz(C), which is at least the sum over the rows of
+ *   A of min(n_col, number of products A[i,j]*B[j,k]). The total number
+ *   of products, or n_row*n_col, will do.
+ *
+ *   The rows are split over the threads as in Pass 1. Each thread writes
+ *   its rows from the bound of the previous rows on, and the parts are
+ *   moved together at the end. The value of nnz(C) is Cp[n_row].
+ *
+ */
+template <class I, class T>
+void csr_matmat(const I n_row,
+                const I n_col,
+                const I Ap[],
+                const I Aj[],
+                const T Ax[],
+                const I Bp[],
+                const I Bj[],
+                const T Bx[],
+                      I Cp[],
+                      I Cj[],
+                      T Cx[],
+                const I n_threads = 1)
+{
+    std::vector<I> bounds;
+    std::vector<npy_intp> max_row;
+    const int n_parts = csr_matmat_partition(n_row, Ap, Aj, Bp, n_threads,
+                                             bounds, max_row);
+    std::vector<I> part_start(n_parts + 1, 0), part_end(n_parts);
+
+    // bound the nonzeros of the parts
+    if (n_parts > 1) {
+        parallel_run(n_parts, [&](const int k) {
+            npy_intp bound = 0;
+            for(I i = bounds[k]; i < bounds[k+1]; i++){
+                npy_intp row_bound = 0;
+                for(I jj = Ap[i]; jj < Ap[i+1]; jj++){
+                    const I j = Aj[jj];
+                    row_bound += Bp[j+1] - Bp[j];
+                }
+                bound += std::min(row_bound, (npy_intp)n_col);
+            }
+            part_start[k+1] = (I)bound;
+        });
+        for(int k = 0; k < n_parts; k++){
+            part_start[k+1] += part_start[k];
+        }
+    }
+
+    parallel_run(n_parts, [&](const int k) {
+        part_end[k] = csr_matmat_rows(bounds[k], bounds[k+1], n_col,
+                                      Ap, Aj, Ax, Bp, Bj, Bx, Cp, Cj, Cx,
+                                      part_start[k], max_row[k]);
+    });
+
+    csr_matmat_join(n_parts, bounds, part_start, part_end, Cp, Cj, Cx);
 }
 
 
@@ -1070,6 +1457,7 @@ void csr_eliminate_zeros(const I n_row,
  *   I  Aj[nnz(A)]    - column indices
  *   T  Ax[nnz(A)]    - nonzeros
  *   T  Xx[n_col]     - input vector
+ *   I  n_threads     - maximum number of threads
  *
  * Output Arguments:
  *   T  Yx[n_row]     - output vector
@@ -1077,6 +1465,10 @@ void csr_eliminate_zeros(const I n_row,
  * Note:
  *   Output array Yx must be preallocated
  *
+ *   The rows are split over the threads in ranges holding about the same
+ *   number of nonzeros, see partition_rows. Small matrices are processed
+ *   by a single thread.
+ *
  *   Complexity: Linear.  Specifically O(nnz(A) + n_row)
  * 
  */
@@ -1087,15 +1479,22 @@ void csr_matvec(const I n_row,
 	            const I Aj[], 
 	            const T Ax[],
 	            const T Xx[],
-	                  T Yx[])
+	                  T Yx[],
+	            const I n_threads = 1)
 {
-    for(I i = 0; i < n_row; i++){
-        T sum = Yx[i];
-        for(I jj = Ap[i]; jj < Ap[i+1]; jj++){
-            sum += Ax[jj] * Xx[Aj[jj]];
+    const int n_parts = parallel_threads(n_threads, (npy_intp)Ap[n_row] + n_row);
+    std::vector<I> bounds;
+    partition_rows(n_row, Ap, n_parts, bounds);
+
+    parallel_run(n_parts, [&](const int k) {
+        for(I i = bounds[k]; i < bounds[k+1]; i++){
+            T sum = Yx[i];
+            for(I jj = Ap[i]; jj < Ap[i+1]; jj++){
+                sum += Ax[jj] * Xx[Aj[jj]];
+            }
+            Yx[i] = sum;
         }
-        Yx[i] = sum;
-    }
+    });
 }
 
 
@@ -1111,10 +1510,14 @@ void csr_matvec(const I n_row,
  *   I  Aj[nnz(A)]       - column indices
  *   T  Ax[nnz(A)]       - nonzeros
  *   T  Xx[n_col,n_vecs] - input vector
+ *   I  n_threads        - maximum number of threads
  *
  * Output Arguments:
  *   T  Yx[n_row,n_vecs] - output vector
  *
+ * Note:
+ *   The rows are split over the threads as in csr_matvec.
+ *
  */
 template <class I, class T>
 void csr_matvecs(const I n_row,
@@ -1124,17 +1527,25 @@ void csr_matvecs(const I n_row,
 	             const I Aj[], 
 	             const T Ax[],
 	             const T Xx[],
-	                   T Yx[])
+	                   T Yx[],
+	             const I n_threads = 1)
 {
-    for(I i = 0; i < n_row; i++){
-        T * y = Yx + (npy_intp)n_vecs * i;
-        for(I jj = Ap[i]; jj < Ap[i+1]; jj++){
-            const I j = Aj[jj];
-            const T a = Ax[jj];
-            const T * x = Xx + (npy_intp)n_vecs * j;
-            axpy(n_vecs, a, x, y);
+    const npy_intp work = ((npy_intp)Ap[n_row] + n_row) * n_vecs;
+    const int n_parts = parallel_threads(n_threads, work);
+    std::vector<I> bounds;
+    partition_rows(n_row, Ap, n_parts, bounds);
+
+    parallel_run(n_parts, [&](const int k) {
+        for(I i = bounds[k]; i < bounds[k+1]; i++){
+            T * y = Yx + (npy_intp)n_vecs * i;
+            for(I jj = Ap[i]; jj < Ap[i+1]; jj++){
+                const I j = Aj[jj];
+                const T a = Ax[jj];
+                const T * x = Xx + (npy_intp)n_vecs * j;
+                axpy(n_vecs, a, x, y);
+            }
         }
-    }
+    });
 }
 
 
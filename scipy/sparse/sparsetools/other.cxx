@@ -3,6 +3,7 @@
 
 #include "sparsetools.h"
 #include "dia.h"
+#include "sell.h"
 #include "csgraph.h"
 #include "coo.h"
 
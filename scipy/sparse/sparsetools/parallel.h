@@ -0,0 +1,141 @@
+#ifndef __SPTOOLS_PARALLEL_H__
+#define __SPTOOLS_PARALLEL_H__
+
+#include <vector>
+#include <thread>
+#include <exception>
+#include <system_error>
+
+/*
+ * Fork-join parallelism for the sparsetools routines.
+ *
+ * The routines run with the GIL released (see call_thunk in sparsetools.cxx),
+ * and the worker threads never touch the Python C API. The threads are
+ * started for each call, so a routine only uses them when every thread gets
+ * at least SPTOOLS_PARALLEL_GRAIN units of work; smaller problems run
+ * serially whatever the requested number of threads.
+ */
+
+#define SPTOOLS_PARALLEL_GRAIN 32768
+
+
+/*
+ * Number of threads to use for the given amount of work, at most n_threads
+ */
+inline int parallel_threads(const npy_intp n_threads, const npy_intp work)
+{
+    npy_intp n = work / SPTOOLS_PARALLEL_GRAIN;
+    if (n > n_threads) {
+        n = n_threads;
+    }
+    return (n < 1) ? 1 : (int)n;
+}
+
+
+/*
+ * Call body(k) for k = 0, ..., n_parts - 1, each in its own thread.
+ *
+ * The calling thread runs part 0. If a thread cannot be started, the
+ * remaining parts are run by the calling thread. The first exception
+ * thrown by a part is rethrown after all parts have finished.
+ */
+template <class Body>
+void parallel_run(const int n_parts, const Body &body)
+{
+    if (n_parts <= 1) {
+        body(0);
+        return;
+    }
+
+    std::vector<std::exception_ptr> errors(n_parts);
+    std::vector<std::thread> threads;
+    int k = 1;
+
+    threads.reserve(n_parts - 1);
+    try {
+        for (; k < n_parts; ++k) {
+            threads.push_back(std::thread([&body, &errors, k]() {
+                try {
+                    body(k);
+                }
+                catch (...) {
+                    errors[k] = std::current_exception();
+                }
+            }));
+        }
+    }
+    catch (const std::system_error &) {
+        /* out of threads: run the rest here */
+    }
+
+    for (int j = k; j < n_parts; ++j) {
+        try {
+            body(j);
+        }
+        catch (...) {
+            errors[j] = std::current_exception();
+        }
+    }
+    try {
+        body(0);
+    }
+    catch (...) {
+        errors[0] = std::current_exception();
+    }
+
+    for (size_t j = 0; j < threads.size(); ++j) {
+        threads[j].join();
+    }
+    for (int j = 0; j < n_parts; ++j) {
+        if (errors[j]) {
+            std::rethrow_exception(errors[j]);
+        }
+    }
+}
+
+
+/*
+ * Split the rows of a CSR matrix into n_parts contiguous ranges of about
+ * equal work, counted as the number of nonzeros plus the number of rows.
+ * Any other nondecreasing prefix sum of the work of the rows may be passed
+ * in place of the row pointer.
+ *
+ * Input Arguments:
+ *   I  n_row         - number of rows in A
+ *   W  Ap[n_row+1]   - row pointer
+ *   int n_parts      - number of ranges
+ *
+ * Output Arguments:
+ *   bounds[n_parts+1] - part k holds the rows bounds[k] to bounds[k+1] - 1
+ *
+ */
+template <class I, class W>
+void partition_rows(const I n_row,
+                    const W Ap[],
+                    const int n_parts,
+                    std::vector<I> &bounds)
+{
+    const npy_intp total = (npy_intp)Ap[n_row] - Ap[0] + n_row;
+
+    bounds.resize(n_parts + 1);
+    bounds[0] = 0;
+    for (int k = 1; k < n_parts; ++k) {
+        const npy_intp target = total * k / n_parts;
+
+        // first row i >= bounds[k-1] with Ap[i] - Ap[0] + i >= target
+        I lo = bounds[k - 1], hi = n_row;
+        while (lo < hi) {
+            const I mid = lo + (hi - lo) / 2;
+            if ((npy_intp)Ap[mid] - Ap[0] + mid < target) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        bounds[k] = lo;
+    }
+    bounds[n_parts] = n_row;
+}
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef __SELL_H__
+#define __SELL_H__
+
+#include <algorithm>
+#include <vector>
+
+#include "parallel.h"
+
+/*
+ * SELL-C-sigma (sliced ELLPACK) matrices
+ *
+ * The rows of the matrix are permuted, and the permuted rows are split
+ * into chunks of C consecutive rows. Chunk k is stored like an ELL matrix
+ * of C rows whose width is the length of its longest row, in column major
+ * order, so that entry p of its row r is Sj[Sp[k] + p*C + r],
+ * Sx[Sp[k] + p*C + r]. Shorter rows are padded with entries of column
+ * index -1 and value 0. Row r of chunk k is row perm[k*C + r] of the
+ * matrix; the rows after the last row of the matrix in the last chunk are
+ * empty.
+ *
+ * Sorting the rows by length within windows of sigma rows before cutting
+ * the chunks keeps the padding small, and the C rows of a chunk are
+ * processed in lockstep by sell_matvec.
+ */
+
+
+/*
+ * Compute B = A for CSR matrix A, SELL matrix B
+ *
+ * Input Arguments:
+ *   I  n_row           - number of rows in A
+ *   I  n_col           - number of columns in A
+ *   I  Ap[n_row+1]     - row pointer
+ *   I  Aj[nnz(A)]      - column indices
+ *   T  Ax[nnz(A)]      - nonzeros
+ *   I  C               - number of rows in a chunk
+ *   I  perm[n_row]     - row of A stored in each row of B
+ *   I  Sp[n_chunks+1]  - chunk pointer
+ *
+ * Output Arguments:
+ *   I  Sj[Sp[n_chunks]] - column indices
+ *   T  Sx[Sp[n_chunks]] - nonzeros
+ *
+ * Note:
+ *   Output arrays Sj, Sx must be preallocated
+ *   n_chunks is n_row / C rounded up, and Sp[k+1] - Sp[k] must be C times
+ *   the length of the longest row in chunk k.
+ *   Duplicate entries in A are not merged.
+ *   Explicit zeros in A are carried over to B.
+ *   Padding entries have column index -1 and value 0.
+ *
+ */
+template <class I, class T>
+void csr_tosell(const I n_row,
+                const I n_col,
+                const I Ap[],
+                const I Aj[],
+                const T Ax[],
+                const I C,
+                const I perm[],
+                const I Sp[],
+                      I Sj[],
+                      T Sx[])
+{
+    const npy_intp n_chunks = ((npy_intp)n_row + C - 1) / C;
+    std::fill(Sj, Sj + Sp[n_chunks], -1);
+    std::fill(Sx, Sx + Sp[n_chunks], 0);
+
+    for(npy_intp s = 0; s < n_row; s++){
+        const npy_intp k = s / C;
+        const I i = perm[s];
+        I * Sj_row = Sj + Sp[k] + (s - k * C);
+        T * Sx_row = Sx + Sp[k] + (s - k * C);
+        for(I jj = Ap[i]; jj < Ap[i+1]; jj++){
+            *Sj_row = Aj[jj];
+            *Sx_row = Ax[jj];
+            Sj_row += C;
+            Sx_row += C;
+        }
+    }
+}
+
+
+/*
+ * Compute Y += A*X for the chunks k_start to k_end - 1 of SELL matrix A
+ *
+ * The C rows of a chunk are summed in lockstep. With C known at compile
+ * time the loop over the rows is unrolled or vectorized.
+ */
+template <int C, class I, class T>
+void sell_matvec_chunks(const I k_start,
+                        const I k_end,
+                        const I n_row,
+                        const I perm[],
+                        const I Sp[],
+                        const I Sj[],
+                        const T Sx[],
+                        const T Xx[],
+                              T Yx[])
+{
+    T sums[C];
+
+    for(I k = k_start; k < k_end; k++){
+        const I * Sj_chunk = Sj + Sp[k];
+        const T * Sx_chunk = Sx + Sp[k];
+        const I width = (Sp[k+1] - Sp[k]) / C;
+
+        for(int r = 0; r < C; r++){
+            sums[r] = 0;
+        }
+        for(I p = 0; p < width; p++){
+            for(int r = 0; r < C; r++){
+                sums[r] += Sx_chunk[r] * Xx[Sj_chunk[r]];
+            }
+            Sj_chunk += C;
+            Sx_chunk += C;
+        }
+
+        const npy_intp s = (npy_intp)k * C;
+        const int n = (int)std::min<npy_intp>(C, n_row - s);
+        for(int r = 0; r < n; r++){
+            Yx[perm[s + r]] += sums[r];
+        }
+    }
+}
+
+
+/*
+ * Same as above, for a chunk height C only known at run time
+ */
+template <class I, class T>
+void sell_matvec_chunks(const I k_start,
+                        const I k_end,
+                        const I n_row,
+                        const I C,
+                        const I perm[],
+                        const I Sp[],
+                        const I Sj[],
+                        const T Sx[],
+                        const T Xx[],
+                              T Yx[])
+{
+    std::vector<T> sums(C);
+
+    for(I k = k_start; k < k_end; k++){
+        const I * Sj_chunk = Sj + Sp[k];
+        const T * Sx_chunk = Sx + Sp[k];
+        const I width = (Sp[k+1] - Sp[k]) / C;
+
+        std::fill(sums.begin(), sums.end(), T(0));
+        for(I p = 0; p < width; p++){
+            for(I r = 0; r < C; r++){
+                sums[r] += Sx_chunk[r] * Xx[Sj_chunk[r]];
+            }
+            Sj_chunk += C;
+            Sx_chunk += C;
+        }
+
+        const npy_intp s = (npy_intp)k * C;
+        const I n = (I)std::min<npy_intp>(C, n_row - s);
+        for(I r = 0; r < n; r++){
+            Yx[perm[s + r]] += sums[r];
+        }
+    }
+}
+
+
+/*
+ * Compute Y += A*X for SELL matrix A and dense vectors X,Y
+ *
+ *
+ * Input Arguments:
+ *   I  n_row           - number of rows in A
+ *   I  n_col           - number of columns in A
+ *   I  C               - number of rows in a chunk
+ *   I  perm[n_row]     - row of A stored in each row of the chunks
+ *   I  Sp[n_chunks+1]  - chunk pointer
+ *   I  Sj[Sp[n_chunks]] - column indices
+ *   T  Sx[Sp[n_chunks]] - nonzeros
+ *   T  Xx[n_col]       - input vector
+ *   I  n_threads       - maximum number of threads
+ *
+ * Output Arguments:
+ *   T  Yx[n_row]       - output vector
+ *
+ * Note:
+ *   Output array Yx must be preallocated
+ *
+ *   The chunks are split over the threads in ranges holding about the same
+ *   number of entries, see partition_rows. Chunk heights of 4, 8, 16 and
+ *   32 rows use kernels specialized for them.
+ *
+ *   Complexity: Linear.  Specifically O(Sp[n_chunks] + n_row)
+ *
+ */
+template <class I, class T>
+void sell_matvec(const I n_row,
+                 const I n_col,
+                 const I C,
+                 const I perm[],
+                 const I Sp[],
+                 const I Sj[],
+                 const T Sx[],
+                 const T Xx[],
+                       T Yx[],
+                 const I n_threads = 1)
+{
+    const I n_chunks = (I)(((npy_intp)n_row + C - 1) / C);
+
+    /*
+     * The padding entries read the zero in front of this copy of X. With
+     * any column of X they would add 0 * inf = nan to their row if that
+     * entry of X is infinite.
+     */
+    std::vector<T> Xpad(n_col + 1, T(0));
+    std::copy(Xx, Xx + n_col, Xpad.begin() + 1);
+    const T * X = &Xpad[1];
+
+    const int n_parts = parallel_threads(n_threads,
+                                         (npy_intp)Sp[n_chunks] + n_row);
+    std::vector<I> bounds;
+    partition_rows(n_chunks, Sp, n_parts, bounds);
+
+    parallel_run(n_parts, [&](const int k) {
+        const I k_start = bounds[k], k_end = bounds[k+1];
+        switch (C) {
+        case 4:
+            sell_matvec_chunks<4>(k_start, k_end, n_row, perm, Sp, Sj, Sx,
+                                  X, Yx);
+            break;
+        case 8:
+            sell_matvec_chunks<8>(k_start, k_end, n_row, perm, Sp, Sj, Sx,
+                                  X, Yx);
+            break;
+        case 16:
+            sell_matvec_chunks<16>(k_start, k_end, n_row, perm, Sp, Sj, Sx,
+                                   X, Yx);
+            break;
+        case 32:
+            sell_matvec_chunks<32>(k_start, k_end, n_row, perm, Sp, Sj, Sx,
+                                   X, Yx);
+            break;
+        default:
+            sell_matvec_chunks(k_start, k_end, n_row, C, perm, Sp, Sj, Sx,
+                               X, Yx);
+        }
+    });
+}
+
+#endif
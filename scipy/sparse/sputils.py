@@ -6,7 +6,9 @@ from __future__ import division, print_function, absolute_import
 __all__ = ['upcast','getdtype','isscalarlike','isintlike',
             'isshape','issequence','isdense','ismatrix']
 
+import operator
 import warnings
+from multiprocessing import cpu_count
 import numpy as np
 
 from scipy._lib._version import NumpyVersion
@@ -174,6 +176,16 @@ def get_index_dtype(arrays=(), maxval=None, check_contents=False):
     return dtype
 
 
+def get_n_threads(n_jobs):
+    """Number of threads for an n_jobs argument, where -1 means all CPUs"""
+    n_jobs = operator.index(n_jobs)
+    if n_jobs == -1:
+        return cpu_count()
+    if n_jobs < 1:
+        raise ValueError("n_jobs must be -1 or a positive integer")
+    return n_jobs
+
+
 def isscalarlike(x):
     """Is x either a scalar, an array scalar, or a 0-dim array?"""
     return np.isscalar(x) or (isdense(x) and x.ndim == 0)
@@ -1,8 +1,10 @@
 from __future__ import division, print_function, absolute_import
 
 import numpy as np
-from numpy.testing import assert_array_almost_equal, run_module_suite, assert_
-from scipy.sparse import csr_matrix
+from numpy.testing import (assert_array_almost_equal, run_module_suite, assert_,
+                           assert_array_equal, assert_raises, assert_equal)
+from scipy.sparse import (csr_matrix, csc_matrix, coo_matrix, dia_matrix,
+                          hstack, vstack)
 
 
 def _check_csr_rowslice(i, sl, X, Xcsr):
@@ -59,5 +61,60 @@ def test_csr_getcol():
         assert_(type(csr_col) is csr_matrix)
 
 
+def test_csr_dot_n_jobs():
+    # rows of very different lengths, and enough nonzeros to use threads
+    np.random.seed(0)
+    n = 3000
+    row = np.random.randint(0, n, size=200000) ** 3 // n ** 2
+    col = np.random.randint(0, n, size=200000)
+    Xcsr = csr_matrix((np.random.random(200000), (row, col)), shape=(n, n))
+    x = np.random.random(n)
+    X = np.random.random((n, 3))
+
+    y = Xcsr.dot(x)
+    Y = Xcsr.dot(X)
+    assert_array_almost_equal(y, Xcsr.toarray().dot(x))
+    for n_jobs in [2, 3, 8, -1]:
+        assert_array_equal(Xcsr.dot(x, n_jobs=n_jobs), y)
+        assert_array_equal(Xcsr.dot(X, n_jobs=n_jobs), Y)
+
+    # other formats accept n_jobs
+    assert_array_almost_equal(csc_matrix(Xcsr).dot(x, n_jobs=2), y)
+    assert_array_almost_equal(coo_matrix(Xcsr).dot(x, n_jobs=2), y)
+    assert_raises(ValueError, Xcsr.dot, x, n_jobs=0)
+
+
+def test_csr_matmat_n_jobs():
+    np.random.seed(0)
+    n, k = 3000, 2000
+    row = np.random.randint(0, n, size=60000) ** 3 // n ** 2
+    col = np.random.randint(0, k, size=60000)
+    A = csr_matrix((np.random.randint(1, 5, size=60000), (row, col)),
+                   shape=(n, k), dtype=float)
+    # the even rows of A are cancelled, leaving explicit zeros to drop
+    odd = dia_matrix((np.arange(n) % 2, 0), shape=(n, n))
+    A2 = hstack([A, A - odd * A], format='csr')
+
+    # the wide product uses the hash accumulator for most rows
+    for m in [3000, 400000]:
+        col = np.random.randint(0, m, size=60000)
+        row = np.random.randint(0, k, size=60000)
+        B = csr_matrix((np.random.randint(1, 5, size=60000), (row, col)),
+                       shape=(k, m), dtype=float)
+        B2 = vstack([B, -B], format='csr')
+
+        C = A2.dot(B2)
+        assert_equal(C.nnz, (odd * A * B).nnz)
+        assert_equal((C - odd * A * B).nnz, 0)
+        for n_jobs in [2, 3, 8, -1]:
+            Cp = A2.dot(B2, n_jobs=n_jobs)
+            assert_array_equal(Cp.indptr, C.indptr)
+            assert_array_equal(Cp.indices, C.indices)
+            assert_array_equal(Cp.data, C.data)
+
+        Cp = csc_matrix(A2).dot(csc_matrix(B2), n_jobs=2)
+        assert_equal((Cp - C).nnz, 0)
+
+
 if __name__ == "__main__":
     run_module_suite()
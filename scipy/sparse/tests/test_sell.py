@@ -0,0 +1,116 @@
+from __future__ import division, print_function, absolute_import
+
+import numpy as np
+from numpy.testing import (assert_array_almost_equal, run_module_suite, assert_,
+                           assert_array_equal, assert_raises, assert_equal)
+from scipy.sparse import csr_matrix, coo_matrix, sell_matrix, isspmatrix_sell
+
+
+def _irregular_matrix(M, N, seed=0):
+    # rows with very different lengths, in random order
+    np.random.seed(seed)
+    lengths = np.minimum(np.random.pareto(1.0, size=M).astype(int), N)
+    row = np.repeat(np.arange(M), lengths)
+    col = np.concatenate([np.random.choice(N, n, replace=False)
+                          for n in lengths] + [np.zeros(0, dtype=int)])
+    data = np.random.rand(len(row)) - 0.5
+    return coo_matrix((data, (row, col)), shape=(M, N)).tocsr()
+
+
+def test_sell_conversion():
+    A = _irregular_matrix(101, 37)
+
+    for chunk_size in [1, 3, 8, 32]:
+        for sigma in [1, 4, 256]:
+            S = A.tosell(chunk_size=chunk_size, sigma=sigma)
+            assert_(isspmatrix_sell(S))
+            assert_equal(S.chunk_size, chunk_size)
+            assert_equal(S.count_nonzero(), A.count_nonzero())
+            assert_(S.nnz >= A.nnz)
+            assert_equal(len(S.chunk_ptr), -(-101 // chunk_size) + 1)
+            assert_array_equal(S.toarray(), A.toarray())
+            assert_array_equal(S.tocsr().toarray(), A.toarray())
+
+    # sorting the rows by length leaves less padding
+    S1 = A.tosell(chunk_size=8, sigma=1)
+    S2 = A.tosell(chunk_size=8, sigma=128)
+    assert_(len(S2.data) < len(S1.data))
+    assert_array_equal(S1.perm, np.arange(101))
+
+    D = A.toarray()
+    assert_array_equal(sell_matrix(D, chunk_size=4).toarray(), D)
+    assert_array_equal(sell_matrix(A, chunk_size=4).toarray(), D)
+    assert_array_equal(coo_matrix(A).tosell().toarray(), D)
+
+
+def test_sell_matvec():
+    A = _irregular_matrix(1000, 300)
+    x = np.random.rand(300)
+    X = np.random.rand(300, 3)
+
+    for chunk_size in [1, 3, 4, 8, 16, 32]:
+        S = A.tosell(chunk_size=chunk_size)
+        assert_array_almost_equal(S.dot(x), A.dot(x))
+        assert_array_almost_equal(S * X, A * X)
+
+    # complex and integer values
+    B = sell_matrix(A.astype(complex) * (1 + 2j))
+    assert_array_almost_equal(B.dot(x), (1 + 2j) * A.dot(x))
+    C = sell_matrix(np.arange(12).reshape(3, 4), chunk_size=2)
+    assert_array_equal(C.dot(np.ones(4, dtype=int)), [6, 22, 38])
+
+
+def test_sell_matvec_n_jobs():
+    # enough entries to split the product over several threads
+    A = _irregular_matrix(20000, 2000)
+    x = np.random.rand(2000)
+
+    for chunk_size in [3, 8]:
+        S = A.tosell(chunk_size=chunk_size)
+        assert_(len(S.data) + S.shape[0] > 4 * 32768)
+        y = S.dot(x)
+        assert_array_almost_equal(y, A.dot(x))
+        for n_jobs in [2, 3, 8, -1]:
+            assert_array_equal(S.dot(x, n_jobs=n_jobs), y)
+
+
+def test_sell_matvec_nonfinite():
+    # the padding of the short rows does not pick up inf or nan
+    A = csr_matrix([[1, 0, 2], [0, 0, 3], [0, 5, 6], [0, 0, 0]],
+                   dtype=float)
+    for x in [[np.inf, 1, 1], [np.nan, 1, 1], [1, -np.inf, 1],
+              [1, 1, np.inf]]:
+        x = np.array(x)
+        for chunk_size in [1, 2, 3, 4, 8]:
+            S = A.tosell(chunk_size=chunk_size)
+            assert_array_equal(S.dot(x), A.dot(x))
+
+    B = _irregular_matrix(200, 50)
+    x = np.ones(50)
+    x[::7] = np.inf
+    x[3] = np.nan
+    assert_array_equal(B.tosell(chunk_size=8).dot(x), B.dot(x))
+
+
+def test_sell_empty():
+    for shape in [(0, 0), (0, 5), (5, 0), (7, 3)]:
+        S = sell_matrix(shape)
+        assert_equal(S.shape, shape)
+        assert_equal(S.nnz, 0)
+        assert_array_equal(S.dot(np.ones(shape[1])), np.zeros(shape[0]))
+        assert_array_equal(csr_matrix(shape).tosell().toarray(),
+                           np.zeros(shape))
+
+
+def test_sell_check_format():
+    S = sell_matrix(np.eye(3), chunk_size=2)
+    arg = (S.data, S.indices, S.chunk_ptr, S.perm)
+    assert_raises(ValueError, sell_matrix, arg)
+    assert_raises(ValueError, sell_matrix, arg, shape=(4, 3), chunk_size=2)
+    assert_raises(ValueError, sell_matrix, arg, shape=(3, 3), chunk_size=4)
+    assert_raises(ValueError, sell_matrix, arg, shape=(3, 3), chunk_size=3)
+    assert_raises(ValueError, csr_matrix(np.eye(3)).tosell, chunk_size=0)
+
+
+if __name__ == "__main__":
+    run_module_suite()
@@ -11,7 +11,7 @@ import numpy as np
 from numpy.testing import (assert_raises, assert_equal, dec, run_module_suite, assert_,
                            assert_allclose)
 from scipy.sparse import (_sparsetools, coo_matrix, csr_matrix, csc_matrix,
-                          bsr_matrix, dia_matrix)
+                          bsr_matrix, dia_matrix, kron)
 from scipy.sparse.sputils import supported_dtypes
 from scipy._lib._testutils import xslow
 
@@ -247,6 +247,95 @@ def test_csr_matmat_int64_overflow():
     assert_raises(RuntimeError, a.dot, b)
 
 
+def _csr_matmat_two_pass(a, b, n_threads):
+    m, n = a.shape[0], b.shape[1]
+    indptr = np.empty(m + 1, dtype=a.indices.dtype)
+    _sparsetools.csr_matmat_pass1(m, n, a.indptr, a.indices,
+                                  b.indptr, b.indices, indptr, n_threads)
+    indices = np.empty(indptr[-1], dtype=indptr.dtype)
+    data = np.empty(indptr[-1], dtype=a.dtype)
+    _sparsetools.csr_matmat_pass2(m, n, a.indptr, a.indices, a.data,
+                                  b.indptr, b.indices, b.data,
+                                  indptr, indices, data, n_threads)
+    return indptr, indices, data
+
+
+def test_csr_matmat_single_pass():
+    # csr_matmat gives the same result as csr_matmat_pass1/2 with output
+    # arrays of any size bounding nnz(C), and all of them give the same
+    # result in threads
+    np.random.seed(1234)
+    n = 500
+    a = csr_matrix(np.random.randint(-2, 3, size=(n, n)) *
+                   (np.random.rand(n, n) < 0.05))
+    b = csr_matrix(np.random.randint(-2, 3, size=(n, n)) *
+                   (np.random.rand(n, n) < 0.05))
+    # more than 2**18 columns, with a power-of-two stride between some of
+    # them, so that the threads count and sum the rows in hash tables
+    m, k, n_col = 2000, 2000, 2**19
+    row = np.random.randint(0, k, size=40000)
+    col = np.where(np.arange(40000) % 2,
+                   np.random.randint(0, n_col, size=40000),
+                   np.random.randint(0, n_col // 4096, size=40000) * 4096)
+    c = csr_matrix((np.random.randint(-2, 3, size=40000), (row, col)),
+                   shape=(k, n_col))
+    d = csr_matrix(np.random.randint(-2, 3, size=(m, k)) *
+                   (np.random.rand(m, k) < 0.005))
+
+    for a, b in [(a, b), (d, c)]:
+        m, n = a.shape[0], b.shape[1]
+        indptr, indices, data = _csr_matmat_two_pass(a, b, 1)
+        nnz = indptr[-1]
+        # some entries cancel out, and are dropped by pass 2
+        assert_(nnz < len(indices))
+        n_products = np.diff(b.indptr)[a.indices].sum()
+
+        for n_threads in [2, 4]:
+            t_indptr, t_indices, t_data = _csr_matmat_two_pass(a, b,
+                                                               n_threads)
+            assert_equal(t_indptr, indptr)
+            assert_equal(t_indices[:nnz], indices[:nnz])
+            assert_equal(t_data[:nnz], data[:nnz])
+
+        for bound in [n_products, min(m * n, 4 * n_products)]:
+            for n_threads in [1, 4]:
+                c_indptr = np.empty(m + 1, dtype=indptr.dtype)
+                c_indices = np.empty(bound, dtype=indptr.dtype)
+                c_data = np.empty(bound, dtype=a.dtype)
+                _sparsetools.csr_matmat(m, n, a.indptr, a.indices, a.data,
+                                        b.indptr, b.indices, b.data,
+                                        c_indptr, c_indices, c_data,
+                                        n_threads)
+                assert_equal(c_indptr, indptr)
+                assert_equal(c_indices[:nnz], indices[:nnz])
+                assert_equal(c_data[:nnz], data[:nnz])
+
+
+def test_bsr_matvec_blocksizes():
+    # bsr_matvec has kernels specialized for some square block sizes; all
+    # must agree with CSR, also when the block rows are split over threads
+    np.random.seed(1234)
+    n_brow, n_bcol, n_blocks = 2000, 1500, 40000
+    row = np.random.randint(0, n_brow, size=n_blocks) ** 2 // n_brow
+    col = np.random.randint(0, n_bcol, size=n_blocks)
+    pattern = coo_matrix((np.ones(n_blocks), (row, col)),
+                         shape=(n_brow, n_bcol))
+
+    for R, C in [(1, 1), (2, 2), (3, 3), (4, 4), (5, 5), (6, 6), (8, 8),
+                 (2, 3), (6, 2)]:
+        m = kron(pattern, np.random.randint(1, 4, size=(R, C)), format='bsr')
+        assert_equal(m.blocksize, (R, C))
+        m_csr = m.tocsr()
+        x = np.random.randint(-3, 4, size=m.shape[1]).astype(float)
+        X = np.random.randint(-3, 4, size=(m.shape[1], 3)).astype(float)
+
+        y = m_csr.dot(x)
+        Y = m_csr.dot(X)
+        for n_jobs in [1, 3]:
+            assert_equal(m.dot(x, n_jobs=n_jobs), y)
+            assert_equal(m.dot(X, n_jobs=n_jobs), Y)
+
+
 def test_upcast():
     a0 = csr_matrix([[np.pi, np.pi*1j], [3, 4]], dtype=complex)
     b0 = np.array([256+1j, 2**32], dtype=complex)
@@ -268,7 +357,7 @@ def test_upcast():
             if not (a_dtype == np.bool_ and b_dtype == np.bool_):
                 c = np.zeros((2,), dtype=np.bool_)
                 assert_raises(ValueError, _sparsetools.csr_matvec,
-                              2, 2, a.indptr, a.indices, a.data, b, c)
+                              2, 2, a.indptr, a.indices, a.data, b, c, 1)
 
             if ((np.issubdtype(a_dtype, np.complexfloating) and
                  not np.issubdtype(b_dtype, np.complexfloating)) or
@@ -276,10 +365,10 @@ def test_upcast():
                  np.issubdtype(b_dtype, np.complexfloating))):
                 c = np.zeros((2,), dtype=np.float64)
                 assert_raises(ValueError, _sparsetools.csr_matvec,
-                              2, 2, a.indptr, a.indices, a.data, b, c)
+                              2, 2, a.indptr, a.indices, a.data, b, c, 1)
 
             c = np.zeros((2,), dtype=np.result_type(a_dtype, b_dtype))
-            _sparsetools.csr_matvec(2, 2, a.indptr, a.indices, a.data, b, c)
+            _sparsetools.csr_matvec(2, 2, a.indptr, a.indices, a.data, b, c, 1)
             assert_allclose(c, np.dot(a.toarray(), b), err_msg=msg)
 
 
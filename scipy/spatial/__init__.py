@@ -12,6 +12,7 @@ Nearest-neighbor Queries
 
    KDTree      -- class for efficient nearest-neighbor queries
    cKDTree     -- class for efficient nearest-neighbor queries (faster impl.)
+   cKDTreeForest -- cKDTree-based set of points with insertions and deletions
    distance    -- module containing many different distance measures
    Rectangle
 
@@ -13,12 +13,14 @@ cimport numpy as np
 from numpy.math cimport INFINITY
     
 from cpython.mem cimport PyMem_Malloc, PyMem_Realloc, PyMem_Free
+from cpython.bytes cimport PyBytes_FromStringAndSize
+from cpython.pycapsule cimport (PyCapsule_CheckExact, PyCapsule_GetPointer,
+                                 PyCapsule_IsValid)
 from libc.string cimport memset, memcpy
 
 cimport cython
 
 from multiprocessing import cpu_count
-import threading
 
 cdef extern from "limits.h":
     long LONG_MAX
@@ -31,7 +33,7 @@ number_of_processors = cpu_count()
 from libcpp.vector cimport vector
 from libc cimport string
 
-__all__ = ['cKDTree']
+__all__ = ['cKDTree', 'cKDTreeForest']
 
     
 # Borrowed references
@@ -53,10 +55,18 @@ cdef extern from "ckdtree_decl.h":
         np.float64_t split
         np.intp_t start_idx
         np.intp_t end_idx
-        ckdtreenode *less
-        ckdtreenode *greater
         np.intp_t _less
         np.intp_t _greater
+
+    struct ckdtree_compact_node:
+        np.float64_t split
+        np.intp_t start_idx
+        np.intp_t end_idx
+        np.int32_t split_dim
+        np.int32_t greater
+
+    ctypedef struct ckdtree_metric:
+        pass
     
     
 # C++ helper functions
@@ -79,7 +89,6 @@ def new_object(obj):
     return obj.__new__(obj)
  
 cdef extern from "cpp_utils.h": 
-    object pickle_tree_buffer(vector[ckdtreenode] *buf)    
     object unpickle_tree_buffer(vector[ckdtreenode] *buf, object src)
     ckdtreenode *tree_buffer_root(vector[ckdtreenode] *buf)
     ordered_pair *ordered_pair_vector_buf(vector[ordered_pair] *buf)
@@ -259,7 +268,7 @@ cdef class cKDTreeNode:
         whereas those with value < split are sorted to the 'lesser' subnode.
     children : int
         The number of data points sorted to this node.
-    data_points : ndarray of float64
+    data_points : ndarray of float64 or float32
         An array with the data points sorted to this node.
     indices : ndarray of intp
         An array with the indices of the data points sorted to this node. The
@@ -279,6 +288,7 @@ cdef class cKDTreeNode:
         readonly np.intp_t    children
         readonly np.float64_t split
         ckdtreenode           *_node
+        ckdtreenode           *_root
         np.ndarray            _data
         np.ndarray            _indices
         
@@ -308,7 +318,8 @@ cdef class cKDTreeNode:
                 return None
             else:
                 n = cKDTreeNode()
-                n._node = self._node.less
+                n._node = self._root + self._node._less
+                n._root = self._root
                 n._data = self._data
                 n._indices = self._indices
                 n.level = self.level + 1
@@ -321,19 +332,123 @@ cdef class cKDTreeNode:
                 return None
             else:
                 n = cKDTreeNode()
-                n._node = self._node.greater
+                n._node = self._root + self._node._greater
+                n._root = self._root
                 n._data = self._data
                 n._indices = self._indices
                 n.level = self.level + 1
                 n._setup()
                 return n
 
+
+# File format of cKDTree.save
+# ===========================
+#
+# The file starts with a header described by _FILE_HEADER, followed by the
+# sections listed in _FILE_SECTIONS. Each section starts at an offset
+# aligned to _FILE_ALIGN bytes, so the arrays can be used directly from a
+# memory mapping of the file. The header stores the offset and size in 
+# bytes of each section, with an offset of zero for absent sections. All
+# numbers are stored in the byte order of the machine that wrote the file,
+# which is checked on load together with the sizes of npy_intp and of the
+# nodes. The version is incremented whenever the format changes.
+
+_FILE_MAGIC = b'CKDTREE\x00'
+_FILE_VERSION = 1
+_FILE_BYTEORDER = 0x01020304
+_FILE_ALIGN = 64
+
+_FILE_SECTIONS = ('nodes', 'indices', 'data', 'maxes', 'mins', 
+                  'boxsize_data', 'tree_data', 'compact_nodes')
+
+_FILE_HEADER = np.dtype([
+    ('magic', 'S8'),
+    ('version', np.uint32),
+    ('byteorder', np.uint32),
+    ('sizeof_intp', np.uint32),
+    ('sizeof_node', np.uint32),
+    ('sizeof_compact_node', np.uint32),
+    ('float32', np.uint32),
+    ('n', np.int64),
+    ('m', np.int64),
+    ('leafsize', np.int64),
+    ('size', np.int64),
+    ('sections', np.int64, (len(_FILE_SECTIONS), 2)),
+])
+
+
+# Pickled cKDTree states
+# =======================
+#
+# The state of a cKDTree holds 13 items. Trees pickled by earlier versions
+# of scipy have a state of 10 items, without the node layout, the reorder
+# flag and the deletion flags, and nodes with two pointers to their children
+# after end_idx, which are dropped when they are unpickled.
+
+_PICKLE_STATE_SIZE = 13
+_PICKLE_STATE_SIZE_OLD = 10
+
+_PICKLE_NODE_OLD = np.dtype([
+    ('split_dim', np.intp),
+    ('children', np.intp),
+    ('split', np.float64),
+    ('start_idx', np.intp),
+    ('end_idx', np.intp),
+    ('less', np.intp),
+    ('greater', np.intp),
+    ('_less', np.intp),
+    ('_greater', np.intp),
+], align=True)
+
+_PICKLE_NODE = np.dtype([
+    ('split_dim', np.intp),
+    ('children', np.intp),
+    ('split', np.float64),
+    ('start_idx', np.intp),
+    ('end_idx', np.intp),
+    ('_less', np.intp),
+    ('_greater', np.intp),
+], align=True)
+
+
+cdef object _upgrade_pickle_state(object state):
+    cdef np.ndarray nodes
+    old_nodes = np.frombuffer(state[0], dtype=_PICKLE_NODE_OLD)
+    nodes = np.empty(old_nodes.shape[0], dtype=_PICKLE_NODE)
+    for name in _PICKLE_NODE.names:
+        nodes[name] = old_nodes[name]
+    tree = PyBytes_FromStringAndSize(<char*> np.PyArray_DATA(nodes),
+                                     nodes.nbytes)
+    return (tree,) + tuple(state[1:]) + ('standard', False, None)
+
+
+def _file_align(offset):
+    return -(-offset // _FILE_ALIGN) * _FILE_ALIGN
+
+
+def _query_chunks(tree, x, k, eps, p, distance_upper_bound, n_jobs, 
+                  chunk_size, out):
+    # generator behind cKDTree.query_chunked
+    for start in range(0, x.shape[0], chunk_size):
+        stop = min(start + chunk_size, x.shape[0])
+        if out is None:
+            chunk_out = None
+        else:
+            chunk_out = (out[0][start:stop], out[1][start:stop])
+        d, i = tree.query(x[start:stop], k, eps, p, distance_upper_bound,
+                          n_jobs, chunk_out)
+        yield start, d, i
+
     
 # Main cKDTree class
 # ==================
 
 cdef extern from "ckdtree_methods.h":
 
+    # neighbors of a block of queries, for query_ball_point_csr
+    cppclass ball_block:
+        pass
+
     # External build and query methods in C++. These will internally
     # release the GIL to avoid locking up the interpreter.
     
@@ -345,9 +460,12 @@ cdef extern from "ckdtree_methods.h":
                          np.float64_t *maxes, 
                          np.float64_t *mins, 
                          int _median, 
-                         int _compact)
+                         int _compact,
+                         int n_jobs)
        
     object query_knn(const ckdtree *self, 
+                     ckdtree **others,
+                     np.intp_t nothers,
                      np.float64_t *dd, 
                      np.intp_t    *ii, 
                      const np.float64_t *xx,
@@ -357,21 +475,49 @@ cdef extern from "ckdtree_methods.h":
                      const np.intp_t    kmax, 
                      const np.float64_t eps, 
                      const np.float64_t p, 
-                     const np.float64_t distance_upper_bound) 
+                     const np.float64_t distance_upper_bound,
+                     const np.intp_t max_leaves,
+                     const int n_jobs) 
                      
     object query_pairs(const ckdtree *self, 
                        const np.float64_t r, 
                        const np.float64_t p, 
                        const np.float64_t eps,
-                       vector[ordered_pair] *results)
+                       vector[ordered_pair] *results,
+                       const int n_jobs)
                        
-    object count_neighbors(const ckdtree *self,
-                           const ckdtree *other,
-                           np.intp_t     n_queries,
-                           np.float64_t  *real_r,
-                           np.intp_t     *results,
-                           np.intp_t     *idx,
-                           const np.float64_t p)
+    object build_compact_tree(ckdtree *self)
+
+    object build_weights(ckdtree *self, 
+                         np.float64_t *node_weights, 
+                         np.float64_t *weights)
+
+    object build_node_stats(ckdtree *self, 
+                            const np.float64_t *weights, 
+                            np.float64_t *node_weights, 
+                            np.float64_t *centroids)
+                     
+    object count_neighbors_unweighted(const ckdtree *self,
+                                      const ckdtree *other,
+                                      np.intp_t     n_queries,
+                                      np.float64_t  *real_r,
+                                      np.intp_t     *results,
+                                      const np.float64_t p,
+                                      int cumulative,
+                                      const int n_jobs)
+
+    object count_neighbors_weighted(const ckdtree *self,
+                                    const ckdtree *other,
+                                    np.float64_t  *self_weights,
+                                    np.float64_t  *other_weights,
+                                    np.float64_t  *self_node_weights,
+                                    np.float64_t  *other_node_weights,
+                                    np.intp_t     n_queries,
+                                    np.float64_t  *real_r,
+                                    np.float64_t  *results,
+                                    const np.float64_t p,
+                                    int cumulative,
+                                    const int n_jobs)
                            
     object query_ball_point(const ckdtree *self,
                             const np.float64_t *x,
@@ -379,26 +525,83 @@ cdef extern from "ckdtree_methods.h":
                             const np.float64_t p,
                             const np.float64_t eps,
                             const np.intp_t n_queries,
-                            vector[np.intp_t] **results)
+                            vector[np.intp_t] **results,
+                            const int n_jobs)
+
+    object query_ball_point_csr(const ckdtree *self,
+                                const np.float64_t *x,
+                                const np.float64_t r,
+                                const np.float64_t p,
+                                const np.float64_t eps,
+                                const np.intp_t n_queries,
+                                np.intp_t *indptr,
+                                vector[ball_block] *blocks,
+                                const int return_distances,
+                                const int n_jobs)
+
+    object query_ball_point_csr_copy(vector[ball_block] *blocks,
+                                     const np.intp_t *indptr,
+                                     np.intp_t *indices,
+                                     np.float64_t *distances,
+                                     const int n_jobs)
+
+    object count_ball_point(const ckdtree *self,
+                            const np.float64_t *x,
+                            const np.float64_t r,
+                            const np.float64_t p,
+                            const np.float64_t eps,
+                            const np.intp_t n_queries,
+                            const np.float64_t *weights,
+                            const np.float64_t *node_weights,
+                            np.float64_t *results,
+                            const int n_jobs)
+
+    object kernel_sum(const ckdtree *self,
+                      const np.float64_t *x,
+                      const np.float64_t bandwidth,
+                      const np.float64_t p,
+                      const np.float64_t atol,
+                      const np.intp_t n_queries,
+                      const np.float64_t *weights,
+                      const np.float64_t *node_weights,
+                      const np.float64_t *centroids,
+                      np.float64_t *results,
+                      const int n_jobs)
 
     object query_ball_tree(const ckdtree *self,
                            const ckdtree *other,
                            const np.float64_t r,
                            const np.float64_t p,
                            const np.float64_t eps,
-                           vector[np.intp_t] **results)                     
+                           vector[np.intp_t] **results,
+                           const int n_jobs)
      
+    object query_knn_tree(const ckdtree *self,
+                          const ckdtree *other,
+                          np.float64_t *dd,
+                          np.intp_t *ii,
+                          const np.intp_t *k,
+                          const np.intp_t nk,
+                          const np.intp_t kmax,
+                          const np.float64_t eps,
+                          const np.float64_t p,
+                          const np.float64_t distance_upper_bound,
+                          const int n_jobs)
+
     object sparse_distance_matrix(const ckdtree *self,
                                   const ckdtree *other,
                                   const np.float64_t p,
                                   const np.float64_t max_distance,
-                                  vector[coo_entry] *results)                    
+                                  vector[coo_entry] *results,
+                                  const int n_jobs)
                       
                       
 cdef public class cKDTree [object ckdtree, type ckdtree_type]:
     """
     cKDTree(data, leafsize=16, compact_nodes=True, copy_data=False,
-            balanced_tree=True)
+            balanced_tree=True, boxsize=None, n_jobs=1,
+            node_layout='standard', reorder_data=False, dtype=None,
+            random_splits=None, metric=None)
 
     kd-tree for quick nearest-neighbor lookup
 
@@ -453,6 +656,66 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
         is the boxsize along i-th dimension. The input data shall be wrapped 
         into :math:`[0, L_i)`. A ValueError is raised if any of the data is
         outside of this bound.
+    n_jobs : int, optional
+        Number of threads used to build the kd-tree. The subtrees below the
+        top levels are built in parallel, and the resulting tree is identical
+        to the one built serially. If -1 is given all processors are used.
+        Default: 1.
+    node_layout : {'standard', 'compact'}, optional
+        Memory layout of the tree used by `query` and `query_ball_point`.
+        With 'compact', a second copy of the tree is stored with 32-byte
+        nodes in depth-first order, together with a copy of the data 
+        reordered so that the points of each leaf are contiguous. This 
+        reduces the number of cache lines touched by the queries at the
+        expense of the extra memory. Default: 'standard'.
+    reorder_data : bool, optional
+        If True, a copy of the data is stored with the points of each leaf
+        contiguous, so the brute-force scans at the leaves of `query` and
+        `query_ball_point` read the points sequentially instead of through
+        the index array. This doubles the memory used for the data.
+        Implied by ``node_layout='compact'``. Default: False.
+    dtype : {None, numpy.float64, numpy.float32}, optional
+        Type used to store the data. With `numpy.float32` the data take
+        half the memory and memory bandwidth, which speeds up the leaf
+        scans of large trees. Distances are still computed in double 
+        precision from the stored coordinates, so the results are those
+        for the data rounded to single precision. None stores the data as
+        double precision. Default: None.
+    random_splits : int, optional
+        If given, the seed of a randomized tree, which splits on a random
+        choice among the five dimensions of largest spread instead of the
+        dimension of largest spread. Several randomized trees over the
+        same data with different seeds can be searched together by `query`
+        with a bound on the number of leaves visited, which gives better
+        approximate neighbors in high dimensions than a single tree.
+        Default: None.
+    metric : PyCapsule, optional
+        A metric other than the Minkowski distances, given as C functions.
+        The capsule must be named ``"ckdtree_metric"`` and holds a pointer
+        to a struct ::
+
+            typedef struct {
+                double (*point_point)(const double *x, const double *y,
+                                      npy_intp m, void *user_data);
+                void (*rect_rect)(const double *mins1, const double *maxes1,
+                                  const double *mins2, const double *maxes2,
+                                  npy_intp m, double *min, double *max,
+                                  void *user_data);
+                void *user_data;
+            } ckdtree_metric;
+
+        ``point_point`` returns the distance between the points x and y.
+        ``rect_rect`` returns in min and max a lower and an upper bound of 
+        the distances between the points of two hyperrectangles, given by
+        their minimum and maximum coordinates; a query point is passed as 
+        a rectangle with ``mins == maxes``. The bounds need not be tight,
+        but the queries are only correct if they are bounds. The functions
+        read the data of the tree in place and are called without holding
+        the GIL, possibly from several threads at once. The capsule and 
+        the struct must stay valid as long as the tree is used. The 
+        argument ``p`` of the queries is ignored for such trees, and the 
+        trees of the dual-tree queries must have the same metric. Cannot
+        be combined with `boxsize`. Default: None.
 
     See Also
     --------
@@ -464,7 +727,7 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
         ckdtreenode              *ctree 
         readonly cKDTreeNode     tree 
         readonly np.ndarray      data
-        np.float64_t             *raw_data
+        void                     *raw_data
         readonly np.intp_t       n, m
         readonly np.intp_t       leafsize
         readonly np.ndarray      maxes
@@ -477,17 +740,43 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
         readonly object          boxsize
         np.ndarray               boxsize_data
         np.float64_t             *raw_boxsize_data
+        readonly object          node_layout
+        vector[ckdtree_compact_node] *compact_tree_buffer
+        ckdtree_compact_node     *compact_tree
+        np.ndarray               tree_data
+        void                     *raw_tree_data
+        readonly np.intp_t       size
+        object                   _node_arrays
+        np.ndarray               _deleted
+        np.uint8_t               *raw_deleted
+        np.uint64_t              split_seed
+        readonly object          metric
+        ckdtree_metric           *raw_metric
 
     def __cinit__(cKDTree self):
         self.tree_buffer = NULL        
+        self.compact_tree_buffer = NULL
+        self.compact_tree = NULL
+        self.raw_tree_data = NULL
+        self.raw_deleted = NULL
+        self.raw_metric = NULL
             
     def __init__(cKDTree self, data, np.intp_t leafsize=16, compact_nodes=True, 
-            copy_data=False, balanced_tree=True, boxsize=None):
-        cdef np.ndarray[np.float64_t, ndim=2] data_arr
+            copy_data=False, balanced_tree=True, boxsize=None, 
+            np.intp_t n_jobs=1, node_layout='standard', reorder_data=False,
+            dtype=None, random_splits=None, metric=None):
+        cdef np.ndarray data_arr
         cdef np.float64_t *tmp
         cdef int _median, _compact
         cdef np.ndarray[np.float64_t, ndim=1] boxsize_arr
-        data_arr = np.ascontiguousarray(data, dtype=np.float64)
+        if dtype is None:
+            dtype = np.float64
+        dtype = np.dtype(dtype)
+        if dtype != np.float64 and dtype != np.float32:
+            raise ValueError("dtype must be float64 or float32")
+        data_arr = np.ascontiguousarray(data, dtype=dtype)
+        if data_arr.ndim != 2:
+            raise ValueError("data must be 2 dimensional")
         if copy_data and (data_arr is data):
             data_arr = data_arr.copy()
         self.data = data_arr
@@ -496,6 +785,26 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
         self.leafsize = leafsize
         if self.leafsize<1:
             raise ValueError("leafsize must be at least 1")
+        if n_jobs == -1:
+            n_jobs = number_of_processors
+        if n_jobs < 1:
+            raise ValueError("n_jobs must be -1 or a positive integer")
+        if node_layout not in ('standard', 'compact'):
+            raise ValueError("node_layout must be 'standard' or 'compact'")
+        self.node_layout = node_layout
+
+        if metric is not None:
+            if not PyCapsule_CheckExact(metric):
+                raise ValueError("metric must be a PyCapsule holding a "
+                                 "pointer to a ckdtree_metric")
+            if not PyCapsule_IsValid(metric, "ckdtree_metric"):
+                raise TypeError("the metric capsule must be named "
+                                "'ckdtree_metric'")
+            if boxsize is not None:
+                raise ValueError("metric cannot be combined with boxsize")
+            self.raw_metric = <ckdtree_metric*> PyCapsule_GetPointer(
+                metric, "ckdtree_metric")
+            self.metric = metric
 
         if boxsize is None:
             self.boxsize = None
@@ -518,13 +827,16 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
         self.mins = np.ascontiguousarray(np.amin(self.data,axis=0), dtype=np.float64)
         self.indices = np.ascontiguousarray(np.arange(self.n,dtype=np.intp))
 
-        self.raw_data = <np.float64_t*> np.PyArray_DATA(self.data)
-        self.raw_maxes = <np.float64_t*> np.PyArray_DATA(self.maxes)
-        self.raw_mins = <np.float64_t*> np.PyArray_DATA(self.mins)
-        self.raw_indices = <np.intp_t*> np.PyArray_DATA(self.indices)
+        self._set_raw_pointers()
 
         _compact = 1 if compact_nodes else 0
         _median = 1 if balanced_tree else 0
+        if random_splits is not None:
+            if random_splits < 0:
+                raise ValueError("random_splits must be None or a "
+                                 "nonnegative integer")
+            # zero is reserved for the deterministic splits
+            self.split_seed = <np.uint64_t> random_splits + 1
         if _median:
             self._median_workspace = np.zeros(self.n)
 
@@ -536,7 +848,7 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
             memcpy(tmp, self.raw_maxes, self.m*sizeof(np.float64_t))
             memcpy(tmp + self.m, self.raw_mins, self.m*sizeof(np.float64_t))
             build_ckdtree(<ckdtree*> self, 0, self.n, tmp, tmp + self.m, 
-                _median, _compact)
+                _median, _compact, n_jobs)
         finally:
             PyMem_Free(tmp)
                 
@@ -544,35 +856,59 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
         
         # set up the tree structure pointers
         self.ctree = tree_buffer_root(self.tree_buffer)
-        self._post_init(self.ctree)
+        self.size = self.tree_buffer.size()
+        self._build_layout(reorder_data)
+        self._post_init()
         
+                
+    cdef int _post_init(cKDTree self) except -1:
         # make the tree viewable from Python
         self.tree = cKDTreeNode()
         self.tree._node = self.ctree
+        self.tree._root = self.ctree
         self.tree._data = self.data
         self.tree._indices = self.indices
         self.tree.level = 0
         self.tree._setup()
-        
-                
-    cdef int _post_init(cKDTree self, ckdtreenode *node) except -1:
-        # recurse the tree and re-initialize
-        # "less" and "greater" fields
-        if node.split_dim == -1:
-            # leafnode
-            node.less = NULL
-            node.greater = NULL
-        else:
-            node.less = self.ctree + node._less
-            node.greater = self.ctree + node._greater
-            self._post_init(node.less)
-            self._post_init(node.greater)
+        return 0
+
+    cdef int _set_raw_pointers(cKDTree self) except -1:
+        self.raw_data = np.PyArray_DATA(self.data)
+        self.raw_maxes = <np.float64_t*> np.PyArray_DATA(self.maxes)
+        self.raw_mins = <np.float64_t*> np.PyArray_DATA(self.mins)
+        self.raw_indices = <np.intp_t*> np.PyArray_DATA(self.indices)
+        if self.boxsize_data is not None:
+            self.raw_boxsize_data = <np.float64_t*> np.PyArray_DATA(self.boxsize_data)
+        if self._deleted is not None:
+            self.raw_deleted = <np.uint8_t*> np.PyArray_DATA(self._deleted)
+        return 0
+
+    cdef np.float64_t _metric_p(cKDTree self, np.float64_t p, 
+                                cKDTree other=None) except? -1:
+        # the distances of a user-supplied metric are used as they are
+        if other is not None and other.raw_metric != self.raw_metric:
+            raise ValueError("Trees have different metrics")
+        if self.raw_metric != NULL:
+            return 1.
+        return p
+
+    cdef int _build_layout(cKDTree self, bint reorder_data) except -1:
+        # copy the data in tree order for sequential leaf scans
+        if reorder_data or self.node_layout == 'compact':
+            self.tree_data = np.take(self.data, self.indices, axis=0)
+            self.raw_tree_data = np.PyArray_DATA(self.tree_data)
+        # set up the copy of the tree used by the compact node layout
+        if self.node_layout == 'compact':
+            self.compact_tree_buffer = new vector[ckdtree_compact_node]()
+            build_compact_tree(<ckdtree*> self)
         return 0
         
 
     def __dealloc__(cKDTree self):
         if self.tree_buffer != NULL:
             del self.tree_buffer
+        if self.compact_tree_buffer != NULL:
+            del self.compact_tree_buffer
 
     # -----
     # query
@@ -581,9 +917,11 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
     @cython.boundscheck(False)
     def query(cKDTree self, object x, object k=1, np.float64_t eps=0,
               np.float64_t p=2, np.float64_t distance_upper_bound=INFINITY,
-              np.intp_t n_jobs=1):
+              np.intp_t n_jobs=1, object out=None, object max_leaves=None,
+              object others=None):
         """
-        query(self, x, k=1, eps=0, p=2, distance_upper_bound=np.inf, n_jobs=1)
+        query(self, x, k=1, eps=0, p=2, distance_upper_bound=np.inf, n_jobs=1,
+              out=None, max_leaves=None, others=None)
 
         Query the kd-tree for nearest neighbors
 
@@ -612,6 +950,24 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
         n_jobs : int, optional
             Number of jobs to schedule for parallel processing. If -1 is given
             all processors are used. Default: 1.
+        out : tuple of two ndarrays, optional
+            Arrays to store the distances and the indices in, instead of 
+            allocating new ones, e.g. memory mapped arrays. They must be 
+            C contiguous and writeable, of dtype float64 and intp, and of
+            shape tuple+(len(k),) for x of shape tuple+(self.m,). The arrays
+            are returned as they are, without squeezing for k == 1.
+        max_leaves : positive int, optional
+            Stop the search of each point after scanning this many leaves,
+            which bounds the time of a query also in high dimensions. The
+            cells are visited in the order of their distance to the point
+            (best bin first), so the neighbors found are usually close to
+            the exact ones. Default: None, which searches until the 
+            neighbors are exact (or within the bound of `eps`).
+        others : sequence of cKDTree, optional
+            Further trees over the same data, with the same `dtype` and
+            layout, which are searched together with this tree, sharing the
+            budget of `max_leaves`. Usually these are randomized trees, see
+            `random_splits`.
                         
         Returns
         -------
@@ -626,6 +982,10 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
             When k == 1, the last dimension of the output is squeezed.
             Missing neighbors are indicated with self.n.
 
+        See Also
+        --------
+        query_chunked : Query for blocks of points at a time.
+
         Notes
         -----
         If the KD-Tree is periodic, the position :py:code:`x` is wrapped into the
@@ -664,9 +1024,16 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
         """
         
         cdef:
-            np.intp_t n, i, j
+            np.intp_t n, i, j, _max_leaves
             int overflown
+            vector[ckdtree*] _others
+            cKDTree other
+            np.ndarray[np.float64_t, ndim=2] _dd, _xx
+            np.ndarray[np.intp_t, ndim=2] _ii
+            np.ndarray[np.intp_t, ndim=1] _k
         
+        p = self._metric_p(p)
+
         x_arr = np.asarray(x, dtype=np.float64)
         if x_arr.ndim == 0 or x_arr.shape[x_arr.ndim - 1] != self.m:
             raise ValueError("x must consist of vectors of length %d but "
@@ -688,48 +1055,71 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
         retshape = np.shape(x)[:-1]
         n = <np.intp_t> np.prod(retshape)
         xx = np.ascontiguousarray(x_arr).reshape(n, self.m)
-        dd = np.empty((n,len(k)),dtype=np.float64)
-        dd.fill(INFINITY)
-        ii = np.empty((n,len(k)),dtype=np.intp)
-        ii.fill(self.n)
-
-        # Do the query in an external C++ function. 
-        # The GIL will be released in the external query function.
-        def _thread_func(self, np.intp_t start, np.intp_t stop):
-            cdef: 
-                np.ndarray[np.intp_t,ndim=2] _ii = ii
-                np.ndarray[np.float64_t,ndim=2] _dd = dd
-                np.ndarray[np.float64_t,ndim=2] _xx = xx
-                np.ndarray[np.intp_t,ndim=1] _k = np.array(k, dtype=np.intp)
-            
-            kmax = np.max(k)
+        # the query fills in all entries of dd and ii
+        if out is None:
+            dd = np.empty((n,len(k)),dtype=np.float64)
+            ii = np.empty((n,len(k)),dtype=np.intp)
+        else:
+            try:
+                ddret, iiret = out
+            except (TypeError, ValueError):
+                raise ValueError("out must be a tuple of two arrays")
+            for arr, dtype in ((ddret, np.float64), (iiret, np.intp)):
+                if (not isinstance(arr, np.ndarray) or arr.dtype != dtype or
+                        arr.shape != retshape + (len(k),) or 
+                        not arr.flags.c_contiguous or 
+                        not arr.flags.writeable):
+                    raise ValueError("out must hold C contiguous, writeable "
+                                     "arrays of dtype float64 and intp and "
+                                     "shape %s" % (retshape + (len(k),),))
+            dd = ddret.reshape(n, len(k))
+            ii = iiret.reshape(n, len(k))
+
+        _k = np.array(k, dtype=np.intp)
+        kmax = np.max(_k)
 
-            query_knn(<ckdtree*>self, &_dd[start,0], &_ii[start,0], 
-                &_xx[start,0], stop-start, &_k[0], len(k), kmax, eps, p, distance_upper_bound)
-        
         if (n_jobs == -1): 
             n_jobs = number_of_processors
-        
-        if n_jobs > 1:
-            # static scheduling without load balancing is good enough
-                             
-            ranges = [(j * n // n_jobs, (j + 1) * n // n_jobs)
-                            for j in range(n_jobs)]
-            
-            # There might be n_jobs+1 threads spawned here, but only n_jobs of 
-            # them will do significant work.
-            threads = [threading.Thread(target=_thread_func,
-                                args=(self, start, stop)) for start, stop in ranges]
-
-            # Set the daemon flag so the process can be aborted, 
-            # start all threads and wait for completion.
-            for t in threads:
-                t.daemon = True
-                t.start()
-            for t in threads: 
-                t.join()
+
+        if max_leaves is None:
+            _max_leaves = 0
         else:
-            _thread_func(self, 0, n)
+            _max_leaves = max_leaves
+            if _max_leaves < 1:
+                raise ValueError("max_leaves must be None or positive")
+
+        if others is None:
+            others = ()
+        others = list(others)
+        for obj in others:
+            if not isinstance(obj, cKDTree):
+                raise ValueError("others must be a sequence of cKDTrees")
+            other = obj
+            if (other.n != self.n or other.m != self.m or 
+                    other.data.dtype != self.data.dtype or
+                    other.node_layout != self.node_layout or 
+                    (other.tree_data is None) != (self.tree_data is None) or
+                    not np.array_equal(other.boxsize, self.boxsize) or
+                    other.raw_metric != self.raw_metric):
+                raise ValueError("others must be cKDTrees of the same "
+                                 "points, dtype, layout, boxsize and metric")
+            _others.push_back(<ckdtree*>other)
+
+        # Do the query in an external C++ function. The GIL will be 
+        # released in the external query function, which also schedules
+        # the queries over n_jobs threads.
+        if n > 0:
+            _dd = dd
+            _ii = ii
+            _xx = xx
+            query_knn(<ckdtree*>self, 
+                &_others[0] if _others.size() else NULL, _others.size(),
+                &_dd[0,0], &_ii[0,0], &_xx[0,0], n, 
+                &_k[0], len(k), kmax, eps, p, distance_upper_bound, 
+                _max_leaves, n_jobs)
+
+        if out is not None:
+            return ddret, iiret
                 
         # massage the output in conformabity to the documented behavior
 
@@ -767,14 +1157,85 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
             
         return ddret, iiret
 
+    def query_chunked(cKDTree self, object x, object k=1, 
+                      np.float64_t eps=0, np.float64_t p=2, 
+                      np.float64_t distance_upper_bound=INFINITY,
+                      np.intp_t n_jobs=1, np.intp_t chunk_size=65536, 
+                      object out=None):
+        """
+        query_chunked(self, x, k=1, eps=0, p=2, distance_upper_bound=np.inf,
+                      n_jobs=1, chunk_size=65536, out=None)
+
+        Query the kd-tree for nearest neighbors, a block of points at a time
+
+        The points are queried in consecutive blocks of `chunk_size`, and 
+        the results of each block are returned by a generator as soon as 
+        they are computed. Only the current block of points is converted 
+        to double precision, so `x` may be larger than memory, e.g. a
+        memory mapped array, and the memory used does not grow with the
+        number of points.
+
+        Parameters
+        ----------
+        x : array_like, shape (n, self.m)
+            An array of points to query.
+        k, eps, p, distance_upper_bound, n_jobs :
+            As for `query`.
+        chunk_size : int, optional
+            Number of points per block. Default: 65536.
+        out : tuple of two ndarrays, optional
+            Arrays of shape (n, len(k)) to store the distances and the 
+            indices in, as for `query`. The results of each block are then
+            written to the corresponding rows of `out`.
+
+        Returns
+        -------
+        chunks : generator
+            Yields ``(start, d, i)`` for consecutive blocks, where ``d`` and 
+            ``i`` are the results of `query` for the points 
+            ``x[start:start + len(d)]``. If `out` is given, ``d`` and ``i`` 
+            are views of the corresponding rows of `out`.
+
+        Examples
+        --------
+        Store the 100 nearest neighbors of a large set of points in a 
+        memory mapped file:
+
+        >>> dd = np.lib.format.open_memmap('d.npy', mode='w+', 
+        ...                                shape=(len(x), 100))
+        >>> ii = np.lib.format.open_memmap('i.npy', mode='w+', 
+        ...                                shape=(len(x), 100), dtype=np.intp)
+        >>> for start, d, i in tree.query_chunked(x, k=100, out=(dd, ii)):
+        ...     pass
+
+        """
+        if not hasattr(x, 'shape'):
+            x = np.asarray(x)
+        if len(x.shape) != 2 or x.shape[1] != self.m:
+            raise ValueError("x must have shape (n, %d) but has shape %s" 
+                             % (int(self.m), x.shape))
+        if chunk_size < 1:
+            raise ValueError("chunk_size must be positive")
+        if out is not None:
+            try:
+                ddout, iiout = out
+            except (TypeError, ValueError):
+                raise ValueError("out must be a tuple of two arrays")
+            if len(ddout) != x.shape[0] or len(iiout) != x.shape[0]:
+                raise ValueError("out must have %d rows" % x.shape[0])
+        return _query_chunks(self, x, k, eps, p, distance_upper_bound, 
+                             n_jobs, chunk_size, out)
+
     # ----------------
     # query_ball_point
     # ----------------
 
     def query_ball_point(cKDTree self, object x, np.float64_t r,
-                         np.float64_t p=2., np.float64_t eps=0, n_jobs=1):
+                         np.float64_t p=2., np.float64_t eps=0, n_jobs=1,
+                         return_csr=False, return_distances=False):
         """
-        query_ball_point(self, x, r, p=2., eps=0)
+        query_ball_point(self, x, r, p=2., eps=0, n_jobs=1, return_csr=False,
+                         return_distances=False)
         
         Find all points within distance r of point(s) x.
 
@@ -794,6 +1255,14 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
         n_jobs : int, optional
             Number of jobs to schedule for parallel processing. If -1 is given
             all processors are used. Default: 1.
+        return_csr : bool, optional
+            If True, return the neighbors of all points in the compressed
+            sparse row format, as flat arrays built without creating Python
+            objects per neighbor. This is much faster and smaller than the
+            lists for many points. Default: False.
+        return_distances : bool, optional
+            If True, also return the distances of the neighbors. Requires
+            ``return_csr=True``. Default: False.
 
         Returns
         -------
@@ -801,6 +1270,13 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
             If `x` is a single point, returns a list of the indices of the
             neighbors of `x`. If `x` is an array of points, returns an object
             array of shape tuple containing lists of neighbors.
+        indices, indptr : ndarray of ints
+            Returned instead of `results` if `return_csr` is True. The
+            neighbors of the i-th point of ``x.reshape(-1, self.m)`` are
+            ``indices[indptr[i]:indptr[i+1]]``, in increasing order.
+        distances : ndarray of floats
+            The distances of the neighbors in `indices`, returned after
+            `indptr` if `return_distances` is True.
 
         Notes
         -----
@@ -824,11 +1300,18 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
             np.ndarray[np.float64_t, ndim=2, mode="c"] vxx
             vector[np.intp_t] *vres
             vector[np.intp_t] **vvres
-            np.uintp_t vvres_uintp
             np.intp_t *cur
             list tmp
             np.intp_t i, j, n, m
         
+        p = self._metric_p(p)
+
+        if return_csr:
+            return self._query_ball_point_csr(x, r, p, eps, n_jobs, 
+                                              return_distances)
+        if return_distances:
+            raise ValueError("return_distances requires return_csr=True")
+
         vres = NULL
         vvres = NULL
         
@@ -842,7 +1325,7 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
             if len(x.shape) == 1:
                 vres = new vector[np.intp_t]()
                 xx = np.ascontiguousarray(x, dtype=np.float64)
-                query_ball_point(<ckdtree*> self, &xx[0], r, p, eps, 1, &vres)
+                query_ball_point(<ckdtree*> self, &xx[0], r, p, eps, 1, &vres, 1)
                 n = <np.intp_t> vres.size()
                 tmp = n * [None]
                 if NPY_LIKELY(n > 0):
@@ -875,43 +1358,13 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
                     vxx[i,:] = x[c]
                     i += 1
                     
-                # multithreading logic is similar to cKDTree.query
-                                        
                 if (n_jobs == -1): 
                     n_jobs = number_of_processors
         
-                if n_jobs > 1:
-                
-                    CHUNK = n//n_jobs if n//n_jobs else n
-                             
-                    def _thread_func(self, _j, _vxx, r, p, eps, _vvres, CHUNK): 
-                        cdef: 
-                            np.intp_t j = _j
-                            np.ndarray[np.float64_t,ndim=2] vxx = _vxx
-                            vector[np.intp_t] **vvres                   
-                            np.intp_t start = j*CHUNK
-                            np.intp_t stop = start + CHUNK
-                        stop = n if stop > n else stop
-                        vvres = (<vector[np.intp_t] **> 
-                                  (<void*> (<np.uintp_t> _vvres)))                                    
-                        if start < n:
-                            query_ball_point(<ckdtree*>self, &vxx[start,0], 
-                                r, p, eps, stop-start, vvres+start)
-                                
-                    vvres_uintp = <np.uintp_t> (<void*> vvres)
-                    threads = [threading.Thread(target=_thread_func,
-                               args=(self, j, vxx, r, p, eps,vvres_uintp,CHUNK))
-                                  for j in range(1+(n//CHUNK))]
-                    for t in threads:
-                        t.daemon = True
-                        t.start()
-                    for t in threads: 
-                        t.join()
-                                                                
-                else:
-                
+                # the queries are scheduled over n_jobs threads in C++
+                if n > 0:
                     query_ball_point(<ckdtree*>self, &vxx[0,0], r, p, eps, 
-                        n, vvres)
+                        n, vvres, n_jobs)
                 
                 i = 0
                 for c in np.ndindex(retshape):
@@ -938,6 +1391,217 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
                 PyMem_Free(vvres)
                 
         return result   
+
+    cdef object _query_ball_point_csr(cKDTree self, object x, np.float64_t r,
+                                      np.float64_t p, np.float64_t eps, 
+                                      n_jobs, return_distances):
+        cdef:
+            np.ndarray[np.float64_t, ndim=2, mode="c"] xx
+            np.ndarray[np.intp_t, ndim=1, mode="c"] indptr
+            np.ndarray[np.intp_t, ndim=1, mode="c"] indices
+            np.ndarray[np.float64_t, ndim=1, mode="c"] distances
+            vector[ball_block] blocks
+            np.intp_t n, nnz
+
+        x = np.asarray(x, dtype=np.float64)
+        if x.shape[-1] != self.m:
+            raise ValueError("Searching for a %d-dimensional point in a "
+                             "%d-dimensional KDTree" % 
+                                 (int(x.shape[-1]), int(self.m)))
+        n = np.prod(x.shape[:-1])
+        xx = np.ascontiguousarray(x).reshape(n, self.m)
+        if (n_jobs == -1): 
+            n_jobs = number_of_processors
+
+        indptr = np.zeros(n + 1, dtype=np.intp)
+        if n > 0:
+            query_ball_point_csr(<ckdtree*>self, &xx[0,0], r, p, eps, n, 
+                &indptr[0], &blocks, return_distances, n_jobs)
+
+        # the blocks of neighbors go straight into the output arrays
+        nnz = indptr[n]
+        indices = np.empty(nnz, dtype=np.intp)
+        distances = np.empty(nnz if return_distances else 0, dtype=np.float64)
+        if nnz > 0:
+            query_ball_point_csr_copy(&blocks, &indptr[0], &indices[0],
+                &distances[0] if return_distances else NULL, n_jobs)
+        if return_distances:
+            return indices, indptr, distances
+        return indices, indptr
+
+
+    # ----------------------------
+    # count_ball_point, kernel_sum
+    # ----------------------------
+
+    def count_ball_point(cKDTree self, object x, np.float64_t r,
+                         np.float64_t p=2., np.float64_t eps=0, 
+                         weights=None, n_jobs=1):
+        """
+        count_ball_point(self, x, r, p=2., eps=0, weights=None, n_jobs=1)
+
+        Count the points within distance r of point(s) x.
+
+        Unlike ``len(query_ball_point(x, r))``, the neighbors are not
+        listed: the nodes of the tree which are entirely within distance r
+        are counted as a whole.
+
+        Parameters
+        ----------
+        x : array_like, shape tuple + (self.m,)
+            The point or points to search for neighbors of.
+        r : positive float
+            The radius of points to return.
+        p : float, optional
+            Which Minkowski p-norm to use.  Should be in the range [1, inf].
+        eps : nonnegative float, optional
+            Approximate search. Nodes are counted as a whole if their
+            furthest points are nearer than ``r * (1 + eps)``, and are
+            not searched if their nearest points are further than 
+            ``r / (1 + eps)``.
+        weights : array_like, shape (self.n,), optional
+            If given, the sums of the weights of the points are returned
+            instead of the numbers of points.
+        n_jobs : int, optional
+            Number of jobs to schedule for parallel processing. If -1 is 
+            given all processors are used. Default: 1.
+
+        Returns
+        -------
+        result : ndarray of ints or floats, shape tuple
+            The number of points, or the sum of their weights, within 
+            distance r of each point of x.
+
+        Examples
+        --------
+        >>> from scipy import spatial
+        >>> x, y = np.mgrid[0:5, 0:5]
+        >>> points = np.c_[x.ravel(), y.ravel()]
+        >>> tree = spatial.cKDTree(points)
+        >>> tree.count_ball_point([[2, 0], [2, 2]], 1)
+        array([4, 5])
+
+        """
+        cdef:
+            np.ndarray[np.float64_t, ndim=2, mode="c"] xx
+            np.ndarray[np.float64_t, ndim=1, mode="c"] results
+            np.ndarray[np.float64_t, ndim=1, mode="c"] w, node_weights
+            np.float64_t *wp = NULL
+            np.float64_t *nwp = NULL
+            np.intp_t n
+
+        p = self._metric_p(p)
+
+        x = np.asarray(x, dtype=np.float64)
+        if x.shape[-1] != self.m:
+            raise ValueError("Searching for a %d-dimensional point in a "
+                             "%d-dimensional KDTree" % 
+                                 (int(x.shape[-1]), int(self.m)))
+        n = np.prod(x.shape[:-1])
+        xx = np.ascontiguousarray(x).reshape(n, self.m)
+        if (n_jobs == -1): 
+            n_jobs = number_of_processors
+        if weights is not None:
+            w = np.ascontiguousarray(weights, dtype=np.float64)
+            node_weights = self._build_weights(w)
+            wp = &w[0]
+            nwp = &node_weights[0]
+
+        results = np.zeros(n, dtype=np.float64)
+        if n > 0:
+            count_ball_point(<ckdtree*>self, &xx[0,0], r, p, eps, n, 
+                             wp, nwp, &results[0], n_jobs)
+        
+        if weights is None:
+            return results.astype(np.intp).reshape(x.shape[:-1])
+        return results.reshape(x.shape[:-1])
+
+    def kernel_sum(cKDTree self, object x, np.float64_t bandwidth,
+                   weights=None, np.float64_t atol=0, n_jobs=1):
+        """
+        kernel_sum(self, x, bandwidth, weights=None, atol=0, n_jobs=1)
+
+        Sum a Gaussian kernel over the points of the tree.
+
+        For each point of x, computes the sum of 
+        ``w * exp(-d**2 / (2 * bandwidth**2))`` over the points of the
+        tree, with d the Euclidean distance to the point and w its weight.
+        The nodes of the tree over which the kernel varies by little are 
+        approximated by their weighted centroids, which avoids visiting
+        the points. This is the sum evaluated by a kernel density estimate
+        such as `scipy.stats.gaussian_kde` on whitened data.
+
+        Parameters
+        ----------
+        x : array_like, shape tuple + (self.m,)
+            The point or points to evaluate the sum at.
+        bandwidth : positive float
+            The standard deviation of the kernel.
+        weights : array_like, shape (self.n,), optional
+            Nonnegative weights of the points. Default: all weights are 1.
+        atol : nonnegative float, optional
+            Absolute tolerance of the sums. With zero, all points with a 
+            nonzero kernel value are visited. Default: 0.
+        n_jobs : int, optional
+            Number of jobs to schedule for parallel processing. If -1 is 
+            given all processors are used. Default: 1.
+
+        Returns
+        -------
+        result : ndarray of floats, shape tuple
+            The kernel sums at the points of x.
+
+        Notes
+        -----
+        The weight and the weighted centroid of every node are computed 
+        on each call, in time linear in the number of points. For a tree 
+        with a user-supplied metric, d is the distance of the metric.
+
+        """
+        cdef:
+            np.ndarray[np.float64_t, ndim=2, mode="c"] xx
+            np.ndarray[np.float64_t, ndim=1, mode="c"] results
+            np.ndarray[np.float64_t, ndim=1, mode="c"] w, node_weights
+            np.ndarray[np.float64_t, ndim=2, mode="c"] centroids
+            np.float64_t *wp = NULL
+            np.float64_t p
+            np.intp_t n
+
+        p = self._metric_p(2.)
+
+        x = np.asarray(x, dtype=np.float64)
+        if x.shape[-1] != self.m:
+            raise ValueError("Searching for a %d-dimensional point in a "
+                             "%d-dimensional KDTree" % 
+                                 (int(x.shape[-1]), int(self.m)))
+        if not bandwidth > 0:
+            raise ValueError("bandwidth must be positive")
+        if not atol >= 0:
+            raise ValueError("atol must be nonnegative")
+        n = np.prod(x.shape[:-1])
+        xx = np.ascontiguousarray(x).reshape(n, self.m)
+        if (n_jobs == -1): 
+            n_jobs = number_of_processors
+        if weights is not None:
+            w = np.ascontiguousarray(weights, dtype=np.float64)
+            if w.shape[0] != self.n:
+                raise ValueError('Number of weights differ from the number '
+                                 'of data points')
+            if (w < 0).any():
+                raise ValueError("weights must be nonnegative")
+            wp = &w[0]
+
+        results = np.zeros(n, dtype=np.float64)
+        if n > 0 and self.n > 0:
+            node_weights = np.empty(self.size, dtype=np.float64)
+            centroids = np.empty((self.size, self.m), dtype=np.float64)
+            build_node_stats(<ckdtree*>self, wp, &node_weights[0], 
+                             &centroids[0,0])
+            kernel_sum(<ckdtree*>self, &xx[0,0], bandwidth, p, atol, n, 
+                       wp, &node_weights[0], &centroids[0,0], &results[0], 
+                       n_jobs)
+
+        return results.reshape(x.shape[:-1])
             
 
     # ---------------
@@ -945,9 +1609,10 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
     # ---------------
     
     def query_ball_tree(cKDTree self, cKDTree other,
-                        np.float64_t r, np.float64_t p=2., np.float64_t eps=0):
+                        np.float64_t r, np.float64_t p=2., np.float64_t eps=0,
+                        n_jobs=1):
         """
-        query_ball_tree(self, other, r, p=2., eps=0)
+        query_ball_tree(self, other, r, p=2., eps=0, n_jobs=1)
 
         Find all pairs of points whose distance is at most r
 
@@ -965,6 +1630,11 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
             if their nearest points are further than ``r/(1+eps)``, and
             branches are added in bulk if their furthest points are nearer
             than ``r * (1+eps)``.  `eps` has to be non-negative.
+        n_jobs : int, optional
+            Number of jobs to schedule for parallel processing. The dual-tree
+            traversal is split into independent pairs of subtrees near the
+            top of the trees. If -1 is given all processors are used.
+            Default: 1.
 
         Returns
         -------
@@ -981,10 +1651,15 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
             list results
             list tmp
 
+        p = self._metric_p(p, other)
+
         # Make sure trees are compatible
         if self.m != other.m:
             raise ValueError("Trees passed to query_ball_tree have different "
                              "dimensionality")
+        if self.data.dtype != other.data.dtype:
+            raise ValueError("Trees passed to query_ball_tree have different "
+                             "dtypes")
      
         n = self.n
         
@@ -1003,8 +1678,11 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
         
             # query in C++
             # the GIL will be released in the C++ code
+            if (n_jobs == -1): 
+                n_jobs = number_of_processors
+
             query_ball_tree(
-                <ckdtree*> self, <ckdtree*> other, r, p, eps, vvres)
+                <ckdtree*> self, <ckdtree*> other, r, p, eps, vvres, n_jobs)
                           
             # store the results in a list of lists                                        
             results = n * [None]
@@ -1029,14 +1707,118 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
 
         return results
 
+    # --------------
+    # query_knn_tree
+    # --------------
+    def query_knn_tree(cKDTree self, cKDTree other, object k=1,
+                       np.float64_t eps=0, np.float64_t p=2,
+                       np.float64_t distance_upper_bound=INFINITY,
+                       np.intp_t n_jobs=1):
+        """
+        query_knn_tree(self, other, k=1, eps=0, p=2, 
+                       distance_upper_bound=np.inf, n_jobs=1)
+
+        Find the nearest neighbors in other of all points of this tree
+
+        The result is the same as the one of ``other.query(self.data, k)``,
+        but the two trees are traversed simultaneously, so that groups of 
+        nearby points share the work of pruning the distant parts of `other`.
+        For large sets of points in a few dimensions this is considerably
+        faster than one query per point, e.g. when building a 
+        k-nearest-neighbors graph with ``tree.query_knn_tree(tree, k)``.
+
+        Parameters
+        ----------
+        other : cKDTree instance
+            The tree containing points to search against.
+        k : list of integer or integer
+            The list of k-th nearest neighbors to return. If k is an 
+            integer it is treated as a list of [1, ... k] (range(1, k+1)).
+            Note that the counting starts from 1.
+        eps : non-negative float
+            Return approximate nearest neighbors; the k-th returned value 
+            is guaranteed to be no further than (1+eps) times the 
+            distance to the real k-th nearest neighbor.
+        p : float, 1<=p<=infinity
+            Which Minkowski p-norm to use. 
+        distance_upper_bound : nonnegative float
+            Return only neighbors within this distance.
+        n_jobs : int, optional
+            Number of jobs to schedule for parallel processing. The traversal
+            is split into independent subtrees of this tree. If -1 is given 
+            all processors are used. Default: 1.
+
+        Returns
+        -------
+        d : ndarray of floats
+            The distances to the nearest neighbors, of shape 
+            ``(self.n, len(k))``. When k == 1, the last dimension of the 
+            output is squeezed. Missing neighbors are indicated with infinite
+            distances.
+        i : ndarray of ints
+            The locations of the neighbors in ``other.data``, of the same
+            shape as `d`. Missing neighbors are indicated with ``other.n``.
+
+        See Also
+        --------
+        query : Query the tree for the nearest neighbors of a set of points.
+
+        """
+
+        cdef:
+            np.ndarray[np.float64_t, ndim=2] _dd
+            np.ndarray[np.intp_t, ndim=2] _ii
+            np.ndarray[np.intp_t, ndim=1] _k
+
+        p = self._metric_p(p, other)
+
+        # Make sure trees are compatible
+        if self.m != other.m:
+            raise ValueError("Trees passed to query_knn_tree have different "
+                             "dimensionality")
+        if self.data.dtype != other.data.dtype:
+            raise ValueError("Trees passed to query_knn_tree have different "
+                             "dtypes")
+        if p < 1:
+            raise ValueError("Only p-norms with 1<=p<=infinity permitted")
+
+        nearest = False
+        if np.isscalar(k):
+            if k == 1:
+                nearest = True
+            k = np.arange(1, k + 1)
+        _k = np.array(k, dtype=np.intp)
+        if _k.ndim != 1 or _k.shape[0] == 0 or np.min(_k) < 1:
+            raise ValueError("k must be a positive integer or a list of "
+                             "positive integers")
+        kmax = np.max(_k)
+
+        dd = np.empty((self.n, len(k)), dtype=np.float64)
+        ii = np.empty((self.n, len(k)), dtype=np.intp)
+
+        if (n_jobs == -1): 
+            n_jobs = number_of_processors
+
+        # the GIL will be released in the C++ code
+        if self.n > 0:
+            _dd = dd
+            _ii = ii
+            query_knn_tree(<ckdtree*> self, <ckdtree*> other, &_dd[0,0],
+                &_ii[0,0], &_k[0], len(k), kmax, eps, p, 
+                distance_upper_bound, n_jobs)
+
+        if nearest:
+            return dd[:, 0], ii[:, 0]
+        return dd, ii
+
     # -----------
     # query_pairs
     # -----------
     
     def query_pairs(cKDTree self, np.float64_t r, np.float64_t p=2.,
-                    np.float64_t eps=0, output_type='set'):
+                    np.float64_t eps=0, output_type='set', n_jobs=1):
         """
-        query_pairs(self, r, p=2., eps=0)
+        query_pairs(self, r, p=2., eps=0, output_type='set', n_jobs=1)
 
         Find all pairs of points whose distance is at most r.
 
@@ -1053,7 +1835,12 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
             branches are added in bulk if their furthest points are nearer
             than ``r * (1+eps)``.  `eps` has to be non-negative.
         output_type : string, optional
-            Choose the output container, 'set' or 'ndarray'. Default: 'set'
+            Choose the output container, 'set' or 'ndarray'. The 'ndarray'
+            output is built without creating Python objects per pair, and
+            is much faster for many pairs. Default: 'set'
+        n_jobs : int, optional
+            Number of jobs to schedule for parallel processing. If -1 is given
+            all processors are used. Default: 1.
 
         Returns
         -------
@@ -1066,8 +1853,15 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
                  
         cdef ordered_pairs results
 
+        p = self._metric_p(p)
+
+        if output_type not in ('set', 'ndarray'):
+            raise ValueError("Invalid output type") 
+        if (n_jobs == -1): 
+            n_jobs = number_of_processors
+
         results = ordered_pairs()
-        query_pairs(<ckdtree*> self, r, p, eps, results.buf)
+        query_pairs(<ckdtree*> self, r, p, eps, results.buf, n_jobs)
         
         if output_type == 'set':
             return results.set()
@@ -1082,9 +1876,10 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
     # ---------------
 
     @cython.boundscheck(False)
-    def count_neighbors(cKDTree self, cKDTree other, object r, np.float64_t p=2.):
+    def count_neighbors(cKDTree self, cKDTree other, object r, np.float64_t p=2.,
+                        weights=None, int cumulative=True, n_jobs=1):
         """
-        count_neighbors(self, other, r, p=2.)
+        count_neighbors(self, other, r, p=2., weights=None, cumulative=True, n_jobs=1)
 
         Count how many nearby pairs can be formed.
 
@@ -1095,32 +1890,71 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
         "N-body problems in statistical learning", and the code here is based
         on their algorithm.
 
+        If weights are given, each pair is counted with the product of the
+        weights of its two points instead of one.
+
         Parameters
         ----------
         other : cKDTree instance
-            The other tree to draw points from.
+            The other tree to draw points from, can be the same tree as self.
         r : float or one-dimensional array of floats
             The radius to produce a count for. Multiple radii are searched with
             a single tree traversal.
+            If the count is non-cumulative (``cumulative=False``), `r` defines
+            the edges of the bins, and must be non-decreasing.
         p : float, optional 
             1<=p<=infinity, default 2.0
             Which Minkowski p-norm to use
+        weights : tuple, array_like, or None, optional
+            If None, the pair-counting is unweighted.
+            If given as a tuple, weights[0] is the weights of points in
+            ``self``, and weights[1] is the weights of points in ``other``;
+            either can be None to indicate the points are unweighted.
+            If given as an array_like, weights is the weights of points in
+            ``self`` and ``other``. For this to make sense, ``self`` and
+            ``other`` must be the same tree. If ``self`` and ``other`` are
+            two different trees, a ``ValueError`` is raised.
+            Default: None
+        cumulative : bool, optional
+            Whether the returned counts are cumulative. When cumulative is
+            set to ``False`` the algorithm is optimized to work with a large
+            number of bins (>10) specified by `r`. When ``cumulative`` is set
+            to True, the algorithm is optimized to work with a small number
+            of `r`. Default: True
+        n_jobs : int, optional
+            Number of jobs to schedule for parallel processing. The dual-tree
+            traversal is split into independent pairs of subtrees near the
+            top of the trees, each counted separately and summed at the end.
+            If -1 is given all processors are used. Default: 1.
 
         Returns
         -------
-        result : int or 1-D array of ints
-            The number of pairs.
+        result : scalar or 1-D array
+            The number of pairs. For unweighted counts, the result is an
+            integer. For weighted counts, the result is a float.
+            If cumulative is False, ``result[i]`` contains the counts with
+            ``(-inf if i == 0 else r[i-1]) < R <= r[i]``
         """
         cdef: 
             int r_ndim
             np.intp_t n_queries, i
-            np.ndarray[np.float64_t, ndim=1, mode="c"] real_r
-            np.ndarray[np.intp_t, ndim=1, mode="c"] results, idx
+            np.ndarray[np.float64_t, ndim=1, mode="c"] real_r, fresults
+            np.ndarray[np.float64_t, ndim=1, mode="c"] w1, w1n, w2, w2n
+            np.ndarray[np.intp_t, ndim=1, mode="c"] iresults
+            np.float64_t *w1p
+            np.float64_t *w1np
+            np.float64_t *w2p
+            np.float64_t *w2np
+
+        p = self._metric_p(p, other)
 
         # Make sure trees are compatible
         if self.m != other.m:
             raise ValueError("Trees passed to count_neighbors have different "
                              "dimensionality")
+        if self.data.dtype != other.data.dtype:
+            raise ValueError("Trees passed to count_neighbors have different "
+                             "dtypes")
 
         # Make a copy of r array to ensure it's contiguous and to modify it
         # below
@@ -1131,20 +1965,74 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
         real_r = np.array(r, ndmin=1, dtype=np.float64, copy=True)
         n_queries = real_r.shape[0]
 
+        # The traversal requires sorted radii. Cumulative counts do not
+        # depend on the order, so sort here and undo it on return.
+        if cumulative:
+            uind = np.argsort(real_r, kind='mergesort')
+            real_r = real_r[uind]
+        elif n_queries > 1 and (real_r[:-1] > real_r[1:]).any():
+            raise ValueError("r must be non-decreasing for non-cumulative "
+                             "counting.")
+
         # Internally, we represent all distances as distance ** p
         if not ckdtree_isinf(p):
             for i in range(n_queries):
                 if not ckdtree_isinf(real_r[i]):
                     real_r[i] = real_r[i] ** p
 
-        results = np.zeros(n_queries, dtype=np.intp)
-        idx = np.arange(n_queries, dtype=np.intp)
-        
-        count_neighbors(<ckdtree*> self, <ckdtree*> other, n_queries,
-                        &real_r[0], &results[0], &idx[0], p)
+        if (n_jobs == -1): 
+            n_jobs = number_of_processors
+
+        if weights is None:
+            self_weights = other_weights = None
+        elif isinstance(weights, tuple):
+            self_weights, other_weights = weights
+        else:
+            self_weights = other_weights = weights
+            if other is not self:
+                raise ValueError("Two different trees are used. Specify "
+                                 "weights for both in a tuple.")
+
+        if self_weights is None and other_weights is None:
+            iresults = np.zeros(n_queries, dtype=np.intp)
+            count_neighbors_unweighted(<ckdtree*> self, <ckdtree*> other, 
+                                       n_queries, &real_r[0], &iresults[0],
+                                       p, cumulative, n_jobs)
+            results = iresults
+        else:
+            # weights are per point; the traversal also needs the sums of
+            # the weights under each node
+            w1p = w1np = w2p = w2np = NULL
+            if self_weights is not None:
+                w1 = np.ascontiguousarray(self_weights, dtype=np.float64)
+                w1n = self._build_weights(w1)
+                w1p = &w1[0]
+                w1np = &w1n[0]
+            if other_weights is not None:
+                if other is self and other_weights is self_weights:
+                    w2, w2n = w1, w1n
+                else:
+                    w2 = np.ascontiguousarray(other_weights, dtype=np.float64)
+                    w2n = other._build_weights(w2)
+                w2p = &w2[0]
+                w2np = &w2n[0]
+
+            fresults = np.zeros(n_queries, dtype=np.float64)
+            count_neighbors_weighted(<ckdtree*> self, <ckdtree*> other,
+                                     w1p, w2p, w1np, w2np,
+                                     n_queries, &real_r[0], &fresults[0],
+                                     p, cumulative, n_jobs)
+            results = fresults
+
+        if cumulative:
+            # undo the sorting of r
+            tmp = np.empty_like(results)
+            tmp[uind] = results
+            results = tmp
         
         if r_ndim == 0:
-            if results[0] <= <np.intp_t> LONG_MAX:
+            if results.dtype == np.intp and \
+                    results[0] <= <np.intp_t> LONG_MAX:
                 return int(results[0])
             else:
                 return results[0]
@@ -1152,6 +2040,41 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
             return results
 
 
+    def _build_weights(cKDTree self, object weights):
+        """
+        _build_weights(weights)
+
+        Compute the sums of the point weights under each node of the tree.
+
+        Parameters
+        ----------
+        weights : array_like
+            Weights of the data points, with shape (n,).
+
+        Returns
+        -------
+        node_weights : array_like
+            Total weight of each node, in the order of the tree buffer.
+        """
+        cdef:
+            np.intp_t num_of_nodes
+            np.ndarray[np.float64_t, ndim=1, mode="c"] node_weights
+            np.ndarray[np.float64_t, ndim=1, mode="c"] proper_weights
+
+        num_of_nodes = self.size
+        node_weights = np.empty(num_of_nodes, dtype=np.float64)
+
+        proper_weights = np.ascontiguousarray(weights, dtype=np.float64)
+
+        if len(proper_weights) != self.n:
+            raise ValueError('Number of weights differ from the number of '
+                             'data points')
+
+        build_weights(<ckdtree*> self, &node_weights[0], &proper_weights[0])
+
+        return node_weights
+
+
     # ----------------------
     # sparse_distance_matrix
     # ----------------------
@@ -1159,9 +2082,10 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
     def sparse_distance_matrix(cKDTree self, cKDTree other,
                                np.float64_t max_distance,
                                np.float64_t p=2.,
-                               output_type='dok_matrix'):
+                               output_type='dok_matrix', n_jobs=1):
         """
-        sparse_distance_matrix(self, other, max_distance, p=2.)
+        sparse_distance_matrix(self, other, max_distance, p=2.,
+                               output_type='dok_matrix', n_jobs=1)
 
         Compute a sparse distance matrix
 
@@ -1179,11 +2103,17 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
         
         output_type : string, optional
             Which container to use for output data. Options: 'dok_matrix',
-            'coo_matrix', 'dict', or 'ndarray'. Default: 'dok_matrix'.
+            'coo_matrix', 'csr_matrix', 'dict', or 'ndarray'. The 
+            'coo_matrix', 'csr_matrix' and 'ndarray' outputs are built 
+            without creating Python objects per entry, and are much faster
+            for many entries. Default: 'dok_matrix'.
+        n_jobs : int, optional
+            Number of jobs to schedule for parallel processing. If -1 is given
+            all processors are used. Default: 1.
 
         Returns
         -------
-        result : dok_matrix, coo_matrix, dict or ndarray
+        result : dok_matrix, coo_matrix, csr_matrix, dict or ndarray
             Sparse matrix representing the results in "dictionary of keys" 
             format. If a dict is returned the keys are (i,j) tuples of indices.
             If output_type is 'ndarray' a record array with fields 'i', 'j',
@@ -1192,14 +2122,26 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
         
         cdef coo_entries res
 
+        p = self._metric_p(p, other)
+
         # Make sure trees are compatible
         if self.m != other.m:
             raise ValueError("Trees passed to sparse_distance_matrix have "
                              "different dimensionality")                                      
+        if self.data.dtype != other.data.dtype:
+            raise ValueError("Trees passed to sparse_distance_matrix have different "
+                             "dtypes")
+        if output_type not in ('dict', 'ndarray', 'coo_matrix', 
+                               'csr_matrix', 'dok_matrix'):
+            raise ValueError('Invalid output type')
+        if (n_jobs == -1): 
+            n_jobs = number_of_processors
+
         # do the query
         res = coo_entries()
         sparse_distance_matrix(
-                <ckdtree*> self, <ckdtree*> other, p, max_distance, res.buf)
+                <ckdtree*> self, <ckdtree*> other, p, max_distance, res.buf,
+                n_jobs)
                 
         if output_type == 'dict':
             return res.dict()
@@ -1207,6 +2149,8 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
             return res.ndarray()
         elif output_type == 'coo_matrix':
             return res.coo_matrix(self.n, other.n)            
+        elif output_type == 'csr_matrix':
+            return res.coo_matrix(self.n, other.n).tocsr()
         elif output_type == 'dok_matrix':
             return res.dok_matrix(self.n, other.n)
         else:
@@ -1223,40 +2167,507 @@ cdef public class cKDTree [object ckdtree, type ckdtree_type]:
 
     def __getstate__(cKDTree self):
         cdef object state
-        cdef object tree = pickle_tree_buffer(self.tree_buffer)
-        state = (tree, self.data.copy(), self.n, self.m, self.leafsize,
-                      self.maxes, self.mins, self.indices.copy(), 
-                      self.boxsize, self.boxsize_data)
+        cdef object tree
+        if self.metric is not None:
+            raise TypeError("a cKDTree with a metric given as C functions "
+                            "cannot be pickled")
+        tree = self._node_bytes()
+        state = (tree, np.array(self.data), self.n, self.m, self.leafsize,
+                      self.maxes, self.mins, np.array(self.indices), 
+                      self.boxsize, self.boxsize_data, self.node_layout,
+                      self.tree_data is not None, self._deleted)
         return state
             
     def __setstate__(cKDTree self, state):
         cdef object tree
+        cdef bint reorder_data
+        if len(state) == _PICKLE_STATE_SIZE_OLD:
+            state = _upgrade_pickle_state(state)
+        elif len(state) != _PICKLE_STATE_SIZE:
+            raise ValueError("cannot unpickle a cKDTree with a state of %d "
+                             "items, it was pickled by an incompatible "
+                             "version of scipy" % len(state))
         self.tree_buffer = new vector[ckdtreenode]()
         
         # unpack the state
         (tree, self.data, self.n, self.m, self.leafsize, 
-            self.maxes, self.mins, self.indices, self.boxsize, self.boxsize_data) = state
+            self.maxes, self.mins, self.indices, self.boxsize, self.boxsize_data,
+            self.node_layout, reorder_data, self._deleted) = state
         
         # copy kd-tree buffer 
         unpickle_tree_buffer(self.tree_buffer, tree)    
         
         # set raw pointers
-        self.raw_data = <np.float64_t*>np.PyArray_DATA(self.data)
-        self.raw_maxes = <np.float64_t*>np.PyArray_DATA(self.maxes)
-        self.raw_mins = <np.float64_t*>np.PyArray_DATA(self.mins)
-        self.raw_indices = <np.intp_t*>np.PyArray_DATA(self.indices)
-        if self.boxsize_data is not None:
-            self.raw_boxsize_data = <np.float64_t*>np.PyArray_DATA(self.boxsize_data)
+        self._set_raw_pointers()
  
         # set up the tree structure pointers
         self.ctree = tree_buffer_root(self.tree_buffer)
-        self._post_init(self.ctree)
+        self.size = self.tree_buffer.size()
+        self._build_layout(reorder_data)
+        self._post_init()
+
+    cdef object _node_bytes(cKDTree self):
+        return PyBytes_FromStringAndSize(<char*> self.ctree,
+                                         self.size * sizeof(ckdtreenode))
+    
+    # ----------------------
+    # save and load
+    # ----------------------
+
+    def save(cKDTree self, filename):
+        """
+        save(self, filename)
+
+        Save the kd-tree to a file that can be memory mapped by `load`.
+
+        Parameters
+        ----------
+        filename : str
+            Name of the file to write.
+
+        Notes
+        -----
+        The file holds the nodes, the indices, the data and the periodic 
+        box of the tree, and the copy of the data in tree order and the
+        compact nodes if the tree has them. The numbers are stored in the
+        byte order of the machine, so the file can only be loaded on a
+        machine with the same byte order and word size.
+
+        """
+        cdef object compact = None
+        if self.metric is not None:
+            raise ValueError("a cKDTree with a metric given as C functions "
+                             "cannot be saved")
+        if self.compact_tree != NULL:
+            compact = PyBytes_FromStringAndSize(<char*> self.compact_tree,
+                self.size * sizeof(ckdtree_compact_node))
+        sections = [np.frombuffer(self._node_bytes(), dtype=np.uint8),
+                    self.indices, self.data, self.maxes, self.mins,
+                    self.boxsize_data, self.tree_data,
+                    None if compact is None else 
+                        np.frombuffer(compact, dtype=np.uint8)]
+
+        header = np.zeros(1, dtype=_FILE_HEADER)
+        header['magic'] = _FILE_MAGIC
+        header['version'] = _FILE_VERSION
+        header['byteorder'] = _FILE_BYTEORDER
+        header['sizeof_intp'] = sizeof(np.intp_t)
+        header['sizeof_node'] = sizeof(ckdtreenode)
+        header['sizeof_compact_node'] = sizeof(ckdtree_compact_node)
+        header['float32'] = self.data.dtype == np.float32
+        header['n'] = self.n
+        header['m'] = self.m
+        header['leafsize'] = self.leafsize
+        header['size'] = self.size
+        offset = _file_align(_FILE_HEADER.itemsize)
+        for k, arr in enumerate(sections):
+            if arr is not None:
+                header['sections'][0, k] = (offset, arr.nbytes)
+                offset = _file_align(offset + arr.nbytes)
+
+        with open(filename, 'wb') as f:
+            header.tofile(f)
+            for k, arr in enumerate(sections):
+                if arr is not None:
+                    f.seek(header['sections'][0, k, 0])
+                    np.ascontiguousarray(arr).tofile(f)
+
+    @classmethod
+    def load(cls, filename, mmap_mode='r'):
+        """
+        load(filename, mmap_mode='r')
+
+        Load a kd-tree written by `save`.
+
+        Parameters
+        ----------
+        filename : str
+            Name of the file to read.
+        mmap_mode : {None, 'r', 'c', 'r+'}, optional
+            If not None, the file is memory mapped with this mode (see 
+            `numpy.memmap`) and the tree uses the mapped arrays without
+            copying them. With the default 'r' the pages of the file are 
+            shared between all processes that load it. If None, the file
+            is read into memory.
+
+        Returns
+        -------
+        tree : cKDTree
+            The kd-tree. Its data, indices and nodes are views of the file.
+
+        """
+        cdef cKDTree tree
         
-        # make the tree viewable from Python
-        self.tree = cKDTreeNode()
-        self.tree._node = self.ctree
-        self.tree._data = self.data
-        self.tree._indices = self.indices
-        self.tree.level = 0
-        self.tree._setup() 
+        with open(filename, 'rb') as f:
+            raw = f.read(_FILE_HEADER.itemsize)
+        if len(raw) < 12 or raw[:8] != _FILE_MAGIC:
+            raise ValueError("%s is not a cKDTree file" % (filename,))
+        version = np.frombuffer(raw[8:12], dtype=np.uint32)[0]
+        if version != _FILE_VERSION:
+            raise ValueError("Unsupported cKDTree file version %d" % version)
+        if len(raw) < _FILE_HEADER.itemsize:
+            raise ValueError("Truncated cKDTree file")
+        header = np.frombuffer(raw, dtype=_FILE_HEADER)[0]
+        if header['byteorder'] != _FILE_BYTEORDER:
+            raise ValueError("The cKDTree file was written on a machine "
+                             "with a different byte order")
+        if (header['sizeof_intp'] != sizeof(np.intp_t) or
+                header['sizeof_node'] != sizeof(ckdtreenode) or 
+                header['sizeof_compact_node'] != sizeof(ckdtree_compact_node)):
+            raise ValueError("The cKDTree file was written on a machine "
+                             "with a different word size")
+
+        if mmap_mode is None:
+            buf = np.fromfile(filename, dtype=np.uint8)
+        else:
+            buf = np.memmap(filename, dtype=np.uint8, mode=mmap_mode)
+
+        def section(k, dtype, shape):
+            offset, nbytes = header['sections'][k]
+            if offset == 0:
+                return None
+            if offset + nbytes > buf.shape[0]:
+                raise ValueError("Truncated cKDTree file")
+            return buf[offset:offset + nbytes].view(dtype).reshape(shape)
+
+        n, m, size = header['n'], header['m'], header['size']
+        dtype = np.float32 if header['float32'] else np.float64
+        nodes = section(0, np.uint8, -1)
+        compact_nodes = section(7, np.uint8, -1)
+        
+        tree = new_object(cls)
+        tree.n, tree.m, tree.leafsize = n, m, header['leafsize']
+        tree.size = size
+        tree.indices = section(1, np.intp, (n,))
+        tree.data = section(2, dtype, (n, m))
+        tree.maxes = np.array(section(3, np.float64, (m,)))
+        tree.mins = np.array(section(4, np.float64, (m,)))
+        tree.boxsize_data = section(5, np.float64, (2 * m,))
+        if tree.boxsize_data is not None:
+            tree.boxsize_data = np.array(tree.boxsize_data)
+            tree.boxsize = tree.boxsize_data[:m].copy()
+        tree.tree_data = section(6, dtype, (n, m))
+        if (nodes is None or nodes.shape[0] != size * sizeof(ckdtreenode) or
+                tree.indices is None or tree.data is None or 
+                (compact_nodes is not None and compact_nodes.shape[0] != 
+                    size * sizeof(ckdtree_compact_node))):
+            raise ValueError("Corrupt cKDTree file")
+        tree._set_raw_pointers()
+
+        tree._node_arrays = (nodes, compact_nodes)
+        tree.ctree = <ckdtreenode*> np.PyArray_DATA(nodes)
+        if tree.tree_data is not None:
+            tree.raw_tree_data = np.PyArray_DATA(tree.tree_data)
+        if compact_nodes is not None:
+            tree.compact_tree = <ckdtree_compact_node*> np.PyArray_DATA(
+                compact_nodes)
+            tree.node_layout = 'compact'
+        else:
+            tree.node_layout = 'standard'
+        tree._post_init()
+        return tree
+
+
+# ---------------------------------------------------------------------
+# cKDTreeForest: a dynamic set of points in a logarithmic forest of
+# static trees
+# ---------------------------------------------------------------------
+
+cdef class cKDTreeForest:
+    """
+    cKDTreeForest(m, leafsize=16, compact_nodes=True, balanced_tree=True,
+                  boxsize=None, dtype=None)
+
+    Set of k-dimensional points with insertions and deletions
+
+    A `cKDTree` cannot be modified after it is built. This class keeps the
+    points in a small number of cKDTrees of geometrically decreasing sizes
+    instead. Inserted points go into a new tree, which is merged with the
+    younger trees that are not larger than itself, so that every point is
+    part of O(log n) rebuilds in total and a query visits O(log n) trees.
+    Deleted points are only marked as such in their tree, which is rebuilt
+    without them when they make up half of it.
+
+    The points are identified by the integer ids returned by `insert`,
+    which are never reused.
+
+    Parameters
+    ----------
+    m : int
+        The dimension of the points.
+    leafsize, compact_nodes, balanced_tree, boxsize, dtype : optional
+        Passed on to the constructor of the `cKDTree` objects.
+
+    Attributes
+    ----------
+    n : int
+        The number of points in the forest.
+    m : int
+        The dimension of the points.
+
+    See Also
+    --------
+    cKDTree : The static kd-tree used for the parts of the forest.
+
+    """
+    cdef:
+        readonly np.intp_t  n, m
+        np.intp_t           _next_id
+        dict                _kwargs
+        list                _trees    # oldest first
+        list                _ids      # sorted ids of the points of each tree
+
+    def __init__(cKDTreeForest self, np.intp_t m, np.intp_t leafsize=16,
+                 compact_nodes=True, balanced_tree=True, boxsize=None,
+                 dtype=None):
+        if m < 1:
+            raise ValueError("m must be a positive integer")
+        self.n = 0
+        self.m = m
+        self._next_id = 0
+        self._kwargs = dict(leafsize=leafsize, compact_nodes=compact_nodes,
+                            balanced_tree=balanced_tree, boxsize=boxsize,
+                            dtype=dtype)
+        self._trees = []
+        self._ids = []
+
+    def __reduce__(cKDTreeForest self):
+        return (new_object, (cKDTreeForest,), self.__getstate__())
+
+    def __getstate__(cKDTreeForest self):
+        return (self.n, self.m, self._next_id, self._kwargs, self._trees,
+                self._ids)
+
+    def __setstate__(cKDTreeForest self, state):
+        (self.n, self.m, self._next_id, self._kwargs, self._trees,
+            self._ids) = state
+
+    cdef object _build(cKDTreeForest self, data):
+        cdef cKDTree tree = cKDTree(data, copy_data=True, **self._kwargs)
+        tree._deleted = np.zeros(tree.n, dtype=np.uint8)
+        tree._set_raw_pointers()
+        return tree
+
+    cdef object _live_points(cKDTreeForest self, np.intp_t j):
+        cdef cKDTree tree = self._trees[j]
+        live = tree._deleted == 0
+        return np.asarray(tree.data)[live], self._ids[j][live]
+
+    def insert(cKDTreeForest self, x):
+        """
+        insert(self, x)
+
+        Insert points into the forest
+
+        Parameters
+        ----------
+        x : array_like, shape (n, self.m) or (self.m,)
+            The points to insert.
+
+        Returns
+        -------
+        ids : ndarray of ints, shape (n,)
+            The ids of the new points.
+
+        """
+        cdef cKDTree tree
+        cdef np.intp_t j
+        x_arr = np.array(x, dtype=np.float64, ndmin=2)
+        if x_arr.ndim != 2 or x_arr.shape[1] != self.m:
+            raise ValueError("x must consist of vectors of length %d but "
+                             "has shape %s" % (int(self.m), np.shape(x)))
+        ids = np.arange(self._next_id, self._next_id + x_arr.shape[0],
+                        dtype=np.intp)
+        if x_arr.shape[0] == 0:
+            return ids
+
+        # merge with the younger trees that are not larger; they are only
+        # replaced once the new tree is built, in case that fails
+        data, tree_ids = x_arr, ids
+        j = len(self._trees)
+        while j > 0:
+            tree = self._trees[j - 1]
+            if tree.n - np.count_nonzero(tree._deleted) > data.shape[0]:
+                break
+            old_data, old_ids = self._live_points(j - 1)
+            data = np.concatenate((old_data, data))
+            tree_ids = np.concatenate((old_ids, tree_ids))
+            j -= 1
+
+        tree = self._build(data)
+        self._trees[j:] = [tree]
+        self._ids[j:] = [tree_ids]
+        self._next_id += x_arr.shape[0]
+        self.n += x_arr.shape[0]
+        return ids
+
+    def delete(cKDTreeForest self, ids):
+        """
+        delete(self, ids)
+
+        Delete points from the forest
+
+        Parameters
+        ----------
+        ids : array_like of ints
+            The ids of the points to delete, as returned by `insert`.
+
+        Raises
+        ------
+        KeyError
+            If some of the points are not in the forest. No point is
+            deleted in this case.
+
+        """
+        cdef cKDTree tree
+        cdef np.intp_t j
+        ids = np.unique(np.asarray(ids, dtype=np.intp))
+        if ids.shape[0] == 0:
+            return
+
+        # locate all points before deleting any of them
+        found = np.zeros(ids.shape[0], dtype=bool)
+        located = []
+        for j in range(len(self._trees)):
+            tree = self._trees[j]
+            tree_ids = self._ids[j]
+            pos = np.searchsorted(tree_ids, ids)
+            pos[pos == tree_ids.shape[0]] = 0
+            hit = (tree_ids[pos] == ids) & (tree._deleted[pos] == 0)
+            found |= hit
+            located.append(pos[hit])
+        if not found.all():
+            raise KeyError("ids not in the forest: %s" %
+                           (ids[~found][:10].tolist(),))
+
+        for j in range(len(self._trees) - 1, -1, -1):
+            if located[j].shape[0] == 0:
+                continue
+            tree = self._trees[j]
+            tree._deleted[located[j]] = 1
+            # rebuild trees which are half deleted
+            if 2 * np.count_nonzero(tree._deleted) >= tree.n:
+                data, tree_ids = self._live_points(j)
+                if data.shape[0] == 0:
+                    del self._trees[j]
+                    del self._ids[j]
+                else:
+                    self._trees[j] = self._build(data)
+                    self._ids[j] = tree_ids
+        self.n -= ids.shape[0]
+
+    def query(cKDTreeForest self, object x, object k=1, np.float64_t eps=0,
+              np.float64_t p=2, np.float64_t distance_upper_bound=INFINITY,
+              np.intp_t n_jobs=1):
+        """
+        query(self, x, k=1, eps=0, p=2, distance_upper_bound=np.inf, n_jobs=1)
+
+        Query the forest for nearest neighbors
+
+        The parameters are those of `cKDTree.query`.
+
+        Returns
+        -------
+        d : array of floats
+            The distances to the nearest neighbors, as for `cKDTree.query`.
+        i : ndarray of ints
+            The ids of the neighbors. Missing neighbors are indicated with
+            -1.
+
+        """
+        cdef cKDTree tree
+        cdef np.intp_t j, n
 
+        x_arr = np.asarray(x, dtype=np.float64)
+        if x_arr.ndim == 0 or x_arr.shape[x_arr.ndim - 1] != self.m:
+            raise ValueError("x must consist of vectors of length %d but "
+                             "has shape %s" % (int(self.m), np.shape(x)))
+        if p < 1:
+            raise ValueError("Only p-norms with 1<=p<=infinity permitted")
+        single = (x_arr.ndim == 1)
+
+        nearest = False
+        if np.isscalar(k):
+            if k == 1:
+                nearest = True
+            k = np.arange(1, k + 1)
+        _k = np.array(k, dtype=np.intp)
+        kmax = np.max(_k)
+
+        retshape = x_arr.shape[:-1]
+        n = <np.intp_t> np.prod(retshape)
+        xx = np.ascontiguousarray(x_arr).reshape(n, self.m)
+
+        # the kmax nearest neighbors in every tree, merged by distance
+        dd = [np.empty((n, 0))]
+        ii = [np.empty((n, 0), dtype=np.intp)]
+        for j in range(len(self._trees)):
+            tree = self._trees[j]
+            d, i = tree.query(xx, k=np.arange(1, kmax + 1), eps=eps, p=p,
+                              distance_upper_bound=distance_upper_bound,
+                              n_jobs=n_jobs)
+            dd.append(d)
+            ii.append(np.append(self._ids[j], -1)[i])
+        dd = np.concatenate(dd, axis=1)
+        ii = np.concatenate(ii, axis=1)
+        if dd.shape[1] < kmax:
+            pad = kmax - dd.shape[1]
+            dd = np.hstack((dd, np.inf * np.ones((n, pad))))
+            ii = np.hstack((ii, -np.ones((n, pad), dtype=np.intp)))
+        order = np.argsort(dd, axis=1, kind='mergesort')[:, _k - 1]
+        rows = np.arange(n)[:, np.newaxis]
+        ddret = dd[rows, order].reshape(retshape + (len(_k),))
+        iiret = ii[rows, order].reshape(retshape + (len(_k),))
+
+        if nearest:
+            ddret = ddret[..., 0]
+            iiret = iiret[..., 0]
+            if single:
+                ddret = float(ddret)
+                iiret = int(iiret)
+        return ddret, iiret
+
+    def query_ball_point(cKDTreeForest self, object x, np.float64_t r,
+                         np.float64_t p=2., np.float64_t eps=0, n_jobs=1):
+        """
+        query_ball_point(self, x, r, p=2., eps=0, n_jobs=1)
+
+        Find the ids of all points within distance r of point(s) x
+
+        The parameters are those of `cKDTree.query_ball_point`.
+
+        Returns
+        -------
+        results : list or array of lists
+            If `x` is a single point, returns a list of the ids of the
+            neighbors of `x`. If `x` is an array of points, returns an object
+            array of shape tuple containing lists of neighbors.
+
+        """
+        cdef cKDTree tree
+        cdef np.intp_t i, j, n
+
+        x_arr = np.asarray(x, dtype=np.float64)
+        if x_arr.ndim == 0 or x_arr.shape[x_arr.ndim - 1] != self.m:
+            raise ValueError("Searching for a %d-dimensional point in a "
+                             "%d-dimensional cKDTreeForest" %
+                             (int(x_arr.shape[-1]), int(self.m)))
+        retshape = x_arr.shape[:-1]
+        n = <np.intp_t> np.prod(retshape)
+        xx = np.ascontiguousarray(x_arr).reshape(n, self.m)
+
+        results = [[] for i in range(n)]
+        for j in range(len(self._trees)):
+            tree = self._trees[j]
+            tree_ids = self._ids[j]
+            found = tree.query_ball_point(xx, r, p=p, eps=eps, n_jobs=n_jobs)
+            for i in range(n):
+                if found[i]:
+                    results[i].extend(tree_ids[found[i]].tolist())
+
+        if x_arr.ndim == 1:
+            return results[0]
+        result = np.empty(n, dtype=object)
+        for i in range(n):
+            result[i] = results[i]
+        return result.reshape(retshape)
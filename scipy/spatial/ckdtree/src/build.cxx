@@ -19,6 +19,7 @@
 #include "ckdtree_methods.h"
 #include "cpp_exc.h"
 #include "partial_sort.h"
+#include "thread_pool.h"
 
 
 
@@ -30,59 +31,102 @@ tree_buffer_root(std::vector<ckdtreenode> *buf)
 }
 
 
-static npy_intp 
-build(ckdtree *self, npy_intp start_idx, npy_intp end_idx,
-      npy_float64 *maxes, npy_float64 *mins, 
-      const int _median, const int _compact)
+/*
+ * Randomized trees choose the split dimension among the
+ * CKDTREE_RANDOM_SPLIT_DIMS dimensions of largest spread, as in FLANN. The
+ * choice only depends on the seed and the range of points of the node, so
+ * the parallel build gives the same tree as the serial one.
+ */
+#define CKDTREE_RANDOM_SPLIT_DIMS 5
+
+static npy_intp
+random_split_dim(const ckdtree *self, npy_intp start_idx, npy_intp end_idx,
+                 const npy_float64 *maxes, const npy_float64 *mins)
+{
+    npy_intp best[CKDTREE_RANDOM_SPLIT_DIMS];
+    npy_float64 spread[CKDTREE_RANDOM_SPLIT_DIMS];
+    npy_intp i, j, nbest = 0;
+
+    for (i=0; i<self->m; ++i) {
+        npy_float64 size = maxes[i] - mins[i];
+        if (!(size > 0))
+            continue;
+        /* insertion into the list of largest spreads */
+        j = nbest < CKDTREE_RANDOM_SPLIT_DIMS ? nbest++ : nbest;
+        for (; j > 0 && spread[j-1] < size; --j) {
+            if (j < CKDTREE_RANDOM_SPLIT_DIMS) {
+                spread[j] = spread[j-1];
+                best[j] = best[j-1];
+            }
+        }
+        if (j < CKDTREE_RANDOM_SPLIT_DIMS) {
+            spread[j] = size;
+            best[j] = i;
+        }
+    }
+    if (nbest == 0)
+        return 0;
+
+    /* splitmix64 hash of the seed and the node */
+    npy_uint64 h = self->split_seed 
+                   + (npy_uint64)start_idx * 0x9E3779B97F4A7C15ULL
+                   + (npy_uint64)end_idx;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    h = h ^ (h >> 31);
+    return best[h % nbest];
+}
+
+/*
+ * Choose the split of the points in [start_idx, end_idx) and partition
+ * the indices accordingly. Returns the index of the first point in the
+ * 'greater' half, or -1 if the points should be stored in a leafnode.
+ * T is the dtype of the data.
+ */
+template <typename T> static npy_intp
+partition_node_data(const ckdtree *self, npy_intp start_idx, npy_intp end_idx,
+                    npy_float64 *maxes, npy_float64 *mins,
+                    const int _median, const int _compact,
+                    npy_intp *split_dim, npy_float64 *split_val)
 {
-      
     const npy_intp m = self->m;
-    const npy_float64 *data = self->raw_data;
+    const T *data = tree_points<T>(self);
     npy_intp *indices = (npy_intp *)(self->raw_indices);
-    
-    ckdtreenode new_node, *n, *root;
-    npy_intp node_index, _less, _greater;    
+
     npy_intp i, j, p, q, d;
     npy_float64 size, split, minval, maxval;
-    
-    /* put a new node into the node stack */
-    self->tree_buffer->push_back(new_node);
-    node_index = self->tree_buffer->size() - 1;
-    root = tree_buffer_root(self->tree_buffer);
-    n = root + node_index;
-                
+
     if (end_idx-start_idx <= self->leafsize) {
         /* below brute force limit, return leafnode */
-        n->split_dim = -1;
-        n->children = end_idx - start_idx;
-        n->start_idx = start_idx;
-        n->end_idx = end_idx;
-        return node_index;
+        return -1;
     }
-    else {
-    
-        if (NPY_LIKELY(_compact)) {
-            /* Recompute hyperrectangle bounds. This should lead to a more 
-             * compact kd-tree but comes at the expense of larger construction
-             * time. However, construction time is usually dwarfed by the
-             * query time by orders of magnitude.
-             */
-            const npy_float64 *tmp_data_point;
-            tmp_data_point = data + indices[start_idx] * m;
+
+    if (NPY_LIKELY(_compact)) {
+        /* Recompute hyperrectangle bounds. This should lead to a more 
+         * compact kd-tree but comes at the expense of larger construction
+         * time. However, construction time is usually dwarfed by the
+         * query time by orders of magnitude.
+         */
+        const T *tmp_data_point;
+        tmp_data_point = data + indices[start_idx] * m;
+        for(i=0; i<m; ++i) {
+            maxes[i] = tmp_data_point[i];
+            mins[i] = tmp_data_point[i];
+        }
+        for (j = start_idx + 1; j < end_idx; ++j) {
+            tmp_data_point = data + indices[j] * m;
             for(i=0; i<m; ++i) {
-                maxes[i] = tmp_data_point[i];
-                mins[i] = tmp_data_point[i];
-            }
-            for (j = start_idx + 1; j < end_idx; ++j) {
-                tmp_data_point = data + indices[j] * m;
-                for(i=0; i<m; ++i) {
-                    npy_float64 tmp = tmp_data_point[i];
-                    maxes[i] = maxes[i] > tmp ? maxes[i] : tmp;
-                    mins[i] = mins[i] < tmp ? mins[i] : tmp;
-                }
+                npy_float64 tmp = tmp_data_point[i];
+                maxes[i] = maxes[i] > tmp ? maxes[i] : tmp;
+                mins[i] = mins[i] < tmp ? mins[i] : tmp;
             }
         }
-    
+    }
+
+    if (self->split_seed) {
+        d = random_split_dim(self, start_idx, end_idx, maxes, mins);
+    }
+    else {
         /* split on the dimension with largest spread */ 
         d = 0; 
         size = 0;
@@ -92,88 +136,135 @@ build(ckdtree *self, npy_intp start_idx, npy_intp end_idx,
                 size = maxes[i] - mins[i];
             }
         }
-        maxval = maxes[d];
-        minval = mins[d];
-        if (maxval == minval) {
-            /* all points are identical; warn user?
-             * return leafnode
-             */
-            n->split_dim = -1;
-            n->children = end_idx - start_idx;
-            n->start_idx = start_idx;
-            n->end_idx = end_idx;
-            return node_index;
-        }   
-        
-        /* construct new inner node */
-        
-        if (NPY_LIKELY(_median)) {
-            /* split on median to create a balanced tree
-             * adopted from scikit-learn
-             */
-            i = (end_idx - start_idx) / 2;
-            partition_node_indices(data, indices + start_idx, d, i, m,
-                end_idx - start_idx);               
-            p = start_idx + i;
-            split = data[indices[p]*m+d];
-        }
-        else {
-            /* split with the sliding midpoint rule */
-            split = (maxval + minval) / 2;
-        }
+    }
+    maxval = maxes[d];
+    minval = mins[d];
+    if (maxval == minval) {
+        /* all points are identical; warn user?
+         * return leafnode
+         */
+        return -1;
+    }   
 
-        p = start_idx;
-        q = end_idx - 1;
-        while (p <= q) {
-            if (data[indices[p] * m + d] < split)
-                ++p;
-            else if (data[indices[q] * m + d] >= split)
-                --q;
-            else {
-                npy_intp t = indices[p];
-                indices[p] = indices[q];
-                indices[q] = t;
-                ++p;
-                --q;
-            }
+    /* construct new inner node */
+
+    if (NPY_LIKELY(_median)) {
+        /* split on median to create a balanced tree
+         * adopted from scikit-learn
+         */
+        i = (end_idx - start_idx) / 2;
+        partition_node_indices(data, indices + start_idx, d, i, m,
+            end_idx - start_idx);               
+        p = start_idx + i;
+        split = data[indices[p]*m+d];
+    }
+    else {
+        /* split with the sliding midpoint rule */
+        split = (maxval + minval) / 2;
+    }
+
+    p = start_idx;
+    q = end_idx - 1;
+    while (p <= q) {
+        if (data[indices[p] * m + d] < split)
+            ++p;
+        else if (data[indices[q] * m + d] >= split)
+            --q;
+        else {
+            npy_intp t = indices[p];
+            indices[p] = indices[q];
+            indices[q] = t;
+            ++p;
+            --q;
         }
-        /* slide midpoint if necessary */
-        if (p == start_idx) {
-            /* no points less than split */
-            j = start_idx;
-            split = data[indices[j] * m + d];
-            for (i = start_idx+1; i < end_idx; ++i) {
-                if (data[indices[i] * m + d] < split) {
-                    j = i;
-                    split = data[indices[j] * m + d];
-                }
+    }
+    /* slide midpoint if necessary */
+    if (p == start_idx) {
+        /* no points less than split */
+        j = start_idx;
+        split = data[indices[j] * m + d];
+        for (i = start_idx+1; i < end_idx; ++i) {
+            if (data[indices[i] * m + d] < split) {
+                j = i;
+                split = data[indices[j] * m + d];
             }
-            npy_intp t = indices[start_idx];
-            indices[start_idx] = indices[j];
-            indices[j] = t;
-            p = start_idx + 1;
-            q = start_idx;
         }
-        else if (p == end_idx) {
-            /* no points greater than split */
-            j = end_idx - 1;
-            split = data[indices[j] * m + d];
-            for (i = start_idx; i < end_idx-1; ++i) {
-                if (data[indices[i] * m + d] > split) {
-                    j = i;
-                    split = data[indices[j] * m + d];
-                }
+        npy_intp t = indices[start_idx];
+        indices[start_idx] = indices[j];
+        indices[j] = t;
+        p = start_idx + 1;
+    }
+    else if (p == end_idx) {
+        /* no points greater than split */
+        j = end_idx - 1;
+        split = data[indices[j] * m + d];
+        for (i = start_idx; i < end_idx-1; ++i) {
+            if (data[indices[i] * m + d] > split) {
+                j = i;
+                split = data[indices[j] * m + d];
             }
-            npy_intp t = indices[end_idx-1];
-            indices[end_idx-1] = indices[j];
-            indices[j] = t;
-            p = end_idx - 1;
-            q = end_idx - 2;
         }
+        npy_intp t = indices[end_idx-1];
+        indices[end_idx-1] = indices[j];
+        indices[j] = t;
+        p = end_idx - 1;
+    }
+
+    *split_dim = d;
+    *split_val = split;
+    return p;
+}
+
+
+static npy_intp
+partition_node(const ckdtree *self, npy_intp start_idx, npy_intp end_idx,
+               npy_float64 *maxes, npy_float64 *mins,
+               const int _median, const int _compact,
+               npy_intp *split_dim, npy_float64 *split_val)
+{
+    if (ckdtree_is_float32(self))
+        return partition_node_data<npy_float32>(self, start_idx, end_idx,
+            maxes, mins, _median, _compact, split_dim, split_val);
+    else
+        return partition_node_data<npy_float64>(self, start_idx, end_idx,
+            maxes, mins, _median, _compact, split_dim, split_val);
+}
+
+
+static npy_intp 
+build(const ckdtree *self, std::vector<ckdtreenode> *buf,
+      npy_intp start_idx, npy_intp end_idx,
+      npy_float64 *maxes, npy_float64 *mins, 
+      const int _median, const int _compact)
+{
+    const npy_intp m = self->m;
+    
+    ckdtreenode new_node, *n, *root;
+    npy_intp node_index, _less, _greater;    
+    npy_intp i, p, d;
+    npy_float64 split;
+    
+    /* put a new node into the node stack */
+    buf->push_back(new_node);
+    node_index = buf->size() - 1;
+    root = tree_buffer_root(buf);
+    n = root + node_index;
+
+    p = partition_node(self, start_idx, end_idx, maxes, mins,
+                       _median, _compact, &d, &split);
+
+    if (p < 0) {
+        n->split_dim = -1;
+        n->children = end_idx - start_idx;
+        n->start_idx = start_idx;
+        n->end_idx = end_idx;
+        return node_index;
+    }
+    else {
         
         if (NPY_LIKELY(_compact)) {
-            _less = build(self, start_idx, p, maxes, mins, _median, _compact);
-            _greater = build(self, p, end_idx, maxes, mins, _median, _compact);    
+            _less = build(self, buf, start_idx, p, maxes, mins, _median, _compact);
+            _greater = build(self, buf, p, end_idx, maxes, mins, _median, _compact);    
         }
         else
         {
@@ -182,36 +273,219 @@ build(ckdtree *self, npy_intp start_idx, npy_intp end_idx,
             
             for (i=0; i<m; ++i) mids[i] = maxes[i];
             mids[d] = split;
-            _less = build(self, start_idx, p, mids, mins, _median, _compact);
+            _less = build(self, buf, start_idx, p, mids, mins, _median, _compact);
             
             for (i=0; i<m; ++i) mids[i] = mins[i];
             mids[d] = split;
-            _greater = build(self, p, end_idx, maxes, mids, _median, _compact);
+            _greater = build(self, buf, p, end_idx, maxes, mids, _median, _compact);
         }   
         
         /* recompute n because std::vector can
          * reallocate its internal buffer
          */
-        root = tree_buffer_root(self->tree_buffer); 
+        root = tree_buffer_root(buf); 
         n = root + node_index;
         /* fill in entries */
         n->_less = _less; 
         n->_greater = _greater;
-        n->less = root + _less;
-        n->greater = root + _greater;
-        n->children = n->less->children + n->greater->children;      
+        n->children = root[_less].children + root[_greater].children;
         n->split_dim = d;
         n->split = split;
+        n->start_idx = start_idx;
+        n->end_idx = end_idx;
         
         return node_index;
     }
 }
-        
+
+
+/*
+ * Parallel build
+ * ==============
+ *
+ * The top levels of the tree are split serially, which leaves a set of
+ * disjoint index ranges. The subtrees over these ranges are independent,
+ * so they are built concurrently, each into a private node buffer. The
+ * buffers are finally spliced into the tree buffer in depth-first order,
+ * which gives the same node layout as the serial build.
+ */
+
+struct subtree_task {
+    npy_intp                  start_idx;
+    npy_intp                  end_idx;
+    std::vector<npy_float64>  bounds;   /* maxes followed by mins */
+    std::vector<ckdtreenode>  nodes;
+};
+
+struct skeleton_node {
+    npy_intp      task;     /* index of a subtree task, or -1 */
+    npy_intp      split_dim;
+    npy_float64   split;
+    npy_intp      start_idx;
+    npy_intp      end_idx;
+    npy_intp      less;     /* indices into the skeleton */
+    npy_intp      greater;
+};
+
+static npy_intp
+build_skeleton(const ckdtree *self, std::vector<skeleton_node> *skeleton,
+               std::vector<subtree_task> *tasks, npy_intp start_idx,
+               npy_intp end_idx, npy_float64 *maxes, npy_float64 *mins,
+               const int _median, const int _compact, const int depth)
+{
+    const npy_intp m = self->m;
+    skeleton_node s;
+    npy_intp node_index, p, d;
+    npy_float64 split;
+
+    s.start_idx = start_idx;
+    s.end_idx = end_idx;
+    s.task = -1;
+    s.less = s.greater = -1;
+    s.split_dim = -1;
+    s.split = 0;
+    node_index = skeleton->size();
+    skeleton->push_back(s);
+
+    if (depth == 0 || end_idx - start_idx <= self->leafsize) {
+        /* defer the subtree to a worker thread */
+        subtree_task t;
+        t.start_idx = start_idx;
+        t.end_idx = end_idx;
+        t.bounds.resize(2 * m);
+        std::memcpy(&t.bounds[0], maxes, m * sizeof(npy_float64));
+        std::memcpy(&t.bounds[m], mins, m * sizeof(npy_float64));
+        (*skeleton)[node_index].task = tasks->size();
+        tasks->push_back(t);
+        return node_index;
+    }
+
+    p = partition_node(self, start_idx, end_idx, maxes, mins,
+                       _median, _compact, &d, &split);
+    if (p < 0) {
+        /* degenerate node, becomes a single leaf task */
+        subtree_task t;
+        t.start_idx = start_idx;
+        t.end_idx = end_idx;
+        t.bounds.resize(2 * m);
+        std::memcpy(&t.bounds[0], maxes, m * sizeof(npy_float64));
+        std::memcpy(&t.bounds[m], mins, m * sizeof(npy_float64));
+        (*skeleton)[node_index].task = tasks->size();
+        tasks->push_back(t);
+        return node_index;
+    }
+
+    npy_intp _less, _greater;
+    if (NPY_LIKELY(_compact)) {
+        _less = build_skeleton(self, skeleton, tasks, start_idx, p,
+                               maxes, mins, _median, _compact, depth - 1);
+        _greater = build_skeleton(self, skeleton, tasks, p, end_idx,
+                                  maxes, mins, _median, _compact, depth - 1);
+    }
+    else {
+        std::vector<npy_float64> tmp(m);
+        npy_float64 *mids = &tmp[0];
+        npy_intp i;
+
+        for (i=0; i<m; ++i) mids[i] = maxes[i];
+        mids[d] = split;
+        _less = build_skeleton(self, skeleton, tasks, start_idx, p,
+                               mids, mins, _median, _compact, depth - 1);
+
+        for (i=0; i<m; ++i) mids[i] = mins[i];
+        mids[d] = split;
+        _greater = build_skeleton(self, skeleton, tasks, p, end_idx,
+                                  maxes, mids, _median, _compact, depth - 1);
+    }
+
+    skeleton_node &sn = (*skeleton)[node_index];
+    sn.split_dim = d;
+    sn.split = split;
+    sn.less = _less;
+    sn.greater = _greater;
+    return node_index;
+}
+
+static npy_intp
+splice_skeleton(std::vector<ckdtreenode> *buf,
+                const std::vector<skeleton_node> &skeleton,
+                const std::vector<subtree_task> &tasks,
+                const npy_intp index)
+{
+    const skeleton_node &s = skeleton[index];
+    npy_intp node_index = buf->size();
+
+    if (s.task >= 0) {
+        /* copy the subtree and relocate its child indices */
+        const std::vector<ckdtreenode> &nodes = tasks[s.task].nodes;
+        buf->insert(buf->end(), nodes.begin(), nodes.end());
+        ckdtreenode *root = tree_buffer_root(buf);
+        for (npy_intp i = node_index; i < (npy_intp) buf->size(); ++i) {
+            ckdtreenode *n = root + i;
+            if (n->split_dim != -1) {
+                n->_less += node_index;
+                n->_greater += node_index;
+            }
+        }
+        return node_index;
+    }
+
+    ckdtreenode new_node;
+    buf->push_back(new_node);
+    npy_intp _less = splice_skeleton(buf, skeleton, tasks, s.less);
+    npy_intp _greater = splice_skeleton(buf, skeleton, tasks, s.greater);
+    ckdtreenode *n = tree_buffer_root(buf) + node_index;
+    n->_less = _less;
+    n->_greater = _greater;
+    n->children = s.end_idx - s.start_idx;
+    n->split_dim = s.split_dim;
+    n->split = s.split;
+    n->start_idx = s.start_idx;
+    n->end_idx = s.end_idx;
+    return node_index;
+}
+
+static void
+build_parallel(const ckdtree *self, std::vector<ckdtreenode> *buf,
+               npy_intp start_idx, npy_intp end_idx,
+               npy_float64 *maxes, npy_float64 *mins,
+               const int _median, const int _compact, const int n_jobs)
+{
+    std::vector<skeleton_node> skeleton;
+    std::vector<subtree_task> tasks;
+    int depth = 0;
+
+    /* about eight subtrees per thread for load balancing */
+    while ((1 << depth) < 8 * n_jobs && depth < 24)
+        ++depth;
+
+    build_skeleton(self, &skeleton, &tasks, start_idx, end_idx, maxes, mins,
+                   _median, _compact, depth);
+
+    const npy_intp ntasks = tasks.size();
+    parallel_for(ntasks, n_jobs, 1,
+        [&](npy_intp start, npy_intp stop) {
+            const npy_intp m = self->m;
+            for (npy_intp k = start; k < stop; ++k) {
+                subtree_task &t = tasks[k];
+                build(self, &t.nodes, t.start_idx, t.end_idx,
+                      &t.bounds[0], &t.bounds[m], _median, _compact);
+            }
+        });
+
+    /* splice the subtrees into the tree buffer in depth-first order */
+    npy_intp total = skeleton.size();
+    for (npy_intp k = 0; k < ntasks; ++k)
+        total += tasks[k].nodes.size() - 1;
+    buf->reserve(total);
+    splice_skeleton(buf, skeleton, tasks, 0);
+}
         
 
 extern "C" PyObject*
 build_ckdtree(ckdtree *self, npy_intp start_idx, npy_intp end_idx,
-              npy_float64 *maxes, npy_float64 *mins, int _median, int _compact)
+              npy_float64 *maxes, npy_float64 *mins, int _median, int _compact,
+              int n_jobs)
                        
 {
     
@@ -219,7 +493,212 @@ build_ckdtree(ckdtree *self, npy_intp start_idx, npy_intp end_idx,
     NPY_BEGIN_ALLOW_THREADS
     {
         try {
-            build(self, start_idx, end_idx, maxes, mins, _median, _compact);        
+            if (n_jobs > 1)
+                build_parallel(self, self->tree_buffer, start_idx, end_idx,
+                               maxes, mins, _median, _compact, n_jobs);
+            else
+                build(self, self->tree_buffer, start_idx, end_idx,
+                      maxes, mins, _median, _compact);
+        } 
+        catch(...) {
+            translate_cpp_exception_with_gil();
+        }
+    }
+    /* reacquire the GIL */
+    NPY_END_ALLOW_THREADS
+
+    if (PyErr_Occurred()) 
+        /* true if a C++ exception was translated */
+        return NULL;
+    else {
+        /* return None if there were no errors */
+        Py_RETURN_NONE;
+    }
+}
+
+
+static npy_float64
+add_weights(const ckdtree *self, 
+           npy_float64 *node_weights, 
+           npy_intp node_index, 
+           npy_float64 *weights)
+{
+    npy_intp *indices = (npy_intp *)(self->raw_indices);
+    const ckdtreenode *node = self->ctree + node_index;
+    npy_float64 sum = 0;
+
+    if (node->split_dim != -1) {
+        /* internal node */
+        sum += add_weights(self, node_weights, node->_less, weights);
+        sum += add_weights(self, node_weights, node->_greater, weights);
+    }
+    else {
+        for (npy_intp i = node->start_idx; i < node->end_idx; ++i)
+            sum += weights[indices[i]];
+    }
+
+    node_weights[node_index] = sum;
+    return sum;
+}
+
+
+extern "C" PyObject*
+build_weights(ckdtree *self, npy_float64 *node_weights, npy_float64 *weights)
+{
+    
+    /* release the GIL */
+    NPY_BEGIN_ALLOW_THREADS
+    {
+        try {
+            add_weights(self, node_weights, 0, weights);
+        } 
+        catch(...) {
+            translate_cpp_exception_with_gil();
+        }
+    }
+    /* reacquire the GIL */
+    NPY_END_ALLOW_THREADS
+
+    if (PyErr_Occurred()) 
+        /* true if a C++ exception was translated */
+        return NULL;
+    else {
+        /* return None if there were no errors */
+        Py_RETURN_NONE;
+    }
+}
+
+
+/*
+ * Statistics of the nodes for the kernel sums: the total weight of the
+ * points under each node, and their weighted centroid. Without weights
+ * every point has weight 1.
+ */
+template <typename T> static npy_float64
+add_node_stats(const ckdtree *self, 
+               const npy_intp node_index,
+               const npy_float64 *weights,
+               npy_float64 *node_weights,
+               npy_float64 *centroids)
+{
+    const npy_intp m = self->m;
+    const ckdtreenode *node = self->ctree + node_index;
+    npy_float64 *c = centroids + node_index * m;
+    npy_float64 sum = 0;
+    npy_intp i, k;
+
+    if (node->split_dim != -1) {
+        /* internal node */
+        const npy_float64 w1 = add_node_stats<T>(self, node->_less, weights,
+                                                 node_weights, centroids);
+        const npy_float64 w2 = add_node_stats<T>(self, node->_greater, 
+                                                 weights, node_weights, 
+                                                 centroids);
+        const npy_float64 *c1 = centroids + node->_less * m;
+        const npy_float64 *c2 = centroids + node->_greater * m;
+        sum = w1 + w2;
+        for (k = 0; k < m; ++k)
+            c[k] = (sum > 0) ? (w1 * c1[k] + w2 * c2[k]) / sum : c1[k];
+    }
+    else {
+        const T *data = tree_points<T>(self);
+        const npy_intp *indices = self->raw_indices;
+        const T *first = data + indices[node->start_idx] * m;
+        for (k = 0; k < m; ++k)
+            c[k] = 0;
+        for (i = node->start_idx; i < node->end_idx; ++i) {
+            const npy_float64 w = weights ? weights[indices[i]] : 1.;
+            const T *x = data + indices[i] * m;
+            for (k = 0; k < m; ++k)
+                c[k] += w * x[k];
+            sum += w;
+        }
+        for (k = 0; k < m; ++k)
+            c[k] = (sum > 0) ? c[k] / sum : first[k];
+    }
+
+    node_weights[node_index] = sum;
+    return sum;
+}
+
+
+extern "C" PyObject*
+build_node_stats(ckdtree *self, const npy_float64 *weights, 
+                 npy_float64 *node_weights, npy_float64 *centroids)
+{
+    
+    /* release the GIL */
+    NPY_BEGIN_ALLOW_THREADS
+    {
+        try {
+            if (ckdtree_is_float32(self))
+                add_node_stats<npy_float32>(self, 0, weights, node_weights,
+                                            centroids);
+            else
+                add_node_stats<npy_float64>(self, 0, weights, node_weights,
+                                            centroids);
+        } 
+        catch(...) {
+            translate_cpp_exception_with_gil();
+        }
+    }
+    /* reacquire the GIL */
+    NPY_END_ALLOW_THREADS
+
+    if (PyErr_Occurred()) 
+        /* true if a C++ exception was translated */
+        return NULL;
+    else {
+        /* return None if there were no errors */
+        Py_RETURN_NONE;
+    }
+}
+
+
+static npy_intp
+add_compact_node(const ckdtree *self, 
+                 std::vector<ckdtree_compact_node> *buf,
+                 const ckdtreenode *node)
+{
+    /* nodes are appended in depth-first order, less child first */
+    npy_intp node_index = buf->size();
+    if (NPY_UNLIKELY(node_index > NPY_MAX_INT32))
+        throw std::overflow_error("kd-tree has too many nodes for the "
+                                  "compact node layout");
+    
+    buf->push_back(ckdtree_compact_node());
+    {
+        ckdtree_compact_node &cnode = (*buf)[node_index];
+        cnode.split = node->split;
+        cnode.start_idx = node->start_idx;
+        cnode.end_idx = node->end_idx;
+        cnode.split_dim = (npy_int32) node->split_dim;
+        cnode.greater = -1;
+    }
+    
+    if (node->split_dim != -1) {
+        npy_intp greater;
+        add_compact_node(self, buf, node_less(self, node));
+        greater = add_compact_node(self, buf, node_greater(self, node));
+        (*buf)[node_index].greater = (npy_int32) greater;
+    }
+    return node_index;
+}
+
+
+extern "C" PyObject*
+build_compact_tree(ckdtree *self)
+{
+    
+    /* release the GIL */
+    NPY_BEGIN_ALLOW_THREADS
+    {
+        try {
+            std::vector<ckdtree_compact_node> *buf = self->compact_tree_buffer;
+            buf->clear();
+            buf->reserve(self->size);
+            add_compact_node(self, buf, self->ctree);
+            self->compact_tree = &(*buf)[0];
         } 
         catch(...) {
             translate_cpp_exception_with_gil();
@@ -13,18 +13,56 @@
  * out in the same order they are defined in Cython.
  */
 
+/*
+ * The children of an inner node are stored as indices into the node
+ * array, so the nodes do not depend on where the array is in memory and
+ * can be mapped directly from a file (see node_less and node_greater).
+ */
+
 struct ckdtreenode {
     npy_intp      split_dim;
     npy_intp      children;
     npy_float64   split;
     npy_intp      start_idx;
     npy_intp      end_idx;
-    ckdtreenode   *less;
-    ckdtreenode   *greater;
     npy_intp      _less;
     npy_intp      _greater;
 };
 
+/*
+ * Compact node layout of 32 bytes used by the single tree queries.
+ * The nodes are stored in depth-first order, so the less child of an
+ * inner node follows it directly and only the greater child is stored,
+ * as an index into the node array.
+ */
+
+struct ckdtree_compact_node {
+    npy_float64   split;
+    npy_intp      start_idx;
+    npy_intp      end_idx;
+    npy_int32     split_dim;
+    npy_int32     greater;
+};
+
+/*
+ * A metric supplied by the user as a set of C functions, see the metric
+ * argument of cKDTree. point_point returns the distance between the points
+ * x and y. rect_rect returns a lower and an upper bound of the distances
+ * between the points of two hyperrectangles; a point is passed as a
+ * rectangle with mins == maxes. user_data is passed to both functions.
+ * The functions are called without holding the GIL, possibly from
+ * several threads at once.
+ */
+
+typedef struct {
+    double (*point_point)(const double *x, const double *y, npy_intp m,
+                          void *user_data);
+    void (*rect_rect)(const double *mins1, const double *maxes1,
+                      const double *mins2, const double *maxes2, npy_intp m,
+                      double *min, double *max, void *user_data);
+    void *user_data;
+} ckdtree_metric;
+
 #ifdef CKDTREE_METHODS_IMPL
 
 struct ckdtree {
@@ -37,7 +75,7 @@ struct ckdtree {
     const PyObject      *dummy;
     // meta data
     const PyArrayObject *data;
-    const npy_float64   *raw_data;
+    const void          *raw_data;   // npy_float64 or npy_float32
     const npy_intp      n;
     const npy_intp      m;
     const npy_intp      leafsize;
@@ -51,7 +89,72 @@ struct ckdtree {
     const PyObject      *boxsize;
     const PyArrayObject *boxsize_data;
     const npy_float64   *raw_boxsize_data;
+    // compact node layout
+    const PyObject      *node_layout;
+    std::vector<ckdtree_compact_node> *compact_tree_buffer;
+    const ckdtree_compact_node *compact_tree;
+    const PyArrayObject *tree_data;
+    const void          *raw_tree_data;
+    // number of nodes, and the storage of the nodes of a loaded tree
+    const npy_intp      size;
+    const PyObject      *_node_arrays;
+    // tombstones of the points deleted from a tree of a cKDTreeForest
+    const PyArrayObject *_deleted;
+    const npy_uint8     *raw_deleted;
+    // nonzero: seed of the randomized choice of the split dimensions
+    npy_uint64          split_seed;
+    // user-supplied metric, or NULL for the Minkowski distances
+    const PyObject      *metric;
+    const ckdtree_metric *raw_metric;
 };
 
+/*
+ * The trees of a cKDTreeForest mark deleted points instead of rebuilding.
+ * Only query and query_ball_point skip them.
+ */
+inline int
+ckdtree_is_deleted(const ckdtree *self, const npy_intp index)
+{
+    return NPY_UNLIKELY(self->raw_deleted != NULL) &&
+           self->raw_deleted[index];
+}
+
+inline const ckdtreenode *
+node_less(const ckdtree *self, const ckdtreenode *node)
+{
+    return self->ctree + node->_less;
+}
+
+inline const ckdtreenode *
+node_greater(const ckdtree *self, const ckdtreenode *node)
+{
+    return self->ctree + node->_greater;
+}
+
+/*
+ * The data points are stored either as npy_float64 or as npy_float32,
+ * as given by the dtype of the data array. All code reading the points
+ * is templated on the coordinate type, see tree_points below and the
+ * coord_type of the distance policies in distance.h.
+ */
+
+inline int
+ckdtree_is_float32(const ckdtree *self)
+{
+    return PyArray_DESCR((PyArrayObject*)self->data)->type_num == NPY_FLOAT32;
+}
+
+template <typename T> inline const T *
+tree_points(const ckdtree *self)
+{
+    return (const T *) self->raw_data;
+}
+
+template <typename T> inline const T *
+tree_ordered_points(const ckdtree *self)
+{
+    return (const T *) self->raw_tree_data;
+}
+
 #endif
 #endif
@@ -27,8 +27,8 @@ extern int number_of_processors;
 
 #if defined(__GNUC__)
 
-inline void 
-prefetch_datapoint(const npy_float64 *x, const npy_intp m) 
+template <typename T> inline void
+prefetch_datapoint(const T *x, const npy_intp m) 
 {
     const int cache_line = 64;  // x86, amd64
     char *cur = (char*)x;
@@ -45,8 +45,8 @@ prefetch_datapoint(const npy_float64 *x, const npy_intp m)
 
 #include <xmmintrin.h>
 
-inline void
-prefetch_datapoint(const npy_float64 *x, const npy_intp m)
+template <typename T> inline void
+prefetch_datapoint(const T *x, const npy_intp m)
 {
     const int cache_line = 64;  // x86, amd64
     char *cur = (char*)x;
@@ -116,8 +116,8 @@ wrap_distance(const npy_float64 x, const npy_float64 hb, const npy_float64 fb)
  * Measuring distances
  * ===================
  */
-inline npy_float64
-sqeuclidean_distance_double(const npy_float64 *u, const npy_float64 *v, npy_intp n)
+template <typename U, typename V> inline npy_float64
+sqeuclidean_distance_double(const U *u, const V *v, npy_intp n)
 {
     npy_float64 s;
     npy_intp i;
@@ -138,13 +138,34 @@ sqeuclidean_distance_double(const npy_float64 *u, const npy_float64 *v, npy_intp
     s = acc[0] + acc[1] + acc[2] + acc[3];
     if (i < n) {
         for(; i<n; ++i) {
-            npy_float64 d = u[i] - v[i];
+            npy_float64 d = (npy_float64) u[i] - (npy_float64) v[i];
             s += d * d;
         }
     }
     return s;
 } 
 
+/* 
+ * The coordinates of a data point as npy_float64. Points of npy_float32
+ * trees are converted into buf.
+ */
+inline const npy_float64 *
+point_as_float64(const npy_float64 *x, const npy_intp /* m */,
+                 std::vector<npy_float64> & /* buf */)
+{
+    return x;
+}
+
+inline const npy_float64 *
+point_as_float64(const npy_float32 *x, const npy_intp m,
+                 std::vector<npy_float64> &buf)
+{
+    buf.resize(m);
+    for (npy_intp k = 0; k < m; ++k)
+        buf[k] = x[k];
+    return &buf[0];
+}
+
 
 inline const npy_float64 
 _wrap(const npy_float64 x, const npy_float64 box) 
@@ -230,13 +251,26 @@ const inline npy_float64 side_distance_from_min_max(
 
 CKDTREE_EXTERN PyObject*
 build_ckdtree(ckdtree *self, npy_intp start_idx, npy_intp end_idx,
-              npy_float64 *maxes, npy_float64 *mins, int _median, int _compact);
+              npy_float64 *maxes, npy_float64 *mins, int _median, int _compact,
+              int n_jobs);
+
+CKDTREE_EXTERN PyObject*
+build_weights(ckdtree *self, npy_float64 *node_weights, npy_float64 *weights);
+
+CKDTREE_EXTERN PyObject*
+build_node_stats(ckdtree *self, const npy_float64 *weights, 
+                 npy_float64 *node_weights, npy_float64 *centroids);
+
+CKDTREE_EXTERN PyObject*
+build_compact_tree(ckdtree *self);
 
 
 /* Query methods in C++ for better speed and GIL release */
 
 CKDTREE_EXTERN PyObject*
 query_knn(const ckdtree     *self, 
+          const ckdtree * const *others,
+          const npy_intp     nothers,
           npy_float64       *dd, 
           npy_intp          *ii, 
           const npy_float64 *xx,
@@ -246,23 +280,41 @@ query_knn(const ckdtree     *self,
           const npy_intp     kmax, 
           const npy_float64  eps, 
           const npy_float64  p, 
-          const npy_float64  distance_upper_bound);
+          const npy_float64  distance_upper_bound,
+          const npy_intp     max_leaves,
+          const int          n_jobs);
           
 CKDTREE_EXTERN PyObject*
 query_pairs(const ckdtree *self, 
             const npy_float64 r, 
             const npy_float64 p, 
             const npy_float64 eps,
-            std::vector<ordered_pair> *results);
+            std::vector<ordered_pair> *results,
+            const int n_jobs);
             
 CKDTREE_EXTERN PyObject*
-count_neighbors(const ckdtree *self,
-                const ckdtree *other,
-                npy_intp n_queries,
-                npy_float64 *real_r,
-                npy_intp *results,
-                npy_intp *idx, 
-                const npy_float64 p);
+count_neighbors_unweighted(const ckdtree *self,
+                           const ckdtree *other,
+                           npy_intp n_queries,
+                           npy_float64 *real_r,
+                           npy_intp *results,
+                           const npy_float64 p,
+                           int cumulative,
+                           const int n_jobs);
+
+CKDTREE_EXTERN PyObject*
+count_neighbors_weighted(const ckdtree *self,
+                         const ckdtree *other,
+                         npy_float64 *self_weights,
+                         npy_float64 *other_weights,
+                         npy_float64 *self_node_weights,
+                         npy_float64 *other_node_weights,
+                         npy_intp n_queries,
+                         npy_float64 *real_r,
+                         npy_float64 *results,
+                         const npy_float64 p,
+                         int cumulative,
+                         const int n_jobs);
                                
 CKDTREE_EXTERN PyObject*
 query_ball_point(const ckdtree *self,
@@ -271,7 +323,58 @@ query_ball_point(const ckdtree *self,
                  const npy_float64 p,
                  const npy_float64 eps,
                  const npy_intp n_queries,
-                 std::vector<npy_intp> **results);
+                 std::vector<npy_intp> **results,
+                 const int n_jobs);
+
+/* neighbors of a block of consecutive queries of query_ball_point_csr */
+struct ball_block {
+    std::vector<npy_intp> indices;
+    std::vector<npy_float64> distances;
+};
+
+CKDTREE_EXTERN PyObject*
+query_ball_point_csr(const ckdtree *self,
+                     const npy_float64 *x,
+                     const npy_float64 r,
+                     const npy_float64 p,
+                     const npy_float64 eps,
+                     const npy_intp n_queries,
+                     npy_intp *indptr,
+                     std::vector<ball_block> *blocks,
+                     const int return_distances,
+                     const int n_jobs);
+
+CKDTREE_EXTERN PyObject*
+query_ball_point_csr_copy(std::vector<ball_block> *blocks,
+                          const npy_intp *indptr,
+                          npy_intp *indices,
+                          npy_float64 *distances,
+                          const int n_jobs);
+                 
+CKDTREE_EXTERN PyObject*
+count_ball_point(const ckdtree *self,
+                 const npy_float64 *x,
+                 const npy_float64 r,
+                 const npy_float64 p,
+                 const npy_float64 eps,
+                 const npy_intp n_queries,
+                 const npy_float64 *weights,
+                 const npy_float64 *node_weights,
+                 npy_float64 *results,
+                 const int n_jobs);
+
+CKDTREE_EXTERN PyObject*
+kernel_sum(const ckdtree *self,
+           const npy_float64 *x,
+           const npy_float64 bandwidth,
+           const npy_float64 p,
+           const npy_float64 atol,
+           const npy_intp n_queries,
+           const npy_float64 *weights,
+           const npy_float64 *node_weights,
+           const npy_float64 *centroids,
+           npy_float64 *results,
+           const int n_jobs);
                  
 CKDTREE_EXTERN PyObject*                
 query_ball_tree(const ckdtree *self,
@@ -279,14 +382,29 @@ query_ball_tree(const ckdtree *self,
                 const npy_float64 r,
                 const npy_float64 p,
                 const npy_float64 eps,
-                std::vector<npy_intp> **results);                
+                std::vector<npy_intp> **results,
+                const int n_jobs);                
+
+CKDTREE_EXTERN PyObject*
+query_knn_tree(const ckdtree *self,
+               const ckdtree *other,
+               npy_float64 *dd,
+               npy_intp *ii,
+               const npy_intp *k,
+               const npy_intp nk,
+               const npy_intp kmax,
+               const npy_float64 eps,
+               const npy_float64 p,
+               const npy_float64 distance_upper_bound,
+               const int n_jobs);
 
 CKDTREE_EXTERN PyObject*                 
 sparse_distance_matrix(const ckdtree *self,
                        const ckdtree *other,
                        const npy_float64 p,
                        const npy_float64 max_distance,
-                       std::vector<coo_entry> *results);
+                       std::vector<coo_entry> *results,
+                       const int n_jobs);
 
                   
 #endif
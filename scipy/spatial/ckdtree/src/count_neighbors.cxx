@@ -12,168 +12,320 @@
 #include <typeinfo>
 #include <stdexcept>
 #include <ios>
+#include <mutex>
+#include <algorithm>
 
 #define CKDTREE_METHODS_IMPL
 #include "ckdtree_decl.h"
 #include "ckdtree_methods.h"
 #include "cpp_exc.h"
 #include "rectangle.h"
+#include "parallel_traverse.h"
+#include "thread_pool.h"
 
-template <typename MinMaxDist> static void
-traverse(const ckdtree *self, const ckdtree *other,
-         npy_intp n_queries, npy_float64 *r, npy_intp *results, npy_intp *idx,
-         const ckdtreenode *node1, const ckdtreenode *node2,
-         RectRectDistanceTracker<MinMaxDist> *tracker)
+/*
+ * Pair counting
+ * =============
+ *
+ * The radii r are sorted in increasing order. A pair of nodes is counted
+ * as a whole in every bin whose radius is at least the maximum distance
+ * between the nodes, with the product of the node weights. Only the bins
+ * with radii in [min_distance, max_distance) require a deeper traversal,
+ * and these are found by binary search.
+ *
+ * If the counts are not cumulative, the radii are the right edges of the
+ * bins, r[i-1] < d <= r[i], and a node pair that falls into a single bin
+ * is added to that bin only. Distances larger than the last radius are
+ * not counted.
+ */
+
+struct WeightedTree {
+    const ckdtree *tree;
+    const npy_float64 *weights;       /* per point, or NULL if unweighted */
+    const npy_float64 *node_weights;  /* per node, or NULL if unweighted */
+};
+
+struct CNBParams {
+    npy_float64 *r;
+    npy_intp n_queries;
+    void *results;      /* npy_intp or npy_float64, depending on WeightType */
+    WeightedTree self;
+    WeightedTree other;
+    int cumulative;
+};
+
+struct Unweighted {
+    /* the weight of a node is the number of points in it */
+    static inline npy_intp
+    get_weight(const WeightedTree * /* wt */, const ckdtreenode *node)
+    {
+        return node->children;
+    }
+
+    static inline npy_intp
+    get_weight(const WeightedTree * /* wt */, const npy_intp /* i */)
+    {
+        return 1;
+    }
+};
+
+struct Weighted {
+    /* node weights are precomputed sums of the point weights */
+    static inline npy_float64
+    get_weight(const WeightedTree *wt, const ckdtreenode *node)
+    {
+        return (wt->weights != NULL)
+            ? wt->node_weights[node - wt->tree->ctree]
+            : node->children;
+    }
+
+    static inline npy_float64
+    get_weight(const WeightedTree *wt, const npy_intp i)
+    {
+        return (wt->weights != NULL) ? wt->weights[i] : 1;
+    }
+};
+
+
+template <typename MinMaxDist, typename WeightType, typename ResultType> 
+static void
+traverse(RectRectDistanceTracker<MinMaxDist> *tracker,
+         const CNBParams *params,
+         npy_float64 *start, npy_float64 *end,
+         const ckdtreenode *node1, const ckdtreenode *node2)
 {
+    const ckdtree *self = params->self.tree;
+    const ckdtree *other = params->other.tree;
+    ResultType *results = (ResultType*) params->results;
+    npy_float64 *r_end = params->r + params->n_queries;
 
     const ckdtreenode *lnode1;
     const ckdtreenode *lnode2;
     npy_float64 d;
-    npy_intp *old_idx;
-    npy_intp old_n_queries, l, i, j;
+    npy_intp i, j;
     
     /* 
      * Speed through pairs of nodes all of whose children are close
      * and see if any work remains to be done
      */
     
-    old_idx = idx;
-    
-    std::vector<npy_intp> inner_idx(n_queries);
-    idx = &inner_idx[0];
+    npy_float64 *new_start = std::lower_bound(start, end, 
+                                              tracker->min_distance);
+    npy_float64 *new_end = std::lower_bound(start, end, 
+                                            tracker->max_distance);
 
-    old_n_queries = n_queries;
-    n_queries = 0;
-    
-    for (i=0; i<old_n_queries; ++i) {
-        if (tracker->max_distance < r[old_idx[i]])
-            results[old_idx[i]] += node1->children * node2->children;
-        else if (tracker->min_distance <= r[old_idx[i]]) {
-            idx[n_queries] = old_idx[i];
-            ++n_queries;
+    if (params->cumulative) {
+        /* all pairs are within the radii from new_end to end */
+        if (new_end != end) {
+            ResultType nn = WeightType::get_weight(&params->self, node1)
+                          * WeightType::get_weight(&params->other, node2);
+            for (npy_float64 *l = new_end; l < end; ++l)
+                results[l - params->r] += nn;
         }
+        /* bins before new_start get no pairs from this node pair */
+        start = new_start;
+        end = new_end;
+        if (start == end)
+            return;
     }
-    
-    if (n_queries > 0) {
-        /* OK, need to probe a bit deeper */
-        if (node1->split_dim == -1) {  /* 1 is leaf node */
-            lnode1 = node1;
-            if (node2->split_dim == -1) {  /* 1 & 2 are leaves */
-                lnode2 = node2;
-                const npy_float64 p = tracker->p;
-                const npy_float64 tmd = tracker->max_distance;                
-                const npy_float64 *sdata = self->raw_data;
-                const npy_intp *sindices = self->raw_indices;
-                const npy_float64 *odata = other->raw_data;
-                const npy_intp *oindices = other->raw_indices;
-                const npy_intp m = self->m;
-                const npy_intp start1 = lnode1->start_idx;
-                const npy_intp start2 = lnode2->start_idx;
-                const npy_intp end1 = lnode1->end_idx;
-                const npy_intp end2 = lnode2->end_idx;
+    else {
+        start = new_start;
+        end = new_end;
+        if (start == end) {
+            /* all pairs fall into the same bin */
+            if (start != r_end) {
+                ResultType nn = WeightType::get_weight(&params->self, node1)
+                              * WeightType::get_weight(&params->other, node2);
+                results[start - params->r] += nn;
+            }
+            return;
+        }
+    }
+
+    /* OK, need to probe a bit deeper */
+    if (node1->split_dim == -1) {  /* 1 is leaf node */
+        lnode1 = node1;
+        if (node2->split_dim == -1) {  /* 1 & 2 are leaves */
+            lnode2 = node2;
+            const npy_float64 p = tracker->p;
+            const npy_float64 tmd = tracker->max_distance;                
+            typedef typename MinMaxDist::coord_type coord_type;
+            const coord_type *sdata = tree_points<coord_type>(self);
+            const npy_intp *sindices = self->raw_indices;
+            const coord_type *odata = tree_points<coord_type>(other);
+            const npy_intp *oindices = other->raw_indices;
+            const npy_intp m = self->m;
+            const npy_intp start1 = lnode1->start_idx;
+            const npy_intp start2 = lnode2->start_idx;
+            const npy_intp end1 = lnode1->end_idx;
+            const npy_intp end2 = lnode2->end_idx;
+            
+            prefetch_datapoint(sdata + sindices[start1] * m, m);
+            
+            if (start1 < end1)
+                prefetch_datapoint(sdata + sindices[start1+1] * m, m);
+                                    
+            npy_float64 dbuf[CKDTREE_LEAF_BLOCK];
+                                    
+            /* brute-force */
+            for (i = start1; i < end1; ++i) {
                 
-                prefetch_datapoint(sdata + sindices[start1] * m, m);
+                if (i < end1-2)
+                    prefetch_datapoint(sdata + sindices[i+2] * m, m);
                 
-                if (start1 < end1)
-                    prefetch_datapoint(sdata + sindices[start1+1] * m, m);
-                                        
-                /* brute-force */
-                for (i = start1; i < end1; ++i) {
-                    
-                    if (i < end1-2)
-                        prefetch_datapoint(sdata + sindices[i+2] * m, m);
-                                      
-                    prefetch_datapoint(odata + oindices[start2] * m, m);
-                        
-                    if (start2 < end2)
-                        prefetch_datapoint(odata + oindices[start2+1] * m, m);
-                  
-                    for (j = start2; j < end2; ++j) {
-                     
-                        if (j < end2-2)
-                            prefetch_datapoint(odata + oindices[j+2] * m, m);
+                const npy_float64 *xi = point_as_float64(
+                    sdata + sindices[i] * m, m, tracker->xbuf);
+              
+                for (j = start2; j < end2; ++j) {
                  
-                        d = MinMaxDist::distance_p(self,
-                                sdata + sindices[i] * m,
-                                odata + oindices[j] * m,
-                                p, m, tmd);
+                    if ((j - start2) % CKDTREE_LEAF_BLOCK == 0) {
+                        npy_intp nb = end2 - j;
+                        if (nb > CKDTREE_LEAF_BLOCK)
+                            nb = CKDTREE_LEAF_BLOCK;
+                        MinMaxDist::leaf_distances_p(self, xi,
+                            odata, oindices + j, nb, p, m, tmd, dbuf);
+                    }
+                    d = dbuf[(j - start2) % CKDTREE_LEAF_BLOCK];
+
+                    ResultType nn = 
+                        WeightType::get_weight(&params->self, sindices[i])
+                      * WeightType::get_weight(&params->other, oindices[j]);
+
+                    if (params->cumulative) {
                         /*
                          * I think it's usually cheaper to test d against all 
                          * r's than to generate a distance array, sort it, then
                          * search for all r's via binary search
                          */
-                        for (l=0; l<n_queries; ++l) {
-                            if (d <= r[idx[l]]) results[idx[l]] += 1;
+                        for (npy_float64 *l = start; l < end; ++l) {
+                            if (d <= *l) results[l - params->r] += nn;
                         }
                     }
+                    else {
+                        npy_float64 *l = std::lower_bound(start, end, d);
+                        if (l != r_end)
+                            results[l - params->r] += nn;
+                    }
                 }
             }
-            else {  /* 1 is a leaf node, 2 is inner node */
-                tracker->push_less_of(2, node2);
-                traverse(self, other, n_queries, r, results, idx,
-                    node1, node2->less, tracker);
-                tracker->pop();
-
-                tracker->push_greater_of(2, node2);
-                traverse(self, other, n_queries, r, results, idx,
-                    node1, node2->greater, tracker);
-                tracker->pop();
-            }
         }
-        else { /* 1 is an inner node */
-            if (node2->split_dim == -1) {
-                /* 1 is an inner node, 2 is a leaf node */
-                tracker->push_less_of(1, node1);
-                traverse(self, other, n_queries, r, results, idx,
-                    node1->less, node2, tracker);
-                tracker->pop();
+        else {  /* 1 is a leaf node, 2 is inner node */
+            tracker->push_less_of(2, node2);
+            traverse<MinMaxDist, WeightType, ResultType>(
+                tracker, params, start, end, node1, node_less(other, node2));
+            tracker->pop();
+
+            tracker->push_greater_of(2, node2);
+            traverse<MinMaxDist, WeightType, ResultType>(
+                tracker, params, start, end, node1,
+                node_greater(other, node2));
+            tracker->pop();
+        }
+    }
+    else { /* 1 is an inner node */
+        if (node2->split_dim == -1) {
+            /* 1 is an inner node, 2 is a leaf node */
+            tracker->push_less_of(1, node1);
+            traverse<MinMaxDist, WeightType, ResultType>(
+                tracker, params, start, end, node_less(self, node1), node2);
+            tracker->pop();
+            
+            tracker->push_greater_of(1, node1);
+            traverse<MinMaxDist, WeightType, ResultType>(
+                tracker, params, start, end, node_greater(self, node1), node2);
+            tracker->pop();
+        }
+        else { /* 1 and 2 are inner nodes */
+            tracker->push_less_of(1, node1);
+            tracker->push_less_of(2, node2);
+            traverse<MinMaxDist, WeightType, ResultType>(
+                tracker, params, start, end, node_less(self, node1),
+                node_less(other, node2));
+            tracker->pop();
                 
-                tracker->push_greater_of(1, node1);
-                traverse(self, other, n_queries, r, results, idx,
-                    node1->greater, node2, tracker);
-                tracker->pop();
-            }
-            else { /* 1 and 2 are inner nodes */
-                tracker->push_less_of(1, node1);
-                tracker->push_less_of(2, node2);
-                traverse(self, other, n_queries, r, results, idx,
-                    node1->less, node2->less, tracker);
-                tracker->pop();
-                    
-                tracker->push_greater_of(2, node2);
-                traverse(self, other, n_queries, r, results, idx,
-                    node1->less, node2->greater, tracker);
-                tracker->pop();
-                tracker->pop();
-                    
-                tracker->push_greater_of(1, node1);
-                tracker->push_less_of(2, node2);
-                traverse(self, other, n_queries, r, results, idx,
-                    node1->greater, node2->less, tracker);
-                tracker->pop();
-                    
-                tracker->push_greater_of(2, node2);
-                traverse(self, other, n_queries, r, results, idx,
-                    node1->greater, node2->greater, tracker);
-                tracker->pop();
-                tracker->pop();
-            }
+            tracker->push_greater_of(2, node2);
+            traverse<MinMaxDist, WeightType, ResultType>(
+                tracker, params, start, end, node_less(self, node1),
+                node_greater(other, node2));
+            tracker->pop();
+            tracker->pop();
+                
+            tracker->push_greater_of(1, node1);
+            tracker->push_less_of(2, node2);
+            traverse<MinMaxDist, WeightType, ResultType>(
+                tracker, params, start, end, node_greater(self, node1),
+                node_less(other, node2));
+            tracker->pop();
+                
+            tracker->push_greater_of(2, node2);
+            traverse<MinMaxDist, WeightType, ResultType>(
+                tracker, params, start, end, node_greater(self, node1),
+                node_greater(other, node2));
+            tracker->pop();
+            tracker->pop();
         }
     }
 }
 
 
-extern "C" PyObject*
-count_neighbors(const ckdtree *self, const ckdtree *other,
-                npy_intp n_queries, npy_float64 *real_r, npy_intp *results,
-                npy_intp *idx, const npy_float64 p)
+template <typename MinMaxDist, typename WeightType, typename ResultType> 
+static void
+traverse_parallel(RectRectDistanceTracker<MinMaxDist> *tracker,
+                  const CNBParams *params, const int n_jobs)
 {
+    std::vector<traverse_task<MinMaxDist> > tasks;
+    std::mutex lock;
+    const npy_intp n_queries = params->n_queries;
+    ResultType *results = (ResultType*) params->results;
+
+    tasks.push_back(traverse_task<MinMaxDist>(params->self.tree->ctree,
+                                              params->other.tree->ctree,
+                                              *tracker));
+    split_traversal(params->self.tree, params->other.tree, &tasks,
+                    16 * n_jobs, 1, 0);
+
+    parallel_for(tasks.size(), n_jobs, 1,
+        [&](npy_intp start, npy_intp stop) {
+            /* count into a private accumulator */
+            std::vector<ResultType> local(n_queries, 0);
+            CNBParams local_params = *params;
+            local_params.results = (void*) &local[0];
+            for (npy_intp k = start; k < stop; ++k) {
+                traverse_task<MinMaxDist> &t = tasks[k];
+                traverse<MinMaxDist, WeightType, ResultType>(
+                    &t.tracker, &local_params, params->r, 
+                    params->r + n_queries, t.node1, t.node2);
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            for (npy_intp i = 0; i < n_queries; ++i)
+                results[i] += local[i];
+        });
+}
+
+
+template <typename WeightType, typename ResultType> static PyObject*
+count_neighbors(CNBParams *params, const npy_float64 p, const int n_jobs)
+{
+    const ckdtree *self = params->self.tree;
+    const ckdtree *other = params->other.tree;
+
+#define DISPATCH(kls) { \
+        RectRectDistanceTracker<kls> tracker(self, r1, r2, p, 0.0, 0.0);\
+        if (n_jobs > 1) \
+            traverse_parallel<kls, WeightType, ResultType>( \
+                &tracker, params, n_jobs); \
+        else \
+            traverse<kls, WeightType, ResultType>(&tracker, params, \
+                params->r, params->r + params->n_queries, \
+                self->ctree, other->ctree); \
+    }
 
 #define HANDLE(cond, kls) \
     if(cond) { \
-        RectRectDistanceTracker<kls> tracker(self, r1, r2, p, 0.0, 0.0);\
-        traverse(self, other, n_queries, real_r, results, idx, \
-                 self->ctree, other->ctree, &tracker); \
+        if (ckdtree_is_float32(self)) \
+            DISPATCH(kls##F32) \
+        else \
+            DISPATCH(kls) \
     } else
 
     /* release the GIL */
@@ -185,6 +337,7 @@ count_neighbors(const ckdtree *self, const ckdtree *other,
             Rectangle r2(other->m, other->raw_mins, other->raw_maxes);
             
             if(NPY_LIKELY(self->raw_boxsize_data == NULL)) {
+                HANDLE(self->raw_metric != NULL, CallbackDist)
                 HANDLE(NPY_LIKELY(p == 2), MinkowskiDistP2)
                 HANDLE(p == 1, MinkowskiDistP1)
                 HANDLE(ckdtree_isinf(p), MinkowskiDistPinf)
@@ -215,3 +368,48 @@ count_neighbors(const ckdtree *self, const ckdtree *other,
 }
 
 
+extern "C" PyObject*
+count_neighbors_unweighted(const ckdtree *self, const ckdtree *other,
+                npy_intp n_queries, npy_float64 *real_r, npy_intp *results,
+                const npy_float64 p, int cumulative, const int n_jobs) 
+{
+    CNBParams params = {};
+
+    params.r = real_r;
+    params.n_queries = n_queries;
+    params.results = (void*) results;
+    params.self.tree = self;
+    params.other.tree = other;
+    params.cumulative = cumulative;
+
+    return count_neighbors<Unweighted, npy_intp>(&params, p, n_jobs);
+}
+
+
+extern "C" PyObject*
+count_neighbors_weighted(const ckdtree *self, const ckdtree *other,
+                npy_float64 *self_weights, npy_float64 *other_weights, 
+                npy_float64 *self_node_weights, npy_float64 *other_node_weights, 
+                npy_intp n_queries, npy_float64 *real_r, npy_float64 *results,
+                const npy_float64 p, int cumulative, const int n_jobs) 
+{
+    CNBParams params = {};
+
+    params.r = real_r;
+    params.n_queries = n_queries;
+    params.results = (void*) results;
+    params.cumulative = cumulative;
+
+    params.self.tree = self;
+    params.other.tree = other;
+    if (self_weights) {
+        params.self.weights = self_weights;
+        params.self.node_weights = self_node_weights;
+    }
+    if (other_weights) {
+        params.other.weights = other_weights;
+        params.other.node_weights = other_node_weights;
+    }
+
+    return count_neighbors<Weighted, npy_float64>(&params, p, n_jobs);
+}
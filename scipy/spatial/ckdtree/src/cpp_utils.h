@@ -78,15 +78,6 @@ coo_entry_vector_buf(std::vector<coo_entry> *buf)
 }
 
 
-static PyObject *
-pickle_tree_buffer(std::vector<ckdtreenode> *buf)
-{
-    char *v = (char*) &(buf->front());
-    Py_ssize_t len = buf->size() * sizeof(ckdtreenode);
-    return ckdtree_PyBytes_FromStringAndSize(v,len);
-}
-
-
 static PyObject *
 unpickle_tree_buffer(std::vector<ckdtreenode> *buf, PyObject *src)
 {
@@ -14,17 +14,31 @@ struct Dist1D {
                               rect2.maxes[k] - rect1.mins[k]);
     }
 
+    template <typename U, typename V>
     static inline npy_float64
     point_point(const ckdtree * tree, 
-               const npy_float64 *x, const npy_float64 *y,
+               const U *x, const V *y,
                  const npy_intp k) {
-        return dabs(x[k] - y[k]);
+        return dabs((npy_float64) x[k] - (npy_float64) y[k]);
     }
 };
 
-template <typename Dist1D>
+/*
+ * The metrics give the distances between points and rectangles, as
+ * distance**p for finite p. With max_norm, the distance is the maximum over
+ * the dimensions instead of the sum, which the distance tracker in 
+ * rectangle.h updates differently. The distances of the metrics which are
+ * not separable over the dimensions (see distance_callback.h) are always
+ * recomputed from the whole rectangles.
+ */
+
+template <typename Dist1D, typename T>
 struct BaseMinkowskiDistP1 {
 
+    typedef T coord_type;
+    static const bool max_norm = false;
+    static const bool separable = true;
+
     static inline void 
     interval_interval_p(const ckdtree * tree, 
                         const Rectangle& rect1, const Rectangle& rect2,
@@ -55,9 +69,10 @@ struct BaseMinkowskiDistP1 {
         }
     }
 
+    template <typename U, typename V>
     static inline npy_float64 
     distance_p(const ckdtree * tree, 
-               const npy_float64 *x, const npy_float64 *y,
+               const U *x, const V *y,
                const npy_float64 p, const npy_intp k,
                const npy_float64 upperbound)
     {    
@@ -71,10 +86,27 @@ struct BaseMinkowskiDistP1 {
         }
         return r;
     }
+
+    static inline void
+    leaf_distances_p(const ckdtree * tree, const npy_float64 *x,
+                     const T *data, const npy_intp *indices,
+                     const npy_intp n, const npy_float64 p, const npy_intp k,
+                     const npy_float64 upperbound, npy_float64 *out)
+    {
+        /* distances from x to a block of points, see leaf_kernels.h */
+        for (npy_intp j = 0; j < n; ++j)
+            out[j] = distance_p(tree, data + (indices ? indices[j] : j) * k,
+                                x, p, k, upperbound);
+    }
 };
 
-template <typename Dist1D>
+template <typename Dist1D, typename T>
 struct BaseMinkowskiDistPp {
+
+    typedef T coord_type;
+    static const bool max_norm = false;
+    static const bool separable = true;
+
     /* 1-d pieces
      * These should only be used if p != infinity
      */
@@ -111,9 +143,10 @@ struct BaseMinkowskiDistPp {
         }
     }
 
+    template <typename U, typename V>
     static inline npy_float64 
     distance_p(const ckdtree * tree, 
-               const npy_float64 *x, const npy_float64 *y,
+               const U *x, const V *y,
                const npy_float64 p, const npy_intp k,
                const npy_float64 upperbound)
     {    
@@ -136,17 +169,36 @@ struct BaseMinkowskiDistPp {
         }
         return r;
     } 
+    static inline void
+    leaf_distances_p(const ckdtree * tree, const npy_float64 *x,
+                     const T *data, const npy_intp *indices,
+                     const npy_intp n, const npy_float64 p, const npy_intp k,
+                     const npy_float64 upperbound, npy_float64 *out)
+    {
+        /* distances from x to a block of points, see leaf_kernels.h */
+        for (npy_intp j = 0; j < n; ++j)
+            out[j] = distance_p(tree, data + (indices ? indices[j] : j) * k,
+                                x, p, k, upperbound);
+    }
 };
 
-template <typename Dist1D>
+template <typename Dist1D, typename T>
 struct BaseMinkowskiDistPinf {
+
+    typedef T coord_type;
+    static const bool max_norm = true;
+    static const bool separable = true;
+
     static inline void 
     interval_interval_p(const ckdtree * tree,
                         const Rectangle& rect1, const Rectangle& rect2,
                         const npy_intp k, npy_float64 p,
                         npy_float64 *min, npy_float64 *max)
     {
-        return rect_rect_p(tree, rect1, rect2, p, min, max);
+        /* Compute the minimum/maximum distance along dimension k between points in
+         * two hyperrectangles.
+         */
+        Dist1D::interval_interval(tree, rect1, rect2, k, min, max);
     }
 
     static inline void 
@@ -167,9 +219,10 @@ struct BaseMinkowskiDistPinf {
         }
     }
 
+    template <typename U, typename V>
     static inline npy_float64 
     distance_p(const ckdtree * tree, 
-               const npy_float64 *x, const npy_float64 *y,
+               const U *x, const V *y,
                const npy_float64 p, const npy_intp k,
                const npy_float64 upperbound)
     {    
@@ -183,10 +236,27 @@ struct BaseMinkowskiDistPinf {
         }
         return r;
     }
+
+    static inline void
+    leaf_distances_p(const ckdtree * tree, const npy_float64 *x,
+                     const T *data, const npy_intp *indices,
+                     const npy_intp n, const npy_float64 p, const npy_intp k,
+                     const npy_float64 upperbound, npy_float64 *out)
+    {
+        /* distances from x to a block of points, see leaf_kernels.h */
+        for (npy_intp j = 0; j < n; ++j)
+            out[j] = distance_p(tree, data + (indices ? indices[j] : j) * k,
+                                x, p, k, upperbound);
+    }
 };
 
-template <typename Dist1D>
+template <typename Dist1D, typename T>
 struct BaseMinkowskiDistP2 {
+
+    typedef T coord_type;
+    static const bool max_norm = false;
+    static const bool separable = true;
+
     static inline void 
     interval_interval_p(const ckdtree * tree,
                         const Rectangle& rect1, const Rectangle& rect2,
@@ -220,10 +290,10 @@ struct BaseMinkowskiDistP2 {
             *max += max_;
         }
     }
+    template <typename U, typename V>
     static inline npy_float64 
-
     distance_p(const ckdtree * tree, 
-               const npy_float64 *x, const npy_float64 *y,
+               const U *x, const V *y,
                const npy_float64 p, const npy_intp k,
                const npy_float64 upperbound)
     {    
@@ -238,20 +308,93 @@ struct BaseMinkowskiDistP2 {
         }
         return r;
     }
+
+    static inline void
+    leaf_distances_p(const ckdtree * tree, const npy_float64 *x,
+                     const T *data, const npy_intp *indices,
+                     const npy_intp n, const npy_float64 p, const npy_intp k,
+                     const npy_float64 upperbound, npy_float64 *out)
+    {
+        /* distances from x to a block of points, see leaf_kernels.h */
+        for (npy_intp j = 0; j < n; ++j)
+            out[j] = distance_p(tree, data + (indices ? indices[j] : j) * k,
+                                x, p, k, upperbound);
+    }
 };
 
-typedef BaseMinkowskiDistPp<Dist1D> MinkowskiDistPp;
-typedef BaseMinkowskiDistPinf<Dist1D> MinkowskiDistPinf;
-typedef BaseMinkowskiDistP1<Dist1D> MinkowskiDistP1;
-typedef BaseMinkowskiDistP2<Dist1D> NonOptimizedMinkowskiDistP2;
+/* 
+ * The non-periodic metrics with p = 1, 2 and infinity compute the leaf
+ * distances with the vectorized kernels selected at load time.
+ */
 
-struct MinkowskiDistP2: NonOptimizedMinkowskiDistP2 {
+template <typename T>
+struct MinkowskiDistP1T: BaseMinkowskiDistP1<Dist1D, T> {
+    static inline void
+    leaf_distances_p(const ckdtree * tree, const npy_float64 *x,
+                     const T *data, const npy_intp *indices,
+                     const npy_intp n, const npy_float64 p, const npy_intp k,
+                     const npy_float64 upperbound, npy_float64 *out)
+    {
+        if (k < CKDTREE_LEAF_KERNEL_MIN_DIM)
+            BaseMinkowskiDistP1<Dist1D, T>::leaf_distances_p(tree, x, data,
+                indices, n, p, k, upperbound, out);
+        else
+            leaf_kernel_p1(x, data, indices, n, k, out);
+    }
+};
+
+template <typename T>
+struct MinkowskiDistPinfT: BaseMinkowskiDistPinf<Dist1D, T> {
+    static inline void
+    leaf_distances_p(const ckdtree * tree, const npy_float64 *x,
+                     const T *data, const npy_intp *indices,
+                     const npy_intp n, const npy_float64 p, const npy_intp k,
+                     const npy_float64 upperbound, npy_float64 *out)
+    {
+        if (k < CKDTREE_LEAF_KERNEL_MIN_DIM)
+            BaseMinkowskiDistPinf<Dist1D, T>::leaf_distances_p(tree, x, data,
+                indices, n, p, k, upperbound, out);
+        else
+            leaf_kernel_pinf(x, data, indices, n, k, out);
+    }
+};
+
+template <typename T>
+struct MinkowskiDistP2T: BaseMinkowskiDistP2<Dist1D, T> {
+    template <typename U, typename V>
     static inline npy_float64 
     distance_p(const ckdtree * tree, 
-               const npy_float64 *x, const npy_float64 *y,
+               const U *x, const V *y,
                const npy_float64 p, const npy_intp k,
                const npy_float64 upperbound)
     {    
         return sqeuclidean_distance_double(x, y, k);
     }
+
+    static inline void
+    leaf_distances_p(const ckdtree * /* tree */, const npy_float64 *x,
+                     const T *data, const npy_intp *indices,
+                     const npy_intp n, const npy_float64 /* p */,
+                     const npy_intp k, const npy_float64 /* upperbound */,
+                     npy_float64 *out)
+    {
+        if (k < CKDTREE_LEAF_KERNEL_MIN_DIM) {
+            for (npy_intp j = 0; j < n; ++j)
+                out[j] = sqeuclidean_distance_double(x, 
+                            data + (indices ? indices[j] : j) * k, k);
+        }
+        else
+            leaf_kernel_p2(x, data, indices, n, k, out);
+    }
 };
+
+typedef BaseMinkowskiDistPp<Dist1D, npy_float64> MinkowskiDistPp;
+typedef MinkowskiDistPinfT<npy_float64> MinkowskiDistPinf;
+typedef MinkowskiDistP1T<npy_float64> MinkowskiDistP1;
+typedef MinkowskiDistP2T<npy_float64> MinkowskiDistP2;
+
+/* metrics for trees with npy_float32 data */
+typedef BaseMinkowskiDistPp<Dist1D, npy_float32> MinkowskiDistPpF32;
+typedef MinkowskiDistPinfT<npy_float32> MinkowskiDistPinfF32;
+typedef MinkowskiDistP1T<npy_float32> MinkowskiDistP1F32;
+typedef MinkowskiDistP2T<npy_float32> MinkowskiDistP2F32;
@@ -67,21 +67,115 @@ struct BoxDist1D {
                     tree->raw_boxsize_data[k], tree->raw_boxsize_data[k + rect1.m]);
     }
 
+    template <typename U, typename V>
     static inline npy_float64
     point_point(const ckdtree * tree, 
-               const npy_float64 *x, const npy_float64 *y,
+               const U *x, const V *y,
                const npy_intp k) 
     {
         npy_float64 r1;
-        r1 = wrap_distance(x[k] - y[k], tree->raw_boxsize_data[k + tree->m], tree->raw_boxsize_data[k]);
+        r1 = wrap_distance((npy_float64) x[k] - (npy_float64) y[k], 
+                           tree->raw_boxsize_data[k + tree->m], tree->raw_boxsize_data[k]);
         r1 = dabs(r1);
         return r1;
     }
 };
 
 
-typedef BaseMinkowskiDistPp<BoxDist1D> BoxMinkowskiDistPp;
-typedef BaseMinkowskiDistPinf<BoxDist1D> BoxMinkowskiDistPinf;
-typedef BaseMinkowskiDistP1<BoxDist1D> BoxMinkowskiDistP1;
-typedef BaseMinkowskiDistP2<BoxDist1D> BoxMinkowskiDistP2;
+/*
+ * Leaf distances in a periodic box
+ *
+ * The points of the tree and the (wrapped) query points lie in the box, so
+ * the difference along a dimension is within (-full, full), and the 
+ * periodic distance is min(|d|, full - |d|). This is the result of 
+ * wrap_distance, but computed without branches and without the early 
+ * exit; the sign of d is random, so the branches of dabs and 
+ * wrap_distance are mispredicted about half of the time.
+ */
+
+template <typename T, typename Reduce> static inline void
+box_leaf_distances(const ckdtree * tree, const npy_float64 *x,
+                   const T *data, const npy_intp *indices,
+                   const npy_intp n, const npy_intp k, npy_float64 *out)
+{
+    const npy_float64 *full = tree->raw_boxsize_data;
+    for (npy_intp j = 0; j < n; ++j) {
+        const T *y = data + (indices ? indices[j] : j) * k;
+        npy_float64 r = 0;
+        for (npy_intp i = 0; i < k; ++i) {
+            npy_float64 d = std::fabs(x[i] - (npy_float64) y[i]);
+            d = dmin(d, full[i] - d);
+            r = Reduce::add(r, d);
+        }
+        out[j] = r;
+    }
+}
+
+struct BoxReduceP1 {
+    static inline npy_float64 add(npy_float64 r, npy_float64 d) { 
+        return r + d; 
+    }
+};
+
+struct BoxReduceP2 {
+    static inline npy_float64 add(npy_float64 r, npy_float64 d) { 
+        return r + d * d; 
+    }
+};
+
+struct BoxReducePinf {
+    static inline npy_float64 add(npy_float64 r, npy_float64 d) { 
+        return dmax(r, d); 
+    }
+};
+
+template <typename T>
+struct BoxMinkowskiDistP1T: BaseMinkowskiDistP1<BoxDist1D, T> {
+    static inline void
+    leaf_distances_p(const ckdtree * tree, const npy_float64 *x,
+                     const T *data, const npy_intp *indices,
+                     const npy_intp n, const npy_float64 /* p */,
+                     const npy_intp k, const npy_float64 /* upperbound */,
+                     npy_float64 *out)
+    {
+        box_leaf_distances<T, BoxReduceP1>(tree, x, data, indices, n, k, out);
+    }
+};
+
+template <typename T>
+struct BoxMinkowskiDistP2T: BaseMinkowskiDistP2<BoxDist1D, T> {
+    static inline void
+    leaf_distances_p(const ckdtree * tree, const npy_float64 *x,
+                     const T *data, const npy_intp *indices,
+                     const npy_intp n, const npy_float64 /* p */,
+                     const npy_intp k, const npy_float64 /* upperbound */,
+                     npy_float64 *out)
+    {
+        box_leaf_distances<T, BoxReduceP2>(tree, x, data, indices, n, k, out);
+    }
+};
+
+template <typename T>
+struct BoxMinkowskiDistPinfT: BaseMinkowskiDistPinf<BoxDist1D, T> {
+    static inline void
+    leaf_distances_p(const ckdtree * tree, const npy_float64 *x,
+                     const T *data, const npy_intp *indices,
+                     const npy_intp n, const npy_float64 /* p */,
+                     const npy_intp k, const npy_float64 /* upperbound */,
+                     npy_float64 *out)
+    {
+        box_leaf_distances<T, BoxReducePinf>(tree, x, data, indices, n, k, out);
+    }
+};
+
+typedef BaseMinkowskiDistPp<BoxDist1D, npy_float64> BoxMinkowskiDistPp;
+typedef BoxMinkowskiDistPinfT<npy_float64> BoxMinkowskiDistPinf;
+typedef BoxMinkowskiDistP1T<npy_float64> BoxMinkowskiDistP1;
+typedef BoxMinkowskiDistP2T<npy_float64> BoxMinkowskiDistP2;
+
+/* metrics for periodic trees with npy_float32 data */
+typedef BaseMinkowskiDistPp<BoxDist1D, npy_float32> BoxMinkowskiDistPpF32;
+typedef BoxMinkowskiDistPinfT<npy_float32> BoxMinkowskiDistPinfF32;
+typedef BoxMinkowskiDistP1T<npy_float32> BoxMinkowskiDistP1F32;
+typedef BoxMinkowskiDistP2T<npy_float32> BoxMinkowskiDistP2F32;
 
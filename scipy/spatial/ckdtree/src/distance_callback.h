@@ -0,0 +1,83 @@
+/*
+ * Distances of a user-supplied metric
+ * 
+ * The metric is given by the C functions of the ckdtree_metric of the
+ * tree (see ckdtree_decl.h). The distances are not separable over the 
+ * dimensions, so the distance tracker recomputes the bounds of the whole 
+ * rectangles after each split, and the distances are used as they are 
+ * (the queries are run with p = 1).
+ */
+
+template <typename T>
+struct CallbackDistT {
+
+    typedef T coord_type;
+    static const bool max_norm = false;
+    static const bool separable = false;
+
+    static inline void 
+    interval_interval_p(const ckdtree * /* tree */, 
+                        const Rectangle& /* rect1 */,
+                        const Rectangle& /* rect2 */,
+                        const npy_intp /* k */, const npy_float64 /* p */,
+                        npy_float64 *min, npy_float64 *max)
+    {
+        /* not used, the metric is not separable */
+        *min = 0.;
+        *max = NPY_INFINITY;
+    }
+
+    static inline void 
+    rect_rect_p(const ckdtree * tree, 
+                const Rectangle& rect1, const Rectangle& rect2,
+                const npy_float64 /* p */,
+                npy_float64 *min, npy_float64 *max)
+    {
+        rect_rect_bounds(tree, rect1.mins, rect1.maxes, 
+                     rect2.mins, rect2.maxes, min, max);
+    }
+
+    static inline void 
+    rect_rect_bounds(const ckdtree * tree, 
+                 const npy_float64 *mins1, const npy_float64 *maxes1,
+                 const npy_float64 *mins2, const npy_float64 *maxes2,
+                 npy_float64 *min, npy_float64 *max)
+    {
+        const ckdtree_metric *metric = tree->raw_metric;
+        metric->rect_rect(mins1, maxes1, mins2, maxes2, tree->m, 
+                          min, max, metric->user_data);
+    }
+
+    template <typename U, typename V>
+    static inline npy_float64 
+    distance_p(const ckdtree * tree, 
+               const U *x, const V *y,
+               const npy_float64 /* p */, const npy_intp k,
+               const npy_float64 /* upperbound */)
+    {
+        const ckdtree_metric *metric = tree->raw_metric;
+        std::vector<npy_float64> xbuf, ybuf;
+        return metric->point_point(point_as_float64(x, k, xbuf), 
+                                   point_as_float64(y, k, ybuf), k,
+                                   metric->user_data);
+    }
+
+    static inline void
+    leaf_distances_p(const ckdtree * tree, const npy_float64 *x,
+                     const T *data, const npy_intp *indices,
+                     const npy_intp n, const npy_float64 /* p */,
+                     const npy_intp k, const npy_float64 /* upperbound */,
+                     npy_float64 *out)
+    {
+        const ckdtree_metric *metric = tree->raw_metric;
+        std::vector<npy_float64> ybuf;
+        for (npy_intp j = 0; j < n; ++j) {
+            const T *y = data + (indices ? indices[j] : j) * k;
+            out[j] = metric->point_point(x, point_as_float64(y, k, ybuf), k,
+                                         metric->user_data);
+        }
+    }
+};
+
+typedef CallbackDistT<npy_float64> CallbackDist;
+typedef CallbackDistT<npy_float32> CallbackDistF32;
@@ -0,0 +1,341 @@
+#include <Python.h>
+#include "numpy/arrayobject.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <sstream>
+#include <new>
+#include <typeinfo>
+#include <stdexcept>
+#include <ios>
+
+#define CKDTREE_METHODS_IMPL
+#include "ckdtree_decl.h"
+#include "ckdtree_methods.h"
+#include "cpp_exc.h"
+#include "thread_pool.h"
+#include "rectangle.h"
+
+/*
+ * Range counts and kernel sums
+ * ============================
+ *
+ * Both queries aggregate over the points near a query point without
+ * listing them, using the statistics of the nodes built by
+ * build_node_stats.
+ *
+ * count_ball_point adds the total weight of the nodes which are entirely
+ * within the ball.
+ *
+ * kernel_sum computes the sum of w * exp(-d**2 / (2 h**2)) over the points.
+ * Once the kernel values at the minimum and the maximum distance of a node
+ * differ by at most atol / W, where W is the total weight of the tree, the
+ * contribution of the node is approximated by its weight times the kernel
+ * at its weighted centroid, clipped to these values. The error of the sum
+ * is then at most atol, provided the weights are nonnegative.
+ */
+
+struct KernelParams {
+    const npy_float64 *weights;       /* weights of the points, or NULL */
+    const npy_float64 *node_weights;  /* weights of the nodes, or NULL */
+    const npy_float64 *centroids;
+    npy_float64       inv2h2;         /* 1 / (2 h**2) */
+    npy_float64       tol;
+};
+
+inline npy_float64
+node_weight(const ckdtree *self, const KernelParams *params,
+            const ckdtreenode *node)
+{
+    if (params->node_weights)
+        return params->node_weights[node - self->ctree];
+    else
+        return (npy_float64) (node->end_idx - node->start_idx);
+}
+
+inline npy_float64
+point_weight(const KernelParams *params, const npy_intp index)
+{
+    return params->weights ? params->weights[index] : 1.;
+}
+
+/*
+ * the Gaussian kernel of a distance d**p; p is 2 for the Euclidean
+ * distance and 1 for a user-supplied metric
+ */
+inline npy_float64
+gaussian(const npy_float64 d, const npy_float64 p, const npy_float64 inv2h2)
+{
+    if (NPY_LIKELY(p == 2.))
+        return std::exp(-d * inv2h2);
+    else
+        return std::exp(-d * d * inv2h2);
+}
+
+
+template <typename MinMaxDist> static npy_float64
+traverse_count(const ckdtree *self, const KernelParams *params,
+               const ckdtreenode *node,
+               RectRectDistanceTracker<MinMaxDist> *tracker)
+{
+    if (tracker->min_distance > tracker->upper_bound * tracker->epsfac)
+        return 0;
+    else if (tracker->max_distance < tracker->upper_bound / tracker->epsfac)
+        return node_weight(self, params, node);
+    else if (node->split_dim == -1) {  /* leaf node */
+
+        /* brute-force */
+        typedef typename MinMaxDist::coord_type coord_type;
+        const npy_float64 p = tracker->p;
+        const npy_float64 tub = tracker->upper_bound;
+        const npy_float64 *tpt = tracker->rect1.mins;
+        const coord_type *data = tree_points<coord_type>(self);
+        const npy_intp *indices = self->raw_indices;
+        const npy_intp m = self->m;
+        const npy_intp start = node->start_idx;
+        const npy_intp end = node->end_idx;
+        npy_float64 dbuf[CKDTREE_LEAF_BLOCK];
+        npy_float64 sum = 0;
+
+        for (npy_intp i = start; i < end; i += CKDTREE_LEAF_BLOCK) {
+            npy_intp nb = end - i;
+            if (nb > CKDTREE_LEAF_BLOCK)
+                nb = CKDTREE_LEAF_BLOCK;
+            MinMaxDist::leaf_distances_p(self, tpt, data, indices + i,
+                                         nb, p, m, tub, dbuf);
+            for (npy_intp j = 0; j < nb; ++j)
+                if (dbuf[j] <= tub)
+                    sum += point_weight(params, indices[i + j]);
+        }
+        return sum;
+    }
+    else {
+        npy_float64 sum;
+        tracker->push_less_of(2, node);
+        sum = traverse_count<MinMaxDist>(self, params,
+                                         node_less(self, node), tracker);
+        tracker->pop();
+
+        tracker->push_greater_of(2, node);
+        sum += traverse_count<MinMaxDist>(self, params,
+                                          node_greater(self, node), tracker);
+        tracker->pop();
+        return sum;
+    }
+}
+
+
+template <typename MinMaxDist> static npy_float64
+traverse_kernel(const ckdtree *self, const KernelParams *params,
+                const ckdtreenode *node,
+                RectRectDistanceTracker<MinMaxDist> *tracker)
+{
+    const npy_float64 p = tracker->p;
+    const npy_float64 *tpt = tracker->rect1.mins;
+    const npy_float64 kmax = gaussian(tracker->min_distance, p,
+                                      params->inv2h2);
+    const npy_float64 kmin = gaussian(tracker->max_distance, p,
+                                      params->inv2h2);
+    const npy_intp m = self->m;
+
+    if (kmax - kmin <= params->tol) {
+        /* approximate the node by its centroid */
+        const npy_float64 w = node_weight(self, params, node);
+        if (kmax == 0. || w == 0.)
+            return 0.;
+        const npy_float64 *c = params->centroids + (node - self->ctree) * m;
+        npy_float64 k = gaussian(MinMaxDist::distance_p(self, tpt, c, p, m,
+                                     NPY_INFINITY), p, params->inv2h2);
+        return w * dmin(kmax, dmax(kmin, k));
+    }
+    else if (node->split_dim == -1) {  /* leaf node */
+
+        /* brute-force */
+        typedef typename MinMaxDist::coord_type coord_type;
+        const coord_type *data = tree_points<coord_type>(self);
+        const npy_intp *indices = self->raw_indices;
+        const npy_intp start = node->start_idx;
+        const npy_intp end = node->end_idx;
+        npy_float64 dbuf[CKDTREE_LEAF_BLOCK];
+        npy_float64 sum = 0;
+
+        for (npy_intp i = start; i < end; i += CKDTREE_LEAF_BLOCK) {
+            npy_intp nb = end - i;
+            if (nb > CKDTREE_LEAF_BLOCK)
+                nb = CKDTREE_LEAF_BLOCK;
+            MinMaxDist::leaf_distances_p(self, tpt, data, indices + i,
+                                         nb, p, m, NPY_INFINITY, dbuf);
+            for (npy_intp j = 0; j < nb; ++j)
+                sum += point_weight(params, indices[i + j])
+                     * gaussian(dbuf[j], p, params->inv2h2);
+        }
+        return sum;
+    }
+    else {
+        npy_float64 sum;
+        tracker->push_less_of(2, node);
+        sum = traverse_kernel<MinMaxDist>(self, params,
+                                          node_less(self, node), tracker);
+        tracker->pop();
+
+        tracker->push_greater_of(2, node);
+        sum += traverse_kernel<MinMaxDist>(self, params,
+                                           node_greater(self, node), tracker);
+        tracker->pop();
+        return sum;
+    }
+}
+
+
+/* aggregate over the points near x with traverse, see query_single_ball */
+template <template <typename> class Traverse> static npy_float64
+aggregate_single_point(const ckdtree *self, const KernelParams *params,
+                       const npy_float64 *x, const npy_float64 r,
+                       const npy_float64 p, const npy_float64 eps)
+{
+#define DISPATCH(kls) { \
+        RectRectDistanceTracker<kls> tracker(self, point, rect, p, eps, r); \
+        return Traverse<kls>::run(self, params, self->ctree, &tracker); \
+    }
+
+#define HANDLE(cond, kls) \
+    if(cond) { \
+        if (ckdtree_is_float32(self)) \
+            DISPATCH(kls##F32) \
+        else \
+            DISPATCH(kls) \
+    } else
+
+    const npy_intp m = self->m;
+    Rectangle rect(m, self->raw_mins, self->raw_maxes);
+    if (NPY_LIKELY(self->raw_boxsize_data == NULL)) {
+        Rectangle point(m, x, x);
+        HANDLE(self->raw_metric != NULL, CallbackDist)
+        HANDLE(NPY_LIKELY(p == 2), MinkowskiDistP2)
+        HANDLE(p == 1, MinkowskiDistP1)
+        HANDLE(ckdtree_isinf(p), MinkowskiDistPinf)
+        HANDLE(1, MinkowskiDistPp)
+        {}
+    } else {
+        Rectangle point(m, x, x);
+        int j;
+        for(j=0; j<m; ++j) {
+            point.maxes[j] = point.mins[j] = _wrap(point.mins[j], self->raw_boxsize_data[j]);
+        }
+        HANDLE(NPY_LIKELY(p == 2), BoxMinkowskiDistP2)
+        HANDLE(p == 1, BoxMinkowskiDistP1)
+        HANDLE(ckdtree_isinf(p), BoxMinkowskiDistPinf)
+        HANDLE(1, BoxMinkowskiDistPp)
+        {}
+    }
+#undef HANDLE
+#undef DISPATCH
+    return 0.;
+}
+
+template <typename MinMaxDist> struct CountTraversal {
+    static npy_float64
+    run(const ckdtree *self, const KernelParams *params,
+        const ckdtreenode *node, RectRectDistanceTracker<MinMaxDist> *tracker) {
+        return traverse_count<MinMaxDist>(self, params, node, tracker);
+    }
+};
+
+template <typename MinMaxDist> struct KernelTraversal {
+    static npy_float64
+    run(const ckdtree *self, const KernelParams *params,
+        const ckdtreenode *node, RectRectDistanceTracker<MinMaxDist> *tracker) {
+        return traverse_kernel<MinMaxDist>(self, params, node, tracker);
+    }
+};
+
+
+extern "C" PyObject*
+count_ball_point(const ckdtree *self, const npy_float64 *x,
+                 const npy_float64 r, const npy_float64 p,
+                 const npy_float64 eps, const npy_intp n_queries,
+                 const npy_float64 *weights, const npy_float64 *node_weights,
+                 npy_float64 *results, const int n_jobs)
+{
+    KernelParams params;
+    params.weights = weights;
+    params.node_weights = node_weights;
+    params.centroids = NULL;
+    params.inv2h2 = 0;
+    params.tol = 0;
+
+    /* release the GIL */
+    NPY_BEGIN_ALLOW_THREADS
+    {
+        try {
+            parallel_for(n_queries, n_jobs, 16,
+                [&](npy_intp start, npy_intp stop) {
+                for (npy_intp i=start; i < stop; ++i)
+                    results[i] = aggregate_single_point<CountTraversal>(
+                        self, &params, x + i * self->m, r, p, eps);
+                });
+        }
+        catch(...) {
+            translate_cpp_exception_with_gil();
+        }
+    }
+    /* reacquire the GIL */
+    NPY_END_ALLOW_THREADS
+
+    if (PyErr_Occurred())
+        /* true if a C++ exception was translated */
+        return NULL;
+    else {
+        /* return None if there were no errors */
+        Py_RETURN_NONE;
+    }
+}
+
+
+extern "C" PyObject*
+kernel_sum(const ckdtree *self, const npy_float64 *x,
+           const npy_float64 bandwidth, const npy_float64 p,
+           const npy_float64 atol, const npy_intp n_queries,
+           const npy_float64 *weights, const npy_float64 *node_weights,
+           const npy_float64 *centroids, npy_float64 *results,
+           const int n_jobs)
+{
+    KernelParams params;
+    const npy_float64 total = node_weights[0];
+    params.weights = weights;
+    params.node_weights = node_weights;
+    params.centroids = centroids;
+    params.inv2h2 = 1. / (2. * bandwidth * bandwidth);
+    params.tol = (total > 0) ? atol / total : NPY_INFINITY;
+
+    /* release the GIL */
+    NPY_BEGIN_ALLOW_THREADS
+    {
+        try {
+            parallel_for(n_queries, n_jobs, 16,
+                [&](npy_intp start, npy_intp stop) {
+                for (npy_intp i=start; i < stop; ++i)
+                    results[i] = aggregate_single_point<KernelTraversal>(
+                        self, &params, x + i * self->m, NPY_INFINITY, p, 0.);
+                });
+        }
+        catch(...) {
+            translate_cpp_exception_with_gil();
+        }
+    }
+    /* reacquire the GIL */
+    NPY_END_ALLOW_THREADS
+
+    if (PyErr_Occurred())
+        /* true if a C++ exception was translated */
+        return NULL;
+    else {
+        /* return None if there were no errors */
+        Py_RETURN_NONE;
+    }
+}
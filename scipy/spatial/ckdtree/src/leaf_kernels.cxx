@@ -0,0 +1,290 @@
+#include <Python.h>
+#include "numpy/arrayobject.h"
+
+#include <cmath>
+
+#include "leaf_kernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CKDTREE_HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+
+template <typename T> static inline const T *
+leaf_row(const T *data, const npy_intp *indices, 
+         const npy_intp j, const npy_intp m)
+{
+    return data + (indices ? indices[j] : j) * m;
+}
+
+/*
+ * Scalar kernels
+ * ==============
+ *
+ * The coordinates are accumulated in the same order as the vectorized
+ * kernels, so the results do not depend on the CPU. All kernels are
+ * templated on the dtype of the data; npy_float32 coordinates are
+ * converted to npy_float64 as they are loaded.
+ */
+
+template <typename T> static void
+leaf_p1_scalar(const npy_float64 *x, const T *data,
+               const npy_intp *indices, const npy_intp n, const npy_intp m,
+               npy_float64 *out)
+{
+    for (npy_intp j = 0; j < n; ++j) {
+        const T *y = leaf_row(data, indices, j, m);
+        npy_float64 r = 0;
+        for (npy_intp k = 0; k < m; ++k)
+            r += std::fabs((npy_float64) y[k] - x[k]);
+        out[j] = r;
+    }
+}
+
+template <typename T> static void
+leaf_p2_scalar(const npy_float64 *x, const T *data,
+               const npy_intp *indices, const npy_intp n, const npy_intp m,
+               npy_float64 *out)
+{
+    for (npy_intp j = 0; j < n; ++j) {
+        const T *y = leaf_row(data, indices, j, m);
+        npy_float64 r = 0;
+        for (npy_intp k = 0; k < m; ++k) {
+            npy_float64 d = (npy_float64) y[k] - x[k];
+            r += d * d;
+        }
+        out[j] = r;
+    }
+}
+
+template <typename T> static void
+leaf_pinf_scalar(const npy_float64 *x, const T *data,
+                 const npy_intp *indices, const npy_intp n, const npy_intp m,
+                 npy_float64 *out)
+{
+    for (npy_intp j = 0; j < n; ++j) {
+        const T *y = leaf_row(data, indices, j, m);
+        npy_float64 r = 0;
+        for (npy_intp k = 0; k < m; ++k) {
+            npy_float64 d = std::fabs((npy_float64) y[k] - x[k]);
+            r = (d > r) ? d : r;
+        }
+        out[j] = r;
+    }
+}
+
+static const leaf_kernel_table scalar_kernels = {
+    "scalar",
+    leaf_p1_scalar<npy_float64>, leaf_p2_scalar<npy_float64>,
+    leaf_pinf_scalar<npy_float64>,
+    leaf_p1_scalar<npy_float32>, leaf_p2_scalar<npy_float32>,
+    leaf_pinf_scalar<npy_float32>
+};
+
+
+#ifdef CKDTREE_HAVE_X86_KERNELS
+
+/*
+ * AVX2 kernels
+ * ============
+ *
+ * Four points are processed at a time, one per lane, looping over the
+ * coordinates. Multiplication and addition are not fused, to give the
+ * same results as the scalar kernels.
+ */
+
+#define AVX2_ROWS(j) \
+    const T *y0 = leaf_row(data, indices, j, m); \
+    const T *y1 = leaf_row(data, indices, j + 1, m); \
+    const T *y2 = leaf_row(data, indices, j + 2, m); \
+    const T *y3 = leaf_row(data, indices, j + 3, m);
+
+#define AVX2_DIFF(k) \
+    _mm256_sub_pd(_mm256_set_pd(y3[k], y2[k], y1[k], y0[k]), \
+                  _mm256_set1_pd(x[k]))
+
+template <typename T> __attribute__((target("avx2"))) static void
+leaf_p1_avx2(const npy_float64 *x, const T *data,
+             const npy_intp *indices, const npy_intp n, const npy_intp m,
+             npy_float64 *out)
+{
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    npy_intp j = 0;
+    for (; j + 4 <= n; j += 4) {
+        AVX2_ROWS(j)
+        __m256d r = _mm256_setzero_pd();
+        for (npy_intp k = 0; k < m; ++k)
+            r = _mm256_add_pd(r, _mm256_andnot_pd(sign, AVX2_DIFF(k)));
+        _mm256_storeu_pd(out + j, r);
+    }
+    if (j < n)
+        leaf_p1_scalar(x, indices ? data : data + j * m, 
+                       indices ? indices + j : NULL, n - j, m, out + j);
+}
+
+template <typename T> __attribute__((target("avx2"))) static void
+leaf_p2_avx2(const npy_float64 *x, const T *data,
+             const npy_intp *indices, const npy_intp n, const npy_intp m,
+             npy_float64 *out)
+{
+    npy_intp j = 0;
+    for (; j + 4 <= n; j += 4) {
+        AVX2_ROWS(j)
+        __m256d r = _mm256_setzero_pd();
+        for (npy_intp k = 0; k < m; ++k) {
+            __m256d d = AVX2_DIFF(k);
+            r = _mm256_add_pd(r, _mm256_mul_pd(d, d));
+        }
+        _mm256_storeu_pd(out + j, r);
+    }
+    if (j < n)
+        leaf_p2_scalar(x, indices ? data : data + j * m, 
+                       indices ? indices + j : NULL, n - j, m, out + j);
+}
+
+template <typename T> __attribute__((target("avx2"))) static void
+leaf_pinf_avx2(const npy_float64 *x, const T *data,
+               const npy_intp *indices, const npy_intp n, const npy_intp m,
+               npy_float64 *out)
+{
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    npy_intp j = 0;
+    for (; j + 4 <= n; j += 4) {
+        AVX2_ROWS(j)
+        __m256d r = _mm256_setzero_pd();
+        for (npy_intp k = 0; k < m; ++k)
+            r = _mm256_max_pd(r, _mm256_andnot_pd(sign, AVX2_DIFF(k)));
+        _mm256_storeu_pd(out + j, r);
+    }
+    if (j < n)
+        leaf_pinf_scalar(x, indices ? data : data + j * m, 
+                         indices ? indices + j : NULL, n - j, m, out + j);
+}
+
+static const leaf_kernel_table avx2_kernels = {
+    "avx2",
+    leaf_p1_avx2<npy_float64>, leaf_p2_avx2<npy_float64>,
+    leaf_pinf_avx2<npy_float64>,
+    leaf_p1_avx2<npy_float32>, leaf_p2_avx2<npy_float32>,
+    leaf_pinf_avx2<npy_float32>
+};
+
+/*
+ * AVX-512 kernels
+ * ===============
+ *
+ * As above, with eight points at a time. On many CPUs the 512-bit
+ * instructions lower the clock frequency for a while after they are
+ * executed, which slows down the tree traversal around the leaves. They
+ * only pay off for large blocks, e.g. with a large leafsize, so smaller
+ * blocks are passed on to the AVX2 kernels.
+ */
+
+#define AVX512_MIN_BLOCK 32
+
+#define AVX512_ROWS(j) \
+    AVX2_ROWS(j) \
+    const T *y4 = leaf_row(data, indices, j + 4, m); \
+    const T *y5 = leaf_row(data, indices, j + 5, m); \
+    const T *y6 = leaf_row(data, indices, j + 6, m); \
+    const T *y7 = leaf_row(data, indices, j + 7, m);
+
+#define AVX512_DIFF(k) \
+    _mm512_sub_pd(_mm512_set_pd(y7[k], y6[k], y5[k], y4[k], \
+                                y3[k], y2[k], y1[k], y0[k]), \
+                  _mm512_set1_pd(x[k]))
+
+template <typename T> __attribute__((target("avx512f"))) static void
+leaf_p1_avx512(const npy_float64 *x, const T *data,
+               const npy_intp *indices, const npy_intp n, const npy_intp m,
+               npy_float64 *out)
+{
+    if (n < AVX512_MIN_BLOCK) {
+        leaf_p1_avx2(x, data, indices, n, m, out);
+        return;
+    }
+    npy_intp j = 0;
+    for (; j + 8 <= n; j += 8) {
+        AVX512_ROWS(j)
+        __m512d r = _mm512_setzero_pd();
+        for (npy_intp k = 0; k < m; ++k)
+            r = _mm512_add_pd(r, _mm512_abs_pd(AVX512_DIFF(k)));
+        _mm512_storeu_pd(out + j, r);
+    }
+    if (j < n)
+        leaf_p1_scalar(x, indices ? data : data + j * m, 
+                       indices ? indices + j : NULL, n - j, m, out + j);
+}
+
+template <typename T> __attribute__((target("avx512f"))) static void
+leaf_p2_avx512(const npy_float64 *x, const T *data,
+               const npy_intp *indices, const npy_intp n, const npy_intp m,
+               npy_float64 *out)
+{
+    if (n < AVX512_MIN_BLOCK) {
+        leaf_p2_avx2(x, data, indices, n, m, out);
+        return;
+    }
+    npy_intp j = 0;
+    for (; j + 8 <= n; j += 8) {
+        AVX512_ROWS(j)
+        __m512d r = _mm512_setzero_pd();
+        for (npy_intp k = 0; k < m; ++k) {
+            __m512d d = AVX512_DIFF(k);
+            r = _mm512_add_pd(r, _mm512_mul_pd(d, d));
+        }
+        _mm512_storeu_pd(out + j, r);
+    }
+    if (j < n)
+        leaf_p2_scalar(x, indices ? data : data + j * m, 
+                       indices ? indices + j : NULL, n - j, m, out + j);
+}
+
+template <typename T> __attribute__((target("avx512f"))) static void
+leaf_pinf_avx512(const npy_float64 *x, const T *data,
+                 const npy_intp *indices, const npy_intp n, const npy_intp m,
+                 npy_float64 *out)
+{
+    if (n < AVX512_MIN_BLOCK) {
+        leaf_pinf_avx2(x, data, indices, n, m, out);
+        return;
+    }
+    npy_intp j = 0;
+    for (; j + 8 <= n; j += 8) {
+        AVX512_ROWS(j)
+        __m512d r = _mm512_setzero_pd();
+        for (npy_intp k = 0; k < m; ++k)
+            r = _mm512_max_pd(r, _mm512_abs_pd(AVX512_DIFF(k)));
+        _mm512_storeu_pd(out + j, r);
+    }
+    if (j < n)
+        leaf_pinf_scalar(x, indices ? data : data + j * m, 
+                         indices ? indices + j : NULL, n - j, m, out + j);
+}
+
+static const leaf_kernel_table avx512_kernels = {
+    "avx512f",
+    leaf_p1_avx512<npy_float64>, leaf_p2_avx512<npy_float64>,
+    leaf_pinf_avx512<npy_float64>,
+    leaf_p1_avx512<npy_float32>, leaf_p2_avx512<npy_float32>,
+    leaf_pinf_avx512<npy_float32>
+};
+
+#endif /* CKDTREE_HAVE_X86_KERNELS */
+
+
+static const leaf_kernel_table *
+select_leaf_kernels()
+{
+#ifdef CKDTREE_HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return &avx512_kernels;
+    if (__builtin_cpu_supports("avx2"))
+        return &avx2_kernels;
+#endif
+    return &scalar_kernels;
+}
+
+const leaf_kernel_table *leaf_kernels = select_leaf_kernels();
@@ -0,0 +1,93 @@
+#ifndef CKDTREE_LEAF_KERNELS
+#define CKDTREE_LEAF_KERNELS
+
+#include <Python.h>
+#include "numpy/arrayobject.h"
+
+/*
+ * Leaf kernels
+ * ============
+ *
+ * The brute-force scans at the leaves compute the distances from a single
+ * point x to a block of n points. Row j of the block is
+ *
+ *     data + indices[j] * m    if indices is not NULL, or
+ *     data + j * m             if the block is contiguous.
+ *
+ * The points of the block are stored as npy_float64 or npy_float32,
+ * depending on the dtype of the tree; x and the distances are always
+ * npy_float64. The distances are returned in out as distance**p for
+ * p = 1 and p = 2, and as the maximum coordinate difference for
+ * p = infinity, as computed by the distance_p methods of the non-periodic
+ * metrics.
+ *
+ * The kernels are selected once when the module is loaded, based on the
+ * instruction sets supported by the CPU. With GCC-compatible compilers on
+ * x86 there are AVX2 and AVX-512 versions which compute the distances to
+ * 4 or 8 points at a time. The scalar versions are used everywhere else.
+ *
+ * In low dimensions the kernels are slower than computing one distance
+ * at a time with an early exit once the upper bound is exceeded, so the
+ * metrics only use them from CKDTREE_LEAF_KERNEL_MIN_DIM dimensions on.
+ */
+
+#define CKDTREE_LEAF_BLOCK 64
+#ifndef CKDTREE_LEAF_KERNEL_MIN_DIM
+#define CKDTREE_LEAF_KERNEL_MIN_DIM 8
+#endif
+
+/*
+ * Leaves of the k-nearest neighbor queries are scanned with the kernels
+ * only from this many points on, see query_single_point.
+ */
+#define CKDTREE_LEAF_KERNEL_MIN_POINTS 32
+
+typedef void (*leaf_kernel_t)(const npy_float64 *x, 
+                              const npy_float64 *data,
+                              const npy_intp *indices,
+                              const npy_intp n, 
+                              const npy_intp m,
+                              npy_float64 *out);
+
+typedef void (*leaf_kernel_f32_t)(const npy_float64 *x, 
+                                  const npy_float32 *data,
+                                  const npy_intp *indices,
+                                  const npy_intp n, 
+                                  const npy_intp m,
+                                  npy_float64 *out);
+
+struct leaf_kernel_table {
+    const char        *name;
+    leaf_kernel_t     p1;
+    leaf_kernel_t     p2;
+    leaf_kernel_t     pinf;
+    leaf_kernel_f32_t p1_f32;
+    leaf_kernel_f32_t p2_f32;
+    leaf_kernel_f32_t pinf_f32;
+};
+
+extern const leaf_kernel_table *leaf_kernels;
+
+/* overloads on the dtype of the tree, for the templated metrics */
+
+#define CKDTREE_LEAF_KERNEL_OVERLOADS(name, f64, f32) \
+    inline void \
+    name(const npy_float64 *x, const npy_float64 *data, \
+         const npy_intp *indices, const npy_intp n, const npy_intp m, \
+         npy_float64 *out) { \
+        leaf_kernels->f64(x, data, indices, n, m, out); \
+    } \
+    inline void \
+    name(const npy_float64 *x, const npy_float32 *data, \
+         const npy_intp *indices, const npy_intp n, const npy_intp m, \
+         npy_float64 *out) { \
+        leaf_kernels->f32(x, data, indices, n, m, out); \
+    }
+
+CKDTREE_LEAF_KERNEL_OVERLOADS(leaf_kernel_p1, p1, p1_f32)
+CKDTREE_LEAF_KERNEL_OVERLOADS(leaf_kernel_p2, p2, p2_f32)
+CKDTREE_LEAF_KERNEL_OVERLOADS(leaf_kernel_pinf, pinf, pinf_f32)
+
+#undef CKDTREE_LEAF_KERNEL_OVERLOADS
+
+#endif
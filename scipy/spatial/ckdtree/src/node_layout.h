@@ -0,0 +1,110 @@
+#ifndef CKDTREE_NODE_LAYOUT
+#define CKDTREE_NODE_LAYOUT
+
+/*
+ * Node layouts
+ * ============
+ *
+ * The single tree queries are templated on the layout of the tree, so
+ * the same traversal code walks either the standard nodes or the compact
+ * nodes. A layout provides the root node, the children of an inner node,
+ * and the coordinates of the i-th point in tree order, i.e. of the point
+ * with index raw_indices[i]. leaf_block returns the points from the i-th
+ * onwards in the form expected by the leaf kernels (see leaf_kernels.h).
+ * The layouts are templated on the dtype T of the data.
+ *
+ * StandardLayout walks the ckdtreenode array and reads the points
+ * from the data array through raw_indices. ReorderedLayout walks the same
+ * nodes, but reads the points from a copy of the data stored in tree
+ * order, so the points of a leaf are scanned sequentially.
+ *
+ * CompactLayout walks the 32-byte ckdtree_compact_node array, where the
+ * less child of a node is the next node in memory. The points are read
+ * from the tree ordered copy of the data as well.
+ */
+
+template <typename T>
+struct StandardLayout {
+    
+    typedef ckdtreenode node_type;
+    
+    static inline const ckdtreenode *
+    root(const ckdtree *self) {
+        return self->ctree;
+    }
+    
+    static inline const ckdtreenode *
+    less(const ckdtree *self, const ckdtreenode *node) {
+        return node_less(self, node);
+    }
+    
+    static inline const ckdtreenode *
+    greater(const ckdtree *self, const ckdtreenode *node) {
+        return node_greater(self, node);
+    }
+    
+    static inline const T *
+    point(const ckdtree *self, const npy_intp i) {
+        return tree_points<T>(self) + self->raw_indices[i] * self->m;
+    }
+    
+    static inline void
+    leaf_block(const ckdtree *self, const npy_intp i,
+               const T **data, const npy_intp **indices) {
+        *data = tree_points<T>(self);
+        *indices = self->raw_indices + i;
+    }
+};
+
+
+template <typename T>
+struct ReorderedLayout : public StandardLayout<T> {
+    
+    static inline const T *
+    point(const ckdtree *self, const npy_intp i) {
+        return tree_ordered_points<T>(self) + i * self->m;
+    }
+    
+    static inline void
+    leaf_block(const ckdtree *self, const npy_intp i,
+               const T **data, const npy_intp **indices) {
+        *data = tree_ordered_points<T>(self) + i * self->m;
+        *indices = NULL;
+    }
+};
+
+
+template <typename T>
+struct CompactLayout {
+    
+    typedef ckdtree_compact_node node_type;
+    
+    static inline const ckdtree_compact_node *
+    root(const ckdtree *self) {
+        return self->compact_tree;
+    }
+    
+    static inline const ckdtree_compact_node *
+    less(const ckdtree * /* self */, const ckdtree_compact_node *node) {
+        return node + 1;
+    }
+    
+    static inline const ckdtree_compact_node *
+    greater(const ckdtree *self, const ckdtree_compact_node *node) {
+        return self->compact_tree + node->greater;
+    }
+    
+    static inline const T *
+    point(const ckdtree *self, const npy_intp i) {
+        return tree_ordered_points<T>(self) + i * self->m;
+    }
+    
+    static inline void
+    leaf_block(const ckdtree *self, const npy_intp i,
+               const T **data, const npy_intp **indices) {
+        *data = tree_ordered_points<T>(self) + i * self->m;
+        *indices = NULL;
+    }
+};
+
+#endif
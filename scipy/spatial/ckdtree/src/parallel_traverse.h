@@ -0,0 +1,136 @@
+#ifndef CKDTREE_PARALLEL_TRAVERSE
+#define CKDTREE_PARALLEL_TRAVERSE
+
+#include <vector>
+#include <cstring>
+#include "rectangle.h"
+#include "thread_pool.h"
+
+/*
+ * Task-parallel dual-tree traversal
+ * =================================
+ *
+ * The result of a dual-tree traversal over a pair of nodes is the combined
+ * result over the pairs of their children. Near the top of the two trees
+ * we therefore replace the root pair by a frontier of independent node
+ * pairs, each carrying its own copy of the distance tracker positioned at
+ * that pair. The pairs are then traversed concurrently, each with its own
+ * result accumulator, and the accumulators are reduced at the end.
+ */
+
+template <typename MinMaxDist>
+struct traverse_task {
+    const ckdtreenode *node1;
+    const ckdtreenode *node2;
+    RectRectDistanceTracker<MinMaxDist> tracker;
+
+    traverse_task(const ckdtreenode *_node1, const ckdtreenode *_node2,
+                  const RectRectDistanceTracker<MinMaxDist> &_tracker)
+        : node1(_node1), node2(_node2), tracker(_tracker) {};
+};
+
+
+template <typename MinMaxDist> static inline void
+add_child_task(const ckdtree *self, const ckdtree *other,
+               std::vector<traverse_task<MinMaxDist> > *tasks,
+               const traverse_task<MinMaxDist> &parent,
+               const npy_intp direction1, const npy_intp direction2)
+{
+    /* direction 0 means that the node is not split */
+    const ckdtreenode *node1 = parent.node1;
+    const ckdtreenode *node2 = parent.node2;
+    tasks->push_back(parent);
+    traverse_task<MinMaxDist> &t = tasks->back();
+    if (direction1) {
+        t.tracker.push(1, direction1, node1->split_dim, node1->split);
+        t.node1 = (direction1 == LESS) ? node_less(self, node1) 
+                                       : node_greater(self, node1);
+    }
+    if (direction2) {
+        t.tracker.push(2, direction2, node2->split_dim, node2->split);
+        t.node2 = (direction2 == LESS) ? node_less(other, node2) 
+                                       : node_greater(other, node2);
+    }
+}
+
+
+/*
+ * Split the traversal into at least n_tasks node pairs if possible.
+ * The first node of each pair is in self, the second one in other.
+ *
+ * If split_other is false, only the nodes of the first tree are split.
+ * The tasks then cover disjoint sets of points of the first tree.
+ *
+ * If same_tree is true, a pair of identical nodes (n, n) is split into
+ * (n.less, n.less), (n.less, n.greater) and (n.greater, n.greater), as
+ * required by the traversal of the unordered pairs within one tree.
+ */
+template <typename MinMaxDist> static void
+split_traversal(const ckdtree *self, const ckdtree *other,
+                std::vector<traverse_task<MinMaxDist> > *tasks,
+                const npy_intp n_tasks, const int split_other,
+                const int same_tree)
+{
+    std::vector<traverse_task<MinMaxDist> > next;
+
+    while ((npy_intp) tasks->size() < n_tasks) {
+        int split = 0;
+        next.clear();
+        for (npy_intp i = 0; i < (npy_intp) tasks->size(); ++i) {
+            const traverse_task<MinMaxDist> &t = (*tasks)[i];
+            const int inner1 = (t.node1->split_dim != -1);
+            const int inner2 = split_other && (t.node2->split_dim != -1);
+            if (inner1 && inner2) {
+                add_child_task(self, other, &next, t, LESS, LESS);
+                add_child_task(self, other, &next, t, LESS, GREATER);
+                if (!(same_tree && t.node1 == t.node2))
+                    add_child_task(self, other, &next, t, GREATER, LESS);
+                add_child_task(self, other, &next, t, GREATER, GREATER);
+            }
+            else if (inner1) {
+                add_child_task(self, other, &next, t, LESS, 0);
+                add_child_task(self, other, &next, t, GREATER, 0);
+            }
+            else if (inner2) {
+                add_child_task(self, other, &next, t, 0, LESS);
+                add_child_task(self, other, &next, t, 0, GREATER);
+            }
+            else {
+                next.push_back(t);
+                continue;
+            }
+            split = 1;
+        }
+        tasks->swap(next);
+        if (!split)
+            break;
+    }
+}
+
+
+/*
+ * Concatenate the results of the tasks into one buffer, in the order of
+ * the tasks, which does not depend on the number of threads.
+ */
+template <typename T> static void
+concatenate_task_results(std::vector<std::vector<T> > &parts,
+                         std::vector<T> *results, const int n_jobs)
+{
+    const npy_intp nparts = parts.size();
+    std::vector<npy_intp> offsets(nparts + 1);
+    offsets[0] = results->size();
+    for (npy_intp i = 0; i < nparts; ++i)
+        offsets[i + 1] = offsets[i] + parts[i].size();
+    results->resize(offsets[nparts]);
+    parallel_for(nparts, n_jobs, 1,
+        [&](npy_intp start, npy_intp stop) {
+        for (npy_intp i = start; i < stop; ++i) {
+            if (!parts[i].empty())
+                std::memcpy(&(*results)[offsets[i]], &parts[i][0], 
+                            parts[i].size() * sizeof(T));
+            std::vector<T>().swap(parts[i]);
+        }
+        });
+}
+
+#endif
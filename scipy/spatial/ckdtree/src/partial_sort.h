@@ -19,8 +19,8 @@ index_swap(npy_intp *arr, npy_intp i1, npy_intp i2)
     arr[i2] = tmp;
 }
 
-static void 
-partition_node_indices(const npy_float64 *data,
+template <typename T> static void 
+partition_node_indices(const T *data,
                        npy_intp *node_indices,
                        npy_intp split_dim,
                        npy_intp split_index,
@@ -44,7 +44,7 @@ partition_node_indices(const npy_float64 *data,
      *
      * Parameters
      * ----------
-     * data : double pointer
+     * data : double or float pointer
      *    Pointer to a 2D array of the training data, of shape [N, n_features].
      *    N must be greater than any of the values in node_indices.
      * node_indices : int pointer
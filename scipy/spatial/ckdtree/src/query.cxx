@@ -26,6 +26,8 @@
 #include "ckdtree_methods.h"
 #include "rectangle.h"
 #include "cpp_exc.h"
+#include "thread_pool.h"
+#include "node_layout.h"
 
 /*
  * Priority queue
@@ -116,10 +118,12 @@ struct heap {
  * ========
  */
  
+template <typename Node>
 struct nodeinfo {
     nodeinfo           *next;
     nodeinfo           *prev;
-    const ckdtreenode  *node;
+    const Node         *node;
+    const ckdtree      *tree;
     npy_intp     m;
     npy_float64        buf[1]; // the good old struct hack       
     /* accessors to 'packed' attributes */
@@ -139,6 +143,7 @@ struct nodeinfo {
  * ================================
  */
  
+template <typename Node>
 struct nodeinfo_pool {
 
     std::vector<char*> pool;
@@ -150,7 +155,7 @@ struct nodeinfo_pool {
     char *arena_ptr;
     
     nodeinfo_pool(npy_intp m) {
-        alloc_size = sizeof(nodeinfo) + (3 * m -1)*sizeof(npy_float64);
+        alloc_size = sizeof(nodeinfo<Node>) + (3 * m -1)*sizeof(npy_float64);
         alloc_size = 64*(alloc_size/64)+64;
         arena_size = 4096*((64*alloc_size)/4096)+4096;
         arena = new char[arena_size];
@@ -164,8 +169,8 @@ struct nodeinfo_pool {
             delete [] pool[i];
     }
     
-    inline nodeinfo *allocate() {
-        nodeinfo *ni;
+    inline nodeinfo<Node> *allocate() {
+        nodeinfo<Node> *ni;
         npy_uintp m1 = (npy_uintp)arena_ptr;
         npy_uintp m0 = (npy_uintp)arena;
         if ((arena_size-(npy_intp)(m1-m0))<alloc_size) {
@@ -173,7 +178,7 @@ struct nodeinfo_pool {
             arena_ptr = arena;
             pool.push_back(arena);
         }
-        ni = (nodeinfo*)arena_ptr;
+        ni = (nodeinfo<Node>*)arena_ptr;
         ni->m = m;
         arena_ptr += alloc_size;
         return ni;
@@ -192,10 +197,102 @@ inline const npy_float64 adjust_min_distance(const npy_float64 min_distance,
     }
 }
 
-/* k-nearest neighbor search for a single point x */
+/*
+ * Minimum distance between x and the cell of a nodeinfo. It is only needed 
+ * for the metrics which are not separable over the dimensions, the others 
+ * update the minimum distance from the side distances.
+ */
+template <typename MinMaxDist, bool separable = MinMaxDist::separable>
+struct cell_distance {
+    template <typename Info> static inline npy_float64
+    min_distance(const ckdtree * /* tree */, const npy_float64 * /* x */,
+                 Info * /* inf */) {
+        return 0.;
+    }
+};
+
 template <typename MinMaxDist>
+struct cell_distance<MinMaxDist, false> {
+    template <typename Info> static inline npy_float64
+    min_distance(const ckdtree *tree, const npy_float64 *x, Info *inf) {
+        npy_float64 min, max;
+        MinMaxDist::rect_rect_bounds(tree, x, x, inf->mins(), inf->maxes(),
+                                     &min, &max);
+        return min;
+    }
+};
+
+inline bool
+neighbors_contain(const heap &neighbors, const npy_intp index)
+{
+    for (npy_intp i=0; i<neighbors.n; ++i)
+        if (neighbors._heap[i].contents.intdata == index)
+            return true;
+    return false;
+}
+
+/*
+ * Allocate and set up the nodeinfo of the root of tree for the search for
+ * x, and compute the minimum distance between the two. The periodic box is
+ * the one of self.
+ */
+template <typename MinMaxDist, typename Layout>
+static nodeinfo<typename Layout::node_type> *
+root_nodeinfo(const ckdtree *tree, const ckdtree *self,
+              nodeinfo_pool<typename Layout::node_type> &nipool,
+              const npy_float64 *x, const npy_float64 p,
+              npy_float64 *min_distance)
+{
+    nodeinfo<typename Layout::node_type> *inf = nipool.allocate();
+    const npy_intp m = tree->m;
+    npy_intp i;
+    
+    inf->tree = tree;
+    inf->node = Layout::root(tree);
+    
+    for (i=0; i<m; ++i) {
+        inf->mins()[i] = tree->raw_mins[i];
+        inf->maxes()[i] = tree->raw_maxes[i];
+        npy_float64 hb, fb;
+        if(self->raw_boxsize_data) {
+            fb = self->raw_boxsize_data[i];
+            hb = self->raw_boxsize_data[m + i];
+        } else {
+            hb = fb = 0;
+        }
+        inf->side_distances()[i] = side_distance_from_min_max(
+            x[i], inf->mins()[i], inf->maxes()[i], 
+            p, hb, fb);
+    }
+    
+    /* compute first distance */
+    npy_float64 d = 0.;
+    for (i=0; i<m; ++i) {
+        if (NPY_UNLIKELY(ckdtree_isinf(p)))
+            d = dmax(d, inf->side_distances()[i]);
+        else
+            d += inf->side_distances()[i];
+    }
+    if (!MinMaxDist::separable)
+        d = cell_distance<MinMaxDist>::min_distance(tree, x, inf);
+    
+    *min_distance = d;
+    return inf;
+}
+
+/*
+ * k-nearest neighbor search for a single point x
+ *
+ * The search visits the cells in the order of their distance to x (best bin
+ * first). It is exact unless eps > 0, or max_leaves > 0, in which case it
+ * stops after scanning max_leaves leaves. Several trees over the same points,
+ * e.g. randomized ones, can be searched with a common priority queue; the
+ * leaf budget is then shared between them.
+ */
+template <typename MinMaxDist, typename Layout>
 static void 
-query_single_point(const ckdtree *self, 
+query_single_point(const ckdtree * const *trees,
+                   const npy_intp ntrees,
                    npy_float64   *result_distances, 
                    npy_intp      *result_indices, 
                    const npy_float64  *x, 
@@ -204,10 +301,14 @@ query_single_point(const ckdtree *self,
                    const npy_intp     kmax, 
                    const npy_float64  eps, 
                    const npy_float64  p, 
-                   npy_float64  distance_upper_bound)
+                   npy_float64  distance_upper_bound,
+                   const npy_intp     max_leaves)
 {                
+    typedef typename Layout::node_type node_type;
+    typedef nodeinfo<node_type> info_type;
+
     /* memory pool to allocate and automatically reclaim nodeinfo structs */
-    nodeinfo_pool nipool(self->m);
+    nodeinfo_pool<node_type> nipool(trees[0]->m);
     
     /*
      * priority queue for chasing nodes
@@ -227,10 +328,12 @@ query_single_point(const ckdtree *self,
      */
     heap neighbors(kmax);
     
-    npy_intp      i;
+    npy_intp      i, t;
+    npy_intp      nleaves = 0;
+    const ckdtree *self = trees[0];
     const npy_intp m = self->m;
-    nodeinfo      *inf;
-    nodeinfo      *inf2;
+    info_type     *inf;
+    info_type     *inf2;
     npy_float64   d;
     npy_float64   epsfac;
     npy_float64   min_distance;
@@ -238,36 +341,20 @@ query_single_point(const ckdtree *self,
     npy_float64   inf2_min_distance;
     npy_float64   inf_old_side_distance;
     heapitem      it, it2, neighbor;
-    const ckdtreenode   *node;
-    const ckdtreenode   *inode;
-    
-    /* set up first nodeifo */
-    inf = nipool.allocate();
-    inf->node = self->ctree;
-    
-    for (i=0; i<m; ++i) {
-        inf->mins()[i] = self->raw_mins[i];
-        inf->maxes()[i] = self->raw_maxes[i];
-        npy_float64 hb, fb;
-        if(self->raw_boxsize_data) {
-            fb = self->raw_boxsize_data[i];
-            hb = self->raw_boxsize_data[m + i];
-        } else {
-            hb = fb = 0;
-        }
-        inf->side_distances()[i] = side_distance_from_min_max(
-            x[i], inf->mins()[i], inf->maxes()[i], 
-            p, hb, fb);
-    }
+    const node_type     *node;
+    const node_type     *inode;
     
-    /* compute first distance */
-    min_distance = 0.;
-    for (i=0; i<m; ++i) {
-        if (NPY_UNLIKELY(ckdtree_isinf(p)))
-            min_distance = dmax(min_distance,inf->side_distances()[i]);
-        else
-            min_distance += inf->side_distances()[i];
+    /* 
+     * set up the nodeinfo of the roots; we start with the first tree and
+     * queue the others
+     */
+    for (t=ntrees-1; t>0; --t) {
+        it.contents.ptrdata = (void*) root_nodeinfo<MinMaxDist, Layout>(
+            trees[t], self, nipool, x, p, &it.priority);
+        q.push(it);
     }
+    inf = root_nodeinfo<MinMaxDist, Layout>(trees[0], self, nipool, x, p,
+                                             &min_distance);
     
     /* fiddle approximation factor */
     if (NPY_LIKELY(p == 2.0)) {
@@ -296,23 +383,62 @@ query_single_point(const ckdtree *self,
 
             /* brute-force */
             {
+                const ckdtree *tree = inf->tree;
                 const npy_intp start_idx = node->start_idx;
                 const npy_intp end_idx = node->end_idx;
-                const npy_float64 *data = self->raw_data;
-                const npy_intp *indices = self->raw_indices;
+                const npy_intp *indices = tree->raw_indices;
+                npy_float64 dbuf[CKDTREE_LEAF_BLOCK];
                 
-                prefetch_datapoint(data+indices[start_idx]*m, m);
-                if (start_idx < end_idx)
-                    prefetch_datapoint(data+indices[start_idx+1]*m, m);
+                /*
+                 * One point at a time, with the current upper bound and
+                 * prefetching, unless the leaf kernels are faster: for
+                 * p = 1 and infinity from CKDTREE_LEAF_KERNEL_MIN_DIM
+                 * dimensions and CKDTREE_LEAF_KERNEL_MIN_POINTS points on.
+                 * For p = 2 the scalar loop was faster in all cases
+                 * measured (benchmarks/benchmarks/spatial.py:LeafScan).
+                 */
+                const bool by_point = (m < CKDTREE_LEAF_KERNEL_MIN_DIM ||
+                    p == 2.0 ||
+                    end_idx - start_idx < CKDTREE_LEAF_KERNEL_MIN_POINTS);
                 
-                for (i=start_idx; i<end_idx; ++i) {
-                       
-                    if (i < end_idx-2)
-                        prefetch_datapoint(data+indices[i+2]*m, m);
+                if (by_point) {
+                    prefetch_datapoint(Layout::point(tree, start_idx), m);
+                    if (start_idx < end_idx - 1)
+                        prefetch_datapoint(Layout::point(tree, start_idx+1), m);
+                }
                 
-                    d = MinMaxDist::distance_p(self, data+indices[i]*m, x, p, m, distance_upper_bound);
+                for (i=start_idx; i<end_idx; ++i) {
+                    
+                    if (by_point) {
+                        if (i < end_idx-2)
+                            prefetch_datapoint(Layout::point(tree, i+2), m);
+                        d = MinMaxDist::distance_p(tree, Layout::point(tree, i),
+                            x, p, m, distance_upper_bound);
+                    }
+                    else {
+                        if ((i - start_idx) % CKDTREE_LEAF_BLOCK == 0) {
+                            /* 
+                             * distances to the next block of points, against
+                             * the upper bound after the previous block
+                             */
+                            const typename MinMaxDist::coord_type *bdata;
+                            const npy_intp *bindices;
+                            npy_intp nb = end_idx - i;
+                            if (nb > CKDTREE_LEAF_BLOCK)
+                                nb = CKDTREE_LEAF_BLOCK;
+                            Layout::leaf_block(tree, i, &bdata, &bindices);
+                            MinMaxDist::leaf_distances_p(tree, x, bdata, 
+                                bindices, nb, p, m, distance_upper_bound, dbuf);
+                        }
+                        d = dbuf[(i - start_idx) % CKDTREE_LEAF_BLOCK];
+                    }
 
-                    if (d < distance_upper_bound) {
+                    if (d < distance_upper_bound &&
+                            !ckdtree_is_deleted(tree, indices[i])) {
+                        /* the other trees may have found the point */
+                        if (ntrees > 1 && 
+                                neighbors_contain(neighbors, indices[i]))
+                            continue;
                         /* replace furthest neighbor */
                         if (neighbors.n == kmax)
                               neighbors.remove();
@@ -327,13 +453,17 @@ query_single_point(const ckdtree *self,
                 }
             }
             /* done with this node, get another */                
+            if (max_leaves > 0 && ++nleaves >= max_leaves) {
+                /* out of budget */
+                break;
+            }
             if (q.n == 0) {
                 /* no more nodes to visit */
                 break;
             } 
             else {
                 it = q.pop();
-                inf = (nodeinfo*)(it.contents.ptrdata);
+                inf = (info_type*)(it.contents.ptrdata);
                 min_distance = it.priority;
             }
             
@@ -353,12 +483,14 @@ query_single_point(const ckdtree *self,
                 break;
             }
             inf2 = nipool.allocate();
+            inf2->tree = inf->tree;
 
             inf_old_side_distance = inf->side_distances()[split_dim];
 
             // set up children for searching
             // inf2 will be pushed to the queue
-            if (NPY_LIKELY(self->raw_boxsize_data == NULL)) {
+            if (NPY_LIKELY(self->raw_boxsize_data == NULL && 
+                           MinMaxDist::separable)) {
                 std::memcpy(inf2->side_distances(), inf->side_distances(), sizeof(npy_float64) * ( m)); 
                 /*
                  * non periodic : the 'near' node is know from the
@@ -369,11 +501,11 @@ query_single_point(const ckdtree *self,
                  * we only recalculate the distance of 'far' later.
                  */
                 if (x[split_dim] < split) {
-                    inf->node = inode->less;
-                    inf2->node = inode->greater;
+                    inf->node = Layout::less(inf->tree, inode);
+                    inf2->node = Layout::greater(inf->tree, inode);
                 } else {
-                    inf->node = inode->greater;
-                    inf2->node = inode->less;
+                    inf->node = Layout::greater(inf->tree, inode);
+                    inf2->node = Layout::less(inf->tree, inode);
                }
 
                 inf_min_distance = min_distance;
@@ -385,6 +517,15 @@ query_single_point(const ckdtree *self,
                     inf2->side_distances()[split_dim] = std::pow(dabs(tmp), p);
                 }
              
+            } else if (!MinMaxDist::separable) {
+                std::memcpy(inf2->buf, inf->buf, sizeof(npy_float64) * (3 * m)); 
+                /* the distances of both children are recomputed */
+                inf->maxes()[split_dim] = split;
+                inf->node = Layout::less(inf->tree, inode);
+                inf_min_distance = cell_distance<MinMaxDist>::min_distance(
+                    inf->tree, x, inf);
+                inf2->mins()[split_dim] = split;
+                inf2->node = Layout::greater(inf->tree, inode);
             } else {
                 std::memcpy(inf2->buf, inf->buf, sizeof(npy_float64) * (3 * m)); 
                 /* 
@@ -392,7 +533,7 @@ query_single_point(const ckdtree *self,
                  * thus re-claculate inf.
                  */
                 inf->maxes()[split_dim] = split;
-                inf->node = inode->less;
+                inf->node = Layout::less(inf->tree, inode);
                 inf->side_distances()[split_dim] = 
                     side_distance_from_min_max(
                         x[split_dim],
@@ -408,7 +549,7 @@ query_single_point(const ckdtree *self,
                             p);
 
                 inf2->mins()[split_dim] = split;
-                inf2->node = inode->greater;
+                inf2->node = Layout::greater(inf->tree, inode);
                 inf2->side_distances()[split_dim] = 
                     side_distance_from_min_max(
                         x[split_dim],
@@ -424,10 +565,14 @@ query_single_point(const ckdtree *self,
              * one side distance changes
              * we can adjust the minimum distance without recomputing
              */
-            inf2_min_distance = adjust_min_distance(min_distance, 
-                        inf_old_side_distance, 
-                        inf2->side_distances()[split_dim],
-                        p);
+            if (MinMaxDist::separable)
+                inf2_min_distance = adjust_min_distance(min_distance, 
+                            inf_old_side_distance, 
+                            inf2->side_distances()[split_dim],
+                            p);
+            else
+                inf2_min_distance = cell_distance<MinMaxDist>::min_distance(
+                    inf2->tree, x, inf2);
 
             /* Ensure inf is closer than inf2 */
             if (inf_min_distance > inf2_min_distance) {
@@ -437,7 +582,7 @@ query_single_point(const ckdtree *self,
                     inf_min_distance = tmp;
                 }
                 {   
-                    nodeinfo *tmp; 
+                    info_type *tmp; 
                     tmp = inf; 
                     inf = inf2; 
                     inf2 = tmp;
@@ -464,28 +609,42 @@ query_single_point(const ckdtree *self,
 
         }
     }
-    /* fill output arrays with sorted neighbors */
-    int j = nk - 1;
-    for (i=neighbors.n-1; i>=0; --i) {
-        neighbor = neighbors.pop();
-        if(i + 1 != k[j]) continue;
-
-        result_indices[j] = neighbor.contents.intdata;
+    /*
+     * sort the neighbors by popping the heap, each popped neighbor goes
+     * into the slot the heap has just given up
+     */
+    const npy_intp nnb = neighbors.n;
+    for (i=nnb-1; i>=0; --i) {
+        heapitem it = neighbors.pop();
+        neighbors._heap[i] = it;
+    }
+    const heapitem *sorted_neighbors = &neighbors._heap[0];
+
+    /* fill output arrays, missing neighbors have infinite distance and
+     * index n */
+    for (i=0; i<nk; ++i) {
+        if (NPY_UNLIKELY(k[i] > nnb)) {
+            result_distances[i] = NPY_INFINITY;
+            result_indices[i] = self->n;
+            continue;
+        }
+        neighbor = sorted_neighbors[k[i] - 1];
+        result_indices[i] = neighbor.contents.intdata;
         if (NPY_LIKELY(p == 2.0))
-            result_distances[j] = std::sqrt(-neighbor.priority);
+            result_distances[i] = std::sqrt(-neighbor.priority);
         else if ((p == 1.) || (ckdtree_isinf(p)))
-            result_distances[j] = -neighbor.priority;
+            result_distances[i] = -neighbor.priority;
         else
-            result_distances[j] = std::pow((-neighbor.priority),(1./p));
-        --j;
+            result_distances[i] = std::pow((-neighbor.priority),(1./p));
     }
-
 }
 
 /* Query n points for their k nearest neighbors */
 
 extern "C" PyObject*
 query_knn(const ckdtree      *self, 
+          const ckdtree * const *others,
+          const npy_intp     nothers,
           npy_float64        *dd, 
           npy_intp           *ii, 
           const npy_float64  *xx,
@@ -495,49 +654,74 @@ query_knn(const ckdtree      *self,
           const npy_intp     kmax, 
           const npy_float64  eps, 
           const npy_float64  p, 
-          const npy_float64  distance_upper_bound)
+          const npy_float64  distance_upper_bound,
+          const npy_intp     max_leaves,
+          const int          n_jobs)
 {
+#define DISPATCH(kls) { \
+        if (self->compact_tree) \
+            query_single_point<kls, CompactLayout<kls::coord_type> >(trees, ntrees, dd_row, ii_row, xx_row, k, nk, kmax, eps, p, distance_upper_bound, max_leaves); \
+        else if (self->raw_tree_data) \
+            query_single_point<kls, ReorderedLayout<kls::coord_type> >(trees, ntrees, dd_row, ii_row, xx_row, k, nk, kmax, eps, p, distance_upper_bound, max_leaves); \
+        else \
+            query_single_point<kls, StandardLayout<kls::coord_type> >(trees, ntrees, dd_row, ii_row, xx_row, k, nk, kmax, eps, p, distance_upper_bound, max_leaves); \
+    }
+
 #define HANDLE(cond, kls) \
     if(cond) { \
-        query_single_point<kls>(self, dd_row, ii_row, xx_row, k, nk, kmax, eps, p, distance_upper_bound); \
+        if (ckdtree_is_float32(self)) \
+            DISPATCH(kls##F32) \
+        else \
+            DISPATCH(kls) \
     } else
 
-    npy_intp m = self->m;
-    npy_intp i;
+    const npy_intp m = self->m;
     
     /* release the GIL */
     NPY_BEGIN_ALLOW_THREADS
     {
         try {
-            if(NPY_LIKELY(!self->raw_boxsize_data)) {
-                for (i=0; i<n; ++i) {
-                    npy_float64 *dd_row = dd + (i*nk);
-                    npy_intp *ii_row = ii + (i*nk);
-                    const npy_float64 *xx_row = xx + (i*m);                
-                    HANDLE(NPY_LIKELY(p == 2), MinkowskiDistP2)
-                    HANDLE(p == 1, MinkowskiDistP1)
-                    HANDLE(ckdtree_isinf(p), MinkowskiDistPinf)
-                    HANDLE(1, MinkowskiDistPp) 
-                    {}
-                }    
-            } else {
-                std::vector<npy_float64> row(m);
-                npy_float64 * xx_row = &row[0];
-                int j;
-                for (i=0; i<n; ++i) {
-                    npy_float64 *dd_row = dd + (i*nk);
-                    npy_intp *ii_row = ii + (i*nk);
-                    const npy_float64 *old_xx_row = xx + (i*m);                
-                    for(j=0; j<m; ++j) {
-                        xx_row[j] = _wrap(old_xx_row[j], self->raw_boxsize_data[j]);
-                    }
-                    HANDLE(NPY_LIKELY(p == 2), BoxMinkowskiDistP2)
-                    HANDLE(p == 1, BoxMinkowskiDistP1)
-                    HANDLE(ckdtree_isinf(p), BoxMinkowskiDistPinf)
-                    HANDLE(1, BoxMinkowskiDistPp) {}
-                }    
-
-            }
+            /* 
+             * the other trees index the same points with the same layout 
+             * and dtype, this is checked by the caller
+             */
+            std::vector<const ckdtree*> tree_list(1, self);
+            tree_list.insert(tree_list.end(), others, others + nothers);
+            const ckdtree * const *trees = &tree_list[0];
+            const npy_intp ntrees = tree_list.size();
+
+            parallel_for(n, n_jobs, 16,
+                [&](npy_intp start, npy_intp stop) {
+                if(NPY_LIKELY(!self->raw_boxsize_data)) {
+                    for (npy_intp i=start; i<stop; ++i) {
+                        npy_float64 *dd_row = dd + (i*nk);
+                        npy_intp *ii_row = ii + (i*nk);
+                        const npy_float64 *xx_row = xx + (i*m);                
+                        HANDLE(self->raw_metric != NULL, CallbackDist)
+                        HANDLE(NPY_LIKELY(p == 2), MinkowskiDistP2)
+                        HANDLE(p == 1, MinkowskiDistP1)
+                        HANDLE(ckdtree_isinf(p), MinkowskiDistPinf)
+                        HANDLE(1, MinkowskiDistPp) 
+                        {}
+                    }    
+                } else {
+                    std::vector<npy_float64> row(m);
+                    npy_float64 * xx_row = &row[0];
+                    int j;
+                    for (npy_intp i=start; i<stop; ++i) {
+                        npy_float64 *dd_row = dd + (i*nk);
+                        npy_intp *ii_row = ii + (i*nk);
+                        const npy_float64 *old_xx_row = xx + (i*m);                
+                        for(j=0; j<m; ++j) {
+                            xx_row[j] = _wrap(old_xx_row[j], self->raw_boxsize_data[j]);
+                        }
+                        HANDLE(NPY_LIKELY(p == 2), BoxMinkowskiDistP2)
+                        HANDLE(p == 1, BoxMinkowskiDistP1)
+                        HANDLE(ckdtree_isinf(p), BoxMinkowskiDistPinf)
+                        HANDLE(1, BoxMinkowskiDistPp) {}
+                    }    
+                }
+                });
         } 
         catch(...) {
             translate_cpp_exception_with_gil();
@@ -554,4 +738,3 @@ query_knn(const ckdtree      *self,
         Py_RETURN_NONE;
     }
 }
-
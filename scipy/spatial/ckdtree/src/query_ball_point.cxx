@@ -6,6 +6,7 @@
 #include <cstring>
 
 #include <vector>
+#include <algorithm>
 #include <string>
 #include <sstream>
 #include <new>
@@ -17,16 +18,18 @@
 #include "ckdtree_decl.h"
 #include "ckdtree_methods.h"
 #include "cpp_exc.h"
+#include "thread_pool.h"
 #include "rectangle.h"
+#include "node_layout.h"
 
 
-static void
+template <typename Layout> static void
 traverse_no_checking(const ckdtree *self,
                      std::vector<npy_intp> *results,
-                     const ckdtreenode *node)
+                     const typename Layout::node_type *node)
 {                                                    
     const npy_intp *indices = self->raw_indices;
-    const ckdtreenode *lnode;
+    const typename Layout::node_type *lnode;
     npy_intp i;
     
     if (node->split_dim == -1) {  /* leaf node */
@@ -34,29 +37,39 @@ traverse_no_checking(const ckdtree *self,
         const npy_intp start = lnode->start_idx;
         const npy_intp end = lnode->end_idx;
         for (i = start; i < end; ++i)
-            results->push_back(indices[i]);
+            if (!ckdtree_is_deleted(self, indices[i]))
+                results->push_back(indices[i]);
     }
     else {
-        traverse_no_checking(self, results, node->less);
-        traverse_no_checking(self, results, node->greater);
+        traverse_no_checking<Layout>(self, results, 
+                                     Layout::less(self, node));
+        traverse_no_checking<Layout>(self, results, 
+                                     Layout::greater(self, node));
     }
 }
 
 
-template <typename MinMaxDist> static void 
+/*
+ * If distances is not NULL, the distances of the points found are stored
+ * in it, as distance**p for finite p. Every point is then checked, even
+ * in the nodes that are entirely within the ball.
+ */
+template <typename MinMaxDist, typename Layout> static void 
 traverse_checking(const ckdtree *self,
                   std::vector<npy_intp> *results,
-                  const ckdtreenode *node,
+                  std::vector<npy_float64> *distances,
+                  const typename Layout::node_type *node,
                   RectRectDistanceTracker<MinMaxDist> *tracker)
 {
-    const ckdtreenode *lnode;
+    const typename Layout::node_type *lnode;
     npy_float64 d;
     npy_intp i;
 
     if (tracker->min_distance > tracker->upper_bound * tracker->epsfac)
         return;
-    else if (tracker->max_distance < tracker->upper_bound / tracker->epsfac)
-        traverse_no_checking(self, results, node);
+    else if (distances == NULL && 
+             tracker->max_distance < tracker->upper_bound / tracker->epsfac)
+        traverse_no_checking<Layout>(self, results, node);
     else if (node->split_dim == -1)  { /* leaf node */
         
         /* brute-force */
@@ -64,78 +77,215 @@ traverse_checking(const ckdtree *self,
         const npy_float64 p = tracker->p;
         const npy_float64 tub = tracker->upper_bound;
         const npy_float64 *tpt = tracker->rect1.mins;
-        const npy_float64 *data = self->raw_data;
         const npy_intp *indices = self->raw_indices;
         const npy_intp m = self->m;
         const npy_intp start = lnode->start_idx;
         const npy_intp end = lnode->end_idx;
-            
-        prefetch_datapoint(data + indices[start] * m, m);
-        if (start < end)
-            prefetch_datapoint(data + indices[start+1] * m, m);
+        npy_float64 dbuf[CKDTREE_LEAF_BLOCK];
                 
-        for (i = start; i < end; ++i) {
-            
-            if (i < end-2)
-                prefetch_datapoint(data + indices[i+2] * m, m);
+        for (i = start; i < end; i += CKDTREE_LEAF_BLOCK) {
+            const typename MinMaxDist::coord_type *bdata;
+            const npy_intp *bindices;
+            npy_intp j, nb = end - i;
+            if (nb > CKDTREE_LEAF_BLOCK)
+                nb = CKDTREE_LEAF_BLOCK;
            
-            d = MinMaxDist::distance_p(self, data + indices[i] * m, tpt, p, m, tub);
+            Layout::leaf_block(self, i, &bdata, &bindices);
+            MinMaxDist::leaf_distances_p(self, tpt, bdata, bindices, 
+                                         nb, p, m, tub, dbuf);
 
-            if (d <= tub) {
-                results->push_back((npy_intp) indices[i]);
+            for (j = 0; j < nb; ++j) {
+                d = dbuf[j];
+                if (d <= tub && !ckdtree_is_deleted(self, indices[i + j])) {
+                    results->push_back((npy_intp) indices[i + j]);
+                    if (distances != NULL)
+                        distances->push_back(d);
+                }
             }
         }
     }
     else {
         tracker->push_less_of(2, node);
-        traverse_checking(self, results, node->less, tracker);
+        traverse_checking<MinMaxDist, Layout>(self, results, distances,
+                                              Layout::less(self, node), tracker);
         tracker->pop();
         
         tracker->push_greater_of(2, node);
-        traverse_checking(self, results, node->greater, tracker);
+        traverse_checking<MinMaxDist, Layout>(self, results, distances,
+                                              Layout::greater(self, node), tracker);
         tracker->pop();
     }    
 }
 
+
+/* find the points within distance r of the point x */
+static void
+query_single_ball(const ckdtree *self, const npy_float64 *x,
+                  const npy_float64 r, const npy_float64 p, 
+                  const npy_float64 eps, std::vector<npy_intp> *results,
+                  std::vector<npy_float64> *distances)
+{
+#define DISPATCH(kls) { \
+        RectRectDistanceTracker<kls> tracker(self, point, rect, p, eps, r); \
+        if (self->compact_tree) \
+            traverse_checking<kls, CompactLayout<kls::coord_type> >(self, results, \
+                distances, self->compact_tree, &tracker); \
+        else if (self->raw_tree_data) \
+            traverse_checking<kls, ReorderedLayout<kls::coord_type> >(self, results, \
+                distances, self->ctree, &tracker); \
+        else \
+            traverse_checking<kls, StandardLayout<kls::coord_type> >(self, results, \
+                distances, self->ctree, &tracker); \
+    }
+
+#define HANDLE(cond, kls) \
+    if(cond) { \
+        if (ckdtree_is_float32(self)) \
+            DISPATCH(kls##F32) \
+        else \
+            DISPATCH(kls) \
+    } else
+
+    const npy_intp m = self->m;
+    Rectangle rect(m, self->raw_mins, self->raw_maxes);             
+    if (NPY_LIKELY(self->raw_boxsize_data == NULL)) {
+        Rectangle point(m, x, x);
+        HANDLE(self->raw_metric != NULL, CallbackDist)
+        HANDLE(NPY_LIKELY(p == 2), MinkowskiDistP2)
+        HANDLE(p == 1, MinkowskiDistP1)
+        HANDLE(ckdtree_isinf(p), MinkowskiDistPinf)
+        HANDLE(1, MinkowskiDistPp) 
+        {}
+    } else {
+        Rectangle point(m, x, x);
+        int j;
+        for(j=0; j<m; ++j) {
+            point.maxes[j] = point.mins[j] = _wrap(point.mins[j], self->raw_boxsize_data[j]);
+        }
+        HANDLE(NPY_LIKELY(p == 2), BoxMinkowskiDistP2)
+        HANDLE(p == 1, BoxMinkowskiDistP1)
+        HANDLE(ckdtree_isinf(p), BoxMinkowskiDistPinf)
+        HANDLE(1, BoxMinkowskiDistPp) 
+        {}
+    }
+#undef HANDLE
+#undef DISPATCH
+}
+
         
 extern "C" PyObject*
 query_ball_point(const ckdtree *self, const npy_float64 *x,
                  const npy_float64 r, const npy_float64 p, const npy_float64 eps,
-                 const npy_intp n_queries, std::vector<npy_intp> **results)
+                 const npy_intp n_queries, std::vector<npy_intp> **results,
+                 const int n_jobs)
 {
-#define HANDLE(cond, kls) \
-    if(cond) { \
-        RectRectDistanceTracker<kls> tracker(self, point, rect, p, eps, r); \
-        traverse_checking(self, results[i], self->ctree, &tracker); \
-    } else
+    /* release the GIL */
+    NPY_BEGIN_ALLOW_THREADS   
+    {
+        try {
+            parallel_for(n_queries, n_jobs, 16,
+                [&](npy_intp start, npy_intp stop) {
+                for (npy_intp i=start; i < stop; ++i) {
+                    query_single_ball(self, x + i * self->m, r, p, eps, 
+                                      results[i], NULL);
+                }
+                });
+        } 
+        catch(...) {
+            translate_cpp_exception_with_gil();
+        }
+    }  
+    /* reacquire the GIL */
+    NPY_END_ALLOW_THREADS
+
+    if (PyErr_Occurred()) 
+        /* true if a C++ exception was translated */
+        return NULL;
+    else {
+        /* return None if there were no errors */
+        Py_RETURN_NONE;
+    }
+}
+
 
+/*
+ * Compressed sparse row output
+ * ============================
+ *
+ * query_ball_point_csr collects the neighbors of the queries in blocks of
+ * consecutive queries, each with its own buffers, and fills in the row
+ * pointers indptr. The caller then allocates the indptr[n_queries] entries
+ * of the output, and query_ball_point_csr_copy copies each block straight
+ * to its place in it. Row i of the result is the range
+ * [indptr[i], indptr[i+1]) of indices, sorted by index as in the list
+ * output of query_ball_point.
+ */
+
+#define CKDTREE_BALL_BLOCK 256
+
+extern "C" PyObject*
+query_ball_point_csr(const ckdtree *self, const npy_float64 *x,
+                     const npy_float64 r, const npy_float64 p, 
+                     const npy_float64 eps, const npy_intp n_queries, 
+                     npy_intp *indptr, std::vector<ball_block> *blocks,
+                     const int return_distances, const int n_jobs)
+{
     /* release the GIL */
     NPY_BEGIN_ALLOW_THREADS   
     {
         try {
-            for (npy_intp i=0; i < n_queries; ++i) {
-                const npy_intp m = self->m;
-                Rectangle rect(m, self->raw_mins, self->raw_maxes);             
-                if (NPY_LIKELY(self->raw_boxsize_data == NULL)) {
-                    Rectangle point(m, x + i * m, x + i * m);
-                    HANDLE(NPY_LIKELY(p == 2), MinkowskiDistP2)
-                    HANDLE(p == 1, MinkowskiDistP1)
-                    HANDLE(ckdtree_isinf(p), MinkowskiDistPinf)
-                    HANDLE(1, MinkowskiDistPp) 
-                    {}
-                } else {
-                    Rectangle point(m, x + i * m, x + i * m);
-                    int j;
-                    for(j=0; j<m; ++j) {
-                        point.maxes[j] = point.mins[j] = _wrap(point.mins[j], self->raw_boxsize_data[j]);
+            const npy_intp nblocks = 
+                (n_queries + CKDTREE_BALL_BLOCK - 1) / CKDTREE_BALL_BLOCK;
+            blocks->resize(nblocks);
+
+            parallel_for(nblocks, n_jobs, 1,
+                [&](npy_intp start, npy_intp stop) {
+                std::vector<npy_intp> qidx;
+                std::vector<npy_float64> qdist;
+                std::vector<npy_intp> order;
+                for (npy_intp b=start; b < stop; ++b) {
+                    ball_block &block = (*blocks)[b];
+                    const npy_intp end = std::min(n_queries, 
+                                                  (b + 1) * CKDTREE_BALL_BLOCK);
+                    for (npy_intp i=b * CKDTREE_BALL_BLOCK; i < end; ++i) {
+                        qidx.clear();
+                        qdist.clear();
+                        query_single_ball(self, x + i * self->m, r, p, eps, 
+                                          &qidx, 
+                                          return_distances ? &qdist : NULL);
+                        const npy_intp nq = qidx.size();
+                        indptr[i + 1] = nq;
+                        if (!return_distances) {
+                            std::sort(qidx.begin(), qidx.end());
+                            block.indices.insert(block.indices.end(), 
+                                                 qidx.begin(), qidx.end());
+                            continue;
+                        }
+                        /* sort the indices along with the distances */
+                        order.resize(nq);
+                        for (npy_intp j=0; j < nq; ++j)
+                            order[j] = j;
+                        std::sort(order.begin(), order.end(),
+                            [&](npy_intp a, npy_intp c) { 
+                                return qidx[a] < qidx[c]; 
+                            });
+                        for (npy_intp j=0; j < nq; ++j) {
+                            npy_float64 d = qdist[order[j]];
+                            if (NPY_LIKELY(p == 2.0))
+                                d = std::sqrt(d);
+                            else if ((p != 1.) && (!ckdtree_isinf(p)))
+                                d = std::pow(d, 1. / p);
+                            block.indices.push_back(qidx[order[j]]);
+                            block.distances.push_back(d);
+                        }
                     }
-                    HANDLE(NPY_LIKELY(p == 2), BoxMinkowskiDistP2)
-                    HANDLE(p == 1, BoxMinkowskiDistP1)
-                    HANDLE(ckdtree_isinf(p), BoxMinkowskiDistPinf)
-                    HANDLE(1, BoxMinkowskiDistPp) 
-                    {}
                 }
-            }
+                });
+
+            /* row pointers */
+            indptr[0] = 0;
+            for (npy_intp i=0; i < n_queries; ++i)
+                indptr[i + 1] += indptr[i];
         } 
         catch(...) {
             translate_cpp_exception_with_gil();
@@ -151,4 +301,46 @@ query_ball_point(const ckdtree *self, const npy_float64 *x,
         /* return None if there were no errors */
         Py_RETURN_NONE;
     }
-}        
+}
+
+extern "C" PyObject*
+query_ball_point_csr_copy(std::vector<ball_block> *blocks, 
+                          const npy_intp *indptr, npy_intp *indices, 
+                          npy_float64 *distances, const int n_jobs)
+{
+    /* release the GIL */
+    NPY_BEGIN_ALLOW_THREADS   
+    {
+        try {
+            parallel_for(blocks->size(), n_jobs, 1,
+                [&](npy_intp start, npy_intp stop) {
+                for (npy_intp b=start; b < stop; ++b) {
+                    ball_block &block = (*blocks)[b];
+                    const npy_intp offset = indptr[b * CKDTREE_BALL_BLOCK];
+                    if (!block.indices.empty())
+                        std::memcpy(indices + offset, &block.indices[0],
+                                    block.indices.size() * sizeof(npy_intp));
+                    if (distances && !block.distances.empty())
+                        std::memcpy(distances + offset, &block.distances[0],
+                                    block.distances.size() * sizeof(npy_float64));
+                    /* release the block as soon as it is copied */
+                    std::vector<npy_intp>().swap(block.indices);
+                    std::vector<npy_float64>().swap(block.distances);
+                }
+                });
+        } 
+        catch(...) {
+            translate_cpp_exception_with_gil();
+        }
+    }  
+    /* reacquire the GIL */
+    NPY_END_ALLOW_THREADS
+
+    if (PyErr_Occurred()) 
+        /* true if a C++ exception was translated */
+        return NULL;
+    else {
+        /* return None if there were no errors */
+        Py_RETURN_NONE;
+    }
+}
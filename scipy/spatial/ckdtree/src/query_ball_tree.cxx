@@ -18,6 +18,8 @@
 #include "ckdtree_methods.h"
 #include "cpp_exc.h"
 #include "rectangle.h"
+#include "parallel_traverse.h"
+#include "thread_pool.h"
 
 
 static void
@@ -50,13 +52,17 @@ traverse_no_checking(const ckdtree *self, const ckdtree *other,
             }
         }
         else {            
-            traverse_no_checking(self, other, results, node1, node2->less);   
-            traverse_no_checking(self, other, results, node1, node2->greater);
+            traverse_no_checking(self, other, results, node1,
+                                 node_less(other, node2));
+            traverse_no_checking(self, other, results, node1,
+                                 node_greater(other, node2));
         }
     }
     else {        
-        traverse_no_checking(self, other, results, node1->less, node2);
-        traverse_no_checking(self, other, results, node1->greater, node2);
+        traverse_no_checking(self, other, results, node_less(self, node1),
+                             node2);
+        traverse_no_checking(self, other, results, node_greater(self, node1),
+                             node2);
     }
 }
 
@@ -87,9 +93,10 @@ traverse_checking(const ckdtree *self, const ckdtree *other,
             const npy_float64 p = tracker->p;
             const npy_float64 tub = tracker->upper_bound;
             const npy_float64 tmd = tracker->max_distance;
-            const npy_float64 *sdata = self->raw_data;
+            typedef typename MinMaxDist::coord_type coord_type;
+            const coord_type *sdata = tree_points<coord_type>(self);
             const npy_intp *sindices = self->raw_indices;
-            const npy_float64 *odata = other->raw_data;
+            const coord_type *odata = tree_points<coord_type>(other);
             const npy_intp *oindices = other->raw_indices;
             const npy_intp m = self->m;            
             const npy_intp start1 = lnode1->start_idx;
@@ -102,31 +109,30 @@ traverse_checking(const ckdtree *self, const ckdtree *other,
             if (start1 < end1)
                 prefetch_datapoint(sdata + sindices[start1+1] * m, m);                                    
             
+            npy_float64 dbuf[CKDTREE_LEAF_BLOCK];
+            
             for (i = start1; i < end1; ++i) {
             
                 if (i < end1-2)
                     prefetch_datapoint(sdata + sindices[i+2] * m, m);
-                                  
-                prefetch_datapoint(odata + oindices[start2] * m, m);
-                    
-                if (start2 < end2)
-                    prefetch_datapoint(odata + oindices[start2+1] * m, m);
                         
                 results_i = results[sindices[i]];        
+                const npy_float64 *xi = point_as_float64(
+                    sdata + sindices[i] * m, m, tracker->xbuf);
                                                                 
-                for (j = start2; j < end2; ++j) {
-                
-                    if (j < end2-2)
-                        prefetch_datapoint(odata + oindices[j+2] * m, m);
+                for (j = start2; j < end2; j += CKDTREE_LEAF_BLOCK) {
+                    npy_intp jj, nb = end2 - j;
+                    if (nb > CKDTREE_LEAF_BLOCK)
+                        nb = CKDTREE_LEAF_BLOCK;
                 
-                    d = MinMaxDist::distance_p(
-                            self,
-                            sdata + sindices[i] * m,
-                            odata + oindices[j] * m,
-                            p, m, tmd);
+                    MinMaxDist::leaf_distances_p(self, xi,
+                        odata, oindices + j, nb, p, m, tmd, dbuf);
         
-                    if (d <= tub)
-                        results_i->push_back(other->raw_indices[j]);
+                    for (jj = 0; jj < nb; ++jj) {
+                        d = dbuf[jj];
+                        if (d <= tub)
+                            results_i->push_back(oindices[j + jj]);
+                    }
                 }
             }
                        
@@ -135,12 +141,13 @@ traverse_checking(const ckdtree *self, const ckdtree *other,
 
             tracker->push_less_of(2, node2);
             traverse_checking(
-                self, other, results, node1, node2->less, tracker);
+                self, other, results, node1, node_less(other, node2), tracker);
             tracker->pop();
                 
             tracker->push_greater_of(2, node2);            
             traverse_checking(
-                self, other, results, node1, node2->greater, tracker);
+                self, other, results, node1, node_greater(other, node2),
+                tracker);
             tracker->pop();
         }
     }        
@@ -148,12 +155,13 @@ traverse_checking(const ckdtree *self, const ckdtree *other,
         if (node2->split_dim == -1) { /* 1 is an inner node, 2 is a leaf node */
             tracker->push_less_of(1, node1);
             traverse_checking(
-                self, other, results, node1->less, node2, tracker);
+                self, other, results, node_less(self, node1), node2, tracker);
             tracker->pop();
                 
             tracker->push_greater_of(1, node1);
             traverse_checking(
-                self, other, results, node1->greater, node2, tracker);
+                self, other, results, node_greater(self, node1), node2,
+                tracker);
             tracker->pop();
         }    
         else { /* 1 & 2 are inner nodes */
@@ -161,12 +169,14 @@ traverse_checking(const ckdtree *self, const ckdtree *other,
             tracker->push_less_of(1, node1);
             tracker->push_less_of(2, node2);
             traverse_checking(
-                self, other, results, node1->less, node2->less, tracker);
+                self, other, results, node_less(self, node1),
+                node_less(other, node2), tracker);
             tracker->pop();
                 
             tracker->push_greater_of(2, node2);
             traverse_checking(
-                self, other, results, node1->less, node2->greater, tracker);
+                self, other, results, node_less(self, node1),
+                node_greater(other, node2), tracker);
             tracker->pop();
             tracker->pop();
 
@@ -174,12 +184,14 @@ traverse_checking(const ckdtree *self, const ckdtree *other,
             tracker->push_greater_of(1, node1);
             tracker->push_less_of(2, node2);
             traverse_checking(
-                self, other, results, node1->greater, node2->less, tracker);
+                self, other, results, node_greater(self, node1),
+                node_less(other, node2), tracker);
             tracker->pop();
                 
             tracker->push_greater_of(2, node2);
             traverse_checking(
-                self, other, results, node1->greater, node2->greater, tracker);
+                self, other, results, node_greater(self, node1),
+                node_greater(other, node2), tracker);
             tracker->pop();
             tracker->pop();
         }
@@ -187,17 +199,54 @@ traverse_checking(const ckdtree *self, const ckdtree *other,
 }
     
     
+template <typename MinMaxDist> static void
+traverse_parallel(const ckdtree *self, const ckdtree *other,
+                  std::vector<npy_intp> **results,
+                  RectRectDistanceTracker<MinMaxDist> *tracker,
+                  const int n_jobs)
+{
+    /* 
+     * Only the nodes of self are split, so each task owns the result
+     * lists of a disjoint set of points and no reduction is needed.
+     */
+    std::vector<traverse_task<MinMaxDist> > tasks;
+
+    tasks.push_back(traverse_task<MinMaxDist>(self->ctree, other->ctree,
+                                              *tracker));
+    split_traversal(self, other, &tasks, 16 * n_jobs, 0, 0);
+
+    parallel_for(tasks.size(), n_jobs, 1,
+        [&](npy_intp start, npy_intp stop) {
+            for (npy_intp k = start; k < stop; ++k) {
+                traverse_task<MinMaxDist> &t = tasks[k];
+                traverse_checking(self, other, results, t.node1, t.node2,
+                                  &t.tracker);
+            }
+        });
+}
+
+    
 extern "C" PyObject*
 query_ball_tree(const ckdtree *self, const ckdtree *other, 
                 const npy_float64 r, const npy_float64 p, const npy_float64 eps,
-                std::vector<npy_intp> **results)
+                std::vector<npy_intp> **results, const int n_jobs)
 {
 
+#define DISPATCH(kls) { \
+        RectRectDistanceTracker<kls> tracker(self, r1, r2, p, eps, r); \
+        if (n_jobs > 1) \
+            traverse_parallel(self, other, results, &tracker, n_jobs); \
+        else \
+            traverse_checking(self, other, results, self->ctree, \
+                              other->ctree, &tracker); \
+    }
+
 #define HANDLE(cond, kls) \
     if(cond) { \
-        RectRectDistanceTracker<kls> tracker(self, r1, r2, p, eps, r); \
-        traverse_checking(self, other, results, self->ctree, other->ctree, \
-            &tracker); \
+        if (ckdtree_is_float32(self)) \
+            DISPATCH(kls##F32) \
+        else \
+            DISPATCH(kls) \
     } else
 
     /* release the GIL */
@@ -208,6 +257,7 @@ query_ball_tree(const ckdtree *self, const ckdtree *other,
             Rectangle r2(other->m, other->raw_mins, other->raw_maxes);
             
             if(NPY_LIKELY(self->raw_boxsize_data == NULL)) {
+                HANDLE(self->raw_metric != NULL, CallbackDist)
                 HANDLE(NPY_LIKELY(p == 2), MinkowskiDistP2)
                 HANDLE(p == 1, MinkowskiDistP1)
                 HANDLE(ckdtree_isinf(p), MinkowskiDistPinf)
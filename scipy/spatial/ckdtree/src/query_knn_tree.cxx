@@ -0,0 +1,581 @@
+#include <Python.h>
+#include "numpy/arrayobject.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <new>
+#include <typeinfo>
+#include <stdexcept>
+#include <ios>
+
+#define CKDTREE_METHODS_IMPL
+#include "ckdtree_decl.h"
+#include "ckdtree_methods.h"
+#include "cpp_exc.h"
+#include "rectangle.h"
+#include "parallel_traverse.h"
+#include "thread_pool.h"
+
+/*
+ * Dual-tree k nearest neighbors
+ * =============================
+ *
+ * Every point of self keeps a bounded max-heap of its kmax nearest
+ * neighbors in other found so far. Every node of self keeps a bound, the
+ * largest distance from any of its points to its current kmax-th neighbor.
+ * A pair of nodes is pruned when the minimum distance between their
+ * rectangles exceeds the bound of the node of self, so a single pair
+ * comparison can discard a subtree of other for a whole group of queries.
+ *
+ * The tracker follows the cells of other. The nodes of self are represented
+ * by the bounding boxes of their points instead of their cells: the cells
+ * of a small node still span most of the data along the dimensions that
+ * were never split, which would defeat the pruning in higher dimensions.
+ *
+ * Below a leaf of self the bound of the leaf is too coarse, so the
+ * traversal of other continues with the list of the points of the leaf
+ * that are still closer to the cell than to their kmax-th neighbor.
+ *
+ * Distances are stored as distance ** p, as in the tracker.
+ */
+
+struct knn_state {
+    npy_intp kmax;
+    std::vector<npy_float64> dist;   /* per point (tree order), kmax each */
+    std::vector<npy_intp> idx;
+    std::vector<npy_intp> count;
+    std::vector<npy_float64> bound;  /* per node of self */
+    std::vector<npy_float64> bbox;   /* per node of self, mins and maxes */
+    std::vector<const ckdtreenode*> seed; /* per node of self */
+
+    knn_state(const ckdtree *self, const npy_intp _kmax,
+              const npy_float64 upper_bound)
+        : kmax(_kmax), dist(self->n * _kmax), idx(self->n * _kmax),
+          count(self->n, 0), bound(self->size, upper_bound),
+          bbox(self->size * 2 * self->m), seed(self->size, NULL) {};
+
+    inline npy_float64 worst(const npy_intp i,
+                             const npy_float64 upper_bound) const {
+        return (count[i] < kmax) ? upper_bound : dist[i * kmax];
+    };
+
+    /* insert into the max-heap of point i, which must be closer than worst */
+    inline void push(const npy_intp i, const npy_float64 d,
+                     const npy_intp index) {
+        npy_float64 *hd = &dist[i * kmax];
+        npy_intp *hi = &idx[i * kmax];
+        npy_intp n = count[i];
+        npy_intp c, j;
+
+        if (n < kmax) {
+            /* sift up */
+            j = n;
+            while (j > 0) {
+                c = (j - 1) / 2;
+                if (hd[c] >= d)
+                    break;
+                hd[j] = hd[c];
+                hi[j] = hi[c];
+                j = c;
+            }
+            count[i] = n + 1;
+        }
+        else {
+            /* replace the root and sift down */
+            j = 0;
+            for (;;) {
+                c = 2 * j + 1;
+                if (c >= n)
+                    break;
+                if (c + 1 < n && hd[c + 1] > hd[c])
+                    ++c;
+                if (hd[c] <= d)
+                    break;
+                hd[j] = hd[c];
+                hi[j] = hi[c];
+                j = c;
+            }
+        }
+        hd[j] = d;
+        hi[j] = index;
+    };
+};
+
+
+/* the points of a leaf of self, with scratch space for the traversal */
+struct knn_leaf {
+    const ckdtreenode *node;
+    Rectangle rect;                  /* bounding box of the leaf */
+    std::vector<npy_float64> x;      /* coordinates as float64 */
+    std::vector<npy_intp> active;    /* stack of lists of active points */
+};
+
+
+template <typename T> static void
+compute_bboxes(const ckdtree *self, knn_state *state,
+               const ckdtreenode *node)
+{
+    const npy_intp m = self->m;
+    npy_float64 *mins = &state->bbox[(node - self->ctree) * 2 * m];
+    npy_float64 *maxes = mins + m;
+    npy_intp i, j;
+
+    if (node->split_dim == -1) {
+        const T *data = tree_points<T>(self);
+        const npy_intp *indices = self->raw_indices;
+        for (j = 0; j < m; ++j) {
+            mins[j] = NPY_INFINITY;
+            maxes[j] = -NPY_INFINITY;
+        }
+        for (i = node->start_idx; i < node->end_idx; ++i) {
+            const T *x = data + indices[i] * m;
+            for (j = 0; j < m; ++j) {
+                mins[j] = dmin(mins[j], x[j]);
+                maxes[j] = dmax(maxes[j], x[j]);
+            }
+        }
+    }
+    else {
+        const ckdtreenode *less = node_less(self, node);
+        const ckdtreenode *greater = node_greater(self, node);
+        compute_bboxes<T>(self, state, less);
+        compute_bboxes<T>(self, state, greater);
+        const npy_float64 *lmins = &state->bbox[(less - self->ctree) * 2 * m];
+        const npy_float64 *gmins =
+            &state->bbox[(greater - self->ctree) * 2 * m];
+        for (j = 0; j < m; ++j) {
+            mins[j] = dmin(lmins[j], gmins[j]);
+            maxes[j] = dmax(lmins[m + j], gmins[m + j]);
+        }
+    }
+}
+
+
+/* point rect at the bounding box of node1, without copying */
+static inline void
+node_rect(const ckdtree *self, knn_state *state, const ckdtreenode *node1,
+          Rectangle *rect)
+{
+    rect->m = self->m;
+    rect->mins = &state->bbox[(node1 - self->ctree) * 2 * self->m];
+    rect->maxes = rect->mins + self->m;
+}
+
+
+template <typename T> static void
+load_leaf(const ckdtree *self, knn_state *state, knn_leaf *leaf,
+          const ckdtreenode *node1)
+{
+    const T *sdata = tree_points<T>(self);
+    const npy_intp *sindices = self->raw_indices;
+    const npy_intp m = self->m;
+    const npy_intp start1 = node1->start_idx;
+    const npy_intp end1 = node1->end_idx;
+    npy_intp i, j;
+
+    leaf->node = node1;
+    node_rect(self, state, node1, &leaf->rect);
+    leaf->x.resize((end1 - start1) * m);
+    leaf->active.clear();
+    for (i = start1; i < end1; ++i) {
+        for (j = 0; j < m; ++j)
+            leaf->x[(i - start1) * m + j] = sdata[sindices[i] * m + j];
+        leaf->active.push_back(i - start1);
+    }
+}
+
+
+template <typename MinMaxDist> static void
+leaf_brute_force(const ckdtree *self, const ckdtree *other,
+                 knn_state *state, knn_leaf *leaf, const npy_intp next,
+                 const npy_intp nnext, const ckdtreenode *node2,
+                 RectRectDistanceTracker<MinMaxDist> *tracker)
+{
+    const npy_intp m = self->m;
+    const npy_intp start1 = leaf->node->start_idx;
+    const npy_float64 p = tracker->p;
+    const npy_float64 tub = tracker->upper_bound;
+    typedef typename MinMaxDist::coord_type coord_type;
+    const coord_type *odata = tree_points<coord_type>(other);
+    const npy_intp *oindices = other->raw_indices;
+    const npy_intp start2 = node2->start_idx;
+    const npy_intp end2 = node2->end_idx;
+    npy_float64 dbuf[CKDTREE_LEAF_BLOCK];
+    npy_intp a, i, j, jj;
+
+    for (a = next; a < next + nnext; ++a) {
+        i = leaf->active[a];
+        const npy_float64 *x = &leaf->x[i * m];
+        npy_float64 w = state->worst(start1 + i, tub);
+
+        for (j = start2; j < end2; j += CKDTREE_LEAF_BLOCK) {
+            npy_intp nb = end2 - j;
+            if (nb > CKDTREE_LEAF_BLOCK)
+                nb = CKDTREE_LEAF_BLOCK;
+
+            MinMaxDist::leaf_distances_p(self, x, odata, oindices + j,
+                                         nb, p, m, w, dbuf);
+
+            for (jj = 0; jj < nb; ++jj) {
+                if (dbuf[jj] < w) {
+                    state->push(start1 + i, dbuf[jj], oindices[j + jj]);
+                    w = state->worst(start1 + i, tub);
+                }
+            }
+        }
+    }
+}
+
+
+template <typename MinMaxDist> static void
+traverse_leaf(const ckdtree *self, const ckdtree *other, knn_state *state,
+              knn_leaf *leaf, const npy_intp begin, const npy_intp n,
+              const ckdtreenode *node2,
+              RectRectDistanceTracker<MinMaxDist> *tracker)
+{
+    /*
+     * The active points are leaf->active[begin:begin+n], given by their
+     * offset in the leaf. The points that remain active for node2 are
+     * appended to leaf->active, and removed again before returning.
+     */
+    const npy_intp m = self->m;
+    const npy_intp start1 = leaf->node->start_idx;
+    const npy_float64 p = tracker->p;
+    const npy_float64 tub = tracker->upper_bound;
+    const npy_intp next = leaf->active.size();
+    npy_float64 pmin, pmax;
+    Rectangle prect;
+    npy_intp a, i;
+
+    prect.m = m;
+    for (a = begin; a < begin + n; ++a) {
+        i = leaf->active[a];
+        prect.mins = prect.maxes = &leaf->x[i * m];
+        MinMaxDist::rect_rect_p(self, prect, tracker->rect2, p,
+                                &pmin, &pmax);
+        if (pmin <= state->worst(start1 + i, tub) * tracker->epsfac)
+            leaf->active.push_back(i);
+    }
+    const npy_intp nnext = leaf->active.size() - next;
+
+    if (nnext == 0) {
+        /* all points are pruned */
+    }
+    else if (node2->split_dim == -1) {
+        if (node2 != state->seed[leaf->node - self->ctree])
+            leaf_brute_force<MinMaxDist>(self, other, state, leaf, next,
+                                         nnext, node2, tracker);
+    }
+    else {
+        /* visit the child of node2 on the side of the leaf first */
+        const npy_intp d = node2->split_dim;
+        const npy_float64 mid = 0.5 * (leaf->rect.mins[d] +
+                                       leaf->rect.maxes[d]);
+        const npy_intp first = (mid < node2->split) ? LESS : GREATER;
+        const npy_intp second = (first == LESS) ? GREATER : LESS;
+
+        tracker->push(2, first, d, node2->split);
+        traverse_leaf(self, other, state, leaf, next, nnext,
+                      (first == LESS) ? node_less(other, node2)
+                                      : node_greater(other, node2),
+                      tracker);
+        tracker->pop();
+
+        tracker->push(2, second, d, node2->split);
+        traverse_leaf(self, other, state, leaf, next, nnext,
+                      (second == LESS) ? node_less(other, node2)
+                                       : node_greater(other, node2),
+                      tracker);
+        tracker->pop();
+    }
+    leaf->active.resize(next);
+}
+
+
+template <typename MinMaxDist> static void
+traverse(const ckdtree *self, const ckdtree *other, knn_state *state,
+         knn_leaf *leaf, const ckdtreenode *node1, const ckdtreenode *node2,
+         RectRectDistanceTracker<MinMaxDist> *tracker)
+{
+    const npy_intp n1 = node1 - self->ctree;
+    const npy_float64 tub = tracker->upper_bound;
+    npy_float64 min_distance, max_distance;
+    Rectangle rect1;
+
+    node_rect(self, state, node1, &rect1);
+    MinMaxDist::rect_rect_p(self, rect1, tracker->rect2, tracker->p,
+                            &min_distance, &max_distance);
+    if (min_distance > state->bound[n1] * tracker->epsfac)
+        return;
+
+    if (node1->split_dim == -1) {
+        typedef typename MinMaxDist::coord_type coord_type;
+        const npy_intp start1 = node1->start_idx;
+        const npy_intp end1 = node1->end_idx;
+        npy_float64 bound = 0;
+        npy_intp i;
+
+        load_leaf<coord_type>(self, state, leaf, node1);
+
+        traverse_leaf(self, other, state, leaf, 0, end1 - start1, node2,
+                      tracker);
+
+        for (i = start1; i < end1; ++i)
+            bound = dmax(bound, state->worst(i, tub));
+        state->bound[n1] = bound;
+    }
+    else if (node2->split_dim != -1 &&
+             node2->children > 4 * node1->children) {
+        /*
+         * split node2 only if it is much larger, as node1 reaches the
+         * leaves with their per-point pruning sooner that way. Visit the
+         * child of node2 on the side of the center of node1 first to
+         * tighten the bounds early.
+         */
+        const npy_intp d = node2->split_dim;
+        const npy_float64 mid = 0.5 * (rect1.mins[d] + rect1.maxes[d]);
+        const npy_intp first = (mid < node2->split) ? LESS : GREATER;
+        const npy_intp second = (first == LESS) ? GREATER : LESS;
+
+        tracker->push(2, first, d, node2->split);
+        traverse(self, other, state, leaf, node1,
+                 (first == LESS) ? node_less(other, node2)
+                                 : node_greater(other, node2),
+                 tracker);
+        tracker->pop();
+
+        tracker->push(2, second, d, node2->split);
+        traverse(self, other, state, leaf, node1,
+                 (second == LESS) ? node_less(other, node2)
+                                  : node_greater(other, node2),
+                 tracker);
+        tracker->pop();
+    }
+    else {
+        const ckdtreenode *less = node_less(self, node1);
+        const ckdtreenode *greater = node_greater(self, node1);
+
+        traverse(self, other, state, leaf, less, node2, tracker);
+        traverse(self, other, state, leaf, greater, node2, tracker);
+
+        state->bound[n1] = dmax(state->bound[less - self->ctree],
+                                state->bound[greater - self->ctree]);
+    }
+}
+
+
+/*
+ * Before the traversal, compare every leaf of self with the leaf of other
+ * that contains the center of its bounding box. This gives most points
+ * finite bounds from the start.
+ */
+template <typename MinMaxDist> static void
+seed_bounds(const ckdtree *self, const ckdtree *other, knn_state *state,
+            knn_leaf *leaf, const ckdtreenode *node1,
+            RectRectDistanceTracker<MinMaxDist> *tracker)
+{
+    const npy_intp n1 = node1 - self->ctree;
+
+    if (node1->split_dim == -1) {
+        typedef typename MinMaxDist::coord_type coord_type;
+        const ckdtreenode *node2 = other->ctree;
+        npy_float64 bound = 0;
+        npy_intp i;
+
+        load_leaf<coord_type>(self, state, leaf, node1);
+        while (node2->split_dim != -1) {
+            const npy_intp d = node2->split_dim;
+            if (0.5 * (leaf->rect.mins[d] + leaf->rect.maxes[d])
+                    < node2->split)
+                node2 = node_less(other, node2);
+            else
+                node2 = node_greater(other, node2);
+        }
+        leaf_brute_force<MinMaxDist>(self, other, state, leaf, 0,
+                                     leaf->active.size(), node2, tracker);
+        state->seed[n1] = node2;
+
+        for (i = node1->start_idx; i < node1->end_idx; ++i)
+            bound = dmax(bound, state->worst(i, tracker->upper_bound));
+        state->bound[n1] = bound;
+    }
+    else {
+        const ckdtreenode *less = node_less(self, node1);
+        const ckdtreenode *greater = node_greater(self, node1);
+
+        seed_bounds(self, other, state, leaf, less, tracker);
+        seed_bounds(self, other, state, leaf, greater, tracker);
+
+        state->bound[n1] = dmax(state->bound[less - self->ctree],
+                                state->bound[greater - self->ctree]);
+    }
+}
+
+
+template <typename MinMaxDist> static void
+traverse_parallel(const ckdtree *self, const ckdtree *other,
+                  knn_state *state,
+                  RectRectDistanceTracker<MinMaxDist> *tracker,
+                  const int n_jobs)
+{
+    /*
+     * Only the nodes of self are split, so each task owns the heaps and
+     * the node bounds of a disjoint subtree of self.
+     */
+    std::vector<traverse_task<MinMaxDist> > tasks;
+
+    tasks.push_back(traverse_task<MinMaxDist>(self->ctree, other->ctree,
+                                              *tracker));
+    split_traversal(self, other, &tasks, 16 * n_jobs, 0, 0);
+
+    parallel_for(tasks.size(), n_jobs, 1,
+        [&](npy_intp start, npy_intp stop) {
+            knn_leaf leaf;
+            for (npy_intp k = start; k < stop; ++k) {
+                traverse_task<MinMaxDist> &t = tasks[k];
+                traverse(self, other, state, &leaf, t.node1, t.node2,
+                         &t.tracker);
+            }
+        });
+}
+
+
+static void
+store_results(const ckdtree *self, knn_state *state,
+              npy_float64 *dd, npy_intp *ii, const npy_intp *k,
+              const npy_intp nk, const npy_float64 p, const npy_intp nother,
+              const npy_intp start, const npy_intp stop)
+{
+    const npy_intp kmax = state->kmax;
+    std::vector<npy_float64> sd(kmax);
+    std::vector<npy_intp> si(kmax);
+
+    for (npy_intp i = start; i < stop; ++i) {
+        npy_float64 *result_distances = dd + self->raw_indices[i] * nk;
+        npy_intp *result_indices = ii + self->raw_indices[i] * nk;
+        npy_float64 *hd = &state->dist[i * kmax];
+        npy_intp *hi = &state->idx[i * kmax];
+        npy_intp n = state->count[i];
+        npy_intp j, c;
+
+        /* sort the neighbors by popping the max-heap */
+        while (n > 0) {
+            --n;
+            sd[n] = hd[0];
+            si[n] = hi[0];
+            const npy_float64 d = hd[n];
+            j = 0;
+            for (;;) {
+                c = 2 * j + 1;
+                if (c >= n)
+                    break;
+                if (c + 1 < n && hd[c + 1] > hd[c])
+                    ++c;
+                if (hd[c] <= d)
+                    break;
+                hd[j] = hd[c];
+                hi[j] = hi[c];
+                j = c;
+            }
+            hd[j] = d;
+            hi[j] = hi[n];
+        }
+
+        /* missing neighbors have infinite distance and index n */
+        n = state->count[i];
+        for (j = 0; j < nk; ++j) {
+            const npy_intp r = k[j] - 1;
+            if (r >= n) {
+                result_distances[j] = NPY_INFINITY;
+                result_indices[j] = nother;
+                continue;
+            }
+            result_indices[j] = si[r];
+            if (NPY_LIKELY(p == 2.0))
+                result_distances[j] = std::sqrt(sd[r]);
+            else if ((p == 1.) || (ckdtree_isinf(p)))
+                result_distances[j] = sd[r];
+            else
+                result_distances[j] = std::pow(sd[r], (1./p));
+        }
+    }
+}
+
+
+extern "C" PyObject*
+query_knn_tree(const ckdtree *self, const ckdtree *other,
+               npy_float64 *dd, npy_intp *ii,
+               const npy_intp *k, const npy_intp nk, const npy_intp kmax,
+               const npy_float64 eps, const npy_float64 p,
+               const npy_float64 distance_upper_bound, const int n_jobs)
+{
+
+#define DISPATCH(kls) { \
+        RectRectDistanceTracker<kls> tracker(self, r1, r2, p, eps, \
+                                             distance_upper_bound); \
+        knn_state state(self, kmax, tracker.upper_bound); \
+        knn_leaf leaf; \
+        compute_bboxes<kls::coord_type>(self, &state, self->ctree); \
+        seed_bounds(self, other, &state, &leaf, self->ctree, &tracker); \
+        if (n_jobs > 1) \
+            traverse_parallel(self, other, &state, &tracker, n_jobs); \
+        else \
+            traverse(self, other, &state, &leaf, self->ctree, \
+                     other->ctree, &tracker); \
+        parallel_for(self->n, n_jobs, 256, \
+            [&](npy_intp start, npy_intp stop) { \
+                store_results(self, &state, dd, ii, k, nk, p, other->n, \
+                              start, stop); \
+            }); \
+    }
+
+#define HANDLE(cond, kls) \
+    if(cond) { \
+        if (ckdtree_is_float32(self)) \
+            DISPATCH(kls##F32) \
+        else \
+            DISPATCH(kls) \
+    } else
+
+    /* release the GIL */
+    NPY_BEGIN_ALLOW_THREADS
+    {
+        try {
+            Rectangle r1(self->m, self->raw_mins, self->raw_maxes);
+            Rectangle r2(other->m, other->raw_mins, other->raw_maxes);
+
+            if(NPY_LIKELY(self->raw_boxsize_data == NULL)) {
+                HANDLE(self->raw_metric != NULL, CallbackDist)
+                HANDLE(NPY_LIKELY(p == 2), MinkowskiDistP2)
+                HANDLE(p == 1, MinkowskiDistP1)
+                HANDLE(ckdtree_isinf(p), MinkowskiDistPinf)
+                HANDLE(1, MinkowskiDistPp)
+                {}
+            } else {
+                HANDLE(NPY_LIKELY(p == 2), BoxMinkowskiDistP2)
+                HANDLE(p == 1, BoxMinkowskiDistP1)
+                HANDLE(ckdtree_isinf(p), BoxMinkowskiDistPinf)
+                HANDLE(1, BoxMinkowskiDistPp)
+                {}
+            }
+        }
+        catch(...) {
+            translate_cpp_exception_with_gil();
+        }
+    }
+    /* reacquire the GIL */
+    NPY_END_ALLOW_THREADS
+
+    if (PyErr_Occurred())
+        /* true if a C++ exception was translated */
+        return NULL;
+    else {
+        /* return None if there were no errors */
+        Py_RETURN_NONE;
+    }
+}
@@ -19,6 +19,7 @@
 #include "ckdtree_methods.h"
 #include "cpp_exc.h"
 #include "rectangle.h"
+#include "parallel_traverse.h"
 
 
 static void
@@ -55,8 +56,9 @@ traverse_no_checking(const ckdtree *self,
             }
         }                
         else {
-            traverse_no_checking(self, results, node1, node2->less);
-            traverse_no_checking(self, results, node1, node2->greater);
+            traverse_no_checking(self, results, node1, node_less(self, node2));
+            traverse_no_checking(self, results, node1,
+                                 node_greater(self, node2));
         }
     }
     else {
@@ -67,13 +69,17 @@ traverse_no_checking(const ckdtree *self,
              * over, which is the source of the complication in the
              * original KDTree.query_pairs)
              */
-            traverse_no_checking(self, results, node1->less, node2->less);
-            traverse_no_checking(self, results, node1->less, node2->greater);
-            traverse_no_checking(self, results, node1->greater, node2->greater);
+            traverse_no_checking(self, results, node_less(self, node1),
+                                 node_less(self, node2));
+            traverse_no_checking(self, results, node_less(self, node1),
+                                 node_greater(self, node2));
+            traverse_no_checking(self, results, node_greater(self, node1),
+                                 node_greater(self, node2));
         }
         else {
-            traverse_no_checking(self, results, node1->less, node2);
-            traverse_no_checking(self, results, node1->greater, node2);
+            traverse_no_checking(self, results, node_less(self, node1), node2);
+            traverse_no_checking(self, results, node_greater(self, node1),
+                                 node2);
         }
     }
 }    
@@ -103,7 +109,8 @@ traverse_checking(const ckdtree *self,
             /* brute-force */
             const npy_float64 p = tracker->p;
             const npy_float64 tub = tracker->upper_bound;
-            const npy_float64 *data = self->raw_data;
+            typedef typename MinMaxDist::coord_type coord_type;
+            const coord_type *data = tree_points<coord_type>(self);
             const npy_intp *indices = self->raw_indices;
             const npy_intp m = self->m;
             const npy_intp start1 = lnode1->start_idx;
@@ -115,66 +122,73 @@ traverse_checking(const ckdtree *self,
             if (start1 < end1)
                prefetch_datapoint(data+indices[start1+1]*m, m);
             
+            npy_float64 dbuf[CKDTREE_LEAF_BLOCK];
+            
             for(i = start1; i < end1; ++i) {
             
                 if (i < end1-2)
                      prefetch_datapoint(data+indices[i+2]*m, m);
+                
+                const npy_float64 *xi = point_as_float64(
+                    data + indices[i] * m, m, tracker->xbuf);
                                
                 /* Special care here to avoid duplicate pairs */
                 if (node1 == node2)
                     min_j = i + 1;
                 else
                     min_j = start2;
-                               
-                prefetch_datapoint(data+indices[min_j]*m, m);
-                if (min_j < end2)
-                    prefetch_datapoint(data+indices[min_j+1]*m, m);
                             
-                for (j = min_j; j < end2; ++j) {
-                                        
-                    if (j < end2-2)
-                        prefetch_datapoint(data+indices[j+2]*m, m);
+                for (j = min_j; j < end2; j += CKDTREE_LEAF_BLOCK) {
+                    npy_intp jj, nb = end2 - j;
+                    if (nb > CKDTREE_LEAF_BLOCK)
+                        nb = CKDTREE_LEAF_BLOCK;
                                         
-                    d = MinMaxDist::distance_p(
-                            self,
-                            data + indices[i] * m,
-                            data + indices[j] * m,
-                            p, m, tub);
+                    MinMaxDist::leaf_distances_p(self, xi,
+                        data, indices + j, nb, p, m, tub, dbuf);
                 
-                    if (d <= tub)
-                        add_ordered_pair(results, indices[i], indices[j]);
+                    for (jj = 0; jj < nb; ++jj) {
+                        d = dbuf[jj];
+                        if (d <= tub)
+                            add_ordered_pair(results, indices[i], 
+                                             indices[j + jj]);
+                    }
                 }
             }
         }                      
         else {  /* 1 is a leaf node, 2 is inner node */
             tracker->push_less_of(2, node2);
-            traverse_checking(self, results, node1, node2->less, tracker);
+            traverse_checking(self, results, node1, node_less(self, node2),
+                              tracker);
             tracker->pop();
                 
             tracker->push_greater_of(2, node2);
-            traverse_checking(self, results, node1, node2->greater, tracker);
+            traverse_checking(self, results, node1, node_greater(self, node2),
+                              tracker);
             tracker->pop();
         }
     }        
     else {  /* 1 is an inner node */
         if (node2->split_dim == -1) { /* 1 is an inner node, 2 is a leaf node */
             tracker->push_less_of(1, node1);
-            traverse_checking(self, results, node1->less, node2, tracker);
+            traverse_checking(self, results, node_less(self, node1), node2,
+                              tracker);
             tracker->pop();
             
             tracker->push_greater_of(1, node1);
-            traverse_checking(self, results, node1->greater, node2, tracker);
+            traverse_checking(self, results, node_greater(self, node1), node2,
+                              tracker);
             tracker->pop();
         }    
         else { /* 1 and 2 are inner nodes */
             tracker->push_less_of(1, node1);
             tracker->push_less_of(2, node2);
-            traverse_checking(self, results, node1->less, node2->less, tracker);
+            traverse_checking(self, results, node_less(self, node1),
+                              node_less(self, node2), tracker);
             tracker->pop();
                 
             tracker->push_greater_of(2, node2);
-            traverse_checking(self, results, node1->less, node2->greater, 
-                tracker);
+            traverse_checking(self, results, node_less(self, node1),
+                              node_greater(self, node2), tracker);
             tracker->pop();
             tracker->pop();
                 
@@ -187,13 +201,13 @@ traverse_checking(const ckdtree *self,
                  * the original KDTree.query_pairs)
                  */
                 tracker->push_less_of(2, node2);
-                traverse_checking(self, results, node1->greater, node2->less, 
-                    tracker);
+                traverse_checking(self, results, node_greater(self, node1),
+                                  node_less(self, node2), tracker);
                 tracker->pop();
             }    
             tracker->push_greater_of(2, node2);
-            traverse_checking(self, results, node1->greater, node2->greater, 
-                tracker);
+            traverse_checking(self, results, node_greater(self, node1),
+                              node_greater(self, node2), tracker);
             tracker->pop();
             tracker->pop();
         }
@@ -201,19 +215,51 @@ traverse_checking(const ckdtree *self,
 }
 
 
-#include <iostream>
+template <typename MinMaxDist> static void
+traverse_parallel(const ckdtree *self,
+                  std::vector<ordered_pair> *results,
+                  RectRectDistanceTracker<MinMaxDist> *tracker,
+                  const int n_jobs)
+{
+    std::vector<traverse_task<MinMaxDist> > tasks;
+    tasks.push_back(traverse_task<MinMaxDist>(self->ctree, self->ctree,
+                                              *tracker));
+    split_traversal(self, self, &tasks, 16 * n_jobs, 1, 1);
+
+    /* each task collects its pairs in its own buffer */
+    std::vector<std::vector<ordered_pair> > parts(tasks.size());
+    parallel_for(tasks.size(), n_jobs, 1,
+        [&](npy_intp start, npy_intp stop) {
+        for (npy_intp i = start; i < stop; ++i) {
+            traverse_task<MinMaxDist> &t = tasks[i];
+            traverse_checking(self, &parts[i], t.node1, t.node2, &t.tracker);
+        }
+        });
+    concatenate_task_results(parts, results, n_jobs);
+}
+
 
 extern "C" PyObject*
 query_pairs(const ckdtree *self, 
             const npy_float64 r, const npy_float64 p, const npy_float64 eps,
-            std::vector<ordered_pair> *results)
+            std::vector<ordered_pair> *results, const int n_jobs)
 {
 
+#define DISPATCH(kls) { \
+        RectRectDistanceTracker<kls> tracker(self, r1, r2, p, eps, r);\
+        if (n_jobs > 1) \
+            traverse_parallel(self, results, &tracker, n_jobs); \
+        else \
+            traverse_checking(self, results, self->ctree, self->ctree, \
+                &tracker); \
+    }
+
 #define HANDLE(cond, kls) \
     if(cond) { \
-        RectRectDistanceTracker<kls> tracker(self, r1, r2, p, eps, r);\
-        traverse_checking(self, results, self->ctree, self->ctree, \
-            &tracker); \
+        if (ckdtree_is_float32(self)) \
+            DISPATCH(kls##F32) \
+        else \
+            DISPATCH(kls) \
     } else
 
     /* release the GIL */
@@ -225,6 +271,7 @@ query_pairs(const ckdtree *self,
             Rectangle r2(self->m, self->raw_mins, self->raw_maxes);
                                     
             if(NPY_LIKELY(self->raw_boxsize_data == NULL)) {
+                HANDLE(self->raw_metric != NULL, CallbackDist)
                 HANDLE(NPY_LIKELY(p == 2), MinkowskiDistP2)
                 HANDLE(p == 1, MinkowskiDistP1)
                 HANDLE(ckdtree_isinf(p), MinkowskiDistPinf)
@@ -23,36 +23,38 @@
  * ===================
  */
  
+/*
+ * The mins and maxes are stored in one buffer, so that a rectangle is
+ * copied with one allocation and one memcpy. This matters for the
+ * trackers copied into the tasks of the parallel traversals.
+ */
 struct Rectangle {
     
     npy_intp m;
     npy_float64 *mins;
     npy_float64 *maxes;
     
-    std::vector<npy_float64> mins_arr;
-    std::vector<npy_float64> maxes_arr;
+    std::vector<npy_float64> buf;
 
     Rectangle(const npy_intp _m, 
               const npy_float64 *_mins, 
-              const npy_float64 *_maxes) : mins_arr(_m), maxes_arr(_m) {
+              const npy_float64 *_maxes) : buf(2 * _m) {
 
         /* copy array data */
         m = _m;
-        mins = &mins_arr[0];
-        maxes = &maxes_arr[0];        
+        mins = &buf[0];
+        maxes = &buf[m];        
         std::memcpy((void*)mins, (void*)_mins, m*sizeof(npy_float64));
         std::memcpy((void*)maxes, (void*)_maxes, m*sizeof(npy_float64));
     };    
          
-    Rectangle(const Rectangle& rect) : mins_arr(rect.m), maxes_arr(rect.m) {
+    Rectangle(const Rectangle& rect) : buf(rect.buf) {
         m = rect.m;
-        mins = &mins_arr[0];
-        maxes = &maxes_arr[0];        
-        std::memcpy((void*)mins, (void*)rect.mins, m*sizeof(npy_float64));
-        std::memcpy((void*)maxes, (void*)rect.maxes, m*sizeof(npy_float64));         
+        mins = &buf[0];
+        maxes = &buf[m];        
     };    
     
-    Rectangle() : mins_arr(0), maxes_arr(0) {
+    Rectangle() : buf(0) {
         m = 0;
         mins = NULL;
         maxes = NULL;
@@ -61,8 +63,10 @@ struct Rectangle {
 };
 
 #include "ckdtree_methods.h"
+#include "leaf_kernels.h"
 #include "distance.h"
 #include "distance_box.h"
+#include "distance_callback.h"
 
 /*
  * Rectangle-to-rectangle distance tracker
@@ -125,6 +129,9 @@ template<typename MinMaxDist>
     npy_intp stack_max_size;
     std::vector<RR_stack_item> stack_arr;
     RR_stack_item *stack;
+    
+    /* scratch space for the points of float32 trees in the leaf scans */
+    std::vector<npy_float64> xbuf;
 
     void _resize_stack(const npy_intp new_max_size) {
         stack_arr.resize(new_max_size);
@@ -136,7 +143,8 @@ template<typename MinMaxDist>
                  const Rectangle& _rect1, const Rectangle& _rect2,
                  const npy_float64 _p, const npy_float64 eps, 
                  const npy_float64 _upper_bound)
-        : tree(_tree), rect1(_rect1), rect2(_rect2), stack_arr(8) {
+        : tree(_tree), rect1(_rect1), rect2(_rect2), stack_arr(8), 
+          xbuf(_rect1.m) {
     
         if (rect1.m != rect2.m) {
             const char *msg = "rect1 and rect2 have different dimensions";
@@ -175,6 +183,16 @@ template<typename MinMaxDist>
     };
     
 
+    RectRectDistanceTracker(const RectRectDistanceTracker &t)
+        : tree(t.tree), rect1(t.rect1), rect2(t.rect2), p(t.p), 
+          epsfac(t.epsfac), upper_bound(t.upper_bound), 
+          min_distance(t.min_distance), max_distance(t.max_distance),
+          stack_size(t.stack_size), stack_max_size(t.stack_max_size),
+          stack_arr(t.stack_arr), xbuf(t.xbuf.size()) {
+        /* the stack pointer must refer to our own copy of the stack */
+        stack = &stack_arr[0];
+    };
+    
     void push(const npy_intp which, const npy_intp direction,
               const npy_intp split_dim, const npy_float64 split_val) {
         
@@ -200,32 +218,66 @@ template<typename MinMaxDist>
         item->max_along_dim = rect->maxes[split_dim];
 
         /* update min/max distances */
-        npy_float64 min, max;
+        npy_float64 min_old, max_old, min_new, max_new;
 
-        MinMaxDist::interval_interval_p(tree, rect1, rect2, split_dim, p, &min, &max);
+        if (!MinMaxDist::separable) {
+            if (direction == LESS)
+                rect->maxes[split_dim] = split_val;
+            else
+                rect->mins[split_dim] = split_val;
+            MinMaxDist::rect_rect_p(tree, rect1, rect2, p, 
+                                    &min_distance, &max_distance);
+            return;
+        }
 
-        min_distance -= min;
-        max_distance -= max;
+        MinMaxDist::interval_interval_p(tree, rect1, rect2, split_dim, p, 
+                                        &min_old, &max_old);
         
         if (direction == LESS)
             rect->maxes[split_dim] = split_val;
         else
             rect->mins[split_dim] = split_val;
 
-        MinMaxDist::interval_interval_p(tree, rect1, rect2, split_dim, p, &min, &max);
+        MinMaxDist::interval_interval_p(tree, rect1, rect2, split_dim, p, 
+                                        &min_new, &max_new);
 
-        min_distance += min;
-        max_distance += max;
+        if (MinMaxDist::max_norm) {
+            /*
+             * The distances are maxima over the dimensions. If the
+             * dimension which is split did not attain the maximum, or its
+             * distance did not decrease, the new maximum follows from the
+             * old one. Otherwise the other dimensions are rescanned.
+             */
+            if (min_old < min_distance || min_new >= min_old)
+                min_distance = dmax(min_distance, min_new);
+            else
+                min_distance = rescan_min_max(0);
+            if (max_old < max_distance || max_new >= max_old)
+                max_distance = dmax(max_distance, max_new);
+            else
+                max_distance = rescan_min_max(1);
+        }
+        else {
+            min_distance = (min_distance - min_old) + min_new;
+            max_distance = (max_distance - max_old) + max_new;
+        }
+    };
 
+    npy_float64 rescan_min_max(const int max) {
+        npy_float64 min_, max_;
+        MinMaxDist::rect_rect_p(tree, rect1, rect2, p, &min_, &max_);
+        return max ? max_ : min_;
     };
 
+    template <typename Node>
     inline void push_less_of(const npy_intp which,
-                                 const ckdtreenode *node) {
+                                 const Node *node) {
         push(which, LESS, node->split_dim, node->split);
     };
             
+    template <typename Node>
     inline void push_greater_of(const npy_intp which,
-                                    const ckdtreenode *node) {
+                                    const Node *node) {
         push(which, GREATER, node->split_dim, node->split);
     };
     
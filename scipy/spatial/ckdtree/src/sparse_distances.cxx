@@ -20,6 +20,7 @@
 #include "cpp_exc.h"
 #include "rectangle.h"
 #include "coo_entries.h"
+#include "parallel_traverse.h"
 
 template <typename MinMaxDist> static void
 traverse(const ckdtree *self, const ckdtree *other, 
@@ -36,9 +37,10 @@ traverse(const ckdtree *self, const ckdtree *other,
             /* brute-force */
             const npy_float64 p = tracker->p;
             const npy_float64 tub = tracker->upper_bound;
-            const npy_float64 *sdata = self->raw_data;
+            typedef typename MinMaxDist::coord_type coord_type;
+            const coord_type *sdata = tree_points<coord_type>(self);
             const npy_intp *sindices = self->raw_indices;
-            const npy_float64 *odata = other->raw_data;
+            const coord_type *odata = tree_points<coord_type>(other);
             const npy_intp *oindices = other->raw_indices;
             const npy_intp m = self->m;
             const npy_intp start1 = node1->start_idx;
@@ -50,45 +52,48 @@ traverse(const ckdtree *self, const ckdtree *other,
             if (start1 < end1)
                prefetch_datapoint(sdata + sindices[start1+1] * m, m);                         
                         
+            npy_float64 dbuf[CKDTREE_LEAF_BLOCK];
+                        
             for (npy_intp i = start1; i < end1; ++i) {
             
                 if (i < end1-2)
                      prefetch_datapoint(sdata + sindices[i+2] * m, m);
-            
-                prefetch_datapoint(odata + oindices[start2] * m, m);
-                if (start2 < end2)
-                    prefetch_datapoint(sdata + oindices[start2+1] * m, m);
-                    
-                for (npy_intp j = start2; j < end2; ++j) {
                 
-                    if (j < end2-2)
-                        prefetch_datapoint(odata + oindices[j+2] * m, m);
+                const npy_float64 *xi = point_as_float64(
+                    sdata + sindices[i] * m, m, tracker->xbuf);
+                    
+                for (npy_intp j = start2; j < end2; j += CKDTREE_LEAF_BLOCK) {
+                    npy_intp nb = end2 - j;
+                    if (nb > CKDTREE_LEAF_BLOCK)
+                        nb = CKDTREE_LEAF_BLOCK;
                 
-                    npy_float64 d = MinMaxDist::distance_p(
-                            self,
-                            sdata + sindices[i] * m,
-                            odata + oindices[j] * m,
-                            p, m, tub);
+                    MinMaxDist::leaf_distances_p(self, xi,
+                        odata, oindices + j, nb, p, m, tub, dbuf);
                         
-                    if (d <= tub) {
-                        if (NPY_LIKELY(p == 2.0))
-                            d = std::sqrt(d);
-                        else if ((p != 1) && (!ckdtree_isinf(p)))
-                            d = std::pow(d, 1. / p);
-                         
-                        coo_entry e = {sindices[i], oindices[j], d};
-                        results->push_back(e);
+                    for (npy_intp jj = 0; jj < nb; ++jj) {
+                        npy_float64 d = dbuf[jj];
+                        if (d <= tub) {
+                            if (NPY_LIKELY(p == 2.0))
+                                d = std::sqrt(d);
+                            else if ((p != 1) && (!ckdtree_isinf(p)))
+                                d = std::pow(d, 1. / p);
+                             
+                            coo_entry e = {sindices[i], oindices[j + jj], d};
+                            results->push_back(e);
+                        }
                     }
                 }
             }
         }
         else {  /* 1 is a leaf node, 2 is inner node */
             tracker->push_less_of(2, node2);
-            traverse(self, other, results, node1, node2->less, tracker);
+            traverse(self, other, results, node1, node_less(other, node2),
+                     tracker);
             tracker->pop();
                 
             tracker->push_greater_of(2, node2);
-            traverse(self, other, results, node1, node2->greater, tracker);
+            traverse(self, other, results, node1, node_greater(other, node2),
+                     tracker);
             tracker->pop();
         }
     }        
@@ -96,49 +101,90 @@ traverse(const ckdtree *self, const ckdtree *other,
         if (node2->split_dim == -1) {  
             /* 1 is an inner node, 2 is a leaf node*/
             tracker->push_less_of(1, node1);
-            traverse(self, other, results, node1->less, node2, tracker);
+            traverse(self, other, results, node_less(self, node1), node2,
+                     tracker);
             tracker->pop();
             
             tracker->push_greater_of(1, node1);
-            traverse(self, other, results, node1->greater, node2, tracker);
+            traverse(self, other, results, node_greater(self, node1), node2,
+                     tracker);
             tracker->pop();
         }    
         else { /* 1 and 2 are inner nodes */
             tracker->push_less_of(1, node1);
             tracker->push_less_of(2, node2);
-            traverse(self, other, results, node1->less, node2->less, tracker);
+            traverse(self, other, results, node_less(self, node1),
+                     node_less(other, node2), tracker);
             tracker->pop();
                 
             tracker->push_greater_of(2, node2);
-            traverse(self, other, results, node1->less, node2->greater, tracker);
+            traverse(self, other, results, node_less(self, node1),
+                     node_greater(other, node2), tracker);
             tracker->pop();
             tracker->pop();
                 
             tracker->push_greater_of(1, node1);
             tracker->push_less_of(2, node2);
-            traverse(self, other, results, node1->greater, node2->less, tracker);
+            traverse(self, other, results, node_greater(self, node1),
+                     node_less(other, node2), tracker);
             tracker->pop();
                
             tracker->push_greater_of(2, node2);
-            traverse(self, other, results, node1->greater, node2->greater, 
-                tracker);
+            traverse(self, other, results, node_greater(self, node1),
+                     node_greater(other, node2), tracker);
             tracker->pop();
             tracker->pop();
         }    
     }
 }
 
+
+template <typename MinMaxDist> static void
+traverse_parallel(const ckdtree *self, const ckdtree *other,
+                  std::vector<coo_entry> *results,
+                  RectRectDistanceTracker<MinMaxDist> *tracker,
+                  const int n_jobs)
+{
+    std::vector<traverse_task<MinMaxDist> > tasks;
+    tasks.push_back(traverse_task<MinMaxDist>(self->ctree, other->ctree,
+                                              *tracker));
+    split_traversal(self, other, &tasks, 16 * n_jobs, 1, 0);
+
+    /* each task collects its entries in its own buffer */
+    std::vector<std::vector<coo_entry> > parts(tasks.size());
+    parallel_for(tasks.size(), n_jobs, 1,
+        [&](npy_intp start, npy_intp stop) {
+        for (npy_intp i = start; i < stop; ++i) {
+            traverse_task<MinMaxDist> &t = tasks[i];
+            traverse(self, other, &parts[i], t.node1, t.node2, &t.tracker);
+        }
+        });
+    concatenate_task_results(parts, results, n_jobs);
+}
+
         
 extern "C" PyObject*
 sparse_distance_matrix(const ckdtree *self, const ckdtree *other,
                        const npy_float64 p,
                        const npy_float64 max_distance,
-                       std::vector<coo_entry> *results)
+                       std::vector<coo_entry> *results,
+                       const int n_jobs)
 {
+#define DISPATCH(kls) { \
+        RectRectDistanceTracker<kls> tracker(self, r1, r2, p, 0, max_distance);\
+        if (n_jobs > 1) \
+            traverse_parallel(self, other, results, &tracker, n_jobs); \
+        else \
+            traverse(self, other, results, self->ctree, other->ctree, \
+                     &tracker); \
+    }
+
 #define HANDLE(cond, kls) \
     if(cond) { \
-        RectRectDistanceTracker<kls> tracker(self, r1, r2, p, 0, max_distance);\
-        traverse(self, other, results, self->ctree, other->ctree, &tracker); \
+        if (ckdtree_is_float32(self)) \
+            DISPATCH(kls##F32) \
+        else \
+            DISPATCH(kls) \
     } else
 
     /* release the GIL */
@@ -149,6 +195,7 @@ sparse_distance_matrix(const ckdtree *self, const ckdtree *other,
             Rectangle r1(self->m, self->raw_mins, self->raw_maxes);
             Rectangle r2(other->m, other->raw_mins, other->raw_maxes);             
             if(NPY_LIKELY(self->raw_boxsize_data == NULL)) {
+                HANDLE(self->raw_metric != NULL, CallbackDist)
                 HANDLE(NPY_LIKELY(p == 2), MinkowskiDistP2)
                 HANDLE(p == 1, MinkowskiDistP1)
                 HANDLE(ckdtree_isinf(p), MinkowskiDistPinf)
@@ -0,0 +1,266 @@
+#include <Python.h>
+#include "numpy/arrayobject.h"
+
+#include <vector>
+#include <new>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+#include "thread_pool.h"
+
+
+/*
+ * Work ranges
+ * ===========
+ *
+ * Every participant of a loop owns one range. The owner takes chunks from
+ * the front, thieves take the back half. Both are serialized by a small
+ * mutex per range, which is only contended while stealing.
+ */
+
+struct work_range {
+    std::mutex  lock;
+    npy_intp    begin;
+    npy_intp    end;
+    char        padding[64];  /* keep ranges on separate cache lines */
+};
+
+struct parallel_loop {
+    const parallel_body_t  *body;
+    npy_intp               grain;
+    int                    nthreads;
+    std::vector<work_range> ranges;
+    std::mutex             error_lock;
+    std::exception_ptr     error;
+
+    parallel_loop(const parallel_body_t *_body, const npy_intp n,
+                  const npy_intp _grain, const int _nthreads)
+        : body(_body), grain(_grain), nthreads(_nthreads),
+          ranges(_nthreads) {
+        for (int j = 0; j < nthreads; ++j) {
+            ranges[j].begin = j * n / nthreads;
+            ranges[j].end = (j + 1) * n / nthreads;
+        }
+    }
+
+    /* take the next chunk from our own range */
+    bool next_chunk(const int self, npy_intp *start, npy_intp *stop) {
+        work_range &r = ranges[self];
+        std::lock_guard<std::mutex> guard(r.lock);
+        npy_intp left = r.end - r.begin;
+        if (left <= 0)
+            return false;
+        npy_intp chunk = left / (2 * nthreads);
+        if (chunk < grain)
+            chunk = grain;
+        if (chunk > left)
+            chunk = left;
+        *start = r.begin;
+        *stop = r.begin + chunk;
+        r.begin += chunk;
+        return true;
+    }
+
+    /* move the back half of the largest other range to our own range */
+    bool steal(const int self) {
+        for (;;) {
+            int victim = -1;
+            npy_intp most = 0;
+            for (int j = 0; j < nthreads; ++j) {
+                if (j == self)
+                    continue;
+                std::lock_guard<std::mutex> guard(ranges[j].lock);
+                npy_intp left = ranges[j].end - ranges[j].begin;
+                if (left > most) {
+                    most = left;
+                    victim = j;
+                }
+            }
+            if (victim < 0)
+                return false;
+            npy_intp start, stop;
+            {
+                work_range &r = ranges[victim];
+                std::lock_guard<std::mutex> guard(r.lock);
+                npy_intp left = r.end - r.begin;
+                if (left <= 0)
+                    continue;  /* lost the race, look again */
+                npy_intp half = (left + 1) / 2;
+                start = r.end - half;
+                stop = r.end;
+                r.end = start;
+            }
+            work_range &own = ranges[self];
+            std::lock_guard<std::mutex> guard(own.lock);
+            own.begin = start;
+            own.end = stop;
+            return true;
+        }
+    }
+
+    void run(const int self) {
+        try {
+            npy_intp start, stop;
+            for (;;) {
+                if (next_chunk(self, &start, &stop))
+                    (*body)(start, stop);
+                else if (!steal(self))
+                    break;
+            }
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> guard(error_lock);
+            if (!error)
+                error = std::current_exception();
+            /* abandon the remaining work */
+            for (int j = 0; j < nthreads; ++j) {
+                std::lock_guard<std::mutex> g(ranges[j].lock);
+                ranges[j].begin = ranges[j].end;
+            }
+        }
+    }
+};
+
+
+/*
+ * Thread pool
+ * ===========
+ */
+
+struct thread_pool {
+
+    std::mutex               busy;     /* held by the thread running a loop */
+    std::mutex               lock;
+    std::condition_variable  wakeup;
+    std::condition_variable  done;
+    std::vector<std::thread> workers;
+    parallel_loop            *loop;
+    npy_uintp                generation;
+    int                      participants;
+    int                      finished;
+
+    thread_pool() : loop(NULL), generation(0), participants(0), finished(0) {}
+
+    void worker_main(const int self) {
+        npy_uintp seen = 0;
+        for (;;) {
+            parallel_loop *current;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                while (generation == seen || self >= participants)
+                    wakeup.wait(guard);
+                seen = generation;
+                current = loop;
+            }
+            current->run(self);
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (++finished == participants - 1)
+                    done.notify_one();
+            }
+        }
+    }
+
+    void run(parallel_loop *l) {
+        /* the workers are numbered 1, ..., nthreads-1 */
+        while ((int) workers.size() < l->nthreads - 1) {
+            workers.push_back(std::thread(&thread_pool::worker_main, this,
+                                          (int) workers.size() + 1));
+            workers.back().detach();
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            loop = l;
+            participants = l->nthreads;
+            finished = 0;
+            ++generation;
+        }
+        wakeup.notify_all();
+        l->run(0);
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (finished < participants - 1)
+                done.wait(guard);
+            participants = 0;
+            loop = NULL;
+        }
+    }
+};
+
+
+/* The pool is never destroyed: its threads are detached and blocked on a
+ * condition variable when the interpreter exits. After fork() only the
+ * forking thread exists in the child, so a new pool is started there.
+ */
+static thread_pool *the_pool = NULL;
+static std::mutex the_pool_lock;
+#if !defined(_WIN32)
+static pid_t the_pool_pid = 0;
+#endif
+
+static thread_pool *
+get_thread_pool()
+{
+    std::lock_guard<std::mutex> guard(the_pool_lock);
+#if !defined(_WIN32)
+    if (the_pool != NULL && the_pool_pid != getpid())
+        the_pool = NULL;
+    the_pool_pid = getpid();
+#endif
+    if (the_pool == NULL)
+        the_pool = new thread_pool();
+    return the_pool;
+}
+
+
+/* The pool never grows beyond the number of hardware threads, or 64 if
+ * that is not known, so a large n_jobs does not leave hundreds of idle
+ * threads behind. The work of the jobs above the limit is shared out by
+ * stealing.
+ */
+static int
+max_pool_threads()
+{
+    static const int nthreads = (int) std::thread::hardware_concurrency();
+    return nthreads > 0 ? nthreads : 64;
+}
+
+
+void
+parallel_for(const npy_intp n, int n_jobs, const npy_intp grain,
+             const parallel_body_t &body)
+{
+    const npy_intp g = grain > 0 ? grain : 1;
+
+    if (n <= 0)
+        return;
+    if (n_jobs > max_pool_threads())
+        n_jobs = max_pool_threads();
+    /* no point in waking up more threads than there are chunks */
+    if (n_jobs > (n + g - 1) / g)
+        n_jobs = (int) ((n + g - 1) / g);
+    if (n_jobs <= 1) {
+        body(0, n);
+        return;
+    }
+
+    thread_pool *pool = get_thread_pool();
+    std::unique_lock<std::mutex> busy(pool->busy, std::try_to_lock);
+    if (!busy.owns_lock()) {
+        /* another thread is using the pool */
+        body(0, n);
+        return;
+    }
+
+    parallel_loop l(&body, n, g, n_jobs);
+    pool->run(&l);
+    busy.unlock();
+    if (l.error)
+        std::rethrow_exception(l.error);
+}
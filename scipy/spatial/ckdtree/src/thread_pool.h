@@ -0,0 +1,37 @@
+#ifndef CKDTREE_THREAD_POOL
+#define CKDTREE_THREAD_POOL
+
+#include <Python.h>
+#include "numpy/arrayobject.h"
+
+#include <functional>
+
+/*
+ * Persistent thread pool
+ * ======================
+ *
+ * The worker threads are started on first use and kept alive between calls,
+ * so a query over a small batch of points does not pay for thread creation.
+ * They never touch the Python C API and must only be used while the GIL is
+ * released.
+ *
+ * parallel_for(n, n_jobs, grain, body) calls body(start, stop) for disjoint
+ * subranges covering [0, n). Each participating thread owns a contiguous
+ * part of the range and carves chunks off its front, with the chunk size
+ * shrinking as the range is used up. A thread that runs out of work steals
+ * the back half of the largest remaining range, so skewed workloads are
+ * balanced dynamically. The calling thread participates in the loop, and
+ * n_jobs is limited to the number of hardware threads.
+ *
+ * An exception thrown by body is rethrown in the calling thread after all
+ * participants have finished. If the pool is busy with a loop started from
+ * another thread, the loop is executed serially by the caller.
+ */
+
+typedef std::function<void(npy_intp, npy_intp)> parallel_body_t;
+
+void
+parallel_for(const npy_intp n, int n_jobs, const npy_intp grain,
+             const parallel_body_t &body);
+
+#endif
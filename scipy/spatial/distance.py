@@ -109,6 +109,8 @@ __all__ = [
 
 
 import warnings
+import threading
+from multiprocessing import cpu_count
 import numpy as np
 
 from scipy._lib.six import callable, string_types
@@ -945,6 +947,77 @@ def sokalsneath(u, v):
     return float(2.0 * (ntf + nft)) / denom
 
 
+def _row_blocks(m, n_jobs, condensed=False):
+    """
+    Split m rows into at most n_jobs contiguous blocks of equal work.
+
+    With condensed=True the rows are those of a condensed distance matrix,
+    where row i holds the m - 1 - i distances to the later points, and the
+    blocks hold equal numbers of distances rather than of rows.
+    """
+    if n_jobs == -1:
+        n_jobs = cpu_count()
+    if n_jobs < 1:
+        raise ValueError("n_jobs must be -1 or a positive integer")
+    n_blocks = min(n_jobs, m)
+    if n_blocks <= 1:
+        return [(0, m)]
+    if condensed:
+        # row i ends at entry (i + 1) * m - (i + 1) * (i + 2) // 2
+        ends = np.arange(1, m + 1)
+        ends = ends * m - ends * (ends + 1) // 2
+        targets = np.arange(1, n_blocks) * (m * (m - 1) // 2) // n_blocks
+        bounds = np.searchsorted(ends, targets) + 1
+    else:
+        bounds = np.arange(1, n_blocks) * m // n_blocks
+    bounds = np.unique(np.concatenate([[0], bounds, [m]]))
+    return list(zip(bounds[:-1], bounds[1:]))
+
+
+def _run_row_blocks(func, m, n_jobs, condensed=False):
+    """
+    Call func(start, stop) for blocks of the m rows, in n_jobs threads.
+
+    The C wrappers release the GIL, so the blocks are computed in parallel.
+    """
+    blocks = _row_blocks(m, n_jobs, condensed)
+    if len(blocks) == 1:
+        func(*blocks[0])
+        return
+
+    errors = []
+
+    def run(start, stop):
+        try:
+            func(start, stop)
+        except BaseException as e:
+            errors.append(e)
+
+    threads = [threading.Thread(target=run, args=block)
+               for block in blocks[1:]]
+    for t in threads:
+        t.start()
+    run(*blocks[0])
+    for t in threads:
+        t.join()
+    if errors:
+        raise errors[0]
+
+
+def _parallel_pdist(pdist_fn, n_jobs, X, *args):
+    # pdist_fn(X, *args, start, stop) computes the rows start:stop
+    _run_row_blocks(lambda start, stop: pdist_fn(X, *(args + (start, stop))),
+                    X.shape[0], n_jobs, condensed=True)
+
+
+def _parallel_cdist(cdist_fn, n_jobs, XA, XB, dm, *args):
+    # the blocks of rows of XA and dm are C contiguous
+    _run_row_blocks(lambda start, stop: cdist_fn(XA[start:stop], XB,
+                                                 dm[start:stop], *args),
+                    XA.shape[0], n_jobs)
+
+
+
 # Registry of "simple" distance metrics' pdist and cdist implementations,
 # meaning the ones that accept one dtype and have no additional arguments.
 _SIMPLE_CDIST = {}
@@ -964,6 +1037,14 @@ for names, wrap_name in [
         _SIMPLE_CDIST[name] = _convert_to_double, cdist_fn
         _SIMPLE_PDIST[name] = _convert_to_double, pdist_fn
 
+# Metrics which cdist can compute with matrix products, and whether the
+# distances are squared.
+_GEMM_CDIST = {}
+for name in ["euclidean", "euclid", "eu", "e"]:
+    _GEMM_CDIST[name] = False
+for name in ["sqeuclidean", "sqe", "sqeuclid"]:
+    _GEMM_CDIST[name] = True
+
 for name in ["dice", "kulsinski", "matching", "rogerstanimoto", "russellrao",
              "sokalmichener", "sokalsneath", "yule"]:
     wrap_name = "hamming" if name == "matching" else name
@@ -975,7 +1056,7 @@ for name in ["dice", "kulsinski", "matching", "rogerstanimoto", "russellrao",
     _SIMPLE_PDIST[name] = _convert_to_bool, pdist_fn
 
 
-def pdist(X, metric='euclidean', p=2, w=None, V=None, VI=None):
+def pdist(X, metric='euclidean', p=2, w=None, V=None, VI=None, n_jobs=1):
     """
     Pairwise distances between observations in n-dimensional space.
 
@@ -1181,6 +1262,13 @@ def pdist(X, metric='euclidean', p=2, w=None, V=None, VI=None):
         The variance vector (for standardized Euclidean).
     VI : ndarray, optional
         The inverse of the covariance matrix (for Mahalanobis).
+    n_jobs : int, optional
+        Number of threads to compute the distances with, for the metrics
+        given as strings which are implemented in C. The work is split
+        into blocks of rows of the condensed distance matrix. If -1 is
+        given, all CPUs are used. Default: 1.
+
+        .. versionadded:: 0.18.0
 
     Returns
     -------
@@ -1254,7 +1342,7 @@ def pdist(X, metric='euclidean', p=2, w=None, V=None, VI=None):
         try:
             validate, pdist_fn = _SIMPLE_PDIST[mstr]
             X = validate(X)
-            pdist_fn(X, dm)
+            _parallel_pdist(pdist_fn, n_jobs, X, dm)
             return dm
         except KeyError:
             pass
@@ -1262,24 +1350,30 @@ def pdist(X, metric='euclidean', p=2, w=None, V=None, VI=None):
         if mstr in ['hamming', 'hamm', 'ha', 'h']:
             if X.dtype == bool:
                 X = _convert_to_bool(X)
-                _distance_wrap.pdist_hamming_bool_wrap(X, dm)
+                _parallel_pdist(_distance_wrap.pdist_hamming_bool_wrap, n_jobs,
+                                X, dm)
             else:
                 X = _convert_to_double(X)
-                _distance_wrap.pdist_hamming_wrap(X, dm)
+                _parallel_pdist(_distance_wrap.pdist_hamming_wrap, n_jobs,
+                                X, dm)
         elif mstr in ['jaccard', 'jacc', 'ja', 'j']:
             if X.dtype == bool:
                 X = _convert_to_bool(X)
-                _distance_wrap.pdist_jaccard_bool_wrap(X, dm)
+                _parallel_pdist(_distance_wrap.pdist_jaccard_bool_wrap, n_jobs,
+                                X, dm)
             else:
                 X = _convert_to_double(X)
-                _distance_wrap.pdist_jaccard_wrap(X, dm)
+                _parallel_pdist(_distance_wrap.pdist_jaccard_wrap, n_jobs,
+                                X, dm)
         elif mstr in ['minkowski', 'mi', 'm']:
             X = _convert_to_double(X)
-            _distance_wrap.pdist_minkowski_wrap(X, dm, p)
+            _parallel_pdist(_distance_wrap.pdist_minkowski_wrap, n_jobs,
+                            X, dm, p)
         elif mstr in wmink_names:
             X = _convert_to_double(X)
             w = _convert_to_double(np.asarray(w))
-            _distance_wrap.pdist_weighted_minkowski_wrap(X, dm, p, w)
+            _parallel_pdist(_distance_wrap.pdist_weighted_minkowski_wrap,
+                            n_jobs, X, dm, p, w)
         elif mstr in ['seuclidean', 'se', 's']:
             X = _convert_to_double(X)
             if V is not None:
@@ -1297,11 +1391,13 @@ def pdist(X, metric='euclidean', p=2, w=None, V=None, VI=None):
                 VV = _copy_array_if_base_present(_convert_to_double(V))
             else:
                 VV = np.var(X, axis=0, ddof=1)
-            _distance_wrap.pdist_seuclidean_wrap(X, VV, dm)
+            _parallel_pdist(_distance_wrap.pdist_seuclidean_wrap, n_jobs,
+                            X, VV, dm)
         elif mstr in ['cosine', 'cos']:
             X = _convert_to_double(X)
             norms = _row_norms(X)
-            _distance_wrap.pdist_cosine_wrap(X, dm, norms)
+            _parallel_pdist(_distance_wrap.pdist_cosine_wrap, n_jobs,
+                            X, dm, norms)
         elif mstr in ['old_cosine', 'old_cos']:
             X = _convert_to_double(X)
             norms = _row_norms(X)
@@ -1317,7 +1413,8 @@ def pdist(X, metric='euclidean', p=2, w=None, V=None, VI=None):
             X = _convert_to_double(X)
             X2 = X - X.mean(1)[:, np.newaxis]
             norms = _row_norms(X2)
-            _distance_wrap.pdist_cosine_wrap(X2, dm, norms)
+            _parallel_pdist(_distance_wrap.pdist_cosine_wrap, n_jobs,
+                            X2, dm, norms)
         elif mstr in ['mahalanobis', 'mahal', 'mah']:
             X = _convert_to_double(X)
             if VI is not None:
@@ -1335,7 +1432,8 @@ def pdist(X, metric='euclidean', p=2, w=None, V=None, VI=None):
                 V = np.atleast_2d(np.cov(X.T))
                 VI = _convert_to_double(np.linalg.inv(V).T.copy())
             # (u-v)V^(-1)(u-v)^T
-            _distance_wrap.pdist_mahalanobis_wrap(X, VI, dm)
+            _parallel_pdist(_distance_wrap.pdist_mahalanobis_wrap, n_jobs,
+                            X, VI, dm)
         elif metric == 'test_euclidean':
             dm = pdist(X, euclidean)
         elif metric == 'test_sqeuclidean':
@@ -1741,7 +1839,48 @@ def _cosine_cdist(XA, XB, dm):
     dm += 1
 
 
-def cdist(XA, XB, metric='euclidean', p=2, V=None, VI=None, w=None):
+# Number of distances computed per matrix product in _euclidean_cdist_gemm,
+# which bounds the size of its temporaries.
+_GEMM_BLOCK = 1 << 15
+
+# Squared distances below this fraction of ||u||**2 + ||v||**2 are recomputed
+# directly by the 'gemm_refined' method of cdist.
+_GEMM_RTOL = 1e-4
+
+
+def _euclidean_cdist_gemm(XA, XB, dm, normsB, squared, refine):
+    """
+    Squared Euclidean distances as ||u||**2 + ||v||**2 - 2 u.v.
+
+    The products u.v are computed by BLAS for blocks of rows of XA, and the
+    norms are added while the block of dm is in cache. The subtraction
+    cancels the leading digits of distances which are small compared to the
+    norms; with refine=True these distances are recomputed directly.
+    """
+    m, n = XA.shape
+    normsA = np.einsum('ij,ij->i', XA, XA)
+    rows = max(1, _GEMM_BLOCK // max(1, XB.shape[0]))
+    for start in xrange(0, m, rows):
+        stop = min(start + rows, m)
+        d = dm[start:stop]
+        np.dot(-2 * XA[start:stop], XB.T, out=d)
+        d += normsA[start:stop, np.newaxis]
+        d += normsB
+        np.maximum(d, 0, out=d)
+        if refine:
+            i, j = np.nonzero(d <= _GEMM_RTOL * (normsA[start:stop, np.newaxis]
+                                                 + normsB))
+            step = max(1, _GEMM_BLOCK // max(1, n))
+            for k in xrange(0, len(i), step):
+                ik, jk = i[k:k + step], j[k:k + step]
+                diff = XA[start + ik] - XB[jk]
+                d[ik, jk] = np.einsum('ij,ij->i', diff, diff)
+        if not squared:
+            np.sqrt(d, out=d)
+
+
+def cdist(XA, XB, metric='euclidean', p=2, V=None, VI=None, w=None,
+          n_jobs=1, method='direct'):
     """
     Computes distance between each pair of the two collections of inputs.
 
@@ -1953,6 +2092,24 @@ def cdist(XA, XB, metric='euclidean', p=2, V=None, VI=None, w=None):
         The variance vector (for standardized Euclidean).
     VI : ndarray, optional
         The inverse of the covariance matrix (for Mahalanobis).
+    n_jobs : int, optional
+        Number of threads to compute the distances with, for the metrics
+        given as strings which are implemented in C. The work is split
+        into blocks of rows of `XA`. If -1 is given, all CPUs are used.
+        Default: 1.
+
+        .. versionadded:: 0.18.0
+    method : {'direct', 'gemm', 'gemm_refined'}, optional
+        How to compute the 'euclidean' and 'sqeuclidean' metrics.
+        'direct' sums the squared differences of each pair. 'gemm'
+        computes :math:`||u||^2 + ||v||^2 - 2 u \\cdot v`, with the dot
+        products computed by a BLAS matrix product, which is much faster
+        for many dimensions but loses accuracy for distances which are
+        small compared to the norms of the points. 'gemm_refined' recomputes
+        those distances directly, so that for instance the distance of a
+        point to itself is 0. Default: 'direct'.
+
+        .. versionadded:: 0.18.0
 
     Returns
     -------
@@ -2036,6 +2193,9 @@ def cdist(XA, XB, metric='euclidean', p=2, V=None, VI=None, w=None):
     n = s[1]
     dm = np.zeros((mA, mB), dtype=np.double)
 
+    if method not in ('direct', 'gemm', 'gemm_refined'):
+        raise ValueError("method must be 'direct', 'gemm' or 'gemm_refined'")
+
     if callable(metric):
         if metric == minkowski:
             for i in xrange(0, mA):
@@ -2060,11 +2220,20 @@ def cdist(XA, XB, metric='euclidean', p=2, V=None, VI=None, w=None):
     elif isinstance(metric, string_types):
         mstr = metric.lower()
 
+        if method != 'direct' and mstr in _GEMM_CDIST:
+            normsB = np.einsum('ij,ij->i', XB, XB)
+            _run_row_blocks(
+                lambda start, stop: _euclidean_cdist_gemm(
+                    XA[start:stop], XB, dm[start:stop], normsB,
+                    _GEMM_CDIST[mstr], method == 'gemm_refined'),
+                mA, n_jobs)
+            return dm
+
         try:
             validate, cdist_fn = _SIMPLE_CDIST[mstr]
             XA = validate(XA)
             XB = validate(XB)
-            cdist_fn(XA, XB, dm)
+            _parallel_cdist(cdist_fn, n_jobs, XA, XB, dm)
             return dm
         except KeyError:
             pass
@@ -2073,29 +2242,35 @@ def cdist(XA, XB, metric='euclidean', p=2, V=None, VI=None, w=None):
             if XA.dtype == bool:
                 XA = _convert_to_bool(XA)
                 XB = _convert_to_bool(XB)
-                _distance_wrap.cdist_hamming_bool_wrap(XA, XB, dm)
+                _parallel_cdist(_distance_wrap.cdist_hamming_bool_wrap, n_jobs,
+                                XA, XB, dm)
             else:
                 XA = _convert_to_double(XA)
                 XB = _convert_to_double(XB)
-                _distance_wrap.cdist_hamming_wrap(XA, XB, dm)
+                _parallel_cdist(_distance_wrap.cdist_hamming_wrap, n_jobs,
+                                XA, XB, dm)
         elif mstr in ['jaccard', 'jacc', 'ja', 'j']:
             if XA.dtype == bool:
                 XA = _convert_to_bool(XA)
                 XB = _convert_to_bool(XB)
-                _distance_wrap.cdist_jaccard_bool_wrap(XA, XB, dm)
+                _parallel_cdist(_distance_wrap.cdist_jaccard_bool_wrap, n_jobs,
+                                XA, XB, dm)
             else:
                 XA = _convert_to_double(XA)
                 XB = _convert_to_double(XB)
-                _distance_wrap.cdist_jaccard_wrap(XA, XB, dm)
+                _parallel_cdist(_distance_wrap.cdist_jaccard_wrap, n_jobs,
+                                XA, XB, dm)
         elif mstr in ['minkowski', 'mi', 'm', 'pnorm']:
             XA = _convert_to_double(XA)
             XB = _convert_to_double(XB)
-            _distance_wrap.cdist_minkowski_wrap(XA, XB, dm, p)
+            _parallel_cdist(_distance_wrap.cdist_minkowski_wrap, n_jobs,
+                            XA, XB, dm, p)
         elif mstr in ['wminkowski', 'wmi', 'wm', 'wpnorm']:
             XA = _convert_to_double(XA)
             XB = _convert_to_double(XB)
             w = _convert_to_double(w)
-            _distance_wrap.cdist_weighted_minkowski_wrap(XA, XB, dm, p, w)
+            _parallel_cdist(_distance_wrap.cdist_weighted_minkowski_wrap,
+                            n_jobs, XA, XB, dm, p, w)
         elif mstr in ['seuclidean', 'se', 's']:
             XA = _convert_to_double(XA)
             XB = _convert_to_double(XB)
@@ -2114,7 +2289,9 @@ def cdist(XA, XB, metric='euclidean', p=2, V=None, VI=None, w=None):
                 VV = _copy_array_if_base_present(_convert_to_double(V))
             else:
                 VV = np.var(np.vstack([XA, XB]), axis=0, ddof=1)
-            _distance_wrap.cdist_seuclidean_wrap(XA, XB, VV, dm)
+            def cdist_fn(XA, XB, dm):
+                _distance_wrap.cdist_seuclidean_wrap(XA, XB, VV, dm)
+            _parallel_cdist(cdist_fn, n_jobs, XA, XB, dm)
         elif mstr in ['cosine', 'cos']:
             XA = _convert_to_double(XA)
             XB = _convert_to_double(XB)
@@ -2146,7 +2323,9 @@ def cdist(XA, XB, metric='euclidean', p=2, V=None, VI=None, w=None):
                 del X
                 VI = np.linalg.inv(V).T.copy()
             # (u-v)V^(-1)(u-v)^T
-            _distance_wrap.cdist_mahalanobis_wrap(XA, XB, VI, dm)
+            def cdist_fn(XA, XB, dm):
+                _distance_wrap.cdist_mahalanobis_wrap(XA, XB, VI, dm)
+            _parallel_cdist(cdist_fn, n_jobs, XA, XB, dm)
         elif metric == 'test_euclidean':
             dm = cdist(XA, XB, euclidean)
         elif metric == 'test_seuclidean':
@@ -10,6 +10,7 @@ def configuration(parent_package='', top_path=None):
     from numpy.distutils.misc_util import get_info as get_misc_info
     from numpy.distutils.system_info import get_info as get_sys_info
     from distutils.sysconfig import get_python_inc
+    from scipy._build_utils import get_cxx11_flags
 
     config = Configuration('spatial', parent_package, top_path)
 
@@ -42,7 +43,11 @@ def configuration(parent_package='', top_path=None):
                    'count_neighbors.cxx',
                    'query_ball_point.cxx',
                    'query_ball_tree.cxx',
-                   'sparse_distances.cxx']
+                   'query_knn_tree.cxx',
+                   'sparse_distances.cxx',
+                   'thread_pool.cxx',
+                   'leaf_kernels.cxx',
+                   'kernel_sum.cxx']
                    
     ckdtree_src = [join('ckdtree', 'src', x) for x in ckdtree_src]
     
@@ -53,15 +58,24 @@ def configuration(parent_package='', top_path=None):
                        'rectangle.h',
                        'distance.h',
                        'distance_box.h',
-                       'ordered_pair.h']
+                       'distance_callback.h',
+                       'ordered_pair.h',
+                       'thread_pool.h',
+                       'parallel_traverse.h',
+                       'node_layout.h',
+                       'leaf_kernels.h']
                        
     ckdtree_headers = [join('ckdtree', 'src', x) for x in ckdtree_headers]
         
     ckdtree_dep = ['ckdtree.cxx'] + ckdtree_headers + ckdtree_src
+    # the thread pool and the parallel traversals use C++11 threads
+    cxx11_compile_args, cxx11_link_args = get_cxx11_flags()
     config.add_extension('ckdtree',
                          sources=['ckdtree.cxx'] + ckdtree_src,
                          depends=ckdtree_dep,
-                         include_dirs=inc_dirs + [join('ckdtree','src')])
+                         include_dirs=inc_dirs + [join('ckdtree','src')],
+                         extra_compile_args=cxx11_compile_args,
+                         extra_link_args=cxx11_link_args)
     # _distance_wrap
     config.add_extension('_distance_wrap',
         sources=[join('src', 'distance_wrap.c')],
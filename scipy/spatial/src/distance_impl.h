@@ -370,9 +370,22 @@ compute_mean_vector(double *res, const double *X, npy_intp m, npy_intp n)
 }
 #endif
 
+/*
+ * The pdist functions compute the rows start to stop - 1 of the condensed
+ * distance matrix of the m points in X, so that pdist can be split over
+ * threads. Row i holds the distances d(i, j) for j > i and starts at the
+ * offset below.
+ */
+static NPY_INLINE npy_intp
+condensed_row_offset(npy_intp i, npy_intp m)
+{
+    return i * m - i * (i + 1) / 2;
+}
+
 static NPY_INLINE void
 pdist_mahalanobis(const double *X, const double *covinv, double *dimbuf,
-                  double *dm, npy_intp m, npy_intp n)
+                  double *dm, npy_intp m, npy_intp n,
+                  npy_intp start, npy_intp stop)
 {
     npy_intp i, j;
     const double *u, *v;
@@ -380,7 +393,8 @@ pdist_mahalanobis(const double *X, const double *covinv, double *dimbuf,
     double *dimbuf1 = dimbuf;
     double *dimbuf2 = dimbuf + n;
 
-    for (i = 0; i < m; i++) {
+    dm += condensed_row_offset(start, m);
+    for (i = start; i < stop; i++) {
         for (j = i + 1; j < m; j++, dm++) {
             u = X + (n * i);
             v = X + (n * j);
@@ -391,13 +405,14 @@ pdist_mahalanobis(const double *X, const double *covinv, double *dimbuf,
 
 static NPY_INLINE void
 pdist_cosine(const double *X, double *dm, npy_intp m, npy_intp n,
-             const double *norms)
+             const double *norms, npy_intp start, npy_intp stop)
 {
     const double *u, *v;
     double cosine;
     npy_intp i, j;
 
-    for (i = 0; i < m; i++) {
+    dm += condensed_row_offset(start, m);
+    for (i = start; i < stop; i++) {
         for (j = i + 1; j < m; j++, dm++) {
             u = X + (n * i);
             v = X + (n * j);
@@ -413,12 +428,14 @@ pdist_cosine(const double *X, double *dm, npy_intp m, npy_intp n,
 
 static NPY_INLINE void
 pdist_seuclidean(const double *X, const double *var, double *dm,
-                 npy_intp m, npy_intp n)
+                 npy_intp m, npy_intp n,
+                 npy_intp start, npy_intp stop)
 {
     const double *u, *v;
     npy_intp i, j;
 
-    for (i = 0; i < m; i++) {
+    dm += condensed_row_offset(start, m);
+    for (i = start; i < stop; i++) {
         for (j = i + 1; j < m; j++, dm++) {
             u = X + (n * i);
             v = X + (n * j);
@@ -428,12 +445,14 @@ pdist_seuclidean(const double *X, const double *var, double *dm,
 }
 
 static NPY_INLINE void
-pdist_minkowski(const double *X, double *dm, npy_intp m, npy_intp n, double p)
+pdist_minkowski(const double *X, double *dm, npy_intp m, npy_intp n, double p,
+                npy_intp start, npy_intp stop)
 {
     const double *u, *v;
     npy_intp i, j;
 
-    for (i = 0; i < m; i++) {
+    dm += condensed_row_offset(start, m);
+    for (i = start; i < stop; i++) {
         for (j = i + 1; j < m; j++, dm++) {
             u = X + (n * i);
             v = X + (n * j);
@@ -444,12 +463,14 @@ pdist_minkowski(const double *X, double *dm, npy_intp m, npy_intp n, double p)
 
 static NPY_INLINE void
 pdist_weighted_minkowski(const double *X, double *dm, npy_intp m, npy_intp n,
-                         double p, const double *w)
+                         double p, const double *w,
+                         npy_intp start, npy_intp stop)
 {
     const double *u, *v;
     npy_intp i, j;
 
-    for (i = 0; i < m; i++) {
+    dm += condensed_row_offset(start, m);
+    for (i = start; i < stop; i++) {
         for (j = i + 1; j < m; j++, dm++) {
             u = X + (n * i);
             v = X + (n * j);
@@ -599,12 +620,13 @@ DEFINE_CDIST(yule_bool, char)
 
 #define DEFINE_PDIST(name, type) \
     static void pdist_ ## name ## _ ## type(const type *X, double *dm,      \
-                                            npy_intp m, npy_intp n)         \
+                                            npy_intp m, npy_intp n,         \
+                                            npy_intp start, npy_intp stop)  \
     {                                                                       \
         Py_ssize_t i, j;                                                    \
         const type *u, *v;                                                  \
-        double *it = dm;                                                    \
-        for (i = 0; i < m; i++) {                                           \
+        double *it = dm + condensed_row_offset(start, m);                   \
+        for (i = start; i < stop; i++) {                                    \
             for (j = i + 1; j < m; j++, it++) {                             \
                 u = X + n * i;                                              \
                 v = X + n * j;                                              \
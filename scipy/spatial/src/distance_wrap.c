@@ -420,16 +420,36 @@ static PyObject *cdist_sokalsneath_bool_wrap(PyObject *self, PyObject *args) {
 
 /***************************** pdist ***/
 
+/*
+ * The pdist wrappers take an optional range start:stop of rows of the
+ * condensed distance matrix to compute, the default being all of them.
+ * dm is always the whole condensed matrix.
+ */
+static NPY_INLINE void
+pdist_row_range(Py_ssize_t m, Py_ssize_t *start, Py_ssize_t *stop)
+{
+    if (*stop < 0 || *stop > m) {
+        *stop = m;
+    }
+    if (*start < 0) {
+        *start = 0;
+    }
+    if (*start > *stop) {
+        *start = *stop;
+    }
+}
+
 #define DEFINE_WRAP_PDIST_DOUBLE(name)                                  \
     static PyObject *                                                   \
     pdist_ ## name ## _wrap(PyObject *self, PyObject *args)             \
     {                                                                   \
         PyArrayObject *X_, *dm_;                                        \
-        Py_ssize_t m, n;                                                \
+        Py_ssize_t m, n, start = 0, stop = -1;                          \
         double *dm;                                                     \
         const double *X;                                                \
-        if (!PyArg_ParseTuple(args, "O!O!", &PyArray_Type, &X_,         \
-                                            &PyArray_Type, &dm_)) {     \
+        if (!PyArg_ParseTuple(args, "O!O!|nn", &PyArray_Type, &X_,      \
+                                               &PyArray_Type, &dm_,     \
+                                               &start, &stop)) {        \
             return NULL;                                                \
         }                                                               \
         else {                                                          \
@@ -438,7 +458,8 @@ static PyObject *cdist_sokalsneath_bool_wrap(PyObject *self, PyObject *args) {
             dm = (double *)dm_->data;                                   \
             m = X_->dimensions[0];                                      \
             n = X_->dimensions[1];                                      \
-            pdist_ ## name ## _double(X, dm, m, n);                     \
+            pdist_row_range(m, &start, &stop);                          \
+            pdist_ ## name ## _double(X, dm, m, n, start, stop);        \
             NPY_END_ALLOW_THREADS;                                      \
         }                                                               \
         return Py_BuildValue("d", 0.);                                  \
@@ -457,13 +478,15 @@ DEFINE_WRAP_PDIST_DOUBLE(sqeuclidean)
 static PyObject *pdist_mahalanobis_wrap(PyObject *self, PyObject *args) {
   PyArrayObject *X_, *covinv_, *dm_;
   int m, n;
+  Py_ssize_t start = 0, stop = -1;
   double *dimbuf, *dm;
   const double *X;
   const double *covinv;
-  if (!PyArg_ParseTuple(args, "O!O!O!",
+  if (!PyArg_ParseTuple(args, "O!O!O!|nn",
 			&PyArray_Type, &X_,
 			&PyArray_Type, &covinv_,
-			&PyArray_Type, &dm_)) {
+			&PyArray_Type, &dm_,
+			&start, &stop)) {
     return 0;
   }
   else {
@@ -474,6 +497,7 @@ static PyObject *pdist_mahalanobis_wrap(PyObject *self, PyObject *args) {
     dm = (double*)dm_->data;
     m = X_->dimensions[0];
     n = X_->dimensions[1];
+    pdist_row_range(m, &start, &stop);
 
     dimbuf = mahalanobis_dimbuf(n);
     if (!dimbuf) {
@@ -481,7 +505,7 @@ static PyObject *pdist_mahalanobis_wrap(PyObject *self, PyObject *args) {
         return NULL;
     }
 
-    pdist_mahalanobis(X, covinv, dimbuf, dm, m, n);
+    pdist_mahalanobis(X, covinv, dimbuf, dm, m, n, start, stop);
     free(dimbuf);
     NPY_END_THREADS;
   }
@@ -492,12 +516,14 @@ static PyObject *pdist_mahalanobis_wrap(PyObject *self, PyObject *args) {
 static PyObject *pdist_cosine_wrap(PyObject *self, PyObject *args) {
   PyArrayObject *X_, *dm_, *norms_;
   int m, n;
+  Py_ssize_t start = 0, stop = -1;
   double *dm;
   const double *X, *norms;
-  if (!PyArg_ParseTuple(args, "O!O!O!",
+  if (!PyArg_ParseTuple(args, "O!O!O!|nn",
 			&PyArray_Type, &X_,
 			&PyArray_Type, &dm_,
-			&PyArray_Type, &norms_)) {
+			&PyArray_Type, &norms_,
+			&start, &stop)) {
     return 0;
   }
   else {
@@ -507,8 +533,9 @@ static PyObject *pdist_cosine_wrap(PyObject *self, PyObject *args) {
     norms = (const double*)norms_->data;
     m = X_->dimensions[0];
     n = X_->dimensions[1];
+    pdist_row_range(m, &start, &stop);
 
-    pdist_cosine(X, dm, m, n, norms);
+    pdist_cosine(X, dm, m, n, norms, start, stop);
     NPY_END_ALLOW_THREADS;
   }
   return Py_BuildValue("d", 0.0);
@@ -517,12 +544,14 @@ static PyObject *pdist_cosine_wrap(PyObject *self, PyObject *args) {
 static PyObject *pdist_seuclidean_wrap(PyObject *self, PyObject *args) {
   PyArrayObject *X_, *dm_, *var_;
   int m, n;
+  Py_ssize_t start = 0, stop = -1;
   double *dm;
   const double *X, *var;
-  if (!PyArg_ParseTuple(args, "O!O!O!",
+  if (!PyArg_ParseTuple(args, "O!O!O!|nn",
 			&PyArray_Type, &X_,
 			&PyArray_Type, &var_,
-			&PyArray_Type, &dm_)) {
+			&PyArray_Type, &dm_,
+			&start, &stop)) {
     return 0;
   }
   else {
@@ -532,8 +561,9 @@ static PyObject *pdist_seuclidean_wrap(PyObject *self, PyObject *args) {
     var = (double*)var_->data;
     m = X_->dimensions[0];
     n = X_->dimensions[1];
+    pdist_row_range(m, &start, &stop);
 
-    pdist_seuclidean(X, var, dm, m, n);
+    pdist_seuclidean(X, var, dm, m, n, start, stop);
     NPY_END_ALLOW_THREADS;
   }
   return Py_BuildValue("d", 0.0);
@@ -542,11 +572,13 @@ static PyObject *pdist_seuclidean_wrap(PyObject *self, PyObject *args) {
 static PyObject *pdist_hamming_bool_wrap(PyObject *self, PyObject *args) {
   PyArrayObject *X_, *dm_;
   int m, n;
+  Py_ssize_t start = 0, stop = -1;
   double *dm;
   const char *X;
-  if (!PyArg_ParseTuple(args, "O!O!",
+  if (!PyArg_ParseTuple(args, "O!O!|nn",
 			&PyArray_Type, &X_,
-			&PyArray_Type, &dm_)) {
+			&PyArray_Type, &dm_,
+			&start, &stop)) {
     return 0;
   }
   else {
@@ -555,8 +587,9 @@ static PyObject *pdist_hamming_bool_wrap(PyObject *self, PyObject *args) {
     dm = (double*)dm_->data;
     m = X_->dimensions[0];
     n = X_->dimensions[1];
+    pdist_row_range(m, &start, &stop);
 
-    pdist_hamming_char(X, dm, m, n);
+    pdist_hamming_char(X, dm, m, n, start, stop);
     NPY_END_ALLOW_THREADS;
   }
   return Py_BuildValue("d", 0.0);
@@ -565,11 +598,13 @@ static PyObject *pdist_hamming_bool_wrap(PyObject *self, PyObject *args) {
 static PyObject *pdist_jaccard_bool_wrap(PyObject *self, PyObject *args) {
   PyArrayObject *X_, *dm_;
   int m, n;
+  Py_ssize_t start = 0, stop = -1;
   double *dm;
   const char *X;
-  if (!PyArg_ParseTuple(args, "O!O!",
+  if (!PyArg_ParseTuple(args, "O!O!|nn",
 			&PyArray_Type, &X_,
-			&PyArray_Type, &dm_)) {
+			&PyArray_Type, &dm_,
+			&start, &stop)) {
     return 0;
   }
   else {
@@ -578,8 +613,9 @@ static PyObject *pdist_jaccard_bool_wrap(PyObject *self, PyObject *args) {
     dm = (double*)dm_->data;
     m = X_->dimensions[0];
     n = X_->dimensions[1];
+    pdist_row_range(m, &start, &stop);
 
-    pdist_jaccard_char(X, dm, m, n);
+    pdist_jaccard_char(X, dm, m, n, start, stop);
     NPY_END_ALLOW_THREADS;
   }
   return Py_BuildValue("d", 0.0);
@@ -588,12 +624,14 @@ static PyObject *pdist_jaccard_bool_wrap(PyObject *self, PyObject *args) {
 static PyObject *pdist_minkowski_wrap(PyObject *self, PyObject *args) {
   PyArrayObject *X_, *dm_;
   int m, n;
+  Py_ssize_t start = 0, stop = -1;
   double *dm, *X;
   double p;
-  if (!PyArg_ParseTuple(args, "O!O!d",
+  if (!PyArg_ParseTuple(args, "O!O!d|nn",
 			&PyArray_Type, &X_,
 			&PyArray_Type, &dm_,
-			&p)) {
+			&p,
+			&start, &stop)) {
     return 0;
   }
   else {
@@ -602,8 +640,9 @@ static PyObject *pdist_minkowski_wrap(PyObject *self, PyObject *args) {
     dm = (double*)dm_->data;
     m = X_->dimensions[0];
     n = X_->dimensions[1];
+    pdist_row_range(m, &start, &stop);
 
-    pdist_minkowski(X, dm, m, n, p);
+    pdist_minkowski(X, dm, m, n, p, start, stop);
     NPY_END_ALLOW_THREADS;
   }
   return Py_BuildValue("d", 0.0);
@@ -612,13 +651,15 @@ static PyObject *pdist_minkowski_wrap(PyObject *self, PyObject *args) {
 static PyObject *pdist_weighted_minkowski_wrap(PyObject *self, PyObject *args) {
   PyArrayObject *X_, *dm_, *w_;
   int m, n;
+  Py_ssize_t start = 0, stop = -1;
   double *dm, *X, *w;
   double p;
-  if (!PyArg_ParseTuple(args, "O!O!dO!",
+  if (!PyArg_ParseTuple(args, "O!O!dO!|nn",
 			&PyArray_Type, &X_,
 			&PyArray_Type, &dm_,
 			&p,
-			&PyArray_Type, &w_)) {
+			&PyArray_Type, &w_,
+			&start, &stop)) {
     return 0;
   }
   else {
@@ -628,8 +669,9 @@ static PyObject *pdist_weighted_minkowski_wrap(PyObject *self, PyObject *args) {
     w = (double*)w_->data;
     m = X_->dimensions[0];
     n = X_->dimensions[1];
+    pdist_row_range(m, &start, &stop);
 
-    pdist_weighted_minkowski(X, dm, m, n, p, w);
+    pdist_weighted_minkowski(X, dm, m, n, p, w, start, stop);
     NPY_END_ALLOW_THREADS;
   }
   return Py_BuildValue("d", 0.0);
@@ -639,11 +681,13 @@ static PyObject *pdist_weighted_minkowski_wrap(PyObject *self, PyObject *args) {
 static PyObject *pdist_yule_bool_wrap(PyObject *self, PyObject *args) {
   PyArrayObject *X_, *dm_;
   int m, n;
+  Py_ssize_t start = 0, stop = -1;
   double *dm;
   const char *X;
-  if (!PyArg_ParseTuple(args, "O!O!",
+  if (!PyArg_ParseTuple(args, "O!O!|nn",
 			&PyArray_Type, &X_,
-			&PyArray_Type, &dm_)) {
+			&PyArray_Type, &dm_,
+			&start, &stop)) {
     return 0;
   }
   else {
@@ -652,8 +696,9 @@ static PyObject *pdist_yule_bool_wrap(PyObject *self, PyObject *args) {
     dm = (double*)dm_->data;
     m = X_->dimensions[0];
     n = X_->dimensions[1];
+    pdist_row_range(m, &start, &stop);
 
-    pdist_yule_bool_char(X, dm, m, n);
+    pdist_yule_bool_char(X, dm, m, n, start, stop);
     NPY_END_ALLOW_THREADS;
   }
   return Py_BuildValue("");
@@ -662,11 +707,13 @@ static PyObject *pdist_yule_bool_wrap(PyObject *self, PyObject *args) {
 static PyObject *pdist_dice_bool_wrap(PyObject *self, PyObject *args) {
   PyArrayObject *X_, *dm_;
   int m, n;
+  Py_ssize_t start = 0, stop = -1;
   double *dm;
   const char *X;
-  if (!PyArg_ParseTuple(args, "O!O!",
+  if (!PyArg_ParseTuple(args, "O!O!|nn",
 			&PyArray_Type, &X_,
-			&PyArray_Type, &dm_)) {
+			&PyArray_Type, &dm_,
+			&start, &stop)) {
     return 0;
   }
   else {
@@ -675,8 +722,9 @@ static PyObject *pdist_dice_bool_wrap(PyObject *self, PyObject *args) {
     dm = (double*)dm_->data;
     m = X_->dimensions[0];
     n = X_->dimensions[1];
+    pdist_row_range(m, &start, &stop);
 
-    pdist_dice_char(X, dm, m, n);
+    pdist_dice_char(X, dm, m, n, start, stop);
     NPY_END_ALLOW_THREADS;
   }
   return Py_BuildValue("");
@@ -685,11 +733,13 @@ static PyObject *pdist_dice_bool_wrap(PyObject *self, PyObject *args) {
 static PyObject *pdist_rogerstanimoto_bool_wrap(PyObject *self, PyObject *args) {
   PyArrayObject *X_, *dm_;
   int m, n;
+  Py_ssize_t start = 0, stop = -1;
   double *dm;
   const char *X;
-  if (!PyArg_ParseTuple(args, "O!O!",
+  if (!PyArg_ParseTuple(args, "O!O!|nn",
 			&PyArray_Type, &X_,
-			&PyArray_Type, &dm_)) {
+			&PyArray_Type, &dm_,
+			&start, &stop)) {
     return 0;
   }
   else {
@@ -698,8 +748,9 @@ static PyObject *pdist_rogerstanimoto_bool_wrap(PyObject *self, PyObject *args)
     dm = (double*)dm_->data;
     m = X_->dimensions[0];
     n = X_->dimensions[1];
+    pdist_row_range(m, &start, &stop);
 
-    pdist_rogerstanimoto_char(X, dm, m, n);
+    pdist_rogerstanimoto_char(X, dm, m, n, start, stop);
     NPY_END_ALLOW_THREADS;
   }
   return Py_BuildValue("");
@@ -708,11 +759,13 @@ static PyObject *pdist_rogerstanimoto_bool_wrap(PyObject *self, PyObject *args)
 static PyObject *pdist_russellrao_bool_wrap(PyObject *self, PyObject *args) {
   PyArrayObject *X_, *dm_;
   int m, n;
+  Py_ssize_t start = 0, stop = -1;
   double *dm;
   const char *X;
-  if (!PyArg_ParseTuple(args, "O!O!",
+  if (!PyArg_ParseTuple(args, "O!O!|nn",
 			&PyArray_Type, &X_,
-			&PyArray_Type, &dm_)) {
+			&PyArray_Type, &dm_,
+			&start, &stop)) {
     return 0;
   }
   else {
@@ -721,8 +774,9 @@ static PyObject *pdist_russellrao_bool_wrap(PyObject *self, PyObject *args) {
     dm = (double*)dm_->data;
     m = X_->dimensions[0];
     n = X_->dimensions[1];
+    pdist_row_range(m, &start, &stop);
 
-    pdist_russellrao_char(X, dm, m, n);
+    pdist_russellrao_char(X, dm, m, n, start, stop);
     NPY_END_ALLOW_THREADS;
   }
   return Py_BuildValue("");
@@ -731,11 +785,13 @@ static PyObject *pdist_russellrao_bool_wrap(PyObject *self, PyObject *args) {
 static PyObject *pdist_kulsinski_bool_wrap(PyObject *self, PyObject *args) {
   PyArrayObject *X_, *dm_;
   int m, n;
+  Py_ssize_t start = 0, stop = -1;
   double *dm;
   const char *X;
-  if (!PyArg_ParseTuple(args, "O!O!",
+  if (!PyArg_ParseTuple(args, "O!O!|nn",
 			&PyArray_Type, &X_,
-			&PyArray_Type, &dm_)) {
+			&PyArray_Type, &dm_,
+			&start, &stop)) {
     return 0;
   }
   else {
@@ -744,8 +800,9 @@ static PyObject *pdist_kulsinski_bool_wrap(PyObject *self, PyObject *args) {
     dm = (double*)dm_->data;
     m = X_->dimensions[0];
     n = X_->dimensions[1];
+    pdist_row_range(m, &start, &stop);
 
-    pdist_kulsinski_char(X, dm, m, n);
+    pdist_kulsinski_char(X, dm, m, n, start, stop);
     NPY_END_ALLOW_THREADS;
   }
   return Py_BuildValue("");
@@ -754,11 +811,13 @@ static PyObject *pdist_kulsinski_bool_wrap(PyObject *self, PyObject *args) {
 static PyObject *pdist_sokalmichener_bool_wrap(PyObject *self, PyObject *args) {
   PyArrayObject *X_, *dm_;
   int m, n;
+  Py_ssize_t start = 0, stop = -1;
   double *dm;
   const char *X;
-  if (!PyArg_ParseTuple(args, "O!O!",
+  if (!PyArg_ParseTuple(args, "O!O!|nn",
 			&PyArray_Type, &X_,
-			&PyArray_Type, &dm_)) {
+			&PyArray_Type, &dm_,
+			&start, &stop)) {
     return 0;
   }
   else {
@@ -767,8 +826,9 @@ static PyObject *pdist_sokalmichener_bool_wrap(PyObject *self, PyObject *args) {
     dm = (double*)dm_->data;
     m = X_->dimensions[0];
     n = X_->dimensions[1];
+    pdist_row_range(m, &start, &stop);
 
-    pdist_sokalmichener_char(X, dm, m, n);
+    pdist_sokalmichener_char(X, dm, m, n, start, stop);
     NPY_END_ALLOW_THREADS;
   }
   return Py_BuildValue("");
@@ -777,11 +837,13 @@ static PyObject *pdist_sokalmichener_bool_wrap(PyObject *self, PyObject *args) {
 static PyObject *pdist_sokalsneath_bool_wrap(PyObject *self, PyObject *args) {
   PyArrayObject *X_, *dm_;
   int m, n;
+  Py_ssize_t start = 0, stop = -1;
   double *dm;
   const char *X;
-  if (!PyArg_ParseTuple(args, "O!O!",
+  if (!PyArg_ParseTuple(args, "O!O!|nn",
 			&PyArray_Type, &X_,
-			&PyArray_Type, &dm_)) {
+			&PyArray_Type, &dm_,
+			&start, &stop)) {
     return 0;
   }
   else {
@@ -790,8 +852,9 @@ static PyObject *pdist_sokalsneath_bool_wrap(PyObject *self, PyObject *args) {
     dm = (double*)dm_->data;
     m = X_->dimensions[0];
     n = X_->dimensions[1];
+    pdist_row_range(m, &start, &stop);
 
-    pdist_sokalsneath_char(X, dm, m, n);
+    pdist_sokalsneath_char(X, dm, m, n, start, stop);
     NPY_END_ALLOW_THREADS;
   }
   return Py_BuildValue("");
@@ -380,6 +380,38 @@ class TestCdist(TestCase):
         Y2 = cdist(X1, X2, 'test_sokalsneath')
         _assert_within_tol(Y1, Y2, eps, verbose > 2)
 
+    def test_cdist_n_jobs(self):
+        X1 = eo['cdist-X1']
+        X2 = eo['cdist-X2']
+        kwargs = dict(p=3.5, w=np.linspace(0.5, 1.5, X1.shape[1]))
+        for metric in ['euclidean', 'cityblock', 'minkowski', 'wminkowski',
+                       'seuclidean', 'mahalanobis', 'hamming', 'jaccard']:
+            Y1 = cdist(X1, X2, metric, **kwargs)
+            for n_jobs in [2, 3, 100, -1]:
+                Y2 = cdist(X1, X2, metric, n_jobs=n_jobs, **kwargs)
+                assert_array_equal(Y1, Y2, err_msg=metric)
+        Y1 = cdist(X1 < 0.5, X2 < 0.5, 'yule')
+        Y2 = cdist(X1 < 0.5, X2 < 0.5, 'yule', n_jobs=3)
+        assert_array_equal(Y1, Y2)
+        assert_raises(ValueError, cdist, X1, X2, n_jobs=0)
+
+    def test_cdist_gemm(self):
+        np.random.seed(1234)
+        X1 = np.random.randn(300, 40) + 100
+        X2 = np.vstack([X1[::7], np.random.randn(200, 40) + 100])
+        for metric in ['euclidean', 'sqeuclidean']:
+            Y1 = cdist(X1, X2, metric)
+            for n_jobs in [1, 2]:
+                Y2 = cdist(X1, X2, metric, method='gemm', n_jobs=n_jobs)
+                assert_allclose(Y1, Y2, rtol=1e-6, atol=1e-4)
+                Y2 = cdist(X1, X2, metric, method='gemm_refined',
+                           n_jobs=n_jobs)
+                assert_allclose(Y1, Y2, rtol=1e-10, atol=0)
+        # the distances of the points to themselves are exact
+        Y = cdist(X1, X1, method='gemm_refined')
+        assert_equal(np.diag(Y), 0)
+        assert_raises(ValueError, cdist, X1, X2, method='blas')
+
 
 class TestPdist(TestCase):
 
@@ -1137,6 +1169,22 @@ class TestPdist(TestCase):
         right_y = 0.01492537
         _assert_within_tol(pdist_y, right_y, eps, verbose > 2)
 
+    def test_pdist_n_jobs(self):
+        X = eo['iris']
+        kwargs = dict(p=3.5, w=np.linspace(0.5, 1.5, X.shape[1]))
+        for metric in ['euclidean', 'cityblock', 'minkowski', 'wminkowski',
+                       'seuclidean', 'mahalanobis', 'cosine', 'correlation',
+                       'hamming', 'jaccard']:
+            y1 = pdist(X, metric, **kwargs)
+            for n_jobs in [2, 3, 100, -1]:
+                y2 = pdist(X, metric, n_jobs=n_jobs, **kwargs)
+                assert_array_equal(y1, y2, err_msg=metric)
+        D = eo['random-bool-data']
+        assert_array_equal(pdist(D, 'yule'), pdist(D, 'yule', n_jobs=3))
+        for m in [0, 1, 2, 5]:
+            assert_array_equal(pdist(X[:m], n_jobs=4), pdist(X[:m]))
+        assert_raises(ValueError, pdist, X, n_jobs=0)
+
 
 def within_tol(a, b, tol):
     return np.abs(a - b).max() < tol
@@ -3,13 +3,17 @@
 
 from __future__ import division, print_function, absolute_import
 
+import os
+
 from numpy.testing import (assert_equal, assert_array_equal,
-    assert_almost_equal, assert_array_almost_equal, assert_, run_module_suite)
+    assert_almost_equal, assert_array_almost_equal, assert_, run_module_suite,
+    assert_allclose, assert_raises)
 
 import numpy as np
 from scipy.spatial import KDTree, Rectangle, distance_matrix, cKDTree
-from scipy.spatial.ckdtree import cKDTreeNode
+from scipy.spatial.ckdtree import cKDTreeNode, cKDTreeForest
 from scipy.spatial import minkowski_distance
+from scipy._lib._tmpdirs import tempdir
 
 def distance_box(a, b, p, boxsize):
     diff = a - b
@@ -460,6 +464,43 @@ def test_query_ball_point_multithreading():
             assert_array_equal(l1[i],l3[i])
          
 
+def test_query_ball_point_csr():
+    np.random.seed(1234)
+    x = np.random.uniform(size=(1000, 3))
+    q = np.random.uniform(size=(4, 50, 3))
+    for p in [1, 2, 3.5, np.inf]:
+        for boxsize in [None, 1.0]:
+            T = cKDTree(x, leafsize=8, boxsize=boxsize)
+            l = T.query_ball_point(q, 0.15, p=p)
+            indices, indptr = T.query_ball_point(q, 0.15, p=p, 
+                                                 return_csr=True, n_jobs=4)
+            assert_equal(indptr.shape, (201,))
+            for i, c in enumerate(np.ndindex(l.shape)):
+                assert_array_equal(indices[indptr[i]:indptr[i+1]], l[c])
+
+            indices2, indptr2, d = T.query_ball_point(q, 0.15, p=p, 
+                return_csr=True, return_distances=True)
+            assert_array_equal(indices2, indices)
+            assert_array_equal(indptr2, indptr)
+            rows = np.repeat(np.arange(200), np.diff(indptr))
+            if boxsize is None:
+                assert_array_almost_equal(d, 
+                    minkowski_distance(q.reshape(-1, 3)[rows], x[indices], p))
+            assert_(np.all(d <= 0.15))
+
+    # a single point, and no points
+    T = cKDTree(x)
+    indices, indptr = T.query_ball_point(x[0], 0.1, return_csr=True)
+    assert_array_equal(indices, sorted(T.query_ball_point(x[0], 0.1)))
+    assert_array_equal(indptr, [0, len(indices)])
+    indices, indptr = T.query_ball_point(np.empty((0, 3)), 0.1, 
+                                         return_csr=True)
+    assert_equal(indices.shape, (0,))
+    assert_array_equal(indptr, [0])
+    assert_raises(ValueError, T.query_ball_point, x[0], 0.1, 
+                  return_distances=True)
+
+
 class two_trees_consistency:
 
     def distance(self, a, b, p):
@@ -940,6 +981,34 @@ def test_ckdtree_pickle_boxsize():
     T1 = T1.query(points, k=5)[-1]
     T2 = T2.query(points, k=5)[-1]
     assert_array_equal(T1, T2)
+
+def test_ckdtree_pickle_old_state():
+    # trees pickled by earlier versions have a state of 10 items and
+    # nodes with two pointers after end_idx
+    np.random.seed(0)
+    points = np.random.uniform(size=(200, 3))
+    node = [('split_dim', np.intp), ('children', np.intp),
+            ('split', np.float64), ('start_idx', np.intp),
+            ('end_idx', np.intp), ('_less', np.intp), ('_greater', np.intp)]
+    old_node = node[:5] + [('less', np.intp), ('greater', np.intp)] + node[5:]
+    for boxsize in [None, 1.0]:
+        T1 = cKDTree(points, leafsize=4, boxsize=boxsize)
+        reduced = T1.__reduce__()
+        state = reduced[2]
+        nodes = np.frombuffer(state[0], dtype=np.dtype(node, align=True))
+        old_nodes = np.zeros(len(nodes), dtype=np.dtype(old_node, align=True))
+        for name in nodes.dtype.names:
+            old_nodes[name] = nodes[name]
+        old_nodes['less'] = -1
+        old_nodes['greater'] = -1
+        old_state = (old_nodes.tostring(),) + tuple(state[1:10])
+
+        T2 = reduced[0](*reduced[1])
+        T2.__setstate__(old_state)
+        assert_array_equal(T2.query(points, k=5)[1], T1.query(points, k=5)[1])
+
+        T3 = reduced[0](*reduced[1])
+        assert_raises(ValueError, T3.__setstate__, state[:12])
     
 def test_ckdtree_copy_data():
     # check if copy_data=True makes the kd-tree
@@ -970,7 +1039,575 @@ def test_ckdtree_parallel():
     assert_array_equal(T1, T2)
     assert_array_equal(T1, T3)
 
-def test_ckdtree_view():        
+def test_ckdtree_parallel_small_batches():
+    # the thread pool is reused across calls and shared by
+    # concurrent callers
+    import threading
+    np.random.seed(0)
+    points = np.random.randn(2000, 3)
+    T = cKDTree(points)
+    d0, i0 = T.query(points, k=3)
+    # each batch is large enough to be split into several chunks
+    for start in range(0, 2000, 300):
+        d, i = T.query(points[start:start + 300], k=3, n_jobs=4)
+        assert_array_equal(i, i0[start:start + 300])
+
+    results = [None] * 4
+    def worker(j):
+        results[j] = T.query(points, k=3, n_jobs=3)[1]
+    threads = [threading.Thread(target=worker, args=(j,)) for j in range(4)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    for r in results:
+        assert_array_equal(r, i0)
+
+def test_ckdtree_parallel_dual_tree():
+    np.random.seed(1234)
+    T1 = cKDTree(np.random.uniform(size=(1500, 3)), leafsize=8)
+    T2 = cKDTree(np.random.uniform(size=(1000, 3)), leafsize=8)
+    r = np.linspace(0, 0.5, 11)
+    for kwargs in [dict(), dict(p=1), dict(p=np.inf)]:
+        c1 = T1.count_neighbors(T2, r, **kwargs)
+        c2 = T1.count_neighbors(T2, r, n_jobs=4, **kwargs)
+        assert_array_equal(c1, c2)
+        l1 = T1.query_ball_tree(T2, 0.1, **kwargs)
+        l2 = T1.query_ball_tree(T2, 0.1, n_jobs=4, **kwargs)
+        assert_equal(l1, l2)
+    # periodic trees and trees with a single leaf
+    Tb = cKDTree(T1.data, leafsize=8, boxsize=1.0)
+    assert_array_equal(Tb.count_neighbors(Tb, r),
+                       Tb.count_neighbors(Tb, r, n_jobs=3))
+    Ts = cKDTree(T2.data[:5])
+    assert_array_equal(T1.count_neighbors(Ts, r),
+                       T1.count_neighbors(Ts, r, n_jobs=3))
+    assert_equal(Ts.query_ball_tree(T1, 0.2),
+                 Ts.query_ball_tree(T1, 0.2, n_jobs=3))
+
+def test_ckdtree_parallel_pairs():
+    np.random.seed(1234)
+    x1 = np.random.uniform(size=(1500, 3))
+    x2 = np.random.uniform(size=(1000, 3))
+    for boxsize in [None, 1.0]:
+        T1 = cKDTree(x1, leafsize=8, boxsize=boxsize)
+        T2 = cKDTree(x2, leafsize=8, boxsize=boxsize)
+        for kwargs in [dict(), dict(p=1), dict(p=np.inf)]:
+            s1 = T1.query_pairs(0.05, **kwargs)
+            s2 = T1.query_pairs(0.05, n_jobs=4, **kwargs)
+            assert_equal(s1, s2)
+            a = T1.query_pairs(0.05, output_type='ndarray', n_jobs=4, 
+                               **kwargs)
+            assert_equal(set(map(tuple, a.tolist())), s1)
+
+            d1 = T1.sparse_distance_matrix(T2, 0.05, **kwargs)
+            d2 = T1.sparse_distance_matrix(T2, 0.05, n_jobs=4, 
+                                           output_type='csr_matrix', **kwargs)
+            assert_equal(d2.nnz, d1.nnz)
+            assert_array_equal(d1.toarray(), d2.toarray())
+            d3 = T1.sparse_distance_matrix(T1, 0.05, n_jobs=3, 
+                                           output_type='coo_matrix', **kwargs)
+            assert_equal(d3.nnz, 2 * len(s1) + T1.n)
+    # trees with a single leaf
+    Ts = cKDTree(x2[:5])
+    assert_equal(Ts.query_pairs(0.5), Ts.query_pairs(0.5, n_jobs=3))
+    assert_array_equal(
+        Ts.sparse_distance_matrix(T1, 0.2).toarray(),
+        Ts.sparse_distance_matrix(T1, 0.2, n_jobs=3).toarray())
+    assert_raises(ValueError, Ts.query_pairs, 0.5, output_type='list')
+
+def test_ckdtree_count_ball_point_kernel_sum():
+    np.random.seed(1234)
+    x = np.random.randn(2000, 3)
+    q = np.random.randn(50, 3)
+    w = np.random.uniform(size=2000)
+    for kwargs in [dict(), dict(dtype=np.float32), dict(leafsize=1)]:
+        T = cKDTree(x, **kwargs)
+        # the distances to the stored points
+        d = distance_matrix(q, T.data.astype(np.float64))
+        for r in [0.1, 0.5, 5]:
+            assert_array_equal(T.count_ball_point(q, r), (d <= r).sum(1))
+            assert_array_almost_equal(T.count_ball_point(q, r, weights=w), 
+                                      ((d <= r) * w).sum(1))
+        for p in [1, np.inf]:
+            assert_array_equal(T.count_ball_point(q, 0.5, p=p, n_jobs=2),
+                               [len(l) for l in 
+                                T.query_ball_point(q, 0.5, p=p)])
+        for h in [0.1, 1.0]:
+            k = np.exp(-d**2 / (2 * h**2))
+            assert_allclose(T.kernel_sum(q, h), k.sum(1), rtol=1e-12)
+            for atol in [1e-6, 1e-2]:
+                s = T.kernel_sum(q, h, weights=w, atol=atol, n_jobs=2)
+                assert_(np.abs(s - (k * w).sum(1)).max() <= atol)
+    assert_equal(T.count_ball_point(q[0], 0.5).shape, ())
+    assert_raises(ValueError, T.kernel_sum, q, 0.)
+    assert_raises(ValueError, T.kernel_sum, q, 1., weights=-w)
+
+    # periodic box
+    xb = np.mod(x, 2.)
+    qb = np.mod(q, 2.)
+    Tb = cKDTree(xb, boxsize=2.)
+    db = distance_box(qb[:, None, :], xb[None, :, :], 2, 2.)
+    assert_array_equal(Tb.count_ball_point(qb, 0.5), (db <= 0.5).sum(1))
+    assert_allclose(Tb.kernel_sum(qb, 0.3), 
+                    np.exp(-db**2 / (2 * 0.3**2)).sum(1), rtol=1e-12)
+
+def _weighted_euclidean_capsule(w, name=b"ckdtree_metric"):
+    # a ckdtree_metric of ctypes callbacks for the distance
+    # sqrt(sum(w * (x - y)**2)); the struct must be kept alive
+    import ctypes
+    dptr = ctypes.POINTER(ctypes.c_double)
+    point_point_t = ctypes.CFUNCTYPE(ctypes.c_double, dptr, dptr,
+                                     ctypes.c_ssize_t, ctypes.c_void_p)
+    rect_rect_t = ctypes.CFUNCTYPE(None, dptr, dptr, dptr, dptr,
+                                   ctypes.c_ssize_t, dptr, dptr, 
+                                   ctypes.c_void_p)
+
+    class Metric(ctypes.Structure):
+        _fields_ = [('point_point', point_point_t), 
+                    ('rect_rect', rect_rect_t),
+                    ('user_data', ctypes.c_void_p)]
+
+    def point_point(x, y, m, user_data):
+        return np.sqrt(sum(w[i] * (x[i] - y[i])**2 for i in range(m)))
+
+    def rect_rect(mins1, maxes1, mins2, maxes2, m, dmin, dmax, user_data):
+        lo = hi = 0.
+        for i in range(m):
+            a = max(0., mins1[i] - maxes2[i], mins2[i] - maxes1[i])
+            b = max(maxes1[i] - mins2[i], maxes2[i] - mins1[i])
+            lo += w[i] * a * a
+            hi += w[i] * b * b
+        dmin[0] = np.sqrt(lo)
+        dmax[0] = np.sqrt(hi)
+
+    metric = Metric(point_point_t(point_point), rect_rect_t(rect_rect), None)
+    capsule_new = ctypes.pythonapi.PyCapsule_New
+    capsule_new.restype = ctypes.py_object
+    capsule_new.argtypes = [ctypes.c_void_p, ctypes.c_char_p, 
+                            ctypes.c_void_p]
+    # the name must outlive the capsule as well
+    return capsule_new(ctypes.addressof(metric), name, None), (metric, name)
+
+def test_ckdtree_callback_metric():
+    import pickle
+    np.random.seed(1234)
+    w = np.array([1., 4., 0.25])
+    x1 = np.random.uniform(size=(150, 3))
+    x2 = np.random.uniform(size=(100, 3))
+    capsule, metric = _weighted_euclidean_capsule(w)
+    T1 = cKDTree(x1, leafsize=4, metric=capsule)
+    T2 = cKDTree(x2, leafsize=4, metric=capsule)
+    # the same distances between the whitened points
+    W1 = cKDTree(x1 * np.sqrt(w), leafsize=4)
+    W2 = cKDTree(x2 * np.sqrt(w), leafsize=4)
+    y = x2 * np.sqrt(w)
+    
+    for n_jobs in [1, 2]:
+        d, i = T1.query(x2, k=3, n_jobs=n_jobs)
+        dw, iw = W1.query(y, k=3)
+        assert_array_equal(i, iw)
+        assert_array_almost_equal(d, dw)
+    d, i = T1.query(x2, k=2, distance_upper_bound=0.2, p=1)
+    dw, iw = W1.query(y, k=2, distance_upper_bound=0.2)
+    assert_array_equal(i, iw)
+    assert_array_almost_equal(d, dw)
+
+    l = T1.query_ball_point(x2, 0.3)
+    lw = W1.query_ball_point(y, 0.3)
+    for a, b in zip(l, lw):
+        assert_equal(sorted(a), sorted(b))
+    l = T1.query_ball_tree(T2, 0.3)
+    lw = W1.query_ball_tree(W2, 0.3)
+    for a, b in zip(l, lw):
+        assert_equal(sorted(a), sorted(b))
+    assert_equal(T1.query_pairs(0.2), W1.query_pairs(0.2))
+    r = np.array([0.1, 0.2, 0.5])
+    assert_array_equal(T1.count_neighbors(T2, r), W1.count_neighbors(W2, r))
+    assert_array_almost_equal(T1.sparse_distance_matrix(T2, 0.3).toarray(),
+                              W1.sparse_distance_matrix(W2, 0.3).toarray())
+
+    assert_raises(ValueError, T1.count_neighbors, W2, 0.1)
+    assert_raises(ValueError, cKDTree, x1, metric=capsule, boxsize=1.)
+    assert_raises(ValueError, cKDTree, x1, metric=len)
+    other, _ = _weighted_euclidean_capsule(w, name=b"other_metric")
+    assert_raises(TypeError, cKDTree, x1, metric=other)
+    unnamed, _ = _weighted_euclidean_capsule(w, name=None)
+    assert_raises(TypeError, cKDTree, x1, metric=unnamed)
+    assert_raises(TypeError, pickle.dumps, T1)
+
+def test_ckdtree_count_neighbors_weighted():
+    np.random.seed(1234)
+    x1 = np.random.uniform(size=(200, 3))
+    x2 = np.random.uniform(size=(150, 3))
+    w1 = np.random.uniform(size=200)
+    w2 = np.random.uniform(size=150)
+    T1 = cKDTree(x1, leafsize=4)
+    T2 = cKDTree(x2, leafsize=4)
+    r = np.array([0.5, 0.05, 0.2, 0.1, 0.3])
+    d = distance_matrix(x1, x2)
+    ww = w1[:, None] * w2[None, :]
+
+    expected = np.array([ww[d <= rr].sum() for rr in r])
+    assert_allclose(T1.count_neighbors(T2, r, weights=(w1, w2)), expected)
+    expected = np.array([w1.dot((d <= rr).sum(axis=1)) for rr in r])
+    assert_allclose(T1.count_neighbors(T2, r, weights=(w1, None)), expected)
+    assert_allclose(T1.count_neighbors(T2, r, weights=(w1, None), n_jobs=3),
+                    expected)
+
+    # a weight of one everywhere gives the unweighted counts
+    assert_allclose(T1.count_neighbors(T2, r, weights=(np.ones(200), None)),
+                    T1.count_neighbors(T2, r))
+    assert_equal(T1.count_neighbors(T2, 0.2, weights=(None, None)),
+                 T1.count_neighbors(T2, 0.2))
+
+    # the same weights on both sides of an autocorrelation
+    d = distance_matrix(x1, x1)
+    expected = (w1[:, None] * w1[None, :] * (d <= 0.2)).sum()
+    assert_allclose(T1.count_neighbors(T1, 0.2, weights=w1), expected)
+    assert_raises(ValueError, T1.count_neighbors, T2, 0.2, weights=w1)
+    assert_raises(ValueError, T1.count_neighbors, T2, 0.2, 
+                  weights=(w1[:10], None))
+
+def test_ckdtree_count_neighbors_noncumulative():
+    np.random.seed(1234)
+    T1 = cKDTree(np.random.uniform(size=(300, 2)), leafsize=4)
+    T2 = cKDTree(np.random.uniform(size=(250, 2)), leafsize=4)
+    w1 = np.random.uniform(size=300)
+    r = np.linspace(0, 1.5, 40)
+    for p in [1, 2, np.inf]:
+        for weights in [None, (w1, None)]:
+            c = T1.count_neighbors(T2, r, p=p, weights=weights)
+            nc = T1.count_neighbors(T2, r, p=p, weights=weights,
+                                    cumulative=False)
+            assert_allclose(nc[0], c[0])
+            assert_allclose(nc[1:], np.diff(c))
+            assert_allclose(nc, T1.count_neighbors(T2, r, p=p,
+                weights=weights, cumulative=False, n_jobs=4))
+    assert_raises(ValueError, T1.count_neighbors, T2, r[::-1],
+                  cumulative=False)
+
+def test_ckdtree_compact_layout():
+    np.random.seed(1234)
+    x = np.random.uniform(size=(3000, 3))
+    q = np.random.uniform(size=(200, 3))
+    for kwargs in [{}, dict(boxsize=1.), dict(leafsize=1)]:
+        T1 = cKDTree(x, **kwargs)
+        T2 = cKDTree(x, node_layout='compact', **kwargs)
+        T4 = cKDTree(x, reorder_data=True, **kwargs)
+        assert_equal(T2.node_layout, 'compact')
+        for p in [1, 2, 3.5, np.inf]:
+            d1, i1 = T1.query(q, k=6, p=p)
+            l1 = list(T1.query_ball_point(q, 0.15, p=p))
+            for T in [T2, T4]:
+                d2, i2 = T.query(q, k=6, p=p)
+                assert_array_equal(d1, d2)
+                assert_array_equal(i1, i2)
+                assert_equal(l1, list(T.query_ball_point(q, 0.15, p=p)))
+    try:
+        import cPickle as pickle
+    except ImportError:
+        import pickle
+    T3 = pickle.loads(pickle.dumps(T2))
+    assert_equal(T3.node_layout, 'compact')
+    assert_array_equal(T3.query(q, k=3)[1], T2.query(q, k=3)[1])
+    T3 = pickle.loads(pickle.dumps(T4))
+    assert_array_equal(T3.query(q, k=3)[1], T4.query(q, k=3)[1])
+    assert_raises(ValueError, cKDTree, x, node_layout='breadth_first')
+
+def test_ckdtree_leaf_kernels():
+    # the vectorized leaf kernels are used in 8 or more dimensions,
+    # with blocks of various sizes to exercise the remainder loops
+    np.random.seed(1234)
+    x = np.random.uniform(size=(400, 10))
+    y = np.random.uniform(size=(300, 10))
+    for p in [1, 2, np.inf]:
+        d = minkowski_distance(x[:, None, :], y[None, :, :], p)
+        r = np.percentile(d, 1)
+        for kwargs in [dict(leafsize=1), dict(leafsize=7), 
+                       dict(leafsize=100), dict(leafsize=100, 
+                                                reorder_data=True)]:
+            T1 = cKDTree(x, **kwargs)
+            T2 = cKDTree(y, **kwargs)
+            dd, ii = T2.query(x, k=3, p=p)
+            assert_array_equal(ii, np.argsort(d, axis=1)[:, :3])
+            assert_allclose(dd, np.sort(d, axis=1)[:, :3])
+            l = T2.query_ball_point(x, r, p=p)
+            assert_equal([sorted(li) for li in l], 
+                         [list(np.nonzero(di <= r)[0]) for di in d])
+            l = T1.query_ball_tree(T2, r, p=p)
+            assert_equal([sorted(li) for li in l], 
+                         [list(np.nonzero(di <= r)[0]) for di in d])
+            assert_equal(T1.count_neighbors(T2, r, p=p), (d <= r).sum())
+            M = T1.sparse_distance_matrix(T2, r, p=p).toarray()
+            assert_allclose(M, np.where(d <= r, d, 0))
+            dx = minkowski_distance(x[:, None, :], x[None, :, :], p)
+            rx = np.percentile(dx, 1)
+            pairs = set((i, j) for i, j in zip(*np.nonzero(dx <= rx)) 
+                        if i < j)
+            assert_equal(T1.query_pairs(rx, p=p), pairs)
+
+def test_ckdtree_float32():
+    # a float32 tree gives the same results as a float64 tree built on
+    # the same, single precision representable, data
+    np.random.seed(1234)
+    for m in [3, 10]:
+        x = np.random.uniform(size=(200, m)).astype(np.float32)
+        y = np.random.uniform(size=(150, m)).astype(np.float32)
+        r = 0.1 * m
+        for kwargs in [dict(), dict(node_layout='compact'),
+                       dict(boxsize=1.0), dict(balanced_tree=False)]:
+            S1 = cKDTree(x, dtype=np.float32, **kwargs)
+            S2 = cKDTree(y, dtype=np.float32, **kwargs)
+            D1 = cKDTree(x, **kwargs)
+            D2 = cKDTree(y, **kwargs)
+            assert_equal(S1.data.dtype, np.float32)
+            assert_equal(D1.data.dtype, np.float64)
+            for p in [1, 2, 3, np.inf]:
+                ds, is_ = S2.query(x, k=3, p=p)
+                dd, id_ = D2.query(x, k=3, p=p)
+                assert_array_equal(is_, id_)
+                assert_array_equal(ds, dd)
+                assert_equal(S2.query_ball_point(x, r, p=p),
+                             D2.query_ball_point(x, r, p=p))
+                assert_equal(S1.query_ball_tree(S2, r, p=p),
+                             D1.query_ball_tree(D2, r, p=p))
+                assert_equal(S1.query_pairs(r, p=p), D1.query_pairs(r, p=p))
+                assert_array_equal(S1.count_neighbors(S2, [r, 2 * r], p=p),
+                                   D1.count_neighbors(D2, [r, 2 * r], p=p))
+                assert_array_equal(
+                    S1.sparse_distance_matrix(S2, r, p=p).toarray(),
+                    D1.sparse_distance_matrix(D2, r, p=p).toarray())
+    assert_raises(ValueError, S1.query_ball_tree, D2, r)
+    assert_raises(ValueError, S1.count_neighbors, D2, r)
+    assert_raises(ValueError, S1.sparse_distance_matrix, D2, r)
+    assert_raises(ValueError, cKDTree, x, dtype=np.int32)
+    # pickling keeps the dtype
+    try:
+        import cPickle as pickle
+    except ImportError:
+        import pickle
+    S = pickle.loads(pickle.dumps(S1))
+    assert_equal(S.data.dtype, np.float32)
+    assert_array_equal(S.query(x, k=3)[1], S1.query(x, k=3)[1])
+
+def test_ckdtree_save_load():
+    np.random.seed(1234)
+    x = np.random.uniform(size=(1000, 3))
+    q = np.random.uniform(size=(50, 3))
+    with tempdir() as tmpdir:
+        fname = os.path.join(tmpdir, 'tree.ckdtree')
+        for kwargs in [dict(), dict(node_layout='compact'), 
+                       dict(reorder_data=True), dict(boxsize=1.0),
+                       dict(dtype=np.float32)]:
+            T1 = cKDTree(x, leafsize=4, **kwargs)
+            T1.save(fname)
+            for mmap_mode in ['r', 'c', None]:
+                T2 = cKDTree.load(fname, mmap_mode=mmap_mode)
+                assert_equal(T2.size, T1.size)
+                assert_equal(T2.node_layout, T1.node_layout)
+                assert_array_equal(T2.data, T1.data)
+                assert_equal(T2.data.dtype, T1.data.dtype)
+                assert_array_equal(T2.indices, T1.indices)
+                assert_array_equal(T2.boxsize, T1.boxsize)
+                if mmap_mode == 'r':
+                    assert_(not T2.data.flags.writeable)
+                d1, i1 = T1.query(q, k=4)
+                d2, i2 = T2.query(q, k=4)
+                assert_array_equal(i1, i2)
+                assert_array_equal(d1, d2)
+                assert_equal(T1.query_ball_point(q, 0.1), 
+                             T2.query_ball_point(q, 0.1))
+                assert_equal(T1.query_pairs(0.05), T2.query_pairs(0.05))
+                assert_equal(T1.count_neighbors(T1, 0.1),
+                             T2.count_neighbors(T2, 0.1))
+                assert_array_equal(T1.tree.lesser.greater.indices,
+                                   T2.tree.lesser.greater.indices)
+                # a loaded tree can be saved again
+                T2.save(fname + '2')
+                T3 = cKDTree.load(fname + '2')
+                assert_array_equal(T3.query(q, k=4)[1], i1)
+                del T2, T3
+
+        with open(fname, 'wb') as f:
+            f.write(b'not a kd-tree')
+        assert_raises(ValueError, cKDTree.load, fname)
+
+def test_ckdtree_query_out_chunked():
+    np.random.seed(1234)
+    x = np.random.uniform(size=(500, 3))
+    q = np.random.uniform(size=(230, 3))
+    T = cKDTree(x, leafsize=4)
+    for k, nk in [(1, 1), (3, 3), ([2, 4], 2)]:
+        d, i = T.query(q, k=k, distance_upper_bound=0.1)
+        dout = np.empty((len(q), nk))
+        iout = np.empty((len(q), nk), dtype=np.intp)
+        d2, i2 = T.query(q, k=k, distance_upper_bound=0.1, out=(dout, iout))
+        assert_(d2 is dout and i2 is iout)
+        assert_array_equal(dout.reshape(d.shape), d)
+        assert_array_equal(iout.reshape(i.shape), i)
+        
+        starts = []
+        for start, dc, ic in T.query_chunked(q, k=k, chunk_size=100,
+                                             distance_upper_bound=0.1):
+            starts.append(start)
+            assert_array_equal(dc, d[start:start + 100])
+            assert_array_equal(ic, i[start:start + 100])
+        assert_equal(starts, [0, 100, 200])
+
+        dout[...] = 0
+        iout[...] = 0
+        for start, dc, ic in T.query_chunked(q, k=k, chunk_size=64,
+                                             distance_upper_bound=0.1,
+                                             out=(dout, iout)):
+            assert_(np.may_share_memory(dc, dout))
+        assert_array_equal(dout.reshape(d.shape), d)
+        assert_array_equal(iout.reshape(i.shape), i)
+
+    assert_raises(ValueError, T.query, q, 3, out=(dout, iout))
+    assert_raises(ValueError, T.query, q, 1, out=(dout[:, :1], iout[:, :1]))
+    assert_raises(ValueError, T.query, q, 1, out=(dout, iout.astype(float)))
+    assert_raises(ValueError, T.query_chunked, q[:, :2])
+    assert_raises(ValueError, T.query_chunked, q, chunk_size=0)
+
+def test_ckdtree_query_knn_tree():
+    np.random.seed(1234)
+    x = np.random.uniform(size=(600, 3))
+    q = np.random.uniform(size=(400, 3))
+    for p in [1, 2, 3.5, np.inf]:
+        for boxsize in [None, 1.0]:
+            T = cKDTree(x, leafsize=4, boxsize=boxsize)
+            Q = cKDTree(q, leafsize=7, boxsize=boxsize)
+            for n_jobs in [1, 4]:
+                d, i = Q.query_knn_tree(T, k=[1, 3, 6], p=p, n_jobs=n_jobs)
+                d0, i0 = T.query(q, k=[1, 3, 6], p=p)
+                assert_array_almost_equal(d, d0)
+                assert_array_equal(i, i0)
+
+    # missing neighbors, which query reports the same way
+    T = cKDTree(x)
+    Q = cKDTree(q)
+    d, i = Q.query_knn_tree(T, k=4, distance_upper_bound=0.1)
+    d0, i0 = T.query(q, k=4, distance_upper_bound=0.1)
+    assert_(np.isinf(d).any() and np.isfinite(d).any())
+    assert_array_equal(d, d0)
+    assert_array_equal(i, i0)
+    assert_array_equal(i[np.isinf(d)], T.n)
+
+    d, i = Q.query_knn_tree(T)
+    assert_equal(d.shape, (len(q),))
+    assert_array_equal(i, T.query(q)[1])
+
+    assert_raises(ValueError, Q.query_knn_tree, cKDTree(x[:, :2]))
+    assert_raises(ValueError, Q.query_knn_tree, T, k=0)
+
+def test_ckdtree_forest():
+    try:
+        import cPickle as pickle
+    except ImportError:
+        import pickle
+    np.random.seed(1234)
+    f = cKDTreeForest(3, leafsize=4)
+    points = {}
+    for step in range(20):
+        x = np.random.uniform(size=(np.random.randint(50), 3))
+        for i, pt in zip(f.insert(x), x):
+            points[i] = pt
+        live = np.array(sorted(points), dtype=np.intp)
+        deleted = np.random.permutation(live)[:len(live) // 3]
+        f.delete(deleted)
+        for i in deleted:
+            del points[i]
+        assert_equal(f.n, len(points))
+
+        # compare with a tree of the live points
+        ids = np.array(sorted(points), dtype=np.intp)
+        T = cKDTree(np.array([points[i] for i in ids]))
+        q = np.random.uniform(size=(30, 3))
+        for k in [1, 4, [2, 5]]:
+            d, i = f.query(q, k=k, distance_upper_bound=0.3)
+            d0, i0 = T.query(q, k=k, distance_upper_bound=0.3)
+            assert_array_almost_equal(d, d0)
+            found = np.isfinite(d0)
+            assert_array_equal(i[found], ids[i0[found]])
+            assert_array_equal(i[~found], -1)
+        r = f.query_ball_point(q, 0.2)
+        r0 = T.query_ball_point(q, 0.2)
+        for a, b in zip(r, r0):
+            assert_array_equal(sorted(a), ids[sorted(b)])
+
+    f2 = pickle.loads(pickle.dumps(f))
+    assert_equal(f2.n, f.n)
+    assert_array_equal(f2.query(q, k=3)[1], f.query(q, k=3)[1])
+
+    # deleting is all or nothing
+    assert_raises(KeyError, f.delete, [ids[0], -1])
+    assert_equal(f.n, len(ids))
+    assert_raises(KeyError, f.delete, deleted[:1])
+
+def test_ckdtree_forest_failed_insert():
+    # a failed insert leaves the forest as it was
+    np.random.seed(1234)
+    f = cKDTreeForest(2, boxsize=1.0)
+    x = np.random.uniform(size=(10, 2))
+    for pt in x:
+        f.insert(pt)
+    assert_raises(ValueError, f.insert, [[0.5, 0.5], [2.0, 0.5]])
+    assert_equal(f.n, 10)
+    d, i = f.query(x, k=12)
+    assert_array_equal(np.sort(i[:, :10], axis=1),
+                       np.tile(np.arange(10), (10, 1)))
+    assert_array_equal(i[:, 10:], -1)
+    assert_array_equal(f.insert([0.5, 0.5]), [10])
+    assert_equal(f.n, 11)
+
+def test_ckdtree_query_max_leaves():
+    np.random.seed(1234)
+    x = np.random.randn(2000, 16)
+    q = np.random.randn(100, 16)
+    T = cKDTree(x, leafsize=8)
+    d0, i0 = T.query(q, k=4)
+
+    # an unreached budget gives the exact result
+    d, i = T.query(q, k=4, max_leaves=x.shape[0])
+    assert_array_equal(i, i0)
+
+    # the approximate neighbors are sorted points of the tree, no closer 
+    # than the exact ones, and better with a larger budget
+    recall = []
+    for max_leaves in [1, 4, 16, 64]:
+        d, i = T.query(q, k=4, max_leaves=max_leaves)
+        assert_array_almost_equal(d, minkowski_distance(q[:, None, :], x[i]))
+        assert_(np.all(np.diff(d, axis=1) >= 0))
+        assert_(np.all(d >= d0 - 1e-12))
+        recall.append(np.mean(i == i0))
+    assert_(np.all(np.diff(recall) >= 0) and recall[-1] > recall[0])
+
+    # randomized trees give the same exact result, and the neighbors found
+    # in several trees are reported once
+    trees = [cKDTree(x, leafsize=8, random_splits=seed) for seed in range(4)]
+    d, i = trees[0].query(q, k=4)
+    assert_array_equal(i, i0)
+    d, i = trees[0].query(q, k=4, others=trees[1:])
+    assert_array_equal(i, i0)
+    for max_leaves in [1, 16]:
+        d, i = trees[0].query(q, k=4, max_leaves=max_leaves, 
+                              others=trees[1:])
+        for row in i:
+            assert_equal(len(set(row)), 4)
+        assert_(np.all(d >= d0 - 1e-12))
+
+    # randomized trees are deterministic, also when built in parallel
+    T1 = cKDTree(x, random_splits=7)
+    T2 = cKDTree(x, random_splits=7, n_jobs=4)
+    assert_array_equal(T1.indices, T2.indices)
+
+    assert_raises(ValueError, T.query, q, max_leaves=0)
+    assert_raises(ValueError, T.query, q, others=[cKDTree(x[:-1])])
+    assert_raises(ValueError, T.query, q, others=[cKDTree(x, dtype=np.float32)])
+    assert_raises(ValueError, cKDTree, x, random_splits=-1)
+
+def test_ckdtree_view():
     # Check that the nodes can be correctly viewed from Python.
     # This test also sanity checks each node in the cKDTree, and
     # thus verifies the internal structure of the kd-tree.
@@ -1080,6 +1717,30 @@ def test_ckdtree_box_lower_bounds():
         return
     raise AssertionError("ValueError is not raised")
 
+def test_ckdtree_box_dual_tree():
+    # the specialized trackers and leaf distances of periodic trees,
+    # with clustered points across the faces of the box
+    np.random.seed(1234)
+    for m in [2, 5]:
+        boxsize = 1.5
+        c = np.random.uniform(size=(20, m)) * boxsize
+        x1 = np.mod(c[np.random.randint(20, size=300)] + 
+                    0.05 * np.random.randn(300, m), boxsize)
+        x2 = np.mod(c[np.random.randint(20, size=200)] + 
+                    0.05 * np.random.randn(200, m), boxsize)
+        T1 = cKDTree(x1, leafsize=4, boxsize=boxsize)
+        T2 = cKDTree(x2, leafsize=4, boxsize=boxsize)
+        r = np.array([0.01, 0.05, 0.1, 0.2, 0.4])
+        for p in [1, 2, np.inf]:
+            d = distance_box(x1[:, None, :], x2[None, :, :], p, boxsize)
+            assert_array_equal(T1.count_neighbors(T2, r, p=p),
+                               [(d <= rr).sum() for rr in r])
+            l = T1.query_ball_tree(T2, 0.1, p=p)
+            for i in range(len(x1)):
+                assert_array_equal(sorted(l[i]), np.nonzero(d[i] <= 0.1)[0])
+            dd, ii = T2.query(x1, k=3, p=p)
+            assert_array_almost_equal(dd, np.sort(d, axis=1)[:, :3])
+
 def simulate_periodic_box(kdtree, data, k, boxsize):
     dd = []
     ii = []
@@ -1187,5 +1848,37 @@ def test_len0_arrays():
     z = np.empty(shape=(0,2), dtype=np.intp)
     assert_array_equal(y, z)
 
+def _compare_tree_nodes(n1, n2):
+    assert_equal(n1.split_dim, n2.split_dim)
+    assert_equal(n1.children, n2.children)
+    if n1.split_dim == -1:
+        assert_array_equal(n1.indices, n2.indices)
+    else:
+        assert_equal(n1.split, n2.split)
+        _compare_tree_nodes(n1.lesser, n2.lesser)
+        _compare_tree_nodes(n1.greater, n2.greater)
+
+def test_ckdtree_parallel_build():
+    # the parallel build must give the same tree as the serial build
+    np.random.seed(1234)
+    data = np.random.randn(2000, 3)
+    data[::7] = data[0]
+    for balanced in [True, False]:
+        for compact in [True, False]:
+            T1 = cKDTree(data, leafsize=4, balanced_tree=balanced,
+                         compact_nodes=compact)
+            for n_jobs in [3, -1]:
+                T2 = cKDTree(data, leafsize=4, balanced_tree=balanced,
+                             compact_nodes=compact, n_jobs=n_jobs)
+                assert_array_equal(T1.indices, T2.indices)
+                _compare_tree_nodes(T1.tree, T2.tree)
+                d1, i1 = T1.query(data[:100], k=5)
+                d2, i2 = T2.query(data[:100], k=5)
+                assert_array_equal(d1, d2)
+                assert_array_equal(i1, i2)
+    # tiny trees
+    T = cKDTree(np.zeros((3, 2)), n_jobs=4)
+    assert_equal(T.tree.children, 3)
+
 if __name__ == "__main__":
     run_module_suite()